@@ -192,11 +192,25 @@
 #include <pango/pango.h>
 #include <pango/pangoft2.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "SDL_PangoDraw.h"
 
 //! non-zero if initialized
 static int IS_INITIALIZED = 0;
 
+/* Font maps are created and destroyed one at a time, since contexts may
+   be used on several threads. */
+static GMutex font_map_lock;
+
+#if PANGO_VERSION_CHECK(1, 38, 0)
+/* Fonts given to SDLPangoDraw_InitWithFonts, or NULL for the fonts of
+   the system. */
+static FcConfig *private_fonts = NULL;
+#endif
+
 #define DEFAULT_FONT_FAMILY "sans-serif"
 #define DEFAULT_FONT_SIZE 12
 #define DEFAULT_DPI 96
@@ -207,6 +221,19 @@ static int IS_INITIALIZED = 0;
 #define DEFAULT_GMASK (Uint32)(255 << (8 * 2))
 #define DEFAULT_BMASK (Uint32)(255 << (8 * 1))
 #define DEFAULT_AMASK (Uint32)255
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+#define DEFAULT_SURFACE_FLAGS 0
+#else
+#define DEFAULT_SURFACE_FLAGS (SDL_SWSURFACE | SDL_SRCALPHA)
+#endif
+#define DEFAULT_SCRATCH_LIMIT (256 * 1024)
+#define MIN_SCRATCH_LIMIT 1024
+#define DEFAULT_SHAPE_CACHE_LIMIT (1024 * 1024)
+#define SHAPE_CONTEXT_CHARS 5	/* Characters around an item that the shaper sees */
+
+#define DIV255(v) (((v) + 128 + (((v) + 128) >> 8)) >> 8)	/* v / 255, rounded */
+#define EFFECT_PLANES 5
+#define MAX_STRIP_COLORS 256
 
 static FT_Bitmap *createFTBitmap(int width, int height);
 
@@ -225,7 +252,172 @@ static void getItemProperties (
     PangoRectangle *ink_rect,
     PangoRectangle *logical_rect);
 
-static void clearFTBitmap(FT_Bitmap *bitmap);
+/*!
+    How a run is drawn, from its attributes.
+*/
+typedef struct _runStyle {
+    PangoUnderline uline;
+    gboolean strike;
+    gint rise;
+    PangoColor fg_color;
+    gboolean fg_set;
+    PangoColor bg_color;
+    gboolean bg_set;
+    gboolean shape_set;
+    PangoRectangle ink_rect;	/*!< Relative to the run */
+    PangoRectangle logical_rect;	/*!< Relative to the run */
+} runStyle;
+
+static int scratchLimit(const SDLPangoDraw_Context *context);
+
+static void reserveScratch(
+    SDLPangoDraw_Context *context,
+    int width, int height);
+
+static int drawLayoutLines(
+    SDLPangoDraw_Context *context,
+    SDL_Surface *surface,
+    PangoLayout *layout,
+    int x, int y,
+    int first, int count);
+
+static void copyFTBitmap(
+    const FT_Bitmap *bitmap,
+    int bitmap_x, int bitmap_y,
+    SDL_Surface *surface,
+    const SDLPangoDraw_Matrix *matrix,
+    int x, int y, int width, int height);
+
+static void copyFTBitmapMono(
+    const FT_Bitmap *bitmap,
+    int bitmap_x, int bitmap_y,
+    SDL_Surface *surface,
+    const SDLPangoDraw_Matrix *matrix,
+    int x, int y, int width, int height);
+
+static void blendOver(
+    Uint8 *pixel,
+    const Uint8 *color,
+    int alpha);
+
+static void blendCoverage(
+    SDL_Surface *surface,
+    const SDLPangoDraw_Matrix *matrix,
+    gboolean premultiplied,
+    const Uint8 *coverage,
+    int pitch,
+    int x, int y, int width, int height);
+
+static void applyRenderMode(
+    PangoFontMap *font_map,
+    SDLPangoDraw_RenderMode mode);
+
+typedef struct _shapedText shapedText;
+
+/*!
+    A strip of the coverage mask that effects are computed from.
+    While a context has a strip, glyphs and lines are drawn into the strip
+    instead of the surface.
+*/
+typedef struct _effectStrip {
+    int x, y;			/*!< Left-top on the surface */
+    int width, height;		/*!< Size in pixels */
+    int pitch;			/*!< Bytes per row of every plane */
+    Uint8 *coverage;		/*!< Coverage of the letters */
+    Uint8 *palette;		/*!< Index in colors of every pixel */
+    Uint8 *outline;		/*!< Dilated coverage */
+    Uint8 *shadow;		/*!< Blurred coverage */
+    Uint8 *temp;		/*!< Intermediate of the separable filters */
+    int *sums;			/*!< One row of running sums */
+    int n_colors;		/*!< Colors in use */
+    SDLPangoDraw_Matrix colors[MAX_STRIP_COLORS];	/*!< Colors of the runs */
+} effectStrip;
+
+static void stripGlyphString(
+    effectStrip *strip,
+    const SDLPangoDraw_Matrix *color_matrix,
+    PangoFont *font,
+    PangoGlyphString *glyphs,
+    int x, int y,
+    int width, int height,
+    int baseline);
+
+static void stripHLine(
+    effectStrip *strip,
+    const SDLPangoDraw_Matrix *color_matrix,
+    int y, int start, int end);
+
+static void drawEffects(
+    SDLPangoDraw_Context *context,
+    SDL_Surface *surface,
+    int x, int y);
+
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+static void atlasGlyphString(
+    SDLPangoDraw_Context *context,
+    const SDLPangoDraw_Matrix *color_matrix,
+    PangoFont *font,
+    PangoGlyphString *glyphs,
+    int x, int y,
+    int width, int height,
+    int baseline);
+
+static void atlasHLine(
+    SDLPangoDraw_GlyphAtlas *atlas,
+    const SDLPangoDraw_Matrix *color_matrix,
+    int y, int start, int end);
+#endif
+
+static void setShapedText(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length,
+    PangoAttrList *attrs);
+
+static void reshapeText(SDLPangoDraw_Context *context);
+
+static void placeShapedText(SDLPangoDraw_Context *context);
+
+static shapedText *currentShaped(SDLPangoDraw_Context *context);
+
+static void checkShapedText(SDLPangoDraw_Context *context);
+
+static void syncShapedText(SDLPangoDraw_Context *context);
+
+static GArray *shapedLines(SDLPangoDraw_Context *context);
+
+static void freeShapedText(shapedText *shaped);
+
+static void trimReflows(shapedText *shaped);
+
+typedef struct _simpleFont simpleFont;
+
+static void freeSimpleFont(simpleFont *simple);
+
+static void setLayoutText(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length,
+    PangoAttrList *attrs,
+    PangoAlignment alignment);
+
+static void buildLineIndex(SDLPangoDraw_Context *context);
+
+static void enforceMemoryBudget(SDLPangoDraw_Context *context);
+
+static void premultiplyMatrix(SDLPangoDraw_Matrix *matrix);
+
+static void blendYUV(
+    const SDLPangoDraw_YUVFrame *frame,
+    const SDLPangoDraw_Matrix *color_matrix,
+    const Uint8 *coverage,
+    int pitch,
+    int x, int y,
+    int width, int height);
+
+static void getLayoutExtents(
+    SDLPangoDraw_Context *context,
+    PangoRectangle *logical_rect);
 
 typedef struct _surfaceArgs {
     Uint32 flags;
@@ -236,6 +428,31 @@ typedef struct _surfaceArgs {
     Uint32 Amask;
 } surfaceArgs;
 
+/*!
+    A run as it was drawn, for damage tracking.
+    The coordinates are in pixels on the surface.
+*/
+typedef struct _damageRun {
+    SDL_Rect rect;		/*!< Pixels the run may draw on */
+    guint32 hash;		/*!< Glyphs, font and style, to tell runs apart fast */
+    PangoFont *font;		/*!< Font of the glyphs, referenced */
+    runStyle style;		/*!< How the run is drawn */
+    guint first_glyph;		/*!< Index of the first glyph in the glyphs of the frame */
+    guint n_glyphs;
+} damageRun;
+
+/*!
+    A line as it was drawn, for damage tracking.
+    The coordinates are in pixels on the surface.
+*/
+typedef struct _damageLine {
+    SDL_Rect bounds;		/*!< Union of the rects of the runs */
+    guint first_run;		/*!< Index of the first run of the line */
+    guint n_runs;
+} damageLine;
+
+static void clearDamageRuns(GArray *runs);
+
 typedef struct _contextImpl {
     PangoContext *context;
     PangoFontMap *font_map;
@@ -243,11 +460,191 @@ typedef struct _contextImpl {
     PangoLayout *layout;
     surfaceArgs surface_args;
     FT_Bitmap *tmp_ftbitmap;
+    int scratch_limit;
+    SDLPangoDraw_Effects effects;
+    gboolean effects_enabled;
+    effectStrip *strip;
+    Uint8 *effect_buf;
+    gsize effect_buf_size;
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+    SDLPangoDraw_GlyphAtlas *atlas;
+#endif
+    const SDLPangoDraw_YUVFrame *yuv;	/*!< Frame drawn by SDLPangoDraw_DrawYUV */
     SDLPangoDraw_Matrix color_matrix;
+    gboolean premultiplied;	/*!< Draw premultiplied colors */
+    gboolean blend_into;	/*!< Blend over the surface instead of clearing it */
+    SDLPangoDraw_RenderMode render_mode;
     int min_width;
     int min_height;
+    int max_lines;
+    int max_height;
+    PangoEllipsizeMode ellipsize;
+    int buffer_growths;
+    PangoAlignment alignment;
+    double dpi_x, dpi_y;
+    shapedText *shaped;
+    simpleFont *simple_font;	/*!< Glyphs for simple text, or NULL */
+    gboolean shaped_layout;	/*!< Lay out simple text without the PangoLayout */
+    gboolean fast_path;		/*!< Shape simple text from simple_font */
+    gboolean reflow;		/*!< Break shaped text into lines itself */
+    GHashTable *font_names;
+    GString *shape_key;
+    GArray *index_lines;
+    GArray *index_runs;
+    guint index_lines_peak;
+    guint index_runs_peak;
+    gboolean index_valid;
+    gboolean index_truncated;	/*!< Lines were cut by max_lines or max_height */
+#if PANGO_VERSION_CHECK(1, 32, 4)
+    guint index_serial;
+#endif
+    SDL_Rect clip;
+    gboolean clip_enabled;
+    GArray *damage_lines;
+    GArray *damage_runs;
+    GArray *frame_lines;
+    GArray *frame_runs;
+    GArray *damage_glyphs;	/*!< PangoGlyphInfo of damage_runs */
+    GArray *frame_glyphs;	/*!< PangoGlyphInfo of frame_runs */
+    SDL_Surface *damage_surface;
+    int damage_x, damage_y;
+    SDLPangoDraw_Matrix damage_matrix;
+    gboolean damage_valid;
+    SDL_Surface *buffer_surface;	/*!< Header over the pixels of SDLPangoDraw_DrawToBuffer */
+    SDLPangoDraw_PixelFormat buffer_format;
+    SDL_Surface *incr_surface;	/*!< Surface of SDLPangoDraw_DrawIncremental */
+    int incr_x, incr_y;
+    guint incr_line;		/*!< Next line to draw */
+    gboolean incr_valid;
+    PangoGlyphString *compiled_glyphs;
+    int memory_budget;
+    gsize working_set;		/*!< Memory draws need past the budget */
+    gboolean budget_trimmed;	/*!< The last draw was trimmed to the budget */
+    struct _prewarmJob *prewarm;	/*!< Running prewarm job, or NULL */
+    GString *prewarm_text;	/*!< Every sample given, warmed by each job */
+    GSList *prewarm_callbacks;	/*!< Callbacks for the next job */
+    gboolean prewarm_waiting;	/*!< Samples are waiting for the next job */
 } contextImpl;
 
+static void freePrewarmJob(
+    struct _prewarmJob *job);
+
+static gboolean adoptPrewarm(
+    SDLPangoDraw_Context *context);
+
+/*!
+    A line ready to draw.
+    All the coordinates are in Pango units, relative to the layout.
+*/
+typedef struct _lineInfo {
+    GSList *runs;		/*!< PangoLayoutRun in visual order */
+    PangoRectangle logical_rect;	/*!< Logical extents */
+    int baseline;		/*!< Y of the baseline */
+    int start_index;		/*!< Byte index of the first character */
+    int length;			/*!< Length in bytes */
+} lineInfo;
+
+/*!
+    A paragraph of shaped text.
+    A paragraph of a single line without tabs or shape attributes is
+    shaped by the library, through the shaped-run cache, and broken into
+    lines by breakShapedLine, reusing its glyphs. Any other paragraph is
+    laid out by a PangoLayout of its own, which Pango lays out again only
+    for widths that are not kept.
+*/
+typedef struct _shapedParagraph {
+    int offset;			/*!< Byte index of the paragraph in the text */
+    int length;			/*!< Length in bytes, without the separator */
+    PangoLayout *layout;	/*!< Layout of the paragraph alone, or NULL if shaped by the library */
+    GList *items;		/*!< PangoItem in logical order, if shaped by the library */
+    GArray *natural;		/*!< lineInfo at the natural width */
+    int width;			/*!< Natural width in Pango units */
+    PangoDirection direction;	/*!< Resolved direction of the paragraph */
+    int n_chars;		/*!< Number of characters */
+    PangoLogAttr *log_attrs;	/*!< Break opportunities, or NULL until wrapped */
+    int *char_widths;		/*!< Advance of each character in Pango units */
+    GSList *logical_runs;	/*!< Runs of the natural line in logical order */
+    GQueue reflows;		/*!< reflowEntry, most recently used first */
+    GArray *lines;		/*!< lineInfo for the current width: natural, or kept in reflows */
+} shapedParagraph;
+
+/*!
+    Text that the library lays out itself instead of through a PangoLayout,
+    so that its glyphs can come from the shaped-run cache, and resizing it
+    does not shape it again.
+    The text is split into paragraphs the way Pango splits it, and each
+    paragraph keeps the lines of its recent widths (see shapedParagraph).
+    The lines are placed while the layout settings are ones the library
+    places the same way as Pango; ellipsized text is left to Pango.
+    The PangoLayout of the context still gets the text and the settings.
+    Once it is changed through SDLPangoDraw_GetPangoLayout, which the
+    library sees from its serial, the layout is drawn instead.
+*/
+struct _shapedText {
+    char *text;			/*!< The text */
+    int length;			/*!< Length in bytes */
+    PangoAttrList *attrs;	/*!< Attributes of the text */
+    shapedParagraph *paragraphs;	/*!< The paragraphs, in order */
+    int n_paragraphs;		/*!< Number of paragraphs */
+    int width;			/*!< Natural width of the widest paragraph */
+    GArray *lines;		/*!< lineInfo of every paragraph, placed; runs belong to the paragraphs */
+    gboolean placed;		/*!< FALSE if the lines are left to Pango */
+    guint serial;		/*!< Serial of the layout the text is placed for */
+};
+
+/*!
+    The lines of a paragraph of shaped text broken for a width. Their runs
+    are copies of the runs of the paragraph, split at the ends of the
+    lines, or of the runs of its own layout.
+*/
+typedef struct _reflowEntry {
+    int width;			/*!< Width in Pango units */
+    GArray *lines;		/*!< lineInfo */
+} reflowEntry;
+
+static void freeReflow(reflowEntry *entry);
+
+static GArray *copyParagraphLines(
+    shapedParagraph *para,
+    int width);
+
+/*!
+    Walks the lines of a PangoLayout, or of the shaped text of a context.
+*/
+typedef struct _lineCursor {
+    PangoLayoutIter *iter;	/*!< Iterator, or NULL */
+    const GArray *lines;	/*!< indexLine of the context, or NULL */
+    const GArray *shaped_lines;	/*!< lineInfo of shaped text, or NULL */
+    guint index;		/*!< Index in lines or shaped_lines */
+    lineInfo line;		/*!< The current line */
+} lineCursor;
+
+/*!
+    A line in the line index of a context.
+    The index is used for hit-testing, and for drawing the context without
+    walking its layout again.
+    Lines are sorted by y, and by start_index.
+    All the coordinates are in Pango units.
+*/
+typedef struct _indexLine {
+    int x, y, width, height;	/*!< Logical extents */
+    int baseline;		/*!< Y of the baseline */
+    int start_index;		/*!< Byte index of the first character */
+    int length;			/*!< Length in bytes */
+    GSList *runs;		/*!< Runs, owned by the layout or the shaped text */
+    int first_run;		/*!< Index of the first run in index_runs */
+    int n_runs;			/*!< Number of runs */
+} indexLine;
+
+/*!
+    A run in the hit-testing index of a context.
+    The runs of a line are sorted by x.
+*/
+typedef struct _indexRun {
+    PangoLayoutRun *run;	/*!< The run, owned by the layout */
+    int x, width;		/*!< Logical extents */
+} indexRun;
+
 
 const SDLPangoDraw_Matrix _MATRIX_WHITE_BACK
     = {255, 0, 0, 0,
@@ -321,6 +718,112 @@ SDLPangoDraw_Init()
     return 0;
 }
 
+/*!
+    Initialize like SDLPangoDraw_Init, but make the contexts created from
+    now on use only the given fonts, instead of every font of the system.
+    This saves the scan of the system fonts that the first context may
+    otherwise start with. The shaped-run cache is emptied.
+
+    @param **paths [in] Font files and directories of font files,
+	terminated by NULL
+    @param *cache_dir [in] Directory of the fontconfig cache of the
+	directories, so that they are not scanned either. May be NULL.
+    @return 0 on success, -1 if paths is NULL or a font or the cache
+	cannot be used
+*/
+int
+SDLPangoDraw_InitWithFonts(
+    const char * const *paths,
+    const char *cache_dir)
+{
+    FcConfig *config;
+    int i;
+
+    if(! paths) {
+	SDL_SetError("no font paths given");
+	return -1;
+    }
+
+    SDLPangoDraw_Init();
+
+    config = FcConfigCreate();
+    if(! config) {
+	SDL_SetError("FcConfigCreate failed");
+	return -1;
+    }
+
+    if(cache_dir) {
+	char *escaped = g_markup_escape_text(cache_dir, -1);
+	char *xml = g_strdup_printf(
+	    "<fontconfig><cachedir>%s</cachedir></fontconfig>", escaped);
+	FcBool loaded = FcConfigParseAndLoadFromMemory(config, (const FcChar8 *)xml, FcTrue);
+
+	g_free(xml);
+	g_free(escaped);
+	if(! loaded) {
+	    FcConfigDestroy(config);
+	    SDL_SetError("font cache directory cannot be used: %s", cache_dir);
+	    return -1;
+	}
+    }
+
+    /* No directories are configured, so this scans nothing. */
+    FcConfigBuildFonts(config);
+
+    for(i = 0; paths[i]; i++) {
+	FcBool added;
+
+	if(g_file_test(paths[i], G_FILE_TEST_IS_DIR))
+	    added = FcConfigAppFontAddDir(config, (const FcChar8 *)paths[i]);
+	else
+	    added = FcConfigAppFontAddFile(config, (const FcChar8 *)paths[i]);
+	if(! added) {
+	    FcConfigDestroy(config);
+	    SDL_SetError("fonts cannot be added: %s", paths[i]);
+	    return -1;
+	}
+    }
+
+    g_mutex_lock(&font_map_lock);
+#if PANGO_VERSION_CHECK(1, 38, 0)
+    if(private_fonts)
+	FcConfigDestroy(private_fonts);
+    private_fonts = config;
+#else
+    /* Font maps cannot be given a configuration of their own. */
+    FcConfigSetCurrent(config);
+#endif
+    g_mutex_unlock(&font_map_lock);
+
+    /* Runs shaped with the fonts of the old configuration are not shared
+       with the contexts of the new one. */
+    SDLPangoDraw_ClearShapeCache();
+
+    return 0;
+}
+
+/*!
+    Create a font map, with the fonts given to SDLPangoDraw_InitWithFonts
+    if any.
+
+    @return New font map
+*/
+static PangoFontMap *
+createFontMap(void)
+{
+    PangoFontMap *font_map;
+
+    g_mutex_lock(&font_map_lock);
+    font_map = pango_ft2_font_map_new ();
+#if PANGO_VERSION_CHECK(1, 38, 0)
+    if(private_fonts)
+	pango_fc_font_map_set_config (PANGO_FC_FONT_MAP (font_map), private_fonts);
+#endif
+    g_mutex_unlock(&font_map_lock);
+
+    return font_map;
+}
+
 /*!
     Query the initilization status of the Glib and Pango API.
     You may, of course, use this before SDLPangoDraw_Init to avoid
@@ -337,13 +840,20 @@ SDLPangoDraw_WasInit()
 
 /*!
     Draw glyphs on rect.
+    The glyphs are rasterized tile by tile into the scratch bitmap, so the
+    scratch memory never exceeds the context's scratch limit no matter how
+    large the rect or the layout is.
+    Only the part of the rect inside the surface is rasterized.
 
     @param *context [in] Context
     @param *surface [out] Surface to draw on it
     @param *color_matrix [in] Foreground and background color
     @param *font [in] Innter variable of Pango
     @param *glyphs [in] Innter variable of Pango
-    @param *rect [in] Draw on this area
+    @param x [in] X of left-top of the area to draw on
+    @param y [in] Y of left-top of the area to draw on
+    @param width [in] Width of the area to draw on
+    @param height [in] Height of the area to draw on
     @param baseline [in] Horizontal location of glyphs
 */
 static void
@@ -353,23 +863,96 @@ drawGlyphString(
     SDLPangoDraw_Matrix *color_matrix,
     PangoFont *font,
     PangoGlyphString *glyphs,
-    SDL_Rect *rect,
+    int x, int y,
+    int width, int height,
     int baseline)
 {
-    pango_ft2_render(context->tmp_ftbitmap, font, glyphs, rect->x, rect->y + baseline);
+    FT_Bitmap tile;
+    int x0, y0, x1, y1;
+    int tile_w, tile_h;
+    int limit;
+    int tx, ty;
+    int target_w, target_h;
+
+    if(context->strip) {
+	stripGlyphString(context->strip, color_matrix, font, glyphs,
+	    x, y, width, height, baseline);
+	return;
+    }
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+    if(context->atlas) {
+	atlasGlyphString(context, color_matrix, font, glyphs,
+	    x, y, width, height, baseline);
+	return;
+    }
+#endif
+
+    if(context->yuv) {
+	target_w = context->yuv->width;
+	target_h = context->yuv->height;
+    } else {
+	target_w = surface->w;
+	target_h = surface->h;
+    }
 
-    SDLPangoDraw_CopyFTBitmapToSurface(
-	context->tmp_ftbitmap,
-	surface,
-	color_matrix,
-	rect);
+    x0 = MAX(x, 0);
+    y0 = MAX(y, 0);
+    x1 = MIN(x + width, target_w);
+    y1 = MIN(y + height, target_h);
+    if(context->clip_enabled) {
+	x0 = MAX(x0, context->clip.x);
+	y0 = MAX(y0, context->clip.y);
+	x1 = MIN(x1, context->clip.x + context->clip.w);
+	y1 = MIN(y1, context->clip.y + context->clip.h);
+    }
+    if(x0 >= x1 || y0 >= y1)
+	return;
+
+    limit = scratchLimit(context);
+    tile_w = MIN(x1 - x0, limit);
+    tile_h = limit / ((tile_w + 3) & ~3);
+    tile_h = MAX(1, MIN(y1 - y0, tile_h));
+
+    reserveScratch(context, tile_w, tile_h);
+
+    for(ty = y0; ty < y1; ty += tile_h) {
+	for(tx = x0; tx < x1; tx += tile_w) {
+	    /* A view of the scratch bitmap restricted to this tile, so that
+	       Pango clips the glyphs to the tile. */
+	    tile = *context->tmp_ftbitmap;
+	    tile.width = MIN(tile_w, x1 - tx);
+	    tile.rows = MIN(tile_h, y1 - ty);
+
+	    pango_ft2_render(&tile, font, glyphs,
+		x - tx, y + baseline - ty);
+
+	    if(context->yuv)
+		blendYUV(context->yuv, color_matrix, tile.buffer, tile.pitch,
+		    tx, ty, tile.width, tile.rows);
+	    else if(context->blend_into)
+		blendCoverage(surface, color_matrix, context->premultiplied,
+		    tile.buffer, tile.pitch, tx, ty, tile.width, tile.rows);
+	    else if(context->render_mode == SDLPANGODRAW_RENDER_MONO)
+		copyFTBitmapMono(&tile, 0, 0, surface, color_matrix,
+		    tx, ty, tile.width, tile.rows);
+	    else
+		copyFTBitmap(&tile, 0, 0, surface, color_matrix,
+		    tx, ty, tile.width, tile.rows);
 
-    clearFTBitmap(context->tmp_ftbitmap);
+	    memset(tile.buffer, 0, tile.pitch * tile.rows);
+	}
+    }
 }
 
+static void yuvHLine(
+    const SDLPangoDraw_YUVFrame *frame,
+    const SDLPangoDraw_Matrix *color_matrix,
+    int y, int start, int end);
+
 /*!
     Draw horizontal line of a pixel.
 
+    @param *context [i/o] Context
     @param *surface [out] Surface to draw on it
     @param *color_matrix [in] Foreground and background color
     @param y [in] Y location of line
@@ -377,6 +960,7 @@ drawGlyphString(
     @param end [in] Right of line
 */
 static void drawHLine(
+    SDLPangoDraw_Context *context,
     SDL_Surface *surface,
     SDLPangoDraw_Matrix *color_matrix,
     int y,
@@ -388,7 +972,24 @@ static void drawHLine(
     Uint32 *p32;
     Uint32 color;
     int ix;
-    int pixel_bytes = surface->format->BytesPerPixel;
+    int pixel_bytes;
+
+    if(context->strip) {
+	stripHLine(context->strip, color_matrix, y, start, end);
+	return;
+    }
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+    if(context->atlas) {
+	atlasHLine(context->atlas, color_matrix, y, start, end);
+	return;
+    }
+#endif
+    if(context->yuv) {
+	yuvHLine(context->yuv, color_matrix, y, start, end);
+	return;
+    }
+
+    pixel_bytes = surface->format->BytesPerPixel;
 
     if (y < 0 || y >= surface->h)
 	return;
@@ -402,6 +1003,25 @@ static void drawHLine(
     if (end >= surface->w)
 	end = surface->w;
 
+    if(context->clip_enabled) {
+	if(y < context->clip.y || y >= context->clip.y + context->clip.h)
+	    return;
+	start = MAX(start, context->clip.x);
+	end = MIN(end, context->clip.x + context->clip.w);
+	if(start >= end)
+	    return;
+    }
+
+    if(context->blend_into) {
+	Uint8 full[256];
+
+	memset(full, 255, sizeof(full));
+	for(; start < end; start += sizeof(full))
+	    blendCoverage(surface, color_matrix, context->premultiplied, full, 0,
+		start, y, MIN(end - start, (int)sizeof(full)), 1);
+	return;
+    }
+
     p = (Uint8 *)(surface->pixels) + y * surface->pitch + start * pixel_bytes;
     color = SDL_MapRGBA(surface->format,
 	color_matrix->m[0][1],
@@ -426,12 +1046,153 @@ static void drawHLine(
     }
 }
 
+/*!
+    Get how a run is drawn: its colors, lines and extents.
+
+    @param *run [in] Run
+    @param *style [out] Style of the run
+*/
+static void
+getRunStyle(
+    PangoLayoutRun *run,
+    runStyle *style)
+{
+    style->uline = PANGO_UNDERLINE_NONE;
+    getItemProperties(run->item,
+	&style->uline, &style->strike, &style->rise,
+	&style->fg_color, &style->fg_set, &style->bg_color, &style->bg_set,
+	&style->shape_set, &style->ink_rect, &style->logical_rect);
+
+    if(! style->shape_set) {
+	if (style->uline == PANGO_UNDERLINE_NONE)
+	    pango_glyph_string_extents (run->glyphs, run->item->analysis.font,
+					NULL, &style->logical_rect);
+	else
+	    pango_glyph_string_extents (run->glyphs, run->item->analysis.font,
+					&style->ink_rect, &style->logical_rect);
+    }
+}
+
+/*!
+    Draw a run.
+
+    @param *context [in] Context
+    @param *surface [out] Surface to draw on it
+    @param *style [in] Style of the run
+    @param *font [in] Font of the glyphs
+    @param *glyphs [in] Glyphs of the run
+    @param x [in] X location of line
+    @param x_off [in] X of the run from the line, in Pango units
+    @param y [in] Y location of line
+    @param height [in] Height of line
+    @param baseline [in] Baseline of line, from its top
+*/
+static void
+drawRun(
+    SDLPangoDraw_Context *context,
+    SDL_Surface *surface,
+    const runStyle *style,
+    PangoFont *font,
+    PangoGlyphString *glyphs,
+    int x, int x_off, int y,
+    int height,
+    int baseline)
+{
+    SDLPangoDraw_Matrix color_matrix = context->color_matrix;
+    const PangoRectangle *ink_rect = &style->ink_rect;
+    const PangoRectangle *logical_rect = &style->logical_rect;
+    gint risen_y = y + baseline - PANGO_PIXELS (style->rise);
+
+    if(style->fg_set) {
+	color_matrix.m[0][1] = (Uint8)(style->fg_color.red >> 8);
+	color_matrix.m[1][1] = (Uint8)(style->fg_color.green >> 8);
+	color_matrix.m[2][1] = (Uint8)(style->fg_color.blue >> 8);
+	color_matrix.m[3][1] = 255;
+	if(color_matrix.m[3][0] == 0) {
+	    color_matrix.m[0][0] = (Uint8)(style->fg_color.red >> 8);
+	    color_matrix.m[1][0] = (Uint8)(style->fg_color.green >> 8);
+	    color_matrix.m[2][0] = (Uint8)(style->fg_color.blue >> 8);
+	}
+    }
+
+    if (style->bg_set) {
+	color_matrix.m[0][0] = (Uint8)(style->bg_color.red >> 8);
+	color_matrix.m[1][0] = (Uint8)(style->bg_color.green >> 8);
+	color_matrix.m[2][0] = (Uint8)(style->bg_color.blue >> 8);
+	color_matrix.m[3][0] = 255;
+    }
+
+    /* Strips keep straight colors until they are composited. */
+    if(context->premultiplied && ! context->strip && ! context->yuv)
+	premultiplyMatrix(&color_matrix);
+
+    if(! style->shape_set) {
+	drawGlyphString(context, surface,
+	    &color_matrix,
+	    font, glyphs,
+	    x + PANGO_PIXELS (x_off), risen_y - baseline,
+	    PANGO_PIXELS (logical_rect->width), height,
+	    baseline);
+    }
+    switch (style->uline) {
+    case PANGO_UNDERLINE_NONE:
+	break;
+    case PANGO_UNDERLINE_DOUBLE:
+	drawHLine(context, surface, &color_matrix,
+	    risen_y + 4,
+	    x + PANGO_PIXELS (x_off + ink_rect->x),
+	    x + PANGO_PIXELS (x_off + ink_rect->x + ink_rect->width));
+      /* Fall through */
+    case PANGO_UNDERLINE_SINGLE:
+	drawHLine(context, surface, &color_matrix,
+	    risen_y + 2,
+	    x + PANGO_PIXELS (x_off + ink_rect->x),
+	    x + PANGO_PIXELS (x_off + ink_rect->x + ink_rect->width));
+	break;
+    case PANGO_UNDERLINE_ERROR:
+	{
+	    int point_x;
+	    int counter = 0;
+	    int end_x = x + PANGO_PIXELS (x_off + ink_rect->x + ink_rect->width);
+
+	    for (point_x = x + PANGO_PIXELS (x_off + ink_rect->x) - 1;
+		point_x <= end_x;
+		point_x += 2)
+	    {
+		if (counter)
+		    drawHLine(context, surface, &color_matrix,
+			risen_y + 2,
+			point_x, MIN (point_x + 1, end_x));
+		else
+		    drawHLine(context, surface, &color_matrix,
+			risen_y + 3,
+			point_x, MIN (point_x + 1, end_x));
+
+		counter = (counter + 1) % 2;
+	    }
+	}
+	break;
+    case PANGO_UNDERLINE_LOW:
+	drawHLine(context, surface, &color_matrix,
+	    risen_y + PANGO_PIXELS (ink_rect->y + ink_rect->height),
+	    x + PANGO_PIXELS (x_off + ink_rect->x),
+	    x + PANGO_PIXELS (x_off + ink_rect->x + ink_rect->width));
+      break;
+    }
+
+    if (style->strike)
+	drawHLine(context, surface, &color_matrix,
+	    risen_y + PANGO_PIXELS (logical_rect->y + logical_rect->height / 2),
+	    x + PANGO_PIXELS (x_off + logical_rect->x),
+	    x + PANGO_PIXELS (x_off + logical_rect->x + logical_rect->width));
+}
+
 /*!
     Draw a line.
 
     @param *context [in] Context
     @param *surface [out] Surface to draw on it
-    @param *line [in] Innter variable of Pango
+    @param *runs [in] Runs of the line (PangoLayoutRun) in visual order
     @param x [in] X location of line
     @param y [in] Y location of line
     @param height [in] Height of line
@@ -441,131 +1202,27 @@ static void
 drawLine(
     SDLPangoDraw_Context *context,
     SDL_Surface *surface,
-    PangoLayoutLine *line,
+    GSList *runs,
     gint x, 
     gint y, 
     gint height,
     gint baseline)
 {
-    GSList *tmp_list = line->runs;
-    PangoColor fg_color, bg_color;
-    PangoRectangle logical_rect;
-    PangoRectangle ink_rect;
+    GSList *tmp_list = runs;
+    runStyle style;
     int x_off = 0;
 
     while (tmp_list) {
-	SDLPangoDraw_Matrix color_matrix = context->color_matrix;
-	PangoUnderline uline = PANGO_UNDERLINE_NONE;
-	gboolean strike, fg_set, bg_set, shape_set;
-	gint rise, risen_y;
 	PangoLayoutRun *run = tmp_list->data;
-	SDL_Rect d_rect;
 
 	tmp_list = tmp_list->next;
 
-	getItemProperties(run->item,
-	    &uline, &strike, &rise,
-	    &fg_color, &fg_set, &bg_color, &bg_set,
-	    &shape_set, &ink_rect, &logical_rect);
-
-	risen_y = y + baseline - PANGO_PIXELS (rise);
-
-	if(fg_set) {
-	    color_matrix.m[0][1] = (Uint8)(fg_color.red >> 8);
-	    color_matrix.m[1][1] = (Uint8)(fg_color.green >> 8);
-	    color_matrix.m[2][1] = (Uint8)(fg_color.blue >> 8);
-	    color_matrix.m[3][1] = 255;
-	    if(color_matrix.m[3][0] == 0) {
-		color_matrix.m[0][0] = (Uint8)(fg_color.red >> 8);
-		color_matrix.m[1][0] = (Uint8)(fg_color.green >> 8);
-		color_matrix.m[2][0] = (Uint8)(fg_color.blue >> 8);
-	    }
-	}
-
-	if (bg_set) {
-	    color_matrix.m[0][0] = (Uint8)(bg_color.red >> 8);
-	    color_matrix.m[1][0] = (Uint8)(bg_color.green >> 8);
-	    color_matrix.m[2][0] = (Uint8)(bg_color.blue >> 8);
-	    color_matrix.m[3][0] = 255;
-	}
-
-	if(! shape_set) {
-	    if (uline == PANGO_UNDERLINE_NONE)
-		pango_glyph_string_extents (run->glyphs, run->item->analysis.font,
-					    NULL, &logical_rect);
-	    else
-		pango_glyph_string_extents (run->glyphs, run->item->analysis.font,
-					    &ink_rect, &logical_rect);
-
-	    d_rect.w = (Uint16)PANGO_PIXELS(logical_rect.width);
-	    d_rect.h = (Uint16)height;
-	    d_rect.x = (Uint16)(x + PANGO_PIXELS (x_off));
-	    d_rect.y = (Uint16)(risen_y - baseline);
-
-	    if((! context->tmp_ftbitmap) || d_rect.w + d_rect.x > context->tmp_ftbitmap->width
-		|| d_rect.h + d_rect.y > context->tmp_ftbitmap->rows)
-	    {
-		freeFTBitmap(context->tmp_ftbitmap);
-		context->tmp_ftbitmap = createFTBitmap(d_rect.w + d_rect.x, d_rect.h + d_rect.y);
-	    }
-
-	    drawGlyphString(context, surface, 
-		&color_matrix, 
-		run->item->analysis.font, run->glyphs, &d_rect, baseline);
-	}
-        switch (uline) {
-	case PANGO_UNDERLINE_NONE:
-	    break;
-	case PANGO_UNDERLINE_DOUBLE:
-	    drawHLine(surface, &color_matrix,
-		risen_y + 4,
-		x + PANGO_PIXELS (x_off + ink_rect.x),
-		x + PANGO_PIXELS (x_off + ink_rect.x + ink_rect.width));
-	  /* Fall through */
-	case PANGO_UNDERLINE_SINGLE:
-	    drawHLine(surface, &color_matrix,
-		risen_y + 2,
-		x + PANGO_PIXELS (x_off + ink_rect.x),
-		x + PANGO_PIXELS (x_off + ink_rect.x + ink_rect.width));
-	    break;
-	case PANGO_UNDERLINE_ERROR:
-	    {
-		int point_x;
-		int counter = 0;
-		int end_x = x + PANGO_PIXELS (x_off + ink_rect.x + ink_rect.width);
-
-		for (point_x = x + PANGO_PIXELS (x_off + ink_rect.x) - 1;
-		    point_x <= end_x;
-		    point_x += 2)
-		{
-		    if (counter)
-			drawHLine(surface, &color_matrix,
-			    risen_y + 2,
-			    point_x, MIN (point_x + 1, end_x));
-		    else
-			drawHLine(surface, &color_matrix,
-			    risen_y + 3,
-			    point_x, MIN (point_x + 1, end_x));
-    		
-		    counter = (counter + 1) % 2;
-		}
-	    }
-	    break;
-	case PANGO_UNDERLINE_LOW:
-	    drawHLine(surface, &color_matrix,
-		risen_y + PANGO_PIXELS (ink_rect.y + ink_rect.height),
-		x + PANGO_PIXELS (x_off + ink_rect.x),
-		x + PANGO_PIXELS (x_off + ink_rect.x + ink_rect.width));
-	  break;
-	}
+	getRunStyle(run, &style);
+	drawRun(context, surface, &style,
+	    run->item->analysis.font, run->glyphs,
+	    x, x_off, y, height, baseline);
 
-        if (strike)
-	    drawHLine(surface, &color_matrix,
-		risen_y + PANGO_PIXELS (logical_rect.y + logical_rect.height / 2),
-		x + PANGO_PIXELS (x_off + logical_rect.x),
-		x + PANGO_PIXELS (x_off + logical_rect.x + logical_rect.width));
-
-	x_off += logical_rect.width;
+	x_off += style.logical_rect.width;
     }
 }
 
@@ -679,17 +1336,40 @@ SDLPangoDraw_CopyFTBitmapToSurface(
     SDL_Surface *surface,
     const SDLPangoDraw_Matrix *matrix,
     SDL_Rect *rect)
+{
+    copyFTBitmap(bitmap, rect->x, rect->y, surface, matrix,
+	rect->x, rect->y, rect->w, rect->h);
+}
+
+/*!
+    Copy a region of bitmap to surface.
+    From (bitmap_x, bitmap_y)-(width, height) of bitmap to
+    (x, y)-(width, height) of surface.
+
+    @param *bitmap [in] Grayscale bitmap
+    @param bitmap_x [in] X of left-top of the region in bitmap
+    @param bitmap_y [in] Y of left-top of the region in bitmap
+    @param *surface [out] Surface
+    @param *matrix [in] Foreground and background color
+    @param x [in] X of left-top of the region in surface
+    @param y [in] Y of left-top of the region in surface
+    @param width [in] Width of the region
+    @param height [in] Height of the region
+*/
+static void
+copyFTBitmap(
+    const FT_Bitmap *bitmap,
+    int bitmap_x, int bitmap_y,
+    SDL_Surface *surface,
+    const SDLPangoDraw_Matrix *matrix,
+    int x, int y, int width, int height)
 {
     int i;
     Uint8 *p_ft;
     Uint8 *p_sdl;
-    int width = rect->w;
-    int height = rect->h;
-    int x = rect->x;
-    int y = rect->y;
 
     if(x < 0) {
-	width += x; x = 0;
+	width += x; bitmap_x -= x; x = 0;
     }
     if(x + width > surface->w) {
 	width = surface->w - x;
@@ -698,7 +1378,7 @@ SDLPangoDraw_CopyFTBitmapToSurface(
 	return;
 
     if(y < 0) {
-	height += y; y = 0;
+	height += y; bitmap_y -= y; y = 0;
     }
     if(y + height > surface->h) {
 	height = surface->h - y;
@@ -712,7 +1392,7 @@ SDLPangoDraw_CopyFTBitmapToSurface(
 	return;
     }
 
-    p_ft = (Uint8 *)bitmap->buffer + (bitmap->pitch * y);
+    p_ft = (Uint8 *)bitmap->buffer + (bitmap->pitch * bitmap_y) + bitmap_x;
     p_sdl = (Uint8 *)surface->pixels + (surface->pitch * y);
     for(i = 0; i < height; i ++) {
 	int k;
@@ -723,7 +1403,7 @@ SDLPangoDraw_CopyFTBitmapToSurface(
 
 	    for(n = 0; n < 4; n ++) {
 		Uint16 w;
-		w = ((Uint16)matrix->m[n][0] * (256 - p_ft[k + x])) + ((Uint16)matrix->m[n][1] * p_ft[k + x]);
+		w = ((Uint16)matrix->m[n][0] * (256 - p_ft[k])) + ((Uint16)matrix->m[n][1] * p_ft[k]);
 		pixel[n] = (Uint8)(w >> 8);
 	    }
 
@@ -736,6 +1416,7 @@ SDLPangoDraw_CopyFTBitmapToSurface(
 		break;
 	    default:
 		SDL_SetError("surface->format->BytesPerPixel is invalid value");
+		SDL_UnlockSurface(surface);
 		return;
 	    }
 	}
@@ -746,35 +1427,169 @@ SDLPangoDraw_CopyFTBitmapToSurface(
     SDL_UnlockSurface(surface);
 }
 
+/*!
+    Blend a color over an area of a surface by a coverage bitmap, leaving
+    the pixels where the color is clear as they are, as blendYUV does for
+    YUV frames.
+    The area must be inside the surface.
 
-SDLPangoDraw_Context*
-SDLPangoDraw_CreateContext_GivenFontDesc(const char* font_desc)
+    @param *surface [i/o] Surface
+    @param *matrix [in] Foreground and background color
+    @param premultiplied [in] The matrix and the surface are premultiplied
+    @param *coverage [in] Coverage of the area, from 0 to 255
+    @param pitch [in] Bytes from a row of coverage to the next. May be 0.
+    @param x [in] X of left-top of the area
+    @param y [in] Y of left-top of the area
+    @param width [in] Width of the area
+    @param height [in] Height of the area
+*/
+static void
+blendCoverage(
+    SDL_Surface *surface,
+    const SDLPangoDraw_Matrix *matrix,
+    gboolean premultiplied,
+    const Uint8 *coverage,
+    int pitch,
+    int x, int y,
+    int width, int height)
 {
-    SDLPangoDraw_Context *context = g_malloc(sizeof(SDLPangoDraw_Context));
-    G_CONST_RETURN char *charset;
+    int bytes = surface->format->BytesPerPixel;
+    int i, j;
 
-    context->font_map = pango_ft2_font_map_new ();
-    pango_ft2_font_map_set_resolution (PANGO_FT2_FONT_MAP (context->font_map), DEFAULT_DPI, DEFAULT_DPI);
+    if(bytes != 2 && bytes != 4) {
+	SDL_SetError("surface->format->BytesPerPixel is invalid value");
+	return;
+    }
+    if(SDL_LockSurface(surface)) {
+	SDL_SetError("surface lock failed");
+	return;
+    }
 
-    context->context = pango_ft2_font_map_create_context (PANGO_FT2_FONT_MAP (context->font_map));
+    for(j = 0; j < height; j++) {
+	const Uint8 *c_row = coverage + j * pitch;
+	Uint8 *p_sdl = (Uint8 *)surface->pixels + (y + j) * surface->pitch + x * bytes;
 
-    g_get_charset(&charset);
-    pango_context_set_language (context->context, pango_language_from_string (charset));
-    pango_context_set_base_dir (context->context, PANGO_DIRECTION_LTR);
+	for(i = 0; i < width; i++, p_sdl += bytes) {
+	    int c = c_row[i];
+	    int a = DIV255(matrix->m[3][1] * c + matrix->m[3][0] * (255 - c));
+	    Uint8 color[3], pixel[4];
+	    Uint32 value;
+	    int n;
+
+	    if(a == 0)
+		continue;
+	    for(n = 0; n < 3; n++)
+		color[n] = (Uint8)DIV255(matrix->m[n][1] * c + matrix->m[n][0] * (255 - c));
+
+	    value = bytes == 2 ? *(Uint16 *)p_sdl : *(Uint32 *)p_sdl;
+	    SDL_GetRGBA(value, surface->format, &pixel[0], &pixel[1], &pixel[2], &pixel[3]);
+	    if(premultiplied) {
+		for(n = 0; n < 3; n++)
+		    pixel[n] = (Uint8)MIN(255, color[n] + DIV255(pixel[n] * (255 - a)));
+		pixel[3] = (Uint8)(a + DIV255(pixel[3] * (255 - a)));
+	    } else
+		blendOver(pixel, color, a);
+
+	    value = SDL_MapRGBA(surface->format, pixel[0], pixel[1], pixel[2], pixel[3]);
+	    if(bytes == 2)
+		*(Uint16 *)p_sdl = (Uint16)value;
+	    else
+		*(Uint32 *)p_sdl = value;
+	}
+    }
+
+    SDL_UnlockSurface(surface);
+}
+
+
+SDLPangoDraw_Context*
+SDLPangoDraw_CreateContext_GivenFontDesc(const char* font_desc)
+{
+    SDLPangoDraw_Context *context = g_malloc(sizeof(SDLPangoDraw_Context));
+    G_CONST_RETURN char *charset;
+
+    context->font_map = createFontMap();
+    pango_ft2_font_map_set_resolution (PANGO_FT2_FONT_MAP (context->font_map), DEFAULT_DPI, DEFAULT_DPI);
+
+    context->context = pango_ft2_font_map_create_context (PANGO_FT2_FONT_MAP (context->font_map));
+
+    g_get_charset(&charset);
+    pango_context_set_language (context->context, pango_language_from_string (charset));
+    pango_context_set_base_dir (context->context, PANGO_DIRECTION_LTR);
 
     context->font_desc = pango_font_description_from_string(font_desc);
+    pango_context_set_font_description (context->context, context->font_desc);
 
     context->layout = pango_layout_new (context->context);
 
-    SDLPangoDraw_SetSurfaceCreateArgs(context, SDL_SWSURFACE | SDL_SRCALPHA, DEFAULT_DEPTH,
+    SDLPangoDraw_SetSurfaceCreateArgs(context, DEFAULT_SURFACE_FLAGS, DEFAULT_DEPTH,
 	DEFAULT_RMASK, DEFAULT_GMASK, DEFAULT_BMASK, DEFAULT_AMASK);
 
     context->tmp_ftbitmap = NULL;
+    context->scratch_limit = DEFAULT_SCRATCH_LIMIT;
+
+    context->effects_enabled = FALSE;
+    context->strip = NULL;
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+    context->atlas = NULL;
+#endif
+    context->yuv = NULL;
+    context->effect_buf = NULL;
+    context->effect_buf_size = 0;
 
     context->color_matrix = *MATRIX_TRANSPARENT_BACK_BLACK_LETTER;
+    context->premultiplied = FALSE;
+    context->blend_into = FALSE;
+    context->render_mode = SDLPANGODRAW_RENDER_GRAY;
 
     context->min_height = 0;
     context->min_width = 0;
+    context->max_lines = 0;
+    context->max_height = 0;
+    context->ellipsize = PANGO_ELLIPSIZE_NONE;
+
+    context->alignment = PANGO_ALIGN_LEFT;
+    context->dpi_x = DEFAULT_DPI;
+    context->dpi_y = DEFAULT_DPI;
+    context->shaped = NULL;
+    context->simple_font = NULL;
+    context->shaped_layout = TRUE;
+    context->fast_path = TRUE;
+    context->reflow = TRUE;
+    context->font_names = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+	g_object_unref, g_free);
+    context->shape_key = g_string_new(NULL);
+
+    context->index_lines = g_array_new(FALSE, FALSE, sizeof(indexLine));
+    context->index_runs = g_array_new(FALSE, FALSE, sizeof(indexRun));
+    context->index_lines_peak = 0;
+    context->index_runs_peak = 0;
+    context->index_valid = FALSE;
+    context->index_truncated = FALSE;
+
+    context->clip_enabled = FALSE;
+    context->damage_lines = g_array_new(FALSE, FALSE, sizeof(damageLine));
+    context->damage_runs = g_array_new(FALSE, FALSE, sizeof(damageRun));
+    context->frame_lines = g_array_new(FALSE, FALSE, sizeof(damageLine));
+    context->frame_runs = g_array_new(FALSE, FALSE, sizeof(damageRun));
+    context->damage_glyphs = g_array_new(FALSE, FALSE, sizeof(PangoGlyphInfo));
+    context->frame_glyphs = g_array_new(FALSE, FALSE, sizeof(PangoGlyphInfo));
+    context->damage_surface = NULL;
+    context->damage_valid = FALSE;
+    context->buffer_surface = NULL;
+    context->incr_surface = NULL;
+    context->incr_valid = FALSE;
+    context->compiled_glyphs = NULL;
+    context->memory_budget = 0;
+    context->working_set = 0;
+    context->budget_trimmed = FALSE;
+
+    context->prewarm = NULL;
+    context->prewarm_text = g_string_new(NULL);
+    context->prewarm_callbacks = NULL;
+    context->prewarm_waiting = FALSE;
+
+    context->buffer_growths = 0;
 
     return context;
 }
@@ -787,7 +1602,7 @@ SDLPangoDraw_CreateContext_GivenFontDesc(const char* font_desc)
 SDLPangoDraw_Context*
 SDLPangoDraw_CreateContext()
 {
-    SDLPangoDraw_CreateContext_GivenFontDesc(MAKE_FONT_NAME(DEFAULT_FONT_FAMILY, DEFAULT_FONT_SIZE));
+    return SDLPangoDraw_CreateContext_GivenFontDesc(MAKE_FONT_NAME(DEFAULT_FONT_FAMILY, DEFAULT_FONT_SIZE));
 }
 
 /*!
@@ -798,7 +1613,39 @@ SDLPangoDraw_CreateContext()
 void
 SDLPangoDraw_FreeContext(SDLPangoDraw_Context *context)
 {
+    GSList *tmp_list;
+
+    if(context->prewarm)
+	freePrewarmJob(context->prewarm);
+    for(tmp_list = context->prewarm_callbacks; tmp_list; tmp_list = tmp_list->next)
+	g_free(tmp_list->data);
+    g_slist_free(context->prewarm_callbacks);
+    g_string_free(context->prewarm_text, TRUE);
+
     freeFTBitmap(context->tmp_ftbitmap);
+    g_free(context->effect_buf);
+
+    freeShapedText(context->shaped);
+    freeSimpleFont(context->simple_font);
+    g_hash_table_destroy(context->font_names);
+    g_string_free(context->shape_key, TRUE);
+
+    g_array_free(context->index_lines, TRUE);
+    g_array_free(context->index_runs, TRUE);
+
+    clearDamageRuns(context->damage_runs);
+    clearDamageRuns(context->frame_runs);
+    g_array_free(context->damage_lines, TRUE);
+    g_array_free(context->damage_runs, TRUE);
+    g_array_free(context->frame_lines, TRUE);
+    g_array_free(context->frame_runs, TRUE);
+    g_array_free(context->damage_glyphs, TRUE);
+    g_array_free(context->frame_glyphs, TRUE);
+
+    if(context->compiled_glyphs)
+	pango_glyph_string_free(context->compiled_glyphs);
+    if(context->buffer_surface)
+	SDL_FreeSurface(context->buffer_surface);
 
     g_object_unref (context->layout);
 
@@ -806,7 +1653,9 @@ SDLPangoDraw_FreeContext(SDLPangoDraw_Context *context)
 
     g_object_unref(context->context);
 
+    g_mutex_lock(&font_map_lock);
     g_object_unref(context->font_map);
+    g_mutex_unlock(&font_map_lock);
 
     g_free(context);
 }
@@ -853,7 +1702,7 @@ SDL_Surface * SDLPangoDraw_CreateSurfaceDraw(
     SDL_Surface *surface;
     int width, height;
 
-    pango_layout_get_extents (context->layout, NULL, &logical_rect);
+    getLayoutExtents(context, &logical_rect);
     width = PANGO_PIXELS (logical_rect.width);
     height = PANGO_PIXELS (logical_rect.height);
     if(width < context->min_width)
@@ -890,52 +1739,298 @@ SDLPangoDraw_Draw(
     SDL_Surface *surface,
     int x, int y)
 {
-    PangoLayoutIter *iter;
     PangoRectangle logical_rect;
     int width, height;
 
+    adoptPrewarm(context);
+
+    context->buffer_growths = 0;
+    context->damage_valid = FALSE;
+
     if(! surface) {
 	SDL_SetError("surface is NULL");
 	return;
     }
 
-    iter = pango_layout_get_iter (context->layout);
-
-    pango_layout_get_extents (context->layout, NULL, &logical_rect);
+    getLayoutExtents(context, &logical_rect);
     width = PANGO_PIXELS (logical_rect.width);
     height = PANGO_PIXELS (logical_rect.height);
 
-    if(width && height) {
+    if(width && height && ! context->blend_into) {
 	SDL_FillRect(surface, NULL, SDL_MapRGBA(surface->format, 0, 0, 0, 0));
     }
 
-    if((! context->tmp_ftbitmap) || context->tmp_ftbitmap->width < width
-	|| context->tmp_ftbitmap->rows < height)
+    if(context->effects_enabled)
+	drawEffects(context, surface, x, y);
+    else
+	drawLayoutLines(context, surface, context->layout, x, y, 0, -1);
+
+    enforceMemoryBudget(context);
+}
+
+/*!
+    Draw the text of a context into pixels owned by the caller, such as
+    the frame of a video encoder or a shared-memory buffer, the way
+    SDLPangoDraw_Draw draws on a surface.
+    The pixels are written in place through a surface header kept by the
+    context, which only points at them: nothing is copied, and no surface
+    is created unless the size or the format changes.
+    Unlike SDLPangoDraw_Draw, the pixels are not cleared: the text and its
+    background are blended over them, like SDLPangoDraw_DrawYUV does.
+
+    @param *context [i/o] Context
+    @param *pixels [i/o] Pixels, 16 or 32 bits each
+    @param width [in] Width in pixels
+    @param height [in] Height in pixels
+    @param pitch [in] Bytes from a row to the next
+    @param *format [in] Layout of a pixel
+    @param x [in] X of left-top of drawing area
+    @param y [in] Y of left-top of drawing area
+    @return 0 on success, -1 on error
+*/
+int
+SDLPangoDraw_DrawToBuffer(
+    SDLPangoDraw_Context *context,
+    void *pixels,
+    int width, int height,
+    int pitch,
+    const SDLPangoDraw_PixelFormat *format,
+    int x, int y)
+{
+    SDL_Surface *surface = context->buffer_surface;
+
+    if(! pixels || ! format) {
+	SDL_SetError("no pixels to draw on");
+	return -1;
+    }
+    if(format->bytes_per_pixel != 2 && format->bytes_per_pixel != 4) {
+	SDL_SetError("bytes_per_pixel is invalid value");
+	return -1;
+    }
+
+    if(! surface || surface->w != width || surface->h != height
+	|| surface->pitch != pitch
+	|| memcmp(&context->buffer_format, format, sizeof(SDLPangoDraw_PixelFormat)) != 0)
     {
-	freeFTBitmap(context->tmp_ftbitmap);
-        context->tmp_ftbitmap = createFTBitmap(width, height);
+	if(surface)
+	    SDL_FreeSurface(surface);
+	surface = SDL_CreateRGBSurfaceFrom(pixels, width, height,
+	    format->bytes_per_pixel * 8, pitch,
+	    format->Rmask, format->Gmask, format->Bmask, format->Amask);
+	context->buffer_surface = surface;
+	if(! surface)
+	    return -1;
+	context->buffer_format = *format;
     }
 
-    do {
-	PangoLayoutLine *line;
-	int baseline;
+    /* The header does not own its pixels, so it may point anywhere. */
+    surface->pixels = pixels;
 
-	line = pango_layout_iter_get_line (iter);
+    context->blend_into = TRUE;
+    SDLPangoDraw_Draw(context, surface, x, y);
+    context->blend_into = FALSE;
 
-	pango_layout_iter_get_line_extents (iter, NULL, &logical_rect);
-	baseline = pango_layout_iter_get_baseline (iter);
+    return 0;
+}
+
+/*!
+    Load the current line of a cursor.
+
+    @param *cursor [i/o] Cursor
+*/
+static void
+loadLine(
+    lineCursor *cursor)
+{
+    PangoLayoutLine *line = pango_layout_iter_get_line (cursor->iter);
+
+    cursor->line.runs = line->runs;
+    cursor->line.start_index = line->start_index;
+    cursor->line.length = line->length;
+    pango_layout_iter_get_line_extents (cursor->iter, NULL,
+	&cursor->line.logical_rect);
+    cursor->line.baseline = pango_layout_iter_get_baseline (cursor->iter);
+}
+
+/*!
+    Load the current line of a cursor from the line index.
+
+    @param *cursor [i/o] Cursor
+*/
+static void
+loadIndexLine(
+    lineCursor *cursor)
+{
+    const indexLine *line = &g_array_index(cursor->lines, indexLine, cursor->index);
+
+    cursor->line.runs = line->runs;
+    cursor->line.start_index = line->start_index;
+    cursor->line.length = line->length;
+    cursor->line.logical_rect.x = line->x;
+    cursor->line.logical_rect.y = line->y;
+    cursor->line.logical_rect.width = line->width;
+    cursor->line.logical_rect.height = line->height;
+    cursor->line.baseline = line->baseline;
+}
+
+/*!
+    Start walking the lines of a layout as laid out.
+    The layout of the context is walked through its shaped text, if the
+    text is drawn that way.
+
+    @param *cursor [out] Cursor, on the first line
+    @param *context [i/o] Context
+    @param *layout [in] Layout
+*/
+static void
+openLayoutLines(
+    lineCursor *cursor,
+    SDLPangoDraw_Context *context,
+    PangoLayout *layout)
+{
+    GArray *shaped_lines = layout == context->layout ? shapedLines(context) : NULL;
+
+    cursor->lines = NULL;
+    cursor->shaped_lines = NULL;
+    if(shaped_lines) {
+	cursor->iter = NULL;
+	cursor->shaped_lines = shaped_lines;
+	cursor->index = 0;
+	cursor->line = g_array_index(cursor->shaped_lines, lineInfo, 0);
+    } else {
+	cursor->iter = pango_layout_get_iter (layout);
+	context->buffer_growths++;
+	loadLine(cursor);
+    }
+}
+
+/*!
+    Start walking the lines of a layout.
+    The layout of the context is walked through its line index, which is
+    kept until the text or the layout settings change, so drawing the same
+    text again allocates nothing.
+
+    @param *cursor [out] Cursor, on the first line
+    @param *context [i/o] Context
+    @param *layout [in] Layout
+*/
+static void
+openLines(
+    lineCursor *cursor,
+    SDLPangoDraw_Context *context,
+    PangoLayout *layout)
+{
+    if(layout == context->layout) {
+	buildLineIndex(context);
+	cursor->iter = NULL;
+	cursor->lines = context->index_lines;
+	cursor->shaped_lines = NULL;
+	cursor->index = 0;
+	loadIndexLine(cursor);
+    } else
+	openLayoutLines(cursor, context, layout);
+}
+
+/*!
+    Move a cursor to the next line.
+
+    @param *cursor [i/o] Cursor
+    @return FALSE if there are no more lines
+*/
+static gboolean
+nextLine(
+    lineCursor *cursor)
+{
+    if(cursor->iter) {
+	if(! pango_layout_iter_next_line (cursor->iter))
+	    return FALSE;
+	loadLine(cursor);
+    } else if(cursor->lines) {
+	if(cursor->index + 1 >= cursor->lines->len)
+	    return FALSE;
+	cursor->index++;
+	loadIndexLine(cursor);
+    } else if(cursor->shaped_lines) {
+	if(cursor->index + 1 >= cursor->shaped_lines->len)
+	    return FALSE;
+	cursor->index++;
+	cursor->line = g_array_index(cursor->shaped_lines, lineInfo, cursor->index);
+    } else
+	return FALSE;
+    return TRUE;
+}
+
+/*!
+    Finish walking the lines.
+
+    @param *cursor [i/o] Cursor
+*/
+static void
+closeLines(
+    lineCursor *cursor)
+{
+    if(cursor->iter)
+	pango_layout_iter_free (cursor->iter);
+}
+
+/*!
+    Draw a range of lines of a layout.
+    The top of the first line is placed at y.
+
+    @param *context [in] Context
+    @param *surface [i/o] Surface to draw on
+    @param *layout [in] Layout to draw
+    @param x [in] X of left of drawing area
+    @param y [in] Y of top of the first line
+    @param first [in] Index of the first line to draw
+    @param count [in] Number of lines to draw. -1 means all remaining lines.
+    @return Height of the drawn lines in pixels
+*/
+static int
+drawLayoutLines(
+    SDLPangoDraw_Context *context,
+    SDL_Surface *surface,
+    PangoLayout *layout,
+    int x, int y,
+    int first, int count)
+{
+    lineCursor cursor;
+    int index;
+    int top = 0;
+    int bottom = 0;
+
+    openLines(&cursor, context, layout);
+
+    for(index = 0; index < first; index++) {
+	if(! nextLine(&cursor)) {
+	    closeLines(&cursor);
+	    return 0;
+	}
+    }
+
+    do {
+	const PangoRectangle *logical_rect = &cursor.line.logical_rect;
+
+	if(index == first)
+	    top = PANGO_PIXELS (logical_rect->y);
+	bottom = PANGO_PIXELS (logical_rect->y + logical_rect->height);
 
 	drawLine(
 	    context,
 	    surface,
-	    line,
-	    x + PANGO_PIXELS (logical_rect.x),
-	    y + PANGO_PIXELS (logical_rect.y),
-	    PANGO_PIXELS (logical_rect.height),
-	    PANGO_PIXELS (baseline - logical_rect.y));
-    } while (pango_layout_iter_next_line (iter));
+	    cursor.line.runs,
+	    x + PANGO_PIXELS (logical_rect->x),
+	    y + PANGO_PIXELS (logical_rect->y) - top,
+	    PANGO_PIXELS (logical_rect->height),
+	    PANGO_PIXELS (cursor.line.baseline - logical_rect->y));
 
-    pango_layout_iter_free (iter);
+	index++;
+    } while ((count < 0 || index < first + count)
+	&& nextLine(&cursor));
+
+    closeLines(&cursor);
+
+    return bottom - top;
 }
 
 /*!
@@ -981,252 +2076,8402 @@ freeFTBitmap(
 }
 
 /*!
-    Clear a FTBitmap object.
+    Get the scratch limit of a context in effect: the one set by
+    SDLPangoDraw_SetScratchLimit, lowered to half of the memory budget
+    if there is one.
 
-    @param *bitmap [i/o] FTbitmap to be clear
+    @param *context [in] Context
+    @return Limit in bytes
 */
-static void
-clearFTBitmap(
-    FT_Bitmap *bitmap)
+static int
+scratchLimit(
+    const SDLPangoDraw_Context *context)
 {
-    Uint8 *p = (Uint8 *)bitmap->buffer;
-    int length = bitmap->pitch * bitmap->rows;
-
-    memset(p, 0, length);
+    if(context->memory_budget > 0)
+	return MAX(MIN(context->scratch_limit, context->memory_budget / 2),
+	    MIN_SCRATCH_LIMIT);
+    return context->scratch_limit;
 }
 
 /*!
-    Specify minimum size of drawing rect.
+    Make sure the scratch bitmap of a context is at least width X height.
+    The scratch bitmap keeps its largest size so far, as long as that stays
+    within the scratch limit.
 
     @param *context [i/o] Context
-    @param width [in] Width. -1 means no wrapping mode.
-    @param height [in] Height. zero/minus value means non-specified.
+    @param width [in] Width
+    @param height [in] Height
 */
-void
-SDLPangoDraw_SetMinimumSize(
+static void
+reserveScratch(
     SDLPangoDraw_Context *context,
     int width, int height)
 {
-    int pango_width;
-    if(width > 0)
-	pango_width = width * PANGO_SCALE;
-    else
-	pango_width = -1;
-    pango_layout_set_width(context->layout, pango_width);
+    FT_Bitmap *scratch = context->tmp_ftbitmap;
 
-    context->min_width = width;
-    context->min_height = height;
+    if(scratch && scratch->width >= width && scratch->rows >= height)
+	return;
+
+    if(scratch) {
+	int grown_w = MAX(width, (int)scratch->width);
+	int grown_h = MAX(height, (int)scratch->rows);
+
+	if(((grown_w + 3) & ~3) * grown_h <= scratchLimit(context)) {
+	    width = grown_w;
+	    height = grown_h;
+	}
+    }
+
+    freeFTBitmap(scratch);
+    context->tmp_ftbitmap = createFTBitmap(width, height);
+    context->buffer_growths += 2;
 }
 
 /*!
-    Specify default color.
+    Release the scratch memory of a context if it is over the scratch
+    limit in effect.
 
     @param *context [i/o] Context
-    @param *color_matrix [in] Foreground and background color
 */
-void
-SDLPangoDraw_SetDefaultColor(
-    SDLPangoDraw_Context *context,
-    const SDLPangoDraw_Matrix *color_matrix)
+static void
+fitScratch(
+    SDLPangoDraw_Context *context)
 {
-    context->color_matrix = *color_matrix;
+    FT_Bitmap *scratch = context->tmp_ftbitmap;
+    int limit = scratchLimit(context);
+
+    if((scratch && scratch->pitch * scratch->rows > limit)
+	|| context->effect_buf_size > (gsize)limit)
+	SDLPangoDraw_ReleaseScratch(context);
 }
 
 /*!
-    Get layout width.
+    Specify the upper limit of the scratch memory of a context.
+    Text is rasterized in tiles that fit in this limit, so the scratch
+    memory does not depend on the size of the layout.
+    A smaller limit means more tiles for large text.
+    The default is 256 KiB.
 
-    @param *context [in] Context
-    @return Width
+    @param *context [i/o] Context
+    @param bytes [in] Limit in bytes. Values below 1 KiB are raised to 1 KiB.
 */
-int
-SDLPangoDraw_GetLayoutWidth(
-    SDLPangoDraw_Context *context)
+void
+SDLPangoDraw_SetScratchLimit(
+    SDLPangoDraw_Context *context,
+    int bytes)
 {
-    PangoRectangle logical_rect;
-
-    pango_layout_get_extents (context->layout, NULL, &logical_rect);
-
-    return PANGO_PIXELS (logical_rect.width);
+    if(bytes < MIN_SCRATCH_LIMIT)
+	bytes = MIN_SCRATCH_LIMIT;
+    context->scratch_limit = bytes;
+    fitScratch(context);
 }
 
 /*!
-    Get layout height.
+    Release the scratch memory of a context, including the buffers of
+    the effects.
+    It is allocated again (within the scratch limit) by the next draw.
 
-    @param *context [in] Context
-    @return Height
+    @param *context [i/o] Context
 */
-int
-SDLPangoDraw_GetLayoutHeight(
+void
+SDLPangoDraw_ReleaseScratch(
     SDLPangoDraw_Context *context)
 {
-    PangoRectangle logical_rect;
-
-    pango_layout_get_extents (context->layout, NULL, &logical_rect);
+    freeFTBitmap(context->tmp_ftbitmap);
+    context->tmp_ftbitmap = NULL;
 
-    return PANGO_PIXELS (logical_rect.height);
+    g_free(context->effect_buf);
+    context->effect_buf = NULL;
+    context->effect_buf_size = 0;
 }
 
 /*!
-    Set the markup text to draw.
-    Markup format is same as Pango.
+    Specify effects drawn with the text by SDLPangoDraw_Draw: an outline
+    around the letters and a drop shadow.
+    The letters are rasterized once into a coverage mask, a strip at a time
+    within the scratch limit. The outline is the mask dilated by the outline
+    radius, and the shadow is the mask (with its outline) moved by the
+    shadow offset and blurred by a box blur. The shadow, the outline and the
+    letters are then composited onto the surface in a single pass.
+    Underlines and strike-through lines get the effects too.
 
     @param *context [i/o] Context
-    @param *markup [in] Markup text (must be in UTF-8).
-    @param length [in] Text length. -1 means NULL-terminated text.
+    @param *effects [in] Effects, or NULL to draw without effects
 */
 void
-SDLPangoDraw_SetMarkup(
+SDLPangoDraw_SetEffects(
     SDLPangoDraw_Context *context,
-    const char *markup,
-    int length)
+    const SDLPangoDraw_Effects *effects)
 {
-    pango_layout_set_markup (context->layout, markup, length);
-    pango_layout_set_auto_dir (context->layout, TRUE);
-    pango_layout_set_alignment (context->layout, PANGO_ALIGN_LEFT);
-    pango_layout_set_font_description (context->layout, context->font_desc);
+    if(effects && (effects->outline_radius > 0 || effects->shadow_color[3] != 0)) {
+	context->effects = *effects;
+	context->effects_enabled = TRUE;
+    } else
+	context->effects_enabled = FALSE;
 }
 
 /*!
-    Set the plain (non-markup) text to draw, using a specific text alignment.
-    This only applies if the minimum size has been set using
-    SDLPangoDraw_SetMinimumSize.
+    Get the index of a color in the palette of a strip.
 
-    @param *context [i/o] Context
-    @param *text [in] The raw text (must be in UTF-8).
-    @param length [in] Text length. -1 means NULL-terminated text.
-    @param alignment The text alignment.
+    @param *strip [i/o] Strip
+    @param *color_matrix [in] Color
+    @return Index in the palette. The default color is used when the
+	palette is full.
 */
-void
-SDLPangoDraw_SetText_GivenAlignment(
-    SDLPangoDraw_Context *context,
-    const char *text,
-    int length,
-    SDLPangoDraw_Alignment alignment)
+static Uint8
+stripColor(
+    effectStrip *strip,
+    const SDLPangoDraw_Matrix *color_matrix)
 {
-    pango_layout_set_attributes(context->layout, NULL);
-    pango_layout_set_text (context->layout, text, length);
-    pango_layout_set_auto_dir (context->layout, TRUE);
-    pango_layout_set_alignment (context->layout, alignment);
-    pango_layout_set_font_description (context->layout, context->font_desc);
+    int i;
+
+    for(i = 0; i < strip->n_colors; i++) {
+	if(memcmp(&strip->colors[i], color_matrix, sizeof(SDLPangoDraw_Matrix)) == 0)
+	    return (Uint8)i;
+    }
+    if(strip->n_colors == MAX_STRIP_COLORS)
+	return 0;
+    strip->colors[strip->n_colors] = *color_matrix;
+    return (Uint8)strip->n_colors++;
 }
 
 /*!
-    Set the plain (non-markup) text to draw.
+    Fill a rect of the palette plane of a strip.
 
-    @param *context [i/o] Context
-    @param *text [in] The raw text (must be in UTF-8).
-    @param length [in] Text length. -1 means NULL-terminated text.
+    @param *strip [i/o] Strip
+    @param index [in] Palette index
+    @param x [in] X on the surface
+    @param y [in] Y on the surface
+    @param width [in] Width
+    @param height [in] Height
 */
-void
-SDLPangoDraw_SetText(
-    SDLPangoDraw_Context *context,
-    const char *text,
-    int length)
+static void
+fillStripPalette(
+    effectStrip *strip,
+    Uint8 index,
+    int x, int y, int width, int height)
 {
-    SDLPangoDraw_SetText_GivenAlignment(context, text, length, SDLPANGODRAW_ALIGN_LEFT);
+    int x0 = MAX(x - strip->x, 0);
+    int y0 = MAX(y - strip->y, 0);
+    int x1 = MIN(x + width - strip->x, strip->width);
+    int y1 = MIN(y + height - strip->y, strip->height);
+    int j;
+
+    for(j = y0; j < y1; j++)
+	memset(strip->palette + j * strip->pitch + x0, index, MAX(x1 - x0, 0));
 }
 
 /*!
-    Set the DPI.
-
-    @param *context [i/o] Context
-    @param dpi_x [in] X dpi
-    @param dpi_y [in] Y dpi
+    Rasterize glyphs into the coverage mask of a strip.
+    Same arguments as drawGlyphString.
 */
-void
-SDLPangoDraw_SetDpi(
-    SDLPangoDraw_Context *context,
-    double dpi_x, double dpi_y)
+static void
+stripGlyphString(
+    effectStrip *strip,
+    const SDLPangoDraw_Matrix *color_matrix,
+    PangoFont *font,
+    PangoGlyphString *glyphs,
+    int x, int y,
+    int width, int height,
+    int baseline)
 {
-    pango_ft2_font_map_set_resolution (PANGO_FT2_FONT_MAP (context->font_map), dpi_x, dpi_y);
+    FT_Bitmap mask;
+
+    if(x >= strip->x + strip->width || x + width <= strip->x
+	|| y >= strip->y + strip->height || y + height <= strip->y)
+	return;
+
+    mask.width = strip->width;
+    mask.rows = strip->height;
+    mask.pitch = strip->pitch;
+    mask.buffer = strip->coverage;
+    mask.num_grays = 256;
+    mask.pixel_mode = FT_PIXEL_MODE_GRAY;
+    pango_ft2_render(&mask, font, glyphs, x - strip->x, y + baseline - strip->y);
+
+    fillStripPalette(strip, stripColor(strip, color_matrix), x, y, width, height);
 }
 
 /*!
-    Set language to context.
-
-    @param *context [i/o] Context
-    @param *language_tag [in] A RFC-3066 format language tag 
+    Draw a horizontal line of a pixel into the coverage mask of a strip.
+    Same arguments as drawHLine.
 */
-void SDLCALL
-SDLPangoDraw_SetLanguage(
-    SDLPangoDraw_Context *context,
-    const char *language_tag)
+static void
+stripHLine(
+    effectStrip *strip,
+    const SDLPangoDraw_Matrix *color_matrix,
+    int y, int start, int end)
 {
-    pango_context_set_language (context->context, pango_language_from_string (language_tag));
+    int x0 = MAX(start - strip->x, 0);
+    int x1 = MIN(end - strip->x, strip->width);
+
+    y -= strip->y;
+    if(y < 0 || y >= strip->height || x0 >= x1)
+	return;
+
+    memset(strip->coverage + y * strip->pitch + x0, 255, x1 - x0);
+    fillStripPalette(strip, stripColor(strip, color_matrix),
+	strip->x + x0, strip->y + y, x1 - x0, 1);
 }
 
 /*!
-    Set base direction to context.
+    Dilate a mask by a square of a radius: every pixel becomes the
+    maximum of its neighbors. Done as a horizontal then a vertical pass,
+    with inner loops over whole rows.
 
-    @param *context [i/o] Context
-    @param direction [in] Direction
+    @param *strip [i/o] Strip. coverage is read, temp and outline are written.
+    @param radius [in] Radius in pixels
 */
-void SDLCALL
-SDLPangoDraw_SetBaseDirection(
+static void
+dilateMask(
+    effectStrip *strip,
+    int radius)
+{
+    int w = strip->width;
+    int h = strip->height;
+    int pitch = strip->pitch;
+    int i, j, k;
+
+    for(j = 0; j < h; j++) {
+	const Uint8 *src = strip->coverage + j * pitch;
+	Uint8 *dst = strip->temp + j * pitch;
+
+	memcpy(dst, src, w);
+	for(k = 1; k <= radius && k < w; k++) {
+	    for(i = k; i < w; i++)
+		dst[i] = MAX(dst[i], src[i - k]);
+	    for(i = 0; i < w - k; i++)
+		dst[i] = MAX(dst[i], src[i + k]);
+	}
+    }
+
+    for(j = 0; j < h; j++) {
+	Uint8 *dst = strip->outline + j * pitch;
+	int k0 = MAX(j - radius, 0);
+	int k1 = MIN(j + radius, h - 1);
+
+	memcpy(dst, strip->temp + k0 * pitch, w);
+	for(k = k0 + 1; k <= k1; k++) {
+	    const Uint8 *src = strip->temp + k * pitch;
+
+	    for(i = 0; i < w; i++)
+		dst[i] = MAX(dst[i], src[i]);
+	}
+    }
+}
+
+/*!
+    Blur a mask with a box of a radius, as a horizontal then a vertical
+    pass of running sums.
+
+    @param *strip [i/o] Strip. temp and shadow are written.
+    @param *mask [in] Plane to blur, coverage or outline
+    @param radius [in] Radius in pixels
+*/
+static void
+blurMask(
+    effectStrip *strip,
+    const Uint8 *mask,
+    int radius)
+{
+    int w = strip->width;
+    int h = strip->height;
+    int pitch = strip->pitch;
+    int size = 2 * radius + 1;
+    int *sums = strip->sums;
+    int i, j, k;
+
+    if(radius <= 0) {
+	memcpy(strip->shadow, mask, pitch * h);
+	return;
+    }
+
+    for(j = 0; j < h; j++) {
+	const Uint8 *src = mask + j * pitch;
+	Uint8 *dst = strip->temp + j * pitch;
+	int sum = 0;
+
+	for(i = 0; i < radius && i < w; i++)
+	    sum += src[i];
+	for(i = 0; i < w; i++) {
+	    if(i + radius < w)
+		sum += src[i + radius];
+	    dst[i] = (Uint8)(sum / size);
+	    if(i - radius >= 0)
+		sum -= src[i - radius];
+	}
+    }
+
+    memset(sums, 0, w * sizeof(int));
+    for(k = 0; k < radius && k < h; k++) {
+	const Uint8 *src = strip->temp + k * pitch;
+
+	for(i = 0; i < w; i++)
+	    sums[i] += src[i];
+    }
+    for(j = 0; j < h; j++) {
+	Uint8 *dst = strip->shadow + j * pitch;
+
+	if(j + radius < h) {
+	    const Uint8 *src = strip->temp + (j + radius) * pitch;
+
+	    for(i = 0; i < w; i++)
+		sums[i] += src[i];
+	}
+	for(i = 0; i < w; i++)
+	    dst[i] = (Uint8)(sums[i] / size);
+	if(j - radius >= 0) {
+	    const Uint8 *src = strip->temp + (j - radius) * pitch;
+
+	    for(i = 0; i < w; i++)
+		sums[i] -= src[i];
+	}
+    }
+}
+
+/*!
+    Composite a color over a pixel.
+
+    @param *pixel [i/o] R, G, B and A of the pixel
+    @param *color [in] R, G and B of the color
+    @param alpha [in] Opacity of the color, 0 to 255
+*/
+static void
+blendOver(
+    Uint8 *pixel,
+    const Uint8 *color,
+    int alpha)
+{
+    int below, out;
+    int n;
+
+    if(alpha == 0)
+	return;
+    if(alpha == 255) {
+	pixel[0] = color[0];
+	pixel[1] = color[1];
+	pixel[2] = color[2];
+	pixel[3] = 255;
+	return;
+    }
+
+    below = pixel[3] * (255 - alpha) / 255;
+    out = alpha + below;
+    for(n = 0; n < 3; n++)
+	pixel[n] = (Uint8)((color[n] * alpha + pixel[n] * below + out / 2) / out);
+    pixel[3] = (Uint8)out;
+}
+
+/*!
+    Composite the shadow, the outline and the letters of a strip onto a
+    surface.
+
+    @param *context [in] Context
+    @param *strip [in] Strip with its planes computed
+    @param *surface [i/o] Surface to draw on
+    @param x [in] X of the left of the area to draw
+    @param y [in] Y of the top of the area to draw
+    @param width [in] Width of the area
+    @param height [in] Height of the area
+*/
+static void
+compositeStrip(
     SDLPangoDraw_Context *context,
-    SDLPangoDraw_Direction direction)
+    const effectStrip *strip,
+    SDL_Surface *surface,
+    int x, int y, int width, int height)
 {
-    PangoDirection pango_dir;
+    const SDLPangoDraw_Effects *effects = &context->effects;
+    int outline_alpha = effects->outline_radius > 0 ? effects->outline_color[3] : 0;
+    int shadow_alpha = effects->shadow_color[3];
+    int i, j;
 
-    switch(direction) {
-    case SDLPANGODRAW_DIRECTION_LTR:
-	pango_dir = PANGO_DIRECTION_LTR;
-	break;
-    case SDLPANGODRAW_DIRECTION_RTL:
-	pango_dir = PANGO_DIRECTION_RTL;
-	break;
-    case SDLPANGODRAW_DIRECTION_WEAK_LTR:
-	pango_dir = PANGO_DIRECTION_WEAK_LTR;
-	break;
-    case SDLPANGODRAW_DIRECTION_WEAK_RTL:
-	pango_dir = PANGO_DIRECTION_WEAK_RTL;
-	break;
-    case SDLPANGODRAW_DIRECTION_NEUTRAL:
-	pango_dir = PANGO_DIRECTION_NEUTRAL;
-	break;
-    default:
-	SDL_SetError("unknown direction value");
+    if(SDL_LockSurface(surface)) {
+	SDL_SetError("surface lock failed");
 	return;
     }
 
-    pango_context_set_base_dir (context->context, pango_dir);
+    for(j = 0; j < height; j++) {
+	int my = y + j - strip->y;
+	int sy = my - effects->shadow_y;
+	const Uint8 *coverage = strip->coverage + my * strip->pitch;
+	const Uint8 *palette = strip->palette + my * strip->pitch;
+	const Uint8 *outline = strip->outline + my * strip->pitch;
+	const Uint8 *shadow = shadow_alpha && sy >= 0 && sy < strip->height
+	    ? strip->shadow + sy * strip->pitch : NULL;
+	Uint8 *p_sdl = (Uint8 *)surface->pixels + (y + j) * surface->pitch;
+
+	for(i = 0; i < width; i++) {
+	    int mx = x + i - strip->x;
+	    const SDLPangoDraw_Matrix *matrix = &strip->colors[palette[mx]];
+	    Uint8 pixel[4], color[3];
+	    int sx = mx - effects->shadow_x;
+	    Uint32 value;
+
+	    if(context->blend_into) {
+		/* The background goes over the pixel already there. */
+		value = surface->format->BytesPerPixel == 2
+		    ? ((Uint16 *)p_sdl)[x + i] : ((Uint32 *)p_sdl)[x + i];
+		SDL_GetRGBA(value, surface->format, &pixel[0], &pixel[1], &pixel[2], &pixel[3]);
+		if(context->premultiplied && pixel[3] != 0 && pixel[3] != 255) {
+		    pixel[0] = (Uint8)MIN(255, pixel[0] * 255 / pixel[3]);
+		    pixel[1] = (Uint8)MIN(255, pixel[1] * 255 / pixel[3]);
+		    pixel[2] = (Uint8)MIN(255, pixel[2] * 255 / pixel[3]);
+		}
+		color[0] = matrix->m[0][0];
+		color[1] = matrix->m[1][0];
+		color[2] = matrix->m[2][0];
+		blendOver(pixel, color, matrix->m[3][0]);
+	    } else {
+		pixel[0] = matrix->m[0][0];
+		pixel[1] = matrix->m[1][0];
+		pixel[2] = matrix->m[2][0];
+		pixel[3] = matrix->m[3][0];
+	    }
+
+	    if(shadow && sx >= 0 && sx < strip->width)
+		blendOver(pixel, effects->shadow_color, shadow[sx] * shadow_alpha / 255);
+	    if(outline_alpha)
+		blendOver(pixel, effects->outline_color, outline[mx] * outline_alpha / 255);
+	    color[0] = matrix->m[0][1];
+	    color[1] = matrix->m[1][1];
+	    color[2] = matrix->m[2][1];
+	    blendOver(pixel, color, coverage[mx] * matrix->m[3][1] / 255);
+	    if(context->premultiplied) {
+		pixel[0] = (Uint8)DIV255(pixel[0] * pixel[3]);
+		pixel[1] = (Uint8)DIV255(pixel[1] * pixel[3]);
+		pixel[2] = (Uint8)DIV255(pixel[2] * pixel[3]);
+	    }
+
+	    value = SDL_MapRGBA(surface->format, pixel[0], pixel[1], pixel[2], pixel[3]);
+	    switch(surface->format->BytesPerPixel) {
+	    case 2:
+		((Uint16 *)p_sdl)[x + i] = (Uint16)value;
+		break;
+	    case 4:
+		((Uint32 *)p_sdl)[x + i] = value;
+		break;
+	    default:
+		SDL_SetError("surface->format->BytesPerPixel is invalid value");
+		SDL_UnlockSurface(surface);
+		return;
+	    }
+	}
+    }
+
+    SDL_UnlockSurface(surface);
 }
 
 /*!
-    Get font map from context.
+    Draw the text of a context with its effects.
+
+    @param *context [i/o] Context
+    @param *surface [i/o] Surface to draw on
+    @param x [in] X of left-top of drawing area
+    @param y [in] Y of left-top of drawing area
+*/
+static void
+drawEffects(
+    SDLPangoDraw_Context *context,
+    SDL_Surface *surface,
+    int x, int y)
+{
+    const SDLPangoDraw_Effects *effects = &context->effects;
+    PangoRectangle logical_rect;
+    effectStrip strip_data;
+    effectStrip *strip = &strip_data;
+    int radius = MAX(effects->outline_radius, 0);
+    int blur = MAX(effects->shadow_blur, 0);
+    int margin;
+    int x0, y0, x1, y1;
+    int rows, top;
+    gsize plane, size;
+
+    /* The mask must hold every letter that can reach a drawn pixel. */
+    margin = radius;
+    if(effects->shadow_color[3])
+	margin += MAX(ABS(effects->shadow_x), ABS(effects->shadow_y)) + blur;
+
+    getLayoutExtents(context, &logical_rect);
+    x0 = MAX(x + PANGO_PIXELS (logical_rect.x) - margin, 0);
+    y0 = MAX(y + PANGO_PIXELS (logical_rect.y) - margin, 0);
+    x1 = MIN(x + PANGO_PIXELS (logical_rect.x + logical_rect.width) + margin, surface->w);
+    y1 = MIN(y + PANGO_PIXELS (logical_rect.y + logical_rect.height) + margin, surface->h);
+    if(x0 >= x1 || y0 >= y1)
+	return;
+
+    strip->x = x0 - margin;
+    strip->width = x1 - x0 + 2 * margin;
+    strip->pitch = (strip->width + 3) & ~3;
+
+    rows = scratchLimit(context) / (EFFECT_PLANES * strip->pitch) - 2 * margin;
+    rows = MAX(1, MIN(rows, y1 - y0));
+
+    plane = strip->pitch * (rows + 2 * margin);
+    size = EFFECT_PLANES * plane + strip->width * sizeof(int);
+    if(context->effect_buf_size < size) {
+	g_free(context->effect_buf);
+	context->effect_buf = g_malloc(size);
+	context->effect_buf_size = size;
+	context->buffer_growths++;
+    }
+    strip->coverage = context->effect_buf;
+    strip->palette = strip->coverage + plane;
+    strip->outline = strip->palette + plane;
+    strip->shadow = strip->outline + plane;
+    strip->temp = strip->shadow + plane;
+    strip->sums = (int *)(strip->temp + plane);
+
+    context->strip = strip;
+    for(top = y0; top < y1; top += rows) {
+	int height = MIN(rows, y1 - top);
+	lineCursor cursor;
+
+	strip->y = top - margin;
+	strip->height = height + 2 * margin;
+	memset(strip->coverage, 0, strip->pitch * strip->height);
+	memset(strip->palette, 0, strip->pitch * strip->height);
+	strip->n_colors = 1;
+	strip->colors[0] = context->color_matrix;
+
+	openLines(&cursor, context, context->layout);
+	do {
+	    const PangoRectangle *line_rect = &cursor.line.logical_rect;
+	    int line_top = y + PANGO_PIXELS (line_rect->y);
+
+	    if(line_top >= strip->y + strip->height)
+		break;
+	    if(y + PANGO_PIXELS (line_rect->y + line_rect->height) <= strip->y)
+		continue;
+
+	    drawLine(context, surface, cursor.line.runs,
+		x + PANGO_PIXELS (line_rect->x),
+		line_top,
+		PANGO_PIXELS (line_rect->height),
+		PANGO_PIXELS (cursor.line.baseline - line_rect->y));
+	} while (nextLine(&cursor));
+	closeLines(&cursor);
+
+	if(radius > 0)
+	    dilateMask(strip, radius);
+	if(effects->shadow_color[3])
+	    blurMask(strip, radius > 0 ? strip->outline : strip->coverage, blur);
+
+	compositeStrip(context, strip, surface, x0, top, x1 - x0, height);
+    }
+    context->strip = NULL;
+}
+
+/*!
+    Get the number of times the last SDLPangoDraw_Draw of a context had to
+    create or grow one of the working buffers the context keeps between
+    draws: the scratch bitmap, the effect planes, the line index, the
+    glyph string of compiled layouts, and the layout iterator and fonts it
+    asks Pango for.
+    This is not a count of heap allocations. Pango, FreeType and SDL
+    allocate on their own while drawing, and those are not counted.
+    Drawing the same text on a surface again should count zero; the
+    buffers grow again only when the text, its size or the scratch limit
+    changes.
 
     @param *context [in] Context
-    @return Font map
+    @return Number of buffers created or grown
 */
-PangoFontMap* SDLCALL
-SDLPangoDraw_GetPangoFontMap(
+int
+SDLPangoDraw_GetBufferGrowthCount(
     SDLPangoDraw_Context *context)
 {
-    return context->font_map;
+    return context->buffer_growths;
 }
 
+#define HASH_MIX(h, v) ((h) = ((h) ^ (guint32)(v)) * 16777619u)	/* FNV-1a */
+
 /*!
-    Get font description from context.
+    Union of two rects. An empty rect (w or h is 0) is ignored.
 
-    @param *context [in] Context
-    @return Font description
+    @param *a [i/o] Rect to grow
+    @param *b [in] Rect to add
 */
-PangoFontDescription* SDLCALL
-SDLPangoDraw_GetPangoFontDescription(
+static void
+unionRect(
+    SDL_Rect *a,
+    const SDL_Rect *b)
+{
+    int x0, y0, x1, y1;
+
+    if(b->w == 0 || b->h == 0)
+	return;
+    if(a->w == 0 || a->h == 0) {
+	*a = *b;
+	return;
+    }
+    x0 = MIN(a->x, b->x);
+    y0 = MIN(a->y, b->y);
+    x1 = MAX(a->x + a->w, b->x + b->w);
+    y1 = MAX(a->y + a->h, b->y + b->h);
+    a->x = x0;
+    a->y = y0;
+    a->w = x1 - x0;
+    a->h = y1 - y0;
+}
+
+/*!
+    Check whether two rects overlap.
+*/
+static gboolean
+rectsOverlap(
+    const SDL_Rect *a,
+    const SDL_Rect *b)
+{
+    return a->x < b->x + b->w && b->x < a->x + a->w
+	&& a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+/*!
+    Release the fonts of recorded runs, and empty the list.
+
+    @param *runs [i/o] Runs (damageRun)
+*/
+static void
+clearDamageRuns(
+    GArray *runs)
+{
+    guint i;
+
+    for(i = 0; i < runs->len; i++) {
+	PangoFont *font = g_array_index(runs, damageRun, i).font;
+
+	if(font)
+	    g_object_unref(font);
+    }
+    g_array_set_size(runs, 0);
+}
+
+/*!
+    Mix a color into a hash, one channel at a time.
+*/
+static guint32
+hashColor(
+    guint32 hash,
+    gboolean set,
+    const PangoColor *color)
+{
+    HASH_MIX(hash, set);
+    if(set) {
+	HASH_MIX(hash, color->red);
+	HASH_MIX(hash, color->green);
+	HASH_MIX(hash, color->blue);
+    }
+    return hash;
+}
+
+/*!
+    Record the geometry and the content of the runs of a context as they
+    would be drawn, the same way as drawLine places them.
+
+    @param *context [i/o] Context. frame_lines, frame_runs and
+	frame_glyphs are written.
+    @param x [in] X of left-top of drawing area
+    @param y [in] Y of left-top of drawing area
+*/
+static void
+recordFrame(
+    SDLPangoDraw_Context *context,
+    int x, int y)
+{
+    lineCursor cursor;
+
+    g_array_set_size(context->frame_lines, 0);
+    clearDamageRuns(context->frame_runs);
+    g_array_set_size(context->frame_glyphs, 0);
+
+    openLines(&cursor, context, context->layout);
+    do {
+	const PangoRectangle *line_rect = &cursor.line.logical_rect;
+	int line_x = x + PANGO_PIXELS (line_rect->x);
+	int line_y = y + PANGO_PIXELS (line_rect->y);
+	int height = PANGO_PIXELS (line_rect->height);
+	int baseline = PANGO_PIXELS (cursor.line.baseline - line_rect->y);
+	GSList *tmp_list;
+	damageLine line;
+	int x_off = 0;
+
+	line.first_run = context->frame_runs->len;
+	line.bounds.x = line.bounds.y = line.bounds.w = line.bounds.h = 0;
+
+	for(tmp_list = cursor.line.runs; tmp_list; tmp_list = tmp_list->next) {
+	    PangoLayoutRun *run = tmp_list->data;
+	    const runStyle *style;
+	    guint32 hash = 2166136261u;
+	    damageRun record;
+	    SDL_Rect extra;
+	    gint risen_y;
+	    int i;
+
+	    getRunStyle(run, &record.style);
+	    style = &record.style;
+
+	    risen_y = line_y + baseline - PANGO_PIXELS (style->rise);
+
+	    record.rect.x = line_x + PANGO_PIXELS (x_off);
+	    record.rect.y = risen_y - baseline;
+	    record.rect.w = PANGO_PIXELS (style->logical_rect.width);
+	    record.rect.h = height;
+	    if(style->uline != PANGO_UNDERLINE_NONE || style->strike) {
+		/* Lines follow the ink, and may leave the logical rect. */
+		int left = style->logical_rect.x;
+		int right = style->logical_rect.x + style->logical_rect.width;
+		int bottom = 0;
+
+		if(style->uline != PANGO_UNDERLINE_NONE) {
+		    left = MIN(left, style->ink_rect.x);
+		    right = MAX(right, style->ink_rect.x + style->ink_rect.width);
+		    bottom = MAX(PANGO_PIXELS (style->ink_rect.y + style->ink_rect.height), 0);
+		}
+		extra.x = line_x + PANGO_PIXELS (x_off + left) - 1;
+		extra.y = record.rect.y;
+		extra.w = line_x + PANGO_PIXELS (x_off + right) + 1 - extra.x;
+		extra.h = MAX(height, baseline + 5 + bottom);
+		unionRect(&record.rect, &extra);
+	    }
+
+	    HASH_MIX(hash, GPOINTER_TO_UINT(run->item->analysis.font));
+	    HASH_MIX(hash, style->uline);
+	    HASH_MIX(hash, style->strike);
+	    HASH_MIX(hash, style->rise);
+	    HASH_MIX(hash, style->shape_set);
+	    hash = hashColor(hash, style->fg_set, &style->fg_color);
+	    hash = hashColor(hash, style->bg_set, &style->bg_color);
+	    for(i = 0; i < run->glyphs->num_glyphs; i++) {
+		const PangoGlyphInfo *info = &run->glyphs->glyphs[i];
+
+		HASH_MIX(hash, info->glyph);
+		HASH_MIX(hash, info->geometry.width);
+		HASH_MIX(hash, info->geometry.x_offset);
+		HASH_MIX(hash, info->geometry.y_offset);
+	    }
+	    record.hash = hash;
+	    record.font = run->item->analysis.font
+		? g_object_ref(run->item->analysis.font) : NULL;
+	    record.first_glyph = context->frame_glyphs->len;
+	    record.n_glyphs = run->glyphs->num_glyphs;
+	    g_array_append_vals(context->frame_glyphs,
+		run->glyphs->glyphs, run->glyphs->num_glyphs);
+
+	    g_array_append_val(context->frame_runs, record);
+	    unionRect(&line.bounds, &record.rect);
+	    x_off += style->logical_rect.width;
+	}
+
+	line.n_runs = context->frame_runs->len - line.first_run;
+	g_array_append_val(context->frame_lines, line);
+    } while (nextLine(&cursor));
+    closeLines(&cursor);
+}
+
+/*!
+    Keep the frame just recorded as the last frame drawn.
+
+    @param *context [i/o] Context
+*/
+static void
+keepFrame(
     SDLPangoDraw_Context *context)
 {
-    return context->font_desc;
+    GArray *swap;
+
+    swap = context->damage_lines;
+    context->damage_lines = context->frame_lines;
+    context->frame_lines = swap;
+    swap = context->damage_runs;
+    context->damage_runs = context->frame_runs;
+    context->frame_runs = swap;
+    swap = context->damage_glyphs;
+    context->damage_glyphs = context->frame_glyphs;
+    context->frame_glyphs = swap;
 }
 
 /*!
-    Get layout from context.
+    Compare how two recorded runs are drawn.
+*/
+static gboolean
+sameStyle(
+    const runStyle *a,
+    const runStyle *b)
+{
+    if(a->uline != b->uline || a->strike != b->strike || a->rise != b->rise
+	|| a->fg_set != b->fg_set || a->bg_set != b->bg_set
+	|| a->shape_set != b->shape_set)
+	return FALSE;
+    if(a->fg_set && (a->fg_color.red != b->fg_color.red
+	    || a->fg_color.green != b->fg_color.green
+	    || a->fg_color.blue != b->fg_color.blue))
+	return FALSE;
+    if(a->bg_set && (a->bg_color.red != b->bg_color.red
+	    || a->bg_color.green != b->bg_color.green
+	    || a->bg_color.blue != b->bg_color.blue))
+	return FALSE;
+    /* The ink is only used by underlines and shapes. */
+    if((a->uline != PANGO_UNDERLINE_NONE || a->shape_set)
+	&& (a->ink_rect.x != b->ink_rect.x || a->ink_rect.y != b->ink_rect.y
+	    || a->ink_rect.width != b->ink_rect.width
+	    || a->ink_rect.height != b->ink_rect.height))
+	return FALSE;
+    return a->logical_rect.x == b->logical_rect.x
+	&& a->logical_rect.y == b->logical_rect.y
+	&& a->logical_rect.width == b->logical_rect.width
+	&& a->logical_rect.height == b->logical_rect.height;
+}
+
+/*!
+    Compare a run of the last frame drawn with a run of the frame just
+    recorded. The hashes tell most runs apart; runs with the same hash are
+    compared in full.
 
     @param *context [in] Context
-    @return Layout
+    @param *a [in] Run of damage_runs
+    @param *b [in] Run of frame_runs
+    @return TRUE if the runs draw the same pixels
 */
-PangoLayout* SDLCALL
-SDLPangoDraw_GetPangoLayout(
+static gboolean
+sameRun(
+    SDLPangoDraw_Context *context,
+    const damageRun *a,
+    const damageRun *b)
+{
+    const PangoGlyphInfo *glyphs_a;
+    const PangoGlyphInfo *glyphs_b;
+    guint i;
+
+    if(a->hash != b->hash
+	|| a->rect.x != b->rect.x || a->rect.y != b->rect.y
+	|| a->rect.w != b->rect.w || a->rect.h != b->rect.h
+	|| a->font != b->font || a->n_glyphs != b->n_glyphs
+	|| ! sameStyle(&a->style, &b->style))
+	return FALSE;
+
+    glyphs_a = (const PangoGlyphInfo *)context->damage_glyphs->data + a->first_glyph;
+    glyphs_b = (const PangoGlyphInfo *)context->frame_glyphs->data + b->first_glyph;
+    for(i = 0; i < a->n_glyphs; i++) {
+	if(glyphs_a[i].glyph != glyphs_b[i].glyph
+	    || glyphs_a[i].geometry.width != glyphs_b[i].geometry.width
+	    || glyphs_a[i].geometry.x_offset != glyphs_b[i].geometry.x_offset
+	    || glyphs_a[i].geometry.y_offset != glyphs_b[i].geometry.y_offset)
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+/*!
+    Add a dirty rect to a list, merging it with a rect it overlaps.
+    When the list is full, the rect is merged with the last one.
+
+    @param *rects [i/o] List
+    @param n_rects [in] Number of rects in the list
+    @param max_rects [in] Room of the list
+    @param *rect [in] Rect to add
+    @return New number of rects in the list
+*/
+static int
+addDirtyRect(
+    SDL_Rect *rects,
+    int n_rects,
+    int max_rects,
+    const SDL_Rect *rect)
+{
+    int i;
+
+    if(rect->w == 0 || rect->h == 0)
+	return n_rects;
+
+    for(i = 0; i < n_rects; i++) {
+	if(rectsOverlap(&rects[i], rect)) {
+	    unionRect(&rects[i], rect);
+	    return n_rects;
+	}
+    }
+    if(n_rects == max_rects) {
+	unionRect(&rects[n_rects - 1], rect);
+	return n_rects;
+    }
+    rects[n_rects] = *rect;
+    return n_rects + 1;
+}
+
+/*!
+    Draw the text of a context on a surface it was drawn on before, and
+    repaint only what changed since then.
+    The context remembers the runs of the last frame drawn with this
+    function: runs with the same place, glyphs and attributes are left
+    alone, and the rects of the others, old and new, are cleared and
+    drawn again. The rects are returned, ready for SDL_UpdateRects.
+
+    The whole surface is drawn (and returned as one rect) the first time,
+    after SDLPangoDraw_Draw or SDLPangoDraw_ResetDamage, when the surface,
+    the position or the default color changes, and while effects are set.
+    The caller must not draw on the area of the text in between.
+
+    @param *context [i/o] Context
+    @param *surface [i/o] Surface to draw on
+    @param x [in] X of left-top of drawing area
+    @param y [in] Y of left-top of drawing area
+    @param *rects [out] Dirty rects
+    @param max_rects [in] Room of rects. When there are more dirty rects,
+	the last ones are merged.
+    @return Number of dirty rects, 0 if nothing changed, or -1 on error
+*/
+int
+SDLPangoDraw_DrawDamage(
+    SDLPangoDraw_Context *context,
+    SDL_Surface *surface,
+    int x, int y,
+    SDL_Rect *rects,
+    int max_rects)
+{
+    guint n_lines, line_index;
+    int n_rects = 0;
+    int i;
+
+    adoptPrewarm(context);
+
+    if(! surface) {
+	SDL_SetError("surface is NULL");
+	return -1;
+    }
+    if(! rects || max_rects < 1) {
+	SDL_SetError("no room for rects");
+	return -1;
+    }
+
+    if(! context->damage_valid || context->effects_enabled
+	|| context->damage_surface != surface
+	|| context->damage_x != x || context->damage_y != y
+	|| memcmp(&context->damage_matrix, &context->color_matrix,
+	    sizeof(SDLPangoDraw_Matrix)) != 0)
+    {
+	SDLPangoDraw_Draw(context, surface, x, y);
+
+	if(! context->effects_enabled) {
+	    recordFrame(context, x, y);
+	    keepFrame(context);
+	    context->damage_surface = surface;
+	    context->damage_x = x;
+	    context->damage_y = y;
+	    context->damage_matrix = context->color_matrix;
+	    context->damage_valid = TRUE;
+	}
+
+	rects[0].x = 0;
+	rects[0].y = 0;
+	rects[0].w = surface->w;
+	rects[0].h = surface->h;
+	return 1;
+    }
+
+    context->buffer_growths = 0;
+
+    recordFrame(context, x, y);
+
+    /* Lines are compared by their index. In a line, the runs that are
+       the same from either end are skipped. */
+    n_lines = MAX(context->frame_lines->len, context->damage_lines->len);
+    for(line_index = 0; line_index < n_lines; line_index++) {
+	const damageLine *old_line = NULL;
+	const damageLine *new_line = NULL;
+	const damageRun *old_runs = NULL;
+	const damageRun *new_runs = NULL;
+	int n_old = 0, n_new = 0;
+	int head = 0, tail = 0;
+	SDL_Rect dirty = { 0, 0, 0, 0 };
+
+	if(line_index < context->damage_lines->len) {
+	    old_line = &g_array_index(context->damage_lines, damageLine, line_index);
+	    old_runs = &g_array_index(context->damage_runs, damageRun, old_line->first_run);
+	    n_old = old_line->n_runs;
+	}
+	if(line_index < context->frame_lines->len) {
+	    new_line = &g_array_index(context->frame_lines, damageLine, line_index);
+	    new_runs = &g_array_index(context->frame_runs, damageRun, new_line->first_run);
+	    n_new = new_line->n_runs;
+	}
+
+	while(head < n_old && head < n_new
+	    && sameRun(context, &old_runs[head], &new_runs[head]))
+	    head++;
+	while(tail < n_old - head && tail < n_new - head
+	    && sameRun(context, &old_runs[n_old - 1 - tail], &new_runs[n_new - 1 - tail]))
+	    tail++;
+
+	for(i = head; i < n_old - tail; i++)
+	    unionRect(&dirty, &old_runs[i].rect);
+	for(i = head; i < n_new - tail; i++)
+	    unionRect(&dirty, &new_runs[i].rect);
+
+	n_rects = addDirtyRect(rects, n_rects, max_rects, &dirty);
+    }
+
+    for(i = 0; i < n_rects; i++) {
+	SDL_Rect *rect = &rects[i];
+	int x0 = MAX(rect->x, 0);
+	int y0 = MAX(rect->y, 0);
+	int x1 = MIN(rect->x + rect->w, surface->w);
+	int y1 = MIN(rect->y + rect->h, surface->h);
+	lineCursor cursor;
+
+	if(x0 >= x1 || y0 >= y1) {
+	    rect->w = rect->h = 0;
+	    continue;
+	}
+	rect->x = x0;
+	rect->y = y0;
+	rect->w = x1 - x0;
+	rect->h = y1 - y0;
+
+	SDL_FillRect(surface, rect, SDL_MapRGBA(surface->format, 0, 0, 0, 0));
+
+	context->clip = *rect;
+	context->clip_enabled = TRUE;
+	line_index = 0;
+	openLines(&cursor, context, context->layout);
+	do {
+	    const PangoRectangle *line_rect = &cursor.line.logical_rect;
+	    const damageLine *line =
+		&g_array_index(context->frame_lines, damageLine, line_index);
+
+	    if(rectsOverlap(&line->bounds, rect))
+		drawLine(context, surface, cursor.line.runs,
+		    x + PANGO_PIXELS (line_rect->x),
+		    y + PANGO_PIXELS (line_rect->y),
+		    PANGO_PIXELS (line_rect->height),
+		    PANGO_PIXELS (cursor.line.baseline - line_rect->y));
+	    line_index++;
+	} while (nextLine(&cursor));
+	closeLines(&cursor);
+	context->clip_enabled = FALSE;
+    }
+
+    keepFrame(context);
+    enforceMemoryBudget(context);
+
+    /* Rects that were clipped away entirely are dropped. */
+    for(i = 0; i < n_rects; ) {
+	if(rects[i].w == 0 || rects[i].h == 0)
+	    rects[i] = rects[--n_rects];
+	else
+	    i++;
+    }
+    return n_rects;
+}
+
+/*!
+    Make the next SDLPangoDraw_DrawDamage of a context draw everything,
+    for example after something else was drawn over the text.
+
+    @param *context [i/o] Context
+*/
+void
+SDLPangoDraw_ResetDamage(
     SDLPangoDraw_Context *context)
 {
-    return context->layout;
+    context->damage_valid = FALSE;
+}
+
+/*!
+    Clip a rect to a surface.
+
+    @param *rect [i/o] Rect. Its w and h are 0 if nothing is left.
+    @param *surface [in] Surface
+*/
+static void
+clipRectToSurface(
+    SDL_Rect *rect,
+    const SDL_Surface *surface)
+{
+    int x0 = MAX(rect->x, 0);
+    int y0 = MAX(rect->y, 0);
+    int x1 = MIN(rect->x + rect->w, surface->w);
+    int y1 = MIN(rect->y + rect->h, surface->h);
+
+    if(x0 >= x1 || y0 >= y1) {
+	rect->x = rect->y = rect->w = rect->h = 0;
+	return;
+    }
+    rect->x = x0;
+    rect->y = y0;
+    rect->w = x1 - x0;
+    rect->h = y1 - y0;
+}
+
+/*!
+    Draw the text of a context a few lines at a time, within a time budget,
+    so that a long text can be drawn over several frames.
+    Each call draws lines until the budget is used up, at least one, and
+    the next call on the same surface and position resumes after them.
+    The first call, and any call after the text or the layout changed,
+    clears the surface and starts over. While effects are set, the whole
+    text is drawn at once.
+
+    @param *context [i/o] Context
+    @param *surface [i/o] Surface to draw on
+    @param x [in] X of left-top of drawing area
+    @param y [in] Y of left-top of drawing area
+    @param budget_us [in] Time budget in microseconds
+    @param *progress [out] Progress and drawn areas. May be NULL.
+    @return 1 when the text is completely drawn, 0 if lines remain, or -1
+	on error
+*/
+int
+SDLPangoDraw_DrawIncremental(
+    SDLPangoDraw_Context *context,
+    SDL_Surface *surface,
+    int x, int y,
+    int budget_us,
+    SDLPangoDraw_Progress *progress)
+{
+    gint64 deadline = g_get_monotonic_time() + MAX(budget_us, 0);
+    SDL_Rect drawn = { 0, 0, 0, 0 };
+    SDL_Rect done;
+    guint n_lines;
+    int top;
+
+    adoptPrewarm(context);
+
+    if(! surface) {
+	SDL_SetError("surface is NULL");
+	return -1;
+    }
+
+    if(context->effects_enabled) {
+	SDLPangoDraw_Draw(context, surface, x, y);
+	if(progress) {
+	    progress->lines_total = progress->lines_done = 1;
+	    progress->drawn.x = progress->drawn.y = 0;
+	    progress->drawn.w = surface->w;
+	    progress->drawn.h = surface->h;
+	    progress->done = progress->drawn;
+	}
+	return 1;
+    }
+
+    context->buffer_growths = 0;
+    context->damage_valid = FALSE;
+
+    buildLineIndex(context);
+    if(! context->incr_valid || context->incr_surface != surface
+	|| context->incr_x != x || context->incr_y != y)
+    {
+	PangoRectangle logical_rect;
+
+	getLayoutExtents(context, &logical_rect);
+	if(PANGO_PIXELS (logical_rect.width) && PANGO_PIXELS (logical_rect.height))
+	    SDL_FillRect(surface, NULL, SDL_MapRGBA(surface->format, 0, 0, 0, 0));
+
+	context->incr_surface = surface;
+	context->incr_x = x;
+	context->incr_y = y;
+	context->incr_line = 0;
+	context->incr_valid = TRUE;
+    }
+
+    /* Lines are placed as drawLayoutLines places them. */
+    n_lines = context->index_lines->len;
+    top = PANGO_PIXELS (g_array_index(context->index_lines, indexLine, 0).y);
+    while(context->incr_line < n_lines) {
+	const indexLine *line =
+	    &g_array_index(context->index_lines, indexLine, context->incr_line);
+	SDL_Rect rect;
+
+	rect.x = 0;
+	rect.y = y + PANGO_PIXELS (line->y) - top;
+	rect.w = surface->w;
+	rect.h = PANGO_PIXELS (line->height);
+	drawLine(context, surface, line->runs,
+	    x + PANGO_PIXELS (line->x), rect.y, rect.h,
+	    PANGO_PIXELS (line->baseline - line->y));
+	unionRect(&drawn, &rect);
+
+	context->incr_line++;
+	if(g_get_monotonic_time() >= deadline)
+	    break;
+    }
+
+    if(progress) {
+	const indexLine *last = &g_array_index(context->index_lines, indexLine,
+	    MAX(context->incr_line, 1) - 1);
+
+	done.x = 0;
+	done.y = y;
+	done.w = surface->w;
+	done.h = PANGO_PIXELS (last->y) - top + PANGO_PIXELS (last->height);
+	clipRectToSurface(&drawn, surface);
+	clipRectToSurface(&done, surface);
+
+	progress->lines_done = context->incr_line;
+	progress->lines_total = n_lines;
+	progress->drawn = drawn;
+	progress->done = done;
+    }
+
+    enforceMemoryBudget(context);
+
+    return context->incr_line >= n_lines ? 1 : 0;
+}
+
+/*!
+    Specify minimum size of drawing rect.
+
+    @param *context [i/o] Context
+    @param width [in] Width. -1 means no wrapping mode.
+    @param height [in] Height. zero/minus value means non-specified.
+*/
+void
+SDLPangoDraw_SetMinimumSize(
+    SDLPangoDraw_Context *context,
+    int width, int height)
+{
+    int pango_width;
+
+    if(width == context->min_width && height == context->min_height)
+	return;
+
+    checkShapedText(context);
+    if(width > 0)
+	pango_width = width * PANGO_SCALE;
+    else
+	pango_width = -1;
+    pango_layout_set_width(context->layout, pango_width);
+    context->index_valid = FALSE;
+
+    context->min_width = width;
+    context->min_height = height;
+
+    placeShapedText(context);
+}
+
+/*!
+    Pass the line limits of a context to its layout.
+    When ellipsizing, Pango stops laying out at the limit. Otherwise the
+    lines past the limit are dropped from the line index.
+
+    @param *context [i/o] Context
+*/
+static void
+applyLineLimits(
+    SDLPangoDraw_Context *context)
+{
+    checkShapedText(context);
+    pango_layout_set_ellipsize (context->layout, context->ellipsize);
+#if PANGO_VERSION_CHECK(1, 20, 0)
+    if(context->ellipsize == PANGO_ELLIPSIZE_NONE)
+	pango_layout_set_height (context->layout, -1);
+    else if(context->max_lines > 0)
+	pango_layout_set_height (context->layout, -context->max_lines);
+    else if(context->max_height > 0)
+	pango_layout_set_height (context->layout, context->max_height * PANGO_SCALE);
+    else
+	pango_layout_set_height (context->layout, -1);
+#endif
+    context->index_valid = FALSE;
+    /* Ellipsized lines are placed only while no limit cuts them. */
+    placeShapedText(context);
+}
+
+/*!
+    Specify the maximum number of lines to lay out and draw.
+    The layout height reported for the context covers only these lines.
+
+    @param *context [i/o] Context
+    @param lines [in] Number of lines. zero/minus value means no limit.
+*/
+void
+SDLPangoDraw_SetMaxLines(
+    SDLPangoDraw_Context *context,
+    int lines)
+{
+    if(lines < 0)
+	lines = 0;
+    if(lines == context->max_lines)
+	return;
+
+    context->max_lines = lines;
+    applyLineLimits(context);
+}
+
+/*!
+    Specify the maximum height to lay out and draw.
+    Lines that do not fit entirely are dropped, but the first line is
+    always kept. When a line count is given too, Pango ellipsizes at the
+    line count and the height only cuts lines.
+
+    @param *context [i/o] Context
+    @param height [in] Height in pixels. zero/minus value means no limit.
+*/
+void
+SDLPangoDraw_SetMaxHeight(
+    SDLPangoDraw_Context *context,
+    int height)
+{
+    if(height < 0)
+	height = 0;
+    if(height == context->max_height)
+	return;
+
+    context->max_height = height;
+    applyLineLimits(context);
+}
+
+/*!
+    Specify how to ellipsize text that does not fit.
+    Text is ellipsized at the width given by SDLPangoDraw_SetMinimumSize,
+    on the last line allowed by SDLPangoDraw_SetMaxLines or
+    SDLPangoDraw_SetMaxHeight, or on every line if there is no limit.
+
+    @param *context [i/o] Context
+    @param ellipsize [in] Where to put the ellipsis
+*/
+void
+SDLPangoDraw_SetEllipsize(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_Ellipsize ellipsize)
+{
+    PangoEllipsizeMode mode;
+
+    switch(ellipsize) {
+    case SDLPANGODRAW_ELLIPSIZE_NONE:
+	mode = PANGO_ELLIPSIZE_NONE;
+	break;
+    case SDLPANGODRAW_ELLIPSIZE_START:
+	mode = PANGO_ELLIPSIZE_START;
+	break;
+    case SDLPANGODRAW_ELLIPSIZE_MIDDLE:
+	mode = PANGO_ELLIPSIZE_MIDDLE;
+	break;
+    case SDLPANGODRAW_ELLIPSIZE_END:
+	mode = PANGO_ELLIPSIZE_END;
+	break;
+    default:
+	SDL_SetError("unknown ellipsize value");
+	return;
+    }
+
+    if(mode == context->ellipsize)
+	return;
+
+    context->ellipsize = mode;
+    applyLineLimits(context);
+}
+
+/*!
+    Specify default color.
+
+    @param *context [i/o] Context
+    @param *color_matrix [in] Foreground and background color
+*/
+void
+SDLPangoDraw_SetDefaultColor(
+    SDLPangoDraw_Context *context,
+    const SDLPangoDraw_Matrix *color_matrix)
+{
+    context->color_matrix = *color_matrix;
+}
+
+/*!
+    Get layout width.
+
+    @param *context [in] Context
+    @return Width
+*/
+int
+SDLPangoDraw_GetLayoutWidth(
+    SDLPangoDraw_Context *context)
+{
+    PangoRectangle logical_rect;
+
+    getLayoutExtents(context, &logical_rect);
+
+    return PANGO_PIXELS (logical_rect.width);
+}
+
+/*!
+    Get layout height.
+
+    @param *context [in] Context
+    @return Height
+*/
+int
+SDLPangoDraw_GetLayoutHeight(
+    SDLPangoDraw_Context *context)
+{
+    PangoRectangle logical_rect;
+
+    getLayoutExtents(context, &logical_rect);
+
+    return PANGO_PIXELS (logical_rect.height);
+}
+
+/*!
+    Set the text and attributes of the layout of a context.
+
+    @param *context [i/o] Context
+    @param *text [in] Text (must be in UTF-8).
+    @param length [in] Text length. -1 means NULL-terminated text.
+    @param *attrs [in] Attributes. May be NULL.
+    @param alignment [in] Alignment
+*/
+static void
+setLayoutText(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length,
+    PangoAttrList *attrs,
+    PangoAlignment alignment)
+{
+    pango_layout_set_attributes (context->layout, attrs);
+    pango_layout_set_text (context->layout, text, length);
+    pango_layout_set_auto_dir (context->layout, TRUE);
+    pango_layout_set_alignment (context->layout, alignment);
+    pango_layout_set_font_description (context->layout, context->font_desc);
+    context->alignment = alignment;
+    context->index_valid = FALSE;
+
+    setShapedText(context, text, length, attrs);
+}
+
+/*!
+    Set the markup text to draw.
+    Markup format is same as Pango.
+
+    @param *context [i/o] Context
+    @param *markup [in] Markup text (must be in UTF-8).
+    @param length [in] Text length. -1 means NULL-terminated text.
+*/
+void
+SDLPangoDraw_SetMarkup(
+    SDLPangoDraw_Context *context,
+    const char *markup,
+    int length)
+{
+    PangoAttrList *attrs;
+    char *text;
+
+    if(pango_parse_markup (markup, length, 0, &attrs, &text, NULL, NULL)) {
+	setLayoutText(context, text, -1, attrs, PANGO_ALIGN_LEFT);
+	pango_attr_list_unref (attrs);
+	g_free (text);
+    } else {
+	/* Let Pango report the error. */
+	pango_layout_set_markup (context->layout, markup, length);
+	pango_layout_set_auto_dir (context->layout, TRUE);
+	pango_layout_set_alignment (context->layout, PANGO_ALIGN_LEFT);
+	pango_layout_set_font_description (context->layout, context->font_desc);
+	context->alignment = PANGO_ALIGN_LEFT;
+	context->index_valid = FALSE;
+	setShapedText(context, NULL, 0, NULL);
+    }
+}
+
+/*!
+    Set the plain (non-markup) text to draw, using a specific text alignment.
+    This only applies if the minimum size has been set using
+    SDLPangoDraw_SetMinimumSize.
+
+    @param *context [i/o] Context
+    @param *text [in] The raw text (must be in UTF-8).
+    @param length [in] Text length. -1 means NULL-terminated text.
+    @param alignment The text alignment.
+*/
+void
+SDLPangoDraw_SetText_GivenAlignment(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length,
+    SDLPangoDraw_Alignment alignment)
+{
+    setLayoutText(context, text, length, NULL, (PangoAlignment)alignment);
+}
+
+/*!
+    Set the plain (non-markup) text to draw.
+
+    @param *context [i/o] Context
+    @param *text [in] The raw text (must be in UTF-8).
+    @param length [in] Text length. -1 means NULL-terminated text.
+*/
+void
+SDLPangoDraw_SetText(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length)
+{
+    SDLPangoDraw_SetText_GivenAlignment(context, text, length, SDLPANGODRAW_ALIGN_LEFT);
+}
+
+/*!
+    Set text to draw, styled by an array of attribute spans.
+    This is the same as SDLPangoDraw_SetMarkup without building and parsing
+    a markup string: the spans are turned directly into Pango attributes.
+    Spans may overlap; where they do, a later span in the array wins over
+    an earlier one of the same type.
+
+    @param *context [i/o] Context
+    @param *text [in] The raw text (must be in UTF-8).
+    @param length [in] Text length. -1 means NULL-terminated text.
+    @param *attrs [in] Attribute spans
+    @param n_attrs [in] Number of spans
+    @return 0 on success, -1 if a span has an unknown type, or a range
+	that is out of the text or not on character boundaries. The text
+	is set anyway, without that span.
+*/
+int
+SDLPangoDraw_SetTextWithAttributes(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length,
+    const SDLPangoDraw_Attribute *attrs,
+    int n_attrs)
+{
+    PangoAttrList *list = pango_attr_list_new ();
+    int result = 0;
+    int i;
+
+    if(length < 0)
+	length = strlen(text);
+
+    for(i = 0; i < n_attrs; i++) {
+	PangoAttribute *attr;
+	Uint32 value = (Uint32)attrs[i].value;
+	int start = attrs[i].start;
+	int end = attrs[i].end;
+
+	if(start < 0 || start > end || end > length
+	    || (start < length && (text[start] & 0xc0) == 0x80)
+	    || (end < length && (text[end] & 0xc0) == 0x80))
+	{
+	    SDL_SetError("attribute span %d-%d is not a range of characters of the text",
+		start, end);
+	    result = -1;
+	    continue;
+	}
+
+	switch(attrs[i].type) {
+	case SDLPANGODRAW_ATTR_FOREGROUND:
+	    attr = pango_attr_foreground_new (
+		((value >> 16) & 0xff) * 257,
+		((value >> 8) & 0xff) * 257,
+		(value & 0xff) * 257);
+	    break;
+	case SDLPANGODRAW_ATTR_BACKGROUND:
+	    attr = pango_attr_background_new (
+		((value >> 16) & 0xff) * 257,
+		((value >> 8) & 0xff) * 257,
+		(value & 0xff) * 257);
+	    break;
+	case SDLPANGODRAW_ATTR_WEIGHT:
+	    attr = pango_attr_weight_new ((PangoWeight)attrs[i].value);
+	    break;
+	case SDLPANGODRAW_ATTR_STYLE:
+	    attr = pango_attr_style_new ((PangoStyle)attrs[i].value);
+	    break;
+	case SDLPANGODRAW_ATTR_UNDERLINE:
+	    attr = pango_attr_underline_new ((PangoUnderline)attrs[i].value);
+	    break;
+	case SDLPANGODRAW_ATTR_STRIKETHROUGH:
+	    attr = pango_attr_strikethrough_new (attrs[i].value != 0);
+	    break;
+	case SDLPANGODRAW_ATTR_SIZE:
+	    attr = pango_attr_size_new (attrs[i].value);
+	    break;
+	case SDLPANGODRAW_ATTR_RISE:
+	    attr = pango_attr_rise_new (attrs[i].value);
+	    break;
+	default:
+	    SDL_SetError("unknown attribute type %d", (int)attrs[i].type);
+	    result = -1;
+	    continue;
+	}
+
+	attr->start_index = start;
+	attr->end_index = end;
+	/* Unlike insert, change replaces the overlapped part of earlier
+	   spans, whatever their start. */
+	pango_attr_list_change (list, attr);
+    }
+
+    setLayoutText(context, text, length, list, PANGO_ALIGN_LEFT);
+    pango_attr_list_unref (list);
+
+    return result;
+}
+
+/*!
+    Set the DPI.
+
+    @param *context [i/o] Context
+    @param dpi_x [in] X dpi
+    @param dpi_y [in] Y dpi
+*/
+void
+SDLPangoDraw_SetDpi(
+    SDLPangoDraw_Context *context,
+    double dpi_x, double dpi_y)
+{
+    checkShapedText(context);
+    pango_ft2_font_map_set_resolution (PANGO_FT2_FONT_MAP (context->font_map), dpi_x, dpi_y);
+    context->dpi_x = dpi_x;
+    context->dpi_y = dpi_y;
+    g_hash_table_remove_all(context->font_names);
+    context->index_valid = FALSE;
+
+    reshapeText(context);
+}
+
+/*!
+    Set language to context.
+
+    @param *context [i/o] Context
+    @param *language_tag [in] A RFC-3066 format language tag 
+*/
+void SDLCALL
+SDLPangoDraw_SetLanguage(
+    SDLPangoDraw_Context *context,
+    const char *language_tag)
+{
+    checkShapedText(context);
+    pango_context_set_language (context->context, pango_language_from_string (language_tag));
+    context->index_valid = FALSE;
+
+    reshapeText(context);
+}
+
+/*!
+    Set base direction to context.
+
+    @param *context [i/o] Context
+    @param direction [in] Direction
+*/
+void SDLCALL
+SDLPangoDraw_SetBaseDirection(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_Direction direction)
+{
+    PangoDirection pango_dir;
+
+    switch(direction) {
+    case SDLPANGODRAW_DIRECTION_LTR:
+	pango_dir = PANGO_DIRECTION_LTR;
+	break;
+    case SDLPANGODRAW_DIRECTION_RTL:
+	pango_dir = PANGO_DIRECTION_RTL;
+	break;
+    case SDLPANGODRAW_DIRECTION_WEAK_LTR:
+	pango_dir = PANGO_DIRECTION_WEAK_LTR;
+	break;
+    case SDLPANGODRAW_DIRECTION_WEAK_RTL:
+	pango_dir = PANGO_DIRECTION_WEAK_RTL;
+	break;
+    case SDLPANGODRAW_DIRECTION_NEUTRAL:
+	pango_dir = PANGO_DIRECTION_NEUTRAL;
+	break;
+    default:
+	SDL_SetError("unknown direction value");
+	return;
+    }
+
+    checkShapedText(context);
+    pango_context_set_base_dir (context->context, pango_dir);
+    context->index_valid = FALSE;
+
+    reshapeText(context);
+}
+
+/*!
+    Get font map from context.
+
+    @param *context [in] Context
+    @return Font map
+*/
+PangoFontMap* SDLCALL
+SDLPangoDraw_GetPangoFontMap(
+    SDLPangoDraw_Context *context)
+{
+    return context->font_map;
+}
+
+/*!
+    Get font description from context.
+
+    @param *context [in] Context
+    @return Font description
+*/
+PangoFontDescription* SDLCALL
+SDLPangoDraw_GetPangoFontDescription(
+    SDLPangoDraw_Context *context)
+{
+    return context->font_desc;
+}
+
+/*!
+    Get layout from context.
+
+    @param *context [in] Context
+    @return Layout
+*/
+PangoLayout* SDLCALL
+SDLPangoDraw_GetPangoLayout(
+    SDLPangoDraw_Context *context)
+{
+    return context->layout;
+}
+
+/*!
+    An entry of the shaped-run cache.
+*/
+typedef struct _shapeCacheEntry {
+    gchar *key;			/*!< Font, language, direction and DPI, then the text */
+    PangoGlyphString *glyphs;	/*!< The shaped glyphs */
+    gsize bytes;		/*!< Memory accounted to the entry */
+    GList link;			/*!< Link in the LRU queue */
+} shapeCacheEntry;
+
+/*
+    The shaped-run cache is shared by all the contexts, and may be used by
+    several threads at once. Everything below is guarded by shape_cache_lock.
+*/
+static GMutex shape_cache_lock;
+static GHashTable *shape_cache = NULL;
+static GQueue shape_cache_lru = G_QUEUE_INIT;
+static gsize shape_cache_bytes = 0;
+static gsize shape_cache_limit = DEFAULT_SHAPE_CACHE_LIMIT;
+static Uint32 shape_cache_hits = 0;
+static Uint32 shape_cache_misses = 0;
+static Uint32 shape_cache_evictions = 0;
+
+/*!
+    Drop the least recently used entries of the shaped-run cache.
+    The caller must hold shape_cache_lock.
+
+    @param limit [in] Size to shrink the cache to, in bytes
+*/
+static void
+evictShapeCache(
+    gsize limit)
+{
+    while(shape_cache_bytes > limit && shape_cache_lru.tail) {
+	shapeCacheEntry *entry = shape_cache_lru.tail->data;
+
+	g_queue_unlink(&shape_cache_lru, &entry->link);
+	g_hash_table_remove(shape_cache, entry->key);
+	shape_cache_bytes -= entry->bytes;
+	shape_cache_evictions++;
+
+	pango_glyph_string_free(entry->glyphs);
+	g_free(entry->key);
+	g_free(entry);
+    }
+}
+
+/*!
+    Get the fontconfig pattern of a font.
+
+    @param *font [in] Font
+    @return Pattern, owned by the font, or NULL if the font has none
+*/
+static FcPattern *
+getFontPattern(
+    PangoFont *font)
+{
+#if PANGO_VERSION_CHECK(1, 48, 0)
+    return pango_fc_font_get_pattern (PANGO_FC_FONT (font));
+#else
+    return PANGO_FC_FONT (font)->font_pattern;
+#endif
+}
+
+/*!
+    Get the identity of a font, as used in the keys of the shaped-run
+    cache: its fontconfig pattern, which names the font file, the face in
+    it, the size and the rendering options. Glyph ids are only shared
+    between fonts that agree on all of these, whatever font map or
+    fontconfig configuration they come from.
+    The identities are kept per context, since making one costs more than
+    looking it up.
+
+    @param *context [i/o] Context
+    @param *font [in] Font
+    @return Identity, owned by the context, or NULL if the font has none
+*/
+static const char *
+describeFont(
+    SDLPangoDraw_Context *context,
+    PangoFont *font)
+{
+    char *name = g_hash_table_lookup(context->font_names, font);
+
+    if(! name) {
+	FcPattern *pattern = getFontPattern(font);
+	FcChar8 *unparsed;
+
+	unparsed = pattern ? FcNameUnparse(pattern) : NULL;
+	if(! unparsed)
+	    return NULL;
+	name = g_strdup((const char *)unparsed);
+	FcStrFree(unparsed);
+	g_hash_table_insert(context->font_names, g_object_ref(font), name);
+    }
+    return name;
+}
+
+/*!
+    Shape an item with the text of its paragraph.
+
+    @param *text [in] Text of the paragraph the item refers to
+    @param length [in] Length of the paragraph in bytes
+    @param *item [in] Item
+    @return Newly allocated glyphs
+*/
+static PangoGlyphString *
+shapeInContext(
+    const char *text,
+    int length,
+    PangoItem *item)
+{
+    PangoGlyphString *glyphs = pango_glyph_string_new ();
+
+#if PANGO_VERSION_CHECK(1, 32, 0)
+    pango_shape_full (text + item->offset, item->length, text, length,
+	&item->analysis, glyphs);
+#else
+    pango_shape (text + item->offset, item->length, &item->analysis, glyphs);
+#endif
+    return glyphs;
+}
+
+/*!
+    Shape an item, through the shaped-run cache.
+
+    The text around the item takes part in shaping, as in a PangoLayout,
+    so that letters join across the ends of items in scripts such as
+    Arabic. The characters that the shaper looks at on either side are
+    part of the key.
+
+    @param *context [i/o] Context
+    @param *text [in] Text of the paragraph the item refers to
+    @param length [in] Length of the paragraph in bytes
+    @param *item [in] Item
+    @return Newly allocated glyphs
+*/
+static PangoGlyphString *
+shapeItem(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length,
+    PangoItem *item)
+{
+    PangoGlyphString *glyphs;
+    shapeCacheEntry *entry;
+    GString *key = context->shape_key;
+    const char *font_id = describeFont(context, item->analysis.font);
+    const char *pre = text + item->offset;
+    const char *post = text + item->offset + item->length;
+    int i;
+
+    for(i = 0; i < SHAPE_CONTEXT_CHARS && pre > text; i++)
+	pre = g_utf8_prev_char(pre);
+    for(i = 0; i < SHAPE_CONTEXT_CHARS && post < text + length; i++)
+	post = g_utf8_next_char(post);
+
+    /* A font that cannot be told apart from others is not cached. */
+    if(! font_id)
+	return shapeInContext(text, length, item);
+
+    g_string_truncate(key, 0);
+    /* Monochrome glyphs are hinted for it, and may advance differently. */
+    g_string_append_printf(key, "%s|%s|%d|%d|%d|%d|%g|%g|%d|",
+	font_id,
+	item->analysis.language
+	    ? pango_language_to_string (item->analysis.language) : "",
+	item->analysis.level, item->analysis.script,
+	item->analysis.gravity, item->analysis.flags,
+	context->dpi_x, context->dpi_y, context->render_mode);
+    g_string_append_printf(key, "%d|%d|",
+	(int)(text + item->offset - pre), item->length);
+    g_string_append_len(key, pre, post - pre);
+
+    g_mutex_lock(&shape_cache_lock);
+    entry = shape_cache ? g_hash_table_lookup(shape_cache, key->str) : NULL;
+    if(entry) {
+	shape_cache_hits++;
+	g_queue_unlink(&shape_cache_lru, &entry->link);
+	g_queue_push_head_link(&shape_cache_lru, &entry->link);
+	glyphs = pango_glyph_string_copy (entry->glyphs);
+    } else
+	shape_cache_misses++;
+    g_mutex_unlock(&shape_cache_lock);
+
+    if(entry)
+	return glyphs;
+
+    glyphs = shapeInContext(text, length, item);
+
+    entry = g_new(shapeCacheEntry, 1);
+    entry->bytes = sizeof(shapeCacheEntry) + key->len + 1
+	+ sizeof(PangoGlyphString)
+	+ glyphs->num_glyphs * (sizeof(PangoGlyphInfo) + sizeof(gint));
+    entry->key = g_strndup(key->str, key->len);
+    entry->glyphs = pango_glyph_string_copy (glyphs);
+    entry->link.data = entry;
+    entry->link.prev = entry->link.next = NULL;
+
+    g_mutex_lock(&shape_cache_lock);
+    if(entry->bytes <= shape_cache_limit
+	&& ! (shape_cache && g_hash_table_lookup(shape_cache, entry->key)))
+    {
+	if(! shape_cache)
+	    shape_cache = g_hash_table_new(g_str_hash, g_str_equal);
+	g_hash_table_insert(shape_cache, entry->key, entry);
+	g_queue_push_head_link(&shape_cache_lru, &entry->link);
+	shape_cache_bytes += entry->bytes;
+	evictShapeCache(shape_cache_limit);
+	entry = NULL;
+    }
+    g_mutex_unlock(&shape_cache_lock);
+
+    if(entry) {
+	/* Too large, or another thread got there first. */
+	pango_glyph_string_free(entry->glyphs);
+	g_free(entry->key);
+	g_free(entry);
+    }
+
+    return glyphs;
+}
+
+/*!
+    Specify the size limit of the shaped-run cache.
+    The cache is shared by all the contexts. It keeps the glyphs of text
+    segments shaped for a font, language, direction and DPI, so the same
+    labels are not shaped again by every context that draws them.
+    The default is 1 MiB.
+
+    @param bytes [in] Limit in bytes. Zero disables the cache.
+*/
+void
+SDLPangoDraw_SetShapeCacheLimit(
+    int bytes)
+{
+    g_mutex_lock(&shape_cache_lock);
+    shape_cache_limit = MAX(bytes, 0);
+    evictShapeCache(shape_cache_limit);
+    g_mutex_unlock(&shape_cache_lock);
+}
+
+/*!
+    Drop all the entries of the shaped-run cache.
+    The statistics are not reset.
+*/
+void
+SDLPangoDraw_ClearShapeCache()
+{
+    g_mutex_lock(&shape_cache_lock);
+    evictShapeCache(0);
+    g_mutex_unlock(&shape_cache_lock);
+}
+
+/*!
+    Get the statistics of the shaped-run cache.
+
+    @param *stats [out] Statistics
+*/
+void
+SDLPangoDraw_GetShapeCacheStats(
+    SDLPangoDraw_ShapeCacheStats *stats)
+{
+    g_mutex_lock(&shape_cache_lock);
+    stats->hits = shape_cache_hits;
+    stats->misses = shape_cache_misses;
+    stats->evictions = shape_cache_evictions;
+    stats->entries = shape_cache ? g_hash_table_size(shape_cache) : 0;
+    stats->bytes = (int)shape_cache_bytes;
+    stats->limit = (int)shape_cache_limit;
+    g_mutex_unlock(&shape_cache_lock);
+}
+
+/*!
+    Count the memory held by a run, for SDLPangoDraw_GetMemoryStats.
+
+    @param *run [in] Run
+    @param *fonts [i/o] Set of the fonts seen so far. May be NULL.
+    @return Bytes
+*/
+static gsize
+runBytes(
+    PangoLayoutRun *run,
+    GHashTable *fonts)
+{
+    if(fonts)
+	g_hash_table_insert(fonts, run->item->analysis.font, NULL);
+    return sizeof(PangoGlyphItem) + sizeof(PangoItem)
+	+ run->glyphs->space * (sizeof(PangoGlyphInfo) + sizeof(gint));
+}
+
+/*!
+    Count the memory held by lines of shaped text and their runs, for
+    SDLPangoDraw_GetMemoryStats.
+
+    @param *lines [in] Lines (lineInfo)
+    @param *fonts [i/o] Set of the fonts seen so far. May be NULL.
+    @return Bytes
+*/
+static gsize
+linesBytes(
+    const GArray *lines,
+    GHashTable *fonts)
+{
+    gsize bytes = lines->len * sizeof(lineInfo);
+    guint i;
+
+    for(i = 0; i < lines->len; i++) {
+	GSList *tmp_list;
+
+	for(tmp_list = g_array_index(lines, lineInfo, i).runs; tmp_list; tmp_list = tmp_list->next)
+	    bytes += runBytes(tmp_list->data, fonts);
+    }
+    return bytes;
+}
+
+/*!
+    Get the memory held by the buffers of a context: everything that
+    SDLPANGODRAW_TRIM_BUFFERS releases.
+
+    @param *context [in] Context
+    @return Bytes
+*/
+static gsize
+bufferBytes(
+    SDLPangoDraw_Context *context)
+{
+    gsize bytes = context->effect_buf_size;
+
+    if(context->tmp_ftbitmap)
+	bytes += context->tmp_ftbitmap->pitch * context->tmp_ftbitmap->rows;
+    if(context->compiled_glyphs)
+	bytes += context->compiled_glyphs->space * (sizeof(PangoGlyphInfo) + sizeof(gint));
+    bytes += context->index_lines_peak * sizeof(indexLine);
+    bytes += context->index_runs_peak * sizeof(indexRun);
+    bytes += (context->damage_lines->len + context->frame_lines->len) * sizeof(damageLine);
+    bytes += (context->damage_runs->len + context->frame_runs->len) * sizeof(damageRun);
+    bytes += (context->damage_glyphs->len + context->frame_glyphs->len) * sizeof(PangoGlyphInfo);
+    return bytes;
+}
+
+/*!
+    Get the memory held by the caches of a context: everything that
+    SDLPANGODRAW_TRIM_CACHES releases but the shared shaped-run cache and
+    the fonts, which cannot be counted.
+
+    @param *context [in] Context
+    @param *fonts [i/o] Set of the fonts seen so far. May be NULL.
+    @return Bytes
+*/
+static gsize
+cacheBytes(
+    SDLPangoDraw_Context *context,
+    GHashTable *fonts)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    gsize bytes = 0;
+    int p;
+
+    g_hash_table_iter_init(&iter, context->font_names);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+	if(fonts)
+	    g_hash_table_insert(fonts, key, NULL);
+	bytes += strlen(value) + 1;
+    }
+
+    for(p = 0; context->shaped && p < context->shaped->n_paragraphs; p++) {
+	shapedParagraph *para = &context->shaped->paragraphs[p];
+	GList *reflows;
+
+	/* The lines of the current width are counted with the layouts. */
+	for(reflows = para->reflows.head; reflows; reflows = reflows->next) {
+	    reflowEntry *entry = reflows->data;
+
+	    if(entry->lines != para->lines)
+		bytes += linesBytes(entry->lines, fonts);
+	}
+    }
+    return bytes;
+}
+
+/*!
+    Replace an array by an empty one, to release its memory.
+*/
+static GArray *
+emptyArray(
+    GArray *array,
+    guint element_size)
+{
+    g_array_free(array, TRUE);
+    return g_array_new(FALSE, FALSE, element_size);
+}
+
+/*!
+    Release the buffers of a context, as SDLPANGODRAW_TRIM_BUFFERS.
+
+    @param *context [i/o] Context
+*/
+static void
+trimBuffers(
+    SDLPangoDraw_Context *context)
+{
+    SDLPangoDraw_ReleaseScratch(context);
+    if(context->compiled_glyphs) {
+	pango_glyph_string_free(context->compiled_glyphs);
+	context->compiled_glyphs = NULL;
+    }
+    context->index_lines = emptyArray(context->index_lines, sizeof(indexLine));
+    context->index_runs = emptyArray(context->index_runs, sizeof(indexRun));
+    context->index_lines_peak = 0;
+    context->index_runs_peak = 0;
+    context->index_valid = FALSE;
+    clearDamageRuns(context->damage_runs);
+    clearDamageRuns(context->frame_runs);
+    context->damage_lines = emptyArray(context->damage_lines, sizeof(damageLine));
+    context->damage_runs = emptyArray(context->damage_runs, sizeof(damageRun));
+    context->frame_lines = emptyArray(context->frame_lines, sizeof(damageLine));
+    context->frame_runs = emptyArray(context->frame_runs, sizeof(damageRun));
+    context->damage_glyphs = emptyArray(context->damage_glyphs, sizeof(PangoGlyphInfo));
+    context->frame_glyphs = emptyArray(context->frame_glyphs, sizeof(PangoGlyphInfo));
+    context->damage_valid = FALSE;
+    if(context->buffer_surface) {
+	SDL_FreeSurface(context->buffer_surface);
+	context->buffer_surface = NULL;
+    }
+}
+
+/*!
+    Release the caches of a context and the font caches of its font map,
+    as SDLPANGODRAW_TRIM_CACHES but for the shared shaped-run cache.
+
+    @param *context [i/o] Context
+*/
+static void
+trimCaches(
+    SDLPangoDraw_Context *context)
+{
+    checkShapedText(context);
+    if(context->shaped)
+	trimReflows(context->shaped);
+    freeSimpleFont(context->simple_font);
+    context->simple_font = NULL;
+    g_hash_table_remove_all(context->font_names);
+    pango_fc_font_map_cache_clear(PANGO_FC_FONT_MAP (context->font_map));
+    pango_layout_context_changed (context->layout);
+    syncShapedText(context);
+}
+
+/*!
+    Release the memory of a context when it is over its memory budget.
+    Called at the end of the draws.
+    The caches are released first, since they are built again once by
+    the next draw, and the buffers only if that is not enough. When a
+    draw needs again what the draw before it released, that memory is
+    the working set of the text, and is kept until the context holds
+    more than it: releasing it after every draw would only allocate it
+    again for the next one.
+
+    @param *context [i/o] Context
+*/
+static void
+enforceMemoryBudget(
+    SDLPangoDraw_Context *context)
+{
+    gsize budget = (gsize)context->memory_budget;
+    gsize bytes;
+
+    if(budget == 0)
+	return;
+
+    bytes = bufferBytes(context) + cacheBytes(context, NULL);
+    if(bytes <= budget) {
+	context->working_set = 0;
+	context->budget_trimmed = FALSE;
+	return;
+    }
+    if(bytes <= context->working_set)
+	return;
+    if(context->budget_trimmed) {
+	context->working_set = bytes;
+	context->budget_trimmed = FALSE;
+	return;
+    }
+
+    trimCaches(context);
+    if(bufferBytes(context) > budget)
+	trimBuffers(context);
+    context->budget_trimmed = TRUE;
+}
+
+/*!
+    Specify the memory budget of a context: an upper limit on the buffers
+    it keeps between draws (the scratch bitmap, the buffers of the effects,
+    the line index and the damage records) and on the caches of the
+    context (font names and line breaks of other widths). After a draw
+    that leaves more than this, the caches are released as by
+    SDLPANGODRAW_TRIM_CACHES, then the buffers as by
+    SDLPANGODRAW_TRIM_BUFFERS if that is not enough. Text whose draws need
+    more than the budget keeps what they need, rather than allocating it
+    again on every draw.
+    While there is a budget, the scratch memory is limited to half of it
+    if the scratch limit is higher. The scratch limit itself is kept, and
+    applies again once the budget is removed.
+
+    @param *context [i/o] Context
+    @param bytes [in] Budget in bytes, or 0 for no budget (the default)
+*/
+void
+SDLPangoDraw_SetMemoryBudget(
+    SDLPangoDraw_Context *context,
+    int bytes)
+{
+    context->memory_budget = MAX(bytes, 0);
+    context->working_set = 0;
+    context->budget_trimmed = FALSE;
+    fitScratch(context);
+    enforceMemoryBudget(context);
+}
+
+/*!
+    Release memory held by the library, for example on a low-memory
+    signal. Everything released is built again when needed, so the
+    contexts stay usable; the next draws are only slower.
+
+    SDLPANGODRAW_TRIM_BUFFERS releases the buffers of the context: scratch
+    bitmap, buffers of the effects, line index and damage records (the next
+    SDLPangoDraw_DrawDamage draws everything).
+    SDLPANGODRAW_TRIM_CACHES also empties the shaped-run cache, which is
+    shared by all the contexts, and the font caches of the font map of the
+    context.
+    SDLPANGODRAW_TRIM_ALL also drops the shaped copy of the text, so that
+    only the PangoLayout is kept.
+
+    @param *context [i/o] Context, or NULL to trim only the shared caches
+    @param level [in] How much to release
+*/
+void
+SDLPangoDraw_Trim(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_TrimLevel level)
+{
+    if(level >= SDLPANGODRAW_TRIM_CACHES)
+	SDLPangoDraw_ClearShapeCache();
+
+    if(! context)
+	return;
+
+    trimBuffers(context);
+    context->working_set = 0;
+    context->budget_trimmed = FALSE;
+
+    if(level >= SDLPANGODRAW_TRIM_CACHES)
+	trimCaches(context);
+
+    if(level >= SDLPANGODRAW_TRIM_ALL) {
+	freeShapedText(context->shaped);
+	context->shaped = NULL;
+    }
+}
+
+/*!
+    Get the memory held for a context, by category.
+    The buffers are counted exactly. Layouts count the text, the runs and
+    their glyphs as far as the library can see them; the runs are only
+    counted when the lines of the layout are already indexed, as they
+    are after a draw, since this never lays out the text. The memory of the
+    font maps is kept by Pango, FreeType and fontconfig and cannot be
+    counted: font_maps is always -1, and fonts gives the number of fonts
+    in use instead. Caches include the shaped-run cache, which is shared
+    by all the contexts.
+
+    @param *context [in] Context
+    @param *stats [out] Bytes held
+*/
+void
+SDLPangoDraw_GetMemoryStats(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_MemoryStats *stats)
+{
+    GHashTable *fonts = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gsize layouts = 0;
+    gsize caches = 0;
+    gboolean indexed;
+    guint i;
+
+#if PANGO_VERSION_CHECK(1, 32, 4)
+    /* The runs are stale if the layout was changed directly. */
+    indexed = context->index_valid
+	&& context->index_serial == pango_layout_get_serial (context->layout);
+#else
+    /* There is no telling whether the layout was changed directly. */
+    indexed = FALSE;
+#endif
+
+    layouts += strlen(pango_layout_get_text (context->layout));
+    if(indexed) {
+	for(i = 0; i < context->index_runs->len; i++)
+	    layouts += runBytes(g_array_index(context->index_runs, indexRun, i).run, fonts);
+    }
+    if(context->shaped) {
+	shapedText *shaped = context->shaped;
+	int p;
+
+	layouts += sizeof(shapedText) + shaped->length;
+	layouts += shaped->lines->len * sizeof(lineInfo);
+	for(p = 0; p < shaped->n_paragraphs; p++) {
+	    shapedParagraph *para = &shaped->paragraphs[p];
+
+	    layouts += sizeof(shapedParagraph) + linesBytes(para->natural, fonts);
+	    if(para->lines && para->lines != para->natural)
+		layouts += linesBytes(para->lines, fonts);
+	    if(para->layout)
+		layouts += para->length;
+	    if(para->log_attrs)
+		layouts += para->n_chars * (sizeof(PangoLogAttr) + sizeof(int));
+	}
+    }
+
+    caches += cacheBytes(context, fonts);
+    g_mutex_lock(&shape_cache_lock);
+    caches += shape_cache_bytes;
+    g_mutex_unlock(&shape_cache_lock);
+
+    stats->scratch = (int)bufferBytes(context);
+    stats->font_maps = -1;
+    stats->fonts = (int)g_hash_table_size(fonts);
+    stats->caches = (int)caches;
+    stats->layouts = (int)layouts;
+
+    g_hash_table_destroy(fonts);
+}
+
+/*!
+    Check whether a paragraph can be shaped by the library, instead of by
+    a layout of its own.
+
+    @param *text [in] Text
+    @param offset [in] Byte index of the paragraph
+    @param length [in] Length of the paragraph in bytes
+    @param *attrs [in] Attributes of the text
+    @return TRUE if the paragraph is not empty, and has no tabs,
+	forced line breaks, shape attributes or letter spacing
+*/
+static gboolean
+canShapeParagraph(
+    const char *text,
+    int offset,
+    int length,
+    PangoAttrList *attrs)
+{
+    PangoAttrIterator *iter;
+    gboolean simple = TRUE;
+    int end = offset + length;
+    int i;
+
+    if(length == 0)
+	return FALSE;
+
+    for(i = offset; i < end; i++) {
+	switch((Uint8)text[i]) {
+	case '\t':
+	case '\v':
+	case '\f':
+	    return FALSE;
+	case 0xc2:
+	    /* U+0085 NEXT LINE */
+	    if(i + 1 < end && (Uint8)text[i + 1] == 0x85)
+		return FALSE;
+	    break;
+	case 0xe2:
+	    /* U+2028 LINE SEPARATOR */
+	    if(i + 2 < end && (Uint8)text[i + 1] == 0x80
+		&& (Uint8)text[i + 2] == 0xa8)
+		return FALSE;
+	    break;
+	}
+    }
+
+    iter = pango_attr_list_get_iterator (attrs);
+    do {
+	gint start, stop;
+
+	pango_attr_iterator_range (iter, &start, &stop);
+	if(start >= end)
+	    break;
+	if(stop > offset
+	    && (pango_attr_iterator_get (iter, PANGO_ATTR_SHAPE)
+		|| pango_attr_iterator_get (iter, PANGO_ATTR_LETTER_SPACING)))
+	{
+	    simple = FALSE;
+	    break;
+	}
+    } while(pango_attr_iterator_next (iter));
+    pango_attr_iterator_destroy (iter);
+
+    return simple;
+}
+
+/*!
+    The attributes of a paragraph, for its own layout.
+    See sliceAttribute.
+*/
+typedef struct _attrSlice {
+    PangoAttrList *attrs;	/*!< Attributes of the paragraph */
+    guint start;		/*!< Byte index of the paragraph */
+    guint end;			/*!< Byte index of the end of the paragraph */
+} attrSlice;
+
+/*!
+    Copy an attribute over a paragraph into the attributes of the
+    paragraph, moved to the start of the paragraph. An attribute over the
+    position of an empty paragraph is copied too, since it sets the height
+    of its line. Used with pango_attr_list_filter, which keeps the order.
+
+    @param *attr [in] Attribute of the text
+    @param data [i/o] attrSlice
+    @return FALSE, to leave the attribute in the text
+*/
+static gboolean
+sliceAttribute(
+    PangoAttribute *attr,
+    gpointer data)
+{
+    attrSlice *slice = data;
+    PangoAttribute *copy;
+
+    if(attr->end_index <= slice->start
+	|| attr->start_index >= MAX(slice->end, slice->start + 1))
+	return FALSE;
+
+    copy = pango_attribute_copy (attr);
+    copy->start_index = attr->start_index > slice->start
+	? attr->start_index - slice->start : 0;
+    copy->end_index = attr->end_index - slice->start;
+    pango_attr_list_insert (slice->attrs, copy);
+    return FALSE;
+}
+
+#define SIMPLE_MAX_PAIRS 16384
+#define REFLOW_CACHE_SIZE 8	/*!< Widths to keep the lines of shaped text for */
+#define SIMPLE_COMPLEX G_MININT	/*!< Kerning of a pair that is not simple */
+
+/*!
+    Glyphs of simple text for the font of a context: the glyph and the
+    advance of every character, and the kerning of every pair, as Pango
+    shapes them. See shapeSimpleText.
+*/
+struct _simpleFont {
+    PangoItem *item;		/*!< Item of a sample letter: font and analysis */
+    GHashTable *glyphs;		/*!< Character to simpleGlyph */
+    GHashTable *pairs;		/*!< Pair of characters to kerning, or SIMPLE_COMPLEX */
+};
+
+typedef struct _simpleGlyph {
+    gboolean simple;		/*!< FALSE if the font cannot shape it alone */
+    PangoGlyphInfo info;	/*!< Glyph and advance */
+} simpleGlyph;
+
+/*!
+    Free the glyphs of simple text.
+
+    @param *simple [i/o] Glyphs. May be NULL.
+*/
+static void
+freeSimpleFont(
+    simpleFont *simple)
+{
+    if(! simple)
+	return;
+
+    pango_item_free (simple->item);
+    g_hash_table_destroy(simple->glyphs);
+    g_hash_table_destroy(simple->pairs);
+    g_free(simple);
+}
+
+/*!
+    Get the glyphs of simple text for the font of a context.
+
+    @param *context [i/o] Context
+    @return Glyphs, or NULL if the font cannot be loaded
+*/
+static simpleFont *
+getSimpleFont(
+    SDLPangoDraw_Context *context)
+{
+    PangoAttrList *attrs;
+    GList *items;
+    GList *tmp_list;
+
+    if(context->simple_font)
+	return context->simple_font;
+
+    attrs = pango_attr_list_new ();
+    items = pango_itemize_with_base_dir (context->context,
+	PANGO_DIRECTION_LTR, "x", 0, 1, attrs, NULL);
+    pango_attr_list_unref (attrs);
+    if(! items)
+	return NULL;
+
+    context->simple_font = g_new(simpleFont, 1);
+    context->simple_font->item = items->data;
+    context->simple_font->glyphs = g_hash_table_new_full(g_direct_hash,
+	g_direct_equal, NULL, g_free);
+    context->simple_font->pairs = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    for(tmp_list = items->next; tmp_list; tmp_list = tmp_list->next)
+	pango_item_free (tmp_list->data);
+    g_list_free(items);
+
+    return context->simple_font;
+}
+
+/*!
+    Look up the glyph of a character, shaping it alone the first time.
+
+    @param *simple [i/o] Glyphs
+    @param c [in] Character
+    @return Glyph
+*/
+static const simpleGlyph *
+lookupSimpleGlyph(
+    simpleFont *simple,
+    gunichar c)
+{
+    simpleGlyph *entry = g_hash_table_lookup(simple->glyphs, GUINT_TO_POINTER(c));
+    PangoGlyphString *glyphs;
+    char utf8[6];
+
+    if(entry)
+	return entry;
+
+    glyphs = pango_glyph_string_new ();
+    pango_shape (utf8, g_unichar_to_utf8(c, utf8), &simple->item->analysis, glyphs);
+
+    entry = g_new(simpleGlyph, 1);
+    entry->simple = glyphs->num_glyphs == 1
+	&& ! (glyphs->glyphs[0].glyph & PANGO_GLYPH_UNKNOWN_FLAG)
+	&& glyphs->glyphs[0].geometry.x_offset == 0
+	&& glyphs->glyphs[0].geometry.y_offset == 0;
+    if(entry->simple)
+	entry->info = glyphs->glyphs[0];
+    pango_glyph_string_free (glyphs);
+
+    g_hash_table_insert(simple->glyphs, GUINT_TO_POINTER(c), entry);
+    return entry;
+}
+
+/*!
+    Look up the kerning of a pair of characters, shaping the pair the
+    first time. A pair is simple when it shapes to the glyphs of its
+    characters, and only the advance of the first one changes.
+
+    @param *simple [i/o] Glyphs
+    @param a [in] First character
+    @param b [in] Second character
+    @param *glyph_a [in] Glyph of a
+    @param *glyph_b [in] Glyph of b
+    @return Change of the advance of a, or SIMPLE_COMPLEX
+*/
+static int
+lookupSimplePair(
+    simpleFont *simple,
+    gunichar a,
+    gunichar b,
+    const simpleGlyph *glyph_a,
+    const simpleGlyph *glyph_b)
+{
+    gpointer key = GUINT_TO_POINTER((a << 16) | b);
+    gpointer value;
+    PangoGlyphString *glyphs;
+    char utf8[12];
+    int length;
+    int kerning = SIMPLE_COMPLEX;
+
+    if(g_hash_table_lookup_extended(simple->pairs, key, NULL, &value))
+	return GPOINTER_TO_INT(value);
+
+    length = g_unichar_to_utf8(a, utf8);
+    length += g_unichar_to_utf8(b, utf8 + length);
+    glyphs = pango_glyph_string_new ();
+    pango_shape (utf8, length, &simple->item->analysis, glyphs);
+
+    if(glyphs->num_glyphs == 2
+	&& glyphs->glyphs[0].glyph == glyph_a->info.glyph
+	&& glyphs->glyphs[1].glyph == glyph_b->info.glyph
+	&& glyphs->glyphs[0].geometry.x_offset == 0
+	&& glyphs->glyphs[0].geometry.y_offset == 0
+	&& glyphs->glyphs[1].geometry.x_offset == 0
+	&& glyphs->glyphs[1].geometry.y_offset == 0
+	&& glyphs->glyphs[1].geometry.width == glyph_b->info.geometry.width)
+	kerning = glyphs->glyphs[0].geometry.width - glyph_a->info.geometry.width;
+    pango_glyph_string_free (glyphs);
+
+    if(g_hash_table_size(simple->pairs) >= SIMPLE_MAX_PAIRS)
+	g_hash_table_remove_all(simple->pairs);
+    g_hash_table_insert(simple->pairs, key, GINT_TO_POINTER(kerning));
+    return kerning;
+}
+
+/*!
+    Check whether a character may be in simple text: printable Latin-1,
+    Latin Extended-A and ASCII, except the soft hyphen.
+*/
+static gboolean
+isSimpleChar(
+    gunichar c)
+{
+    return (c >= 0x20 && c < 0x7f) || (c >= 0xa0 && c < 0x180 && c != 0xad);
+}
+
+/*!
+    Shape simple text without itemizing it: text with no attributes, made
+    of Latin letters, digits and punctuation that the font of the context
+    has, with no ligatures or marks. Such text is one left-to-right item in
+    the font of the context, and its glyphs are the glyphs of its
+    characters, with the advances adjusted by the kerning of each pair.
+    The glyphs and the kerning are taken from Pango, one character and one
+    pair at a time, so the result is the same as Pango's.
+
+    @param *context [i/o] Context
+    @param *shaped [in] Shaped text
+    @param *para [i/o] Paragraph with no items. Its item is set when it
+	is simple.
+    @return Newly allocated glyphs, or NULL if the paragraph is not simple
+*/
+static PangoGlyphString *
+shapeSimpleText(
+    SDLPangoDraw_Context *context,
+    shapedText *shaped,
+    shapedParagraph *para)
+{
+    PangoAttrIterator *iter;
+    PangoGlyphString *glyphs;
+    PangoItem *item;
+    simpleFont *simple;
+    const simpleGlyph *prev = NULL;
+    gunichar prev_c = 0;
+    gboolean letter = FALSE;
+    const char *text = shaped->text + para->offset;
+    const char *p;
+    int n_chars = 0;
+    GSList *attrs;
+
+    if(! context->fast_path)
+	return NULL;
+
+    for(p = text; p < text + para->length; p = g_utf8_next_char(p)) {
+	gunichar c = g_utf8_get_char(p);
+
+	if(! isSimpleChar(c))
+	    return NULL;
+	/* Text of digits and punctuation only is shaped as common script. */
+	if(g_unichar_isalpha(c))
+	    letter = TRUE;
+	n_chars++;
+    }
+    if(! letter)
+	return NULL;
+
+    /* Any attribute over any part of the paragraph makes it not simple. */
+    iter = pango_attr_list_get_iterator (shaped->attrs);
+    do {
+	gint start, end;
+
+	pango_attr_iterator_range (iter, &start, &end);
+	if(start >= para->offset + para->length)
+	    break;
+	if(end <= para->offset)
+	    continue;
+	attrs = pango_attr_iterator_get_attrs (iter);
+	if(attrs) {
+	    g_slist_free_full(attrs, (GDestroyNotify)pango_attribute_destroy);
+	    pango_attr_iterator_destroy (iter);
+	    return NULL;
+	}
+    } while (pango_attr_iterator_next (iter));
+    pango_attr_iterator_destroy (iter);
+
+    simple = getSimpleFont(context);
+    if(! simple)
+	return NULL;
+
+    glyphs = pango_glyph_string_new ();
+    pango_glyph_string_set_size (glyphs, n_chars);
+    n_chars = 0;
+    for(p = text; p < text + para->length; p = g_utf8_next_char(p)) {
+	gunichar c = g_utf8_get_char(p);
+	const simpleGlyph *glyph = lookupSimpleGlyph(simple, c);
+
+	if(! glyph->simple) {
+	    pango_glyph_string_free (glyphs);
+	    return NULL;
+	}
+	if(prev) {
+	    int kerning = lookupSimplePair(simple, prev_c, c, prev, glyph);
+
+	    if(kerning == SIMPLE_COMPLEX) {
+		pango_glyph_string_free (glyphs);
+		return NULL;
+	    }
+	    glyphs->glyphs[n_chars - 1].geometry.width += kerning;
+	}
+	glyphs->glyphs[n_chars] = glyph->info;
+	glyphs->log_clusters[n_chars] = p - text;
+	n_chars++;
+	prev = glyph;
+	prev_c = c;
+    }
+
+    item = pango_item_copy (simple->item);
+    item->offset = para->offset;
+    item->length = para->length;
+    item->num_chars = n_chars;
+    para->items = g_list_prepend(NULL, item);
+
+    return glyphs;
+}
+
+/*!
+    Specify whether the text of a context is laid out by the library,
+    paragraph by paragraph (see shapedText), or always by its PangoLayout. It is on by default. Turning it off drops the shaped text
+    at once; turning it on applies from the next text set.
+
+    @param *context [i/o] Context
+    @param enabled [in] Non-zero to let the library lay out the text
+*/
+void
+SDLPangoDraw_SetShapedLayout(
+    SDLPangoDraw_Context *context,
+    int enabled)
+{
+    context->shaped_layout = enabled ? TRUE : FALSE;
+    if(! enabled && context->shaped) {
+	freeShapedText(context->shaped);
+	context->shaped = NULL;
+	context->index_valid = FALSE;
+    }
+}
+
+/*!
+    Specify whether simple text is shaped without itemizing it.
+    See shapeSimpleText. It is on by default; turning it off is meant for
+    checking that both ways draw the same.
+
+    @param *context [i/o] Context
+    @param enabled [in] Non-zero to use the fast path
+*/
+void
+SDLPangoDraw_SetFastPath(
+    SDLPangoDraw_Context *context,
+    int enabled)
+{
+    checkShapedText(context);
+    context->fast_path = enabled ? TRUE : FALSE;
+    context->index_valid = FALSE;
+    reshapeText(context);
+}
+
+/*!
+    Specify whether shaped text that does not fit is broken into lines by
+    the library, paragraph by paragraph, instead of being laid out again
+    by Pango as a whole.
+    See breakShapedLine. It is on by default; turning it off is meant for
+    checking that both ways draw the same.
+
+    @param *context [i/o] Context
+    @param enabled [in] Non-zero to break the lines in the library
+*/
+void
+SDLPangoDraw_SetReflow(
+    SDLPangoDraw_Context *context,
+    int enabled)
+{
+    checkShapedText(context);
+    context->reflow = enabled ? TRUE : FALSE;
+    context->index_valid = FALSE;
+    placeShapedText(context);
+}
+
+/*!
+    Measure a run of shaped text.
+
+    @param *run [in] Run
+    @param *top [i/o] Top of the line from the baseline, widened to the run
+    @param *bottom [i/o] Bottom of the line from the baseline, widened to
+	the run
+    @return Width of the run in Pango units
+*/
+static int
+measureRun(
+    PangoGlyphItem *run,
+    int *top,
+    int *bottom)
+{
+    PangoRectangle ink_rect, logical_rect;
+    PangoUnderline uline;
+    PangoColor fg_color, bg_color;
+    gboolean strike, fg_set, bg_set, shape_set;
+    gint rise;
+
+    getItemProperties(run->item,
+	&uline, &strike, &rise,
+	&fg_color, &fg_set, &bg_color, &bg_set,
+	&shape_set, &ink_rect, &logical_rect);
+    pango_glyph_string_extents (run->glyphs, run->item->analysis.font,
+	NULL, &logical_rect);
+    *top = MIN(*top, logical_rect.y - rise);
+    *bottom = MAX(*bottom, logical_rect.y - rise + logical_rect.height);
+
+    return logical_rect.width;
+}
+
+/*!
+    Shape a paragraph of shaped text: itemize, shape and reorder it into
+    one line if the library shapes it, or lay it out at its natural width
+    in its own layout otherwise.
+
+    @param *context [i/o] Context
+    @param *shaped [in] Shaped text
+    @param *para [i/o] Paragraph with no lines, and its direction resolved
+*/
+static void
+shapeParagraph(
+    SDLPangoDraw_Context *context,
+    shapedText *shaped,
+    shapedParagraph *para)
+{
+    GList *visual;
+    GList *tmp_list;
+    GSList *runs = NULL;
+    int top = G_MAXINT;
+    int bottom = G_MININT;
+    int width = 0;
+    PangoGlyphString *simple_glyphs;
+    lineInfo line;
+    guint i;
+
+    if(para->layout) {
+	PangoTabArray *tabs = pango_layout_get_tabs (context->layout);
+
+	pango_layout_set_font_description (para->layout,
+	    pango_layout_get_font_description (context->layout));
+	pango_layout_set_tabs (para->layout, tabs);
+	if(tabs)
+	    pango_tab_array_free (tabs);
+	pango_layout_context_changed (para->layout);
+
+#if PANGO_VERSION_CHECK(1, 26, 0)
+	para->natural = copyParagraphLines(para, -1);
+#else
+	para->natural = g_array_new(FALSE, FALSE, sizeof(lineInfo));
+#endif
+	para->width = 0;
+	for(i = 0; i < para->natural->len; i++)
+	    para->width = MAX(para->width,
+		g_array_index(para->natural, lineInfo, i).logical_rect.width);
+	return;
+    }
+
+    simple_glyphs = shapeSimpleText(context, shaped, para);
+    if(! simple_glyphs)
+	para->items = pango_itemize_with_base_dir (context->context,
+	    para->direction, shaped->text, para->offset, para->length,
+	    shaped->attrs, NULL);
+
+    visual = pango_reorder_items (para->items);
+    for(tmp_list = visual; tmp_list; tmp_list = tmp_list->next) {
+	PangoGlyphItem *run = g_new(PangoGlyphItem, 1);
+
+	run->item = tmp_list->data;
+	run->glyphs = simple_glyphs
+	    ? simple_glyphs : shapeItem(context, shaped->text, shaped->length, run->item);
+	runs = g_slist_prepend(runs, run);
+
+	width += measureRun(run, &top, &bottom);
+    }
+    g_list_free(visual);
+
+    line.runs = g_slist_reverse(runs);
+    line.logical_rect.x = 0;
+    line.logical_rect.y = 0;
+    line.logical_rect.width = width;
+    line.logical_rect.height = bottom - top;
+    line.baseline = -top;
+    line.start_index = para->offset;
+    line.length = para->length;
+    para->natural = g_array_sized_new(FALSE, FALSE, sizeof(lineInfo), 1);
+    g_array_append_val(para->natural, line);
+    para->width = width;
+}
+
+/*!
+    Shape every paragraph of shaped text. Like a PangoLayout, a paragraph
+    with no strong direction takes the direction of the paragraph before it.
+
+    @param *context [i/o] Context
+    @param *shaped [i/o] Shaped text with no lines
+    @return FALSE if a paragraph cannot be laid out the way the PangoLayout
+	lays it out
+*/
+static gboolean
+shapeText(
+    SDLPangoDraw_Context *context,
+    shapedText *shaped)
+{
+    PangoDirection base_dir = pango_context_get_base_dir (context->context);
+    PangoDirection prev_dir = PANGO_DIRECTION_NEUTRAL;
+    int p;
+
+    shaped->width = 0;
+    for(p = 0; p < shaped->n_paragraphs; p++) {
+	shapedParagraph *para = &shaped->paragraphs[p];
+
+	para->direction = pango_find_base_dir (shaped->text + para->offset, para->length);
+	if(para->direction == PANGO_DIRECTION_NEUTRAL) {
+	    para->direction = prev_dir != PANGO_DIRECTION_NEUTRAL ? prev_dir : base_dir;
+	    /* Its own layout would resolve it from the base direction. */
+	    if(para->layout && para->length > 0 && para->direction != base_dir)
+		return FALSE;
+	} else
+	    prev_dir = para->direction;
+
+	shapeParagraph(context, shaped, para);
+	shaped->width = MAX(shaped->width, para->width);
+    }
+    return TRUE;
+}
+
+/*!
+    Free lines of a paragraph of shaped text and their runs.
+
+    @param *lines [i/o] Lines (lineInfo). May be NULL.
+    @param copies [in] TRUE if the runs own their items
+*/
+static void
+freeShapedLines(
+    GArray *lines,
+    gboolean copies)
+{
+    guint i;
+
+    if(! lines)
+	return;
+
+    for(i = 0; i < lines->len; i++) {
+	lineInfo *line = &g_array_index(lines, lineInfo, i);
+	GSList *tmp_list;
+
+	for(tmp_list = line->runs; tmp_list; tmp_list = tmp_list->next) {
+	    PangoGlyphItem *run = tmp_list->data;
+
+	    if(copies)
+		pango_glyph_item_free (run);
+	    else {
+		pango_glyph_string_free (run->glyphs);
+		g_free(run);
+	    }
+	}
+	g_slist_free(line->runs);
+    }
+    g_array_free(lines, TRUE);
+}
+
+/*!
+    Free the items and lines of shaped text.
+
+    @param *shaped [i/o] Shaped text
+*/
+static void
+unshapeText(
+    shapedText *shaped)
+{
+    int p;
+
+    g_array_set_size(shaped->lines, 0);
+    shaped->placed = FALSE;
+
+    for(p = 0; p < shaped->n_paragraphs; p++) {
+	shapedParagraph *para = &shaped->paragraphs[p];
+	GList *items;
+
+	freeShapedLines(para->natural, para->layout != NULL);
+	para->natural = NULL;
+
+	while(! g_queue_is_empty(&para->reflows))
+	    freeReflow(g_queue_pop_head(&para->reflows));
+	para->lines = NULL;
+	g_free(para->log_attrs);
+	para->log_attrs = NULL;
+	g_free(para->char_widths);
+	para->char_widths = NULL;
+	g_slist_free(para->logical_runs);
+	para->logical_runs = NULL;
+
+	for(items = para->items; items; items = items->next)
+	    pango_item_free (items->data);
+	g_list_free(para->items);
+	para->items = NULL;
+    }
+}
+
+/*!
+    Free shaped text.
+
+    @param *shaped [i/o] Shaped text. May be NULL.
+*/
+static void
+freeShapedText(
+    shapedText *shaped)
+{
+    int p;
+
+    if(! shaped)
+	return;
+
+    unshapeText(shaped);
+    for(p = 0; p < shaped->n_paragraphs; p++) {
+	if(shaped->paragraphs[p].layout)
+	    g_object_unref (shaped->paragraphs[p].layout);
+    }
+    g_free(shaped->paragraphs);
+    g_array_free(shaped->lines, TRUE);
+    pango_attr_list_unref (shaped->attrs);
+    g_free(shaped->text);
+    g_free(shaped);
+}
+
+/*!
+    Get the sign of a direction, as Pango uses it for alignment.
+
+    @param direction [in] Direction
+    @return 1 for left to right, -1 for right to left, 0 for neutral
+*/
+static int
+directionSign(
+    PangoDirection direction)
+{
+    switch(direction) {
+    case PANGO_DIRECTION_LTR:
+    case PANGO_DIRECTION_WEAK_LTR:
+	return 1;
+    case PANGO_DIRECTION_RTL:
+    case PANGO_DIRECTION_WEAK_RTL:
+	return -1;
+    default:
+	return 0;
+    }
+}
+
+/*!
+    Get the x of a line for an alignment.
+
+    @param alignment [in] Alignment, resolved for the direction
+    @param width [in] Width of the layout in Pango units
+    @param line_width [in] Width of the line in Pango units
+    @return X of the line in Pango units
+*/
+static int
+alignLine(
+    PangoAlignment alignment,
+    int width,
+    int line_width)
+{
+    switch(alignment) {
+    case PANGO_ALIGN_CENTER:
+	return (width - line_width) / 2;
+    case PANGO_ALIGN_RIGHT:
+	return width - line_width;
+    default:
+	return 0;
+    }
+}
+
+/*!
+    Free the lines of shaped text broken for a width.
+
+    @param *entry [i/o] Lines
+*/
+static void
+freeReflow(
+    reflowEntry *entry)
+{
+    freeShapedLines(entry->lines, TRUE);
+    g_free(entry);
+}
+
+/*!
+    Drop the lines of shaped text kept for widths other than the current.
+
+    @param *shaped [i/o] Shaped text
+*/
+static void
+trimReflows(
+    shapedText *shaped)
+{
+    int p;
+
+    for(p = 0; p < shaped->n_paragraphs; p++) {
+	shapedParagraph *para = &shaped->paragraphs[p];
+	GList *tmp_list = para->reflows.head;
+
+	while(tmp_list) {
+	    GList *next = tmp_list->next;
+	    reflowEntry *entry = tmp_list->data;
+
+	    if(entry->lines != para->lines) {
+		g_queue_delete_link(&para->reflows, tmp_list);
+		freeReflow(entry);
+	    }
+	    tmp_list = next;
+	}
+    }
+}
+
+#if PANGO_VERSION_CHECK(1, 26, 0)
+static gint
+compareRunOffsets(
+    gconstpointer a,
+    gconstpointer b)
+{
+    return ((const PangoGlyphItem *)a)->item->offset
+	- ((const PangoGlyphItem *)b)->item->offset;
+}
+
+/*!
+    Get the break opportunities and the advance of every character of a
+    paragraph shaped by the library, the first time it is broken into
+    lines.
+
+    @param *context [in] Context
+    @param *shaped [in] Shaped text
+    @param *para [i/o] Paragraph
+*/
+static void
+measureChars(
+    SDLPangoDraw_Context *context,
+    shapedText *shaped,
+    shapedParagraph *para)
+{
+    const char *text = shaped->text + para->offset;
+    GSList *tmp_list;
+
+    if(para->log_attrs)
+	return;
+
+    para->n_chars = g_utf8_strlen(text, para->length);
+    para->log_attrs = g_new(PangoLogAttr, para->n_chars + 1);
+    pango_get_log_attrs (text, para->length, -1,
+	pango_context_get_language (context->context),
+	para->log_attrs, para->n_chars + 1);
+
+    para->char_widths = g_new0(int, para->n_chars);
+    para->logical_runs = g_slist_sort(
+	g_slist_copy(g_array_index(para->natural, lineInfo, 0).runs),
+	compareRunOffsets);
+    for(tmp_list = para->logical_runs; tmp_list; tmp_list = tmp_list->next) {
+	PangoGlyphItem *run = tmp_list->data;
+	int offset = g_utf8_pointer_to_offset(text,
+	    shaped->text + run->item->offset);
+
+	pango_glyph_item_get_logical_widths (run, shaped->text,
+	    para->char_widths + offset);
+    }
+}
+
+/*!
+    Find where a line of a paragraph ends: at the last break opportunity
+    that fits, or between characters if a word is wider than the line.
+    White space at the end of a line may overflow it.
+
+    @param *para [in] Measured paragraph
+    @param start [in] Character the line starts at
+    @param width [in] Width of the line in Pango units
+    @return Character after the end of the line
+*/
+static int
+breakShapedLine(
+    const shapedParagraph *para,
+    int start,
+    int width)
+{
+    const PangoLogAttr *attrs = para->log_attrs;
+    int line_width = 0;
+    int brk = -1;
+    int i;
+
+    for(i = start; i < para->n_chars; i++) {
+	if(i > start && attrs[i].is_line_break)
+	    brk = i;
+	if(i > start && ! attrs[i].is_white
+	    && line_width + para->char_widths[i] > width)
+	    break;
+	line_width += para->char_widths[i];
+    }
+    if(i == para->n_chars)
+	return i;
+    if(brk > start)
+	return brk;
+
+    while(i > start + 1 && ! attrs[i].is_char_break)
+	i--;
+    return i;
+}
+
+/*!
+    Break a paragraph shaped by the library into lines for a width. The
+    glyphs of the runs are split at the ends of the lines, not shaped again.
+
+    @param *context [in] Context
+    @param *shaped [in] Shaped text
+    @param *para [i/o] Paragraph
+    @param width [in] Width in Pango units
+    @return Newly allocated lines (lineInfo)
+*/
+static GArray *
+reflowShapedText(
+    SDLPangoDraw_Context *context,
+    shapedText *shaped,
+    shapedParagraph *para,
+    int width)
+{
+    GArray *lines = g_array_new(FALSE, FALSE, sizeof(lineInfo));
+    GSList *next_run;
+    PangoGlyphItem *rest = NULL;
+    const char *p = shaped->text + para->offset;
+    int start = 0;
+    int y = 0;
+
+    measureChars(context, shaped, para);
+    next_run = para->logical_runs;
+
+    while(start < para->n_chars) {
+	int end = breakShapedLine(para, start, width);
+	const char *q = g_utf8_offset_to_pointer(p, end - start);
+	int end_index = q - shaped->text;
+	GSList *runs = NULL;
+	GList *items = NULL;
+	GList *visual;
+	GList *tmp_list;
+	lineInfo line;
+	int top = G_MAXINT;
+	int bottom = G_MININT;
+
+	/* The runs of the line, in logical order. */
+	while(rest || next_run) {
+	    PangoGlyphItem *run;
+
+	    if(! rest) {
+		rest = pango_glyph_item_copy (next_run->data);
+		next_run = next_run->next;
+	    }
+	    if(rest->item->offset >= end_index)
+		break;
+	    if(rest->item->offset + rest->item->length > end_index)
+		run = pango_glyph_item_split (rest, shaped->text,
+		    end_index - rest->item->offset);
+	    else {
+		run = rest;
+		rest = NULL;
+	    }
+	    runs = g_slist_prepend(runs, run);
+	    items = g_list_prepend(items, run->item);
+	}
+	items = g_list_reverse(items);
+
+	line.runs = NULL;
+	line.logical_rect.width = 0;
+	visual = pango_reorder_items (items);
+	for(tmp_list = visual; tmp_list; tmp_list = tmp_list->next) {
+	    GSList *run = runs;
+
+	    while(((PangoGlyphItem *)run->data)->item != tmp_list->data)
+		run = run->next;
+	    line.runs = g_slist_prepend(line.runs, run->data);
+	    line.logical_rect.width += measureRun(run->data, &top, &bottom);
+	}
+	line.runs = g_slist_reverse(line.runs);
+	g_list_free(visual);
+	g_list_free(items);
+	g_slist_free(runs);
+
+	if(! line.runs)
+	    top = bottom = 0;
+	line.logical_rect.x = 0;
+	line.logical_rect.y = y;
+	line.logical_rect.height = bottom - top;
+	line.baseline = y - top;
+	line.start_index = p - shaped->text;
+	line.length = end_index - line.start_index;
+	g_array_append_val(lines, line);
+
+	y += line.logical_rect.height;
+	start = end;
+	p = q;
+    }
+    if(rest)
+	pango_glyph_item_free (rest);
+
+    return lines;
+}
+
+/*!
+    Copy the lines of a paragraph laid out by its own layout, for a width.
+    The runs are moved to the byte indices of the whole text.
+
+    @param *para [i/o] Paragraph with a layout
+    @param width [in] Width in Pango units, or -1 for the natural width
+    @return Newly allocated lines (lineInfo)
+*/
+static GArray *
+copyParagraphLines(
+    shapedParagraph *para,
+    int width)
+{
+    GArray *lines = g_array_new(FALSE, FALSE, sizeof(lineInfo));
+    PangoLayoutIter *iter;
+
+    pango_layout_set_width (para->layout, width);
+    iter = pango_layout_get_iter (para->layout);
+    do {
+	PangoLayoutLine *layout_line = pango_layout_iter_get_line (iter);
+	GSList *tmp_list;
+	lineInfo line;
+
+	line.runs = NULL;
+	for(tmp_list = layout_line->runs; tmp_list; tmp_list = tmp_list->next) {
+	    PangoGlyphItem *run = pango_glyph_item_copy (tmp_list->data);
+
+	    run->item->offset += para->offset;
+	    line.runs = g_slist_prepend(line.runs, run);
+	}
+	line.runs = g_slist_reverse(line.runs);
+	pango_layout_iter_get_line_extents (iter, NULL, &line.logical_rect);
+	line.logical_rect.x = 0;
+	line.baseline = pango_layout_iter_get_baseline (iter);
+	line.start_index = para->offset + layout_line->start_index;
+	line.length = layout_line->length;
+	g_array_append_val(lines, line);
+    } while(pango_layout_iter_next_line (iter));
+    pango_layout_iter_free (iter);
+
+    return lines;
+}
+
+/*!
+    Get the lines of a paragraph for a width, from the lines kept for
+    recent widths if possible, so that resizing back and forth only
+    breaks the paragraph once per width.
+
+    @param *context [in] Context
+    @param *shaped [in] Shaped text
+    @param *para [i/o] Paragraph
+    @param width [in] Width in Pango units
+    @return Lines (lineInfo), owned by the paragraph
+*/
+static GArray *
+lookupReflow(
+    SDLPangoDraw_Context *context,
+    shapedText *shaped,
+    shapedParagraph *para,
+    int width)
+{
+    GList *tmp_list;
+    reflowEntry *entry;
+
+    for(tmp_list = para->reflows.head; tmp_list; tmp_list = tmp_list->next) {
+	entry = tmp_list->data;
+	if(entry->width == width) {
+	    g_queue_unlink(&para->reflows, tmp_list);
+	    g_queue_push_head_link(&para->reflows, tmp_list);
+	    return entry->lines;
+	}
+    }
+
+    entry = g_new(reflowEntry, 1);
+    entry->width = width;
+    entry->lines = para->layout
+	? copyParagraphLines(para, width)
+	: reflowShapedText(context, shaped, para, width);
+    g_queue_push_head(&para->reflows, entry);
+    if(g_queue_get_length(&para->reflows) > REFLOW_CACHE_SIZE)
+	freeReflow(g_queue_pop_tail(&para->reflows));
+
+    return entry->lines;
+}
+#endif
+
+/*!
+    Check whether the lines of a layout are placed the way placeShapedText
+    places them: no spacing between the lines, no indent and no
+    justification, and, when paragraphs are wrapped, wrapping at words the
+    way breakShapedLine does. Anything else is left to Pango.
+    Changes made through SDLPangoDraw_GetPangoLayout after the lines are
+    placed drop the shaped text instead; see currentShaped.
+
+    @param *context [in] Context
+    @param wrapped [in] TRUE if some paragraph does not fit the width
+    @return TRUE if the lines of shaped text may be placed
+*/
+static gboolean
+canPlaceLines(
+    SDLPangoDraw_Context *context,
+    gboolean wrapped)
+{
+    PangoLayout *layout = context->layout;
+
+    return (! wrapped
+	    || (context->reflow && pango_layout_get_wrap (layout) == PANGO_WRAP_WORD))
+	&& pango_layout_get_spacing (layout) == 0
+	&& pango_layout_get_indent (layout) == 0
+	&& ! pango_layout_get_justify (layout)
+#if PANGO_VERSION_CHECK(1, 44, 0)
+	&& pango_layout_get_line_spacing (layout) == 0.0
+#endif
+	;
+}
+
+/*!
+    Get the shaped text of a context, if its layout has not been changed
+    through SDLPangoDraw_GetPangoLayout since the text was placed.
+    Without layout serials (Pango older than 1.32.4), no text is shaped.
+
+    @param *context [in] Context
+    @return Shaped text, or NULL if the layout is to be drawn
+*/
+static shapedText *
+currentShaped(
+    SDLPangoDraw_Context *context)
+{
+#if PANGO_VERSION_CHECK(1, 32, 4)
+    if(context->shaped
+	&& context->shaped->serial == pango_layout_get_serial (context->layout))
+	return context->shaped;
+#endif
+    return NULL;
+}
+
+/*!
+    Drop the shaped text of a context if its layout has been changed
+    through SDLPangoDraw_GetPangoLayout, so that the layout is drawn until
+    the text is set again. Called before the library changes the layout
+    or its PangoContext itself, since the serial cannot tell the changes
+    apart afterwards.
+
+    @param *context [i/o] Context
+*/
+static void
+checkShapedText(
+    SDLPangoDraw_Context *context)
+{
+    if(context->shaped && ! currentShaped(context)) {
+	freeShapedText(context->shaped);
+	context->shaped = NULL;
+	context->index_valid = FALSE;
+    }
+}
+
+/*!
+    Record that the shaped text of a context matches its layout again,
+    after the library has changed the layout.
+
+    @param *context [i/o] Context
+*/
+static void
+syncShapedText(
+    SDLPangoDraw_Context *context)
+{
+#if PANGO_VERSION_CHECK(1, 32, 4)
+    if(context->shaped)
+	context->shaped->serial = pango_layout_get_serial (context->layout);
+#endif
+}
+
+/*!
+    Get the lines of the shaped text of a context, if they may be drawn.
+
+    @param *context [in] Context
+    @return Lines (lineInfo), or NULL if the layout is to be drawn
+*/
+static GArray *
+shapedLines(
+    SDLPangoDraw_Context *context)
+{
+    shapedText *shaped = currentShaped(context);
+
+    if(! shaped || ! shaped->placed)
+	return NULL;
+    return shaped->lines;
+}
+
+/*!
+    Place the shaped text of a context for the current width and alignment,
+    the same way a PangoLayout would place its lines: every paragraph in
+    its natural line while it fits, and broken into lines otherwise, one
+    paragraph below the other.
+
+    @param *context [i/o] Context
+*/
+static void
+placeShapedText(
+    SDLPangoDraw_Context *context)
+{
+    shapedText *shaped = context->shaped;
+    PangoDirection base_dir;
+    gboolean fits;
+    gboolean single;
+    int width;
+    int y = 0;
+    int p;
+
+    if(! shaped)
+	return;
+
+    if(context->min_width > 0) {
+	width = context->min_width * PANGO_SCALE;
+	fits = shaped->width <= width;
+    } else {
+	width = shaped->width;
+	fits = TRUE;
+    }
+    single = shaped->n_paragraphs == 1
+	&& shaped->paragraphs[0].natural->len == 1;
+
+    /* Ellipsized text is left to Pango, unless it is a single line that
+       fits, or lines that fit with no limit to cut them. */
+    g_array_set_size(shaped->lines, 0);
+    shaped->placed = canPlaceLines(context, ! fits)
+	&& (context->ellipsize == PANGO_ELLIPSIZE_NONE
+	    || (fits && (single
+		|| (context->max_lines <= 0 && context->max_height <= 0))));
+#if ! PANGO_VERSION_CHECK(1, 26, 0)
+    if(! fits)
+	shaped->placed = FALSE;
+#endif
+    if(! shaped->placed) {
+	syncShapedText(context);
+	return;
+    }
+
+    base_dir = pango_context_get_base_dir (context->context);
+    for(p = 0; p < shaped->n_paragraphs; p++) {
+	shapedParagraph *para = &shaped->paragraphs[p];
+	PangoAlignment alignment = context->alignment;
+	const lineInfo *last;
+	guint i;
+
+	if(para->width <= width)
+	    para->lines = para->natural;
+#if PANGO_VERSION_CHECK(1, 26, 0)
+	else
+	    para->lines = lookupReflow(context, shaped, para, width);
+#endif
+
+	if(alignment != PANGO_ALIGN_CENTER
+	    && directionSign(para->direction) == -directionSign(base_dir))
+	    alignment = alignment == PANGO_ALIGN_LEFT
+		? PANGO_ALIGN_RIGHT : PANGO_ALIGN_LEFT;
+
+	for(i = 0; i < para->lines->len; i++) {
+	    lineInfo line = g_array_index(para->lines, lineInfo, i);
+
+	    line.logical_rect.x = alignLine(alignment, width, line.logical_rect.width);
+	    line.logical_rect.y += y;
+	    line.baseline += y;
+	    g_array_append_val(shaped->lines, line);
+	}
+	last = &g_array_index(para->lines, lineInfo, para->lines->len - 1);
+	y += last->logical_rect.y + last->logical_rect.height;
+    }
+    syncShapedText(context);
+}
+
+/*!
+    Split shaped text into paragraphs the way Pango does, and give the
+    paragraphs that the library cannot shape a layout of their own.
+
+    @param *context [in] Context
+    @param *shaped [i/o] Shaped text with no paragraphs
+*/
+static void
+splitParagraphs(
+    SDLPangoDraw_Context *context,
+    shapedText *shaped)
+{
+    GArray *paragraphs = g_array_new(FALSE, TRUE, sizeof(shapedParagraph));
+    int offset = 0;
+    gboolean done;
+
+    do {
+	shapedParagraph para;
+	gint delimiter;
+	gint next;
+
+	pango_find_paragraph_boundary (shaped->text + offset,
+	    shaped->length - offset, &delimiter, &next);
+
+	memset(&para, 0, sizeof(para));
+	para.offset = offset;
+	para.length = delimiter;
+	g_queue_init(&para.reflows);
+	if(! canShapeParagraph(shaped->text, para.offset, para.length, shaped->attrs)) {
+	    attrSlice slice;
+	    PangoAttrList *filtered;
+
+	    slice.attrs = pango_attr_list_new ();
+	    slice.start = para.offset;
+	    slice.end = para.offset + para.length;
+	    filtered = pango_attr_list_filter (shaped->attrs, sliceAttribute, &slice);
+	    if(filtered)
+		pango_attr_list_unref (filtered);
+
+	    para.layout = pango_layout_new (context->context);
+	    pango_layout_set_attributes (para.layout, slice.attrs);
+	    pango_layout_set_text (para.layout, shaped->text + para.offset, para.length);
+	    pango_layout_set_auto_dir (para.layout, TRUE);
+	    pango_attr_list_unref (slice.attrs);
+	}
+	g_array_append_val(paragraphs, para);
+
+	done = offset + delimiter == shaped->length;
+	offset += next;
+    } while(! done);
+
+    shaped->n_paragraphs = paragraphs->len;
+    shaped->paragraphs = (shapedParagraph *)g_array_free(paragraphs, FALSE);
+}
+
+/*!
+    Set the text of a context to be laid out by the library, if every
+    paragraph can be laid out the way the PangoLayout lays it out.
+
+    @param *context [i/o] Context
+    @param *text [in] Text, or NULL to shape nothing
+    @param length [in] Text length. -1 means NULL-terminated text.
+    @param *attrs [in] Attributes. May be NULL.
+*/
+static void
+setShapedText(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length,
+    PangoAttrList *attrs)
+{
+    shapedText *shaped;
+
+    freeShapedText(context->shaped);
+    context->shaped = NULL;
+
+#if ! PANGO_VERSION_CHECK(1, 32, 4)
+    /* Changes through SDLPangoDraw_GetPangoLayout could not be seen. */
+    return;
+#endif
+    if(! text || ! context->shaped_layout)
+	return;
+    if(length < 0)
+	length = strlen(text);
+    if(length == 0 || memchr(text, '\0', length)
+	|| ! g_utf8_validate(text, length, NULL))
+	return;
+
+    shaped = g_new(shapedText, 1);
+    shaped->attrs = attrs ? pango_attr_list_ref (attrs) : pango_attr_list_new ();
+    shaped->text = g_strndup(text, length);
+    shaped->length = length;
+    shaped->lines = g_array_new(FALSE, FALSE, sizeof(lineInfo));
+    shaped->placed = FALSE;
+    splitParagraphs(context, shaped);
+
+    if(! shapeText(context, shaped)) {
+	freeShapedText(shaped);
+	return;
+    }
+    context->shaped = shaped;
+    placeShapedText(context);
+}
+
+/*!
+    Shape the text of a context again, after the settings of the
+    PangoContext have changed.
+
+    @param *context [i/o] Context
+*/
+static void
+reshapeText(
+    SDLPangoDraw_Context *context)
+{
+    /* The glyphs of simple text depend on the same settings. */
+    freeSimpleFont(context->simple_font);
+    context->simple_font = NULL;
+
+    if(! context->shaped)
+	return;
+
+    unshapeText(context->shaped);
+    if(! shapeText(context, context->shaped)) {
+	freeShapedText(context->shaped);
+	context->shaped = NULL;
+	context->index_valid = FALSE;
+	return;
+    }
+    placeShapedText(context);
+}
+
+/*!
+    Get the logical extents of the text of a context.
+
+    @param *context [in] Context
+    @param *logical_rect [out] Extents in Pango units
+*/
+static void
+getLayoutExtents(
+    SDLPangoDraw_Context *context,
+    PangoRectangle *logical_rect)
+{
+    const indexLine *first;
+    const indexLine *last;
+    int right;
+    guint i;
+
+    if(context->max_lines > 0 || context->max_height > 0 || shapedLines(context))
+	buildLineIndex(context);
+    if(! context->index_valid
+	|| ! (context->index_truncated || shapedLines(context))) {
+	pango_layout_get_extents (context->layout, NULL, logical_rect);
+	return;
+    }
+
+    /* Only the lines in the index are drawn, and the layout may not have
+       been laid out at all. */
+    first = &g_array_index(context->index_lines, indexLine, 0);
+    last = &g_array_index(context->index_lines, indexLine,
+	context->index_lines->len - 1);
+    logical_rect->x = first->x;
+    logical_rect->y = first->y;
+    logical_rect->height = last->y + last->height - first->y;
+    right = first->x + first->width;
+    for(i = 1; i < context->index_lines->len; i++) {
+	const indexLine *line = &g_array_index(context->index_lines, indexLine, i);
+
+	logical_rect->x = MIN(logical_rect->x, line->x);
+	right = MAX(right, line->x + line->width);
+    }
+    logical_rect->width = right - logical_rect->x;
+}
+
+/*!
+    Build the line index of a context, if the layout has changed.
+    Without layout serials (Pango older than 1.32.4), a change made
+    through SDLPangoDraw_GetPangoLayout cannot be seen, and it frees the
+    runs the index points to. The index is then built again every time.
+
+    @param *context [i/o] Context
+*/
+static void
+buildLineIndex(
+    SDLPangoDraw_Context *context)
+{
+    lineCursor cursor;
+    PangoRectangle logical_rect;
+    gboolean same_layout = FALSE;
+
+#if PANGO_VERSION_CHECK(1, 32, 4)
+    /* The layout may also have been changed through SDLPangoDraw_GetPangoLayout. */
+    if(context->index_valid
+	&& context->index_serial == pango_layout_get_serial (context->layout))
+	return;
+#else
+    /* Lines are walked again, but as far as the library knows, they are
+       the same lines. */
+    same_layout = context->index_valid;
+#endif
+
+    g_array_set_size(context->index_lines, 0);
+    g_array_set_size(context->index_runs, 0);
+    context->index_truncated = FALSE;
+    if(! same_layout)
+	context->incr_valid = FALSE;
+
+    openLayoutLines(&cursor, context, context->layout);
+    do {
+	GSList *tmp_list;
+	indexLine entry;
+	int x;
+
+	logical_rect = cursor.line.logical_rect;
+	if(context->index_lines->len > 0
+	    && ((context->max_lines > 0
+		    && context->index_lines->len >= (guint)context->max_lines)
+		|| (context->max_height > 0
+		    && logical_rect.y + logical_rect.height
+			- g_array_index(context->index_lines, indexLine, 0).y
+			> context->max_height * PANGO_SCALE)))
+	{
+	    context->index_truncated = TRUE;
+	    break;
+	}
+
+	entry.x = logical_rect.x;
+	entry.y = logical_rect.y;
+	entry.width = logical_rect.width;
+	entry.height = logical_rect.height;
+	entry.baseline = cursor.line.baseline;
+	entry.start_index = cursor.line.start_index;
+	entry.length = cursor.line.length;
+	entry.runs = cursor.line.runs;
+	entry.first_run = context->index_runs->len;
+
+	x = logical_rect.x;
+	for(tmp_list = cursor.line.runs; tmp_list; tmp_list = tmp_list->next) {
+	    indexRun run;
+
+	    run.run = tmp_list->data;
+	    pango_glyph_string_extents (run.run->glyphs,
+		run.run->item->analysis.font, NULL, &logical_rect);
+	    run.x = x;
+	    run.width = logical_rect.width;
+	    g_array_append_val(context->index_runs, run);
+	    x += logical_rect.width;
+	}
+
+	entry.n_runs = context->index_runs->len - entry.first_run;
+	g_array_append_val(context->index_lines, entry);
+    } while (nextLine(&cursor));
+    closeLines(&cursor);
+
+    /* The arrays only grow past their largest size so far. */
+    if(context->index_lines->len > context->index_lines_peak) {
+	context->index_lines_peak = context->index_lines->len;
+	context->buffer_growths++;
+    }
+    if(context->index_runs->len > context->index_runs_peak) {
+	context->index_runs_peak = context->index_runs->len;
+	context->buffer_growths++;
+    }
+
+#if PANGO_VERSION_CHECK(1, 32, 4)
+    context->index_serial = pango_layout_get_serial (context->layout);
+#endif
+    context->index_valid = TRUE;
+}
+
+/*!
+    Find the line at a vertical position.
+
+    @param *context [in] Context with a valid index
+    @param y [in] Y in Pango units
+    @return Index of the line, clamped to the first and last lines
+*/
+static int
+findLineAtY(
+    SDLPangoDraw_Context *context,
+    int y)
+{
+    int lo = 0;
+    int hi = context->index_lines->len - 1;
+
+    while(lo < hi) {
+	int mid = (lo + hi + 1) / 2;
+
+	if(g_array_index(context->index_lines, indexLine, mid).y <= y)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    return lo;
+}
+
+/*!
+    Find the line containing a byte index.
+
+    @param *context [in] Context with a valid index
+    @param index [in] Byte index
+    @return Index of the line, clamped to the first and last lines
+*/
+static int
+findLineAtIndex(
+    SDLPangoDraw_Context *context,
+    int index)
+{
+    int lo = 0;
+    int hi = context->index_lines->len - 1;
+
+    while(lo < hi) {
+	int mid = (lo + hi + 1) / 2;
+
+	if(g_array_index(context->index_lines, indexLine, mid).start_index <= index)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    return lo;
+}
+
+/*!
+    Find the character at a point of the layout.
+    The point is relative to the left-top of the layout, that is, to the
+    x and y given to SDLPangoDraw_Draw.
+    The lookup takes O(log n) time in the number of lines; the index it uses
+    is rebuilt after the text or the layout settings change.
+
+    @param *context [in] Context
+    @param x [in] X in pixels
+    @param y [in] Y in pixels
+    @param *index [out] Byte index of the nearest character. May be NULL.
+    @param *trailing [out] Non-zero if the point is in the trailing half of
+	the character. May be NULL.
+    @return non-zero if the point is inside the text
+*/
+int
+SDLPangoDraw_HitTest(
+    SDLPangoDraw_Context *context,
+    int x, int y,
+    int *index,
+    int *trailing)
+{
+    const indexLine *line;
+    const indexRun *runs;
+    const indexRun *run;
+    int lo, hi;
+    int char_index, char_trailing;
+    int inside;
+
+    buildLineIndex(context);
+
+    x *= PANGO_SCALE;
+    y *= PANGO_SCALE;
+
+    line = &g_array_index(context->index_lines, indexLine,
+	findLineAtY(context, y));
+    inside = y >= line->y && y < line->y + line->height
+	&& x >= line->x && x < line->x + line->width;
+
+    if(line->n_runs == 0) {
+	char_index = line->start_index;
+	char_trailing = 0;
+    } else {
+	runs = &g_array_index(context->index_runs, indexRun, line->first_run);
+	lo = 0;
+	hi = line->n_runs - 1;
+	while(lo < hi) {
+	    int mid = (lo + hi + 1) / 2;
+
+	    if(runs[mid].x <= x)
+		lo = mid;
+	    else
+		hi = mid - 1;
+	}
+	run = &runs[lo];
+
+	pango_glyph_string_x_to_index(run->run->glyphs,
+	    (char *)pango_layout_get_text (context->layout) + run->run->item->offset,
+	    run->run->item->length,
+	    &run->run->item->analysis,
+	    CLAMP(x - run->x, 0, run->width - 1),
+	    &char_index, &char_trailing);
+	char_index += run->run->item->offset;
+    }
+
+    if(index)
+	*index = char_index;
+    if(trailing)
+	*trailing = char_trailing;
+
+    return inside;
+}
+
+/*!
+    Get the rect of a character of the layout.
+    The rect is relative to the left-top of the layout.
+    The rect is returned in ints rather than an SDL_Rect, whose fields are
+    16 bits in SDL 1.2 and too small for long layouts.
+
+    @param *context [in] Context
+    @param index [in] Byte index of the character
+    @param *x [out] X of the rect
+    @param *y [out] Y of the rect
+    @param *w [out] Width of the rect. It is zero at the end of a line.
+    @param *h [out] Height of the rect
+    @return non-zero if index is in the text
+*/
+int
+SDLPangoDraw_GetCharRect(
+    SDLPangoDraw_Context *context,
+    int index,
+    int *x, int *y,
+    int *w, int *h)
+{
+    const indexLine *line;
+    const indexRun *runs;
+    int left, right;
+    int i;
+
+    buildLineIndex(context);
+
+    line = &g_array_index(context->index_lines, indexLine,
+	context->index_lines->len - 1);
+    if(index < 0 || index > line->start_index + line->length)
+	return 0;
+
+    line = &g_array_index(context->index_lines, indexLine,
+	findLineAtIndex(context, index));
+
+    left = right = line->x + line->width;
+    runs = &g_array_index(context->index_runs, indexRun, line->first_run);
+    for(i = 0; i < line->n_runs; i++) {
+	PangoItem *item = runs[i].run->item;
+	int x0, x1;
+
+	if(index < item->offset || index >= item->offset + item->length)
+	    continue;
+
+	pango_glyph_string_index_to_x(runs[i].run->glyphs,
+	    (char *)pango_layout_get_text (context->layout) + item->offset,
+	    item->length, &item->analysis,
+	    index - item->offset, FALSE, &x0);
+	pango_glyph_string_index_to_x(runs[i].run->glyphs,
+	    (char *)pango_layout_get_text (context->layout) + item->offset,
+	    item->length, &item->analysis,
+	    index - item->offset, TRUE, &x1);
+	left = runs[i].x + MIN(x0, x1);
+	right = runs[i].x + MAX(x0, x1);
+	break;
+    }
+
+    *x = PANGO_PIXELS (left);
+    *y = PANGO_PIXELS (line->y);
+    *w = PANGO_PIXELS (right) - PANGO_PIXELS (left);
+    *h = PANGO_PIXELS (line->y + line->height) - PANGO_PIXELS (line->y);
+
+    return 1;
+}
+
+#define DEFAULT_PAGE_WIDTH 640
+#define DEFAULT_PAGE_HEIGHT 480
+#define DEFAULT_PAGE_CACHE 4
+#define MAX_PARAGRAPH_LENGTH (64 * 1024)
+#define READ_CHUNK 4096
+#define MAX_CACHED_PARAGRAPHS 256
+
+/*!
+    Location of a paragraph in the document source.
+*/
+typedef struct _docParagraph {
+    int offset;	    /*!< Byte offset in the source */
+    int length;	    /*!< Length in bytes, without the line terminator */
+    int y;	    /*!< Top in pixels, once measured */
+    int height;	    /*!< Height in pixels, once measured */
+    PangoLayout *layout;    /*!< Cached layout, or NULL */
+} docParagraph;
+
+/*!
+    The first line of a page.
+*/
+typedef struct _docPageStart {
+    int para;	    /*!< Index of the paragraph */
+    int line;	    /*!< Index of the line within the paragraph */
+} docPageStart;
+
+/*!
+    A laid out page kept in the page cache.
+*/
+typedef struct _docPage {
+    int index;		    /*!< Page number */
+    int n_layouts;	    /*!< Number of paragraphs on the page */
+    PangoLayout **layouts;  /*!< Layouts of the paragraphs, from the first */
+} docPage;
+
+typedef struct _documentImpl {
+    SDLPangoDraw_Context *context;
+
+    const char *text;		/* source buffer, or NULL */
+    int text_length;
+    GString *buffer;		/* owned source of editable documents */
+    SDLPangoDraw_ReadFunc read;	/* source callback, or NULL */
+    void *userdata;
+    char *read_buf;		/* text fetched through the callback */
+    int read_buf_size;
+
+    int page_width;
+    int page_height;
+
+    GArray *paragraphs;		/* docParagraph, in source order */
+    int scan_offset;		/* where the next paragraph starts */
+    gboolean scan_done;
+    int measured;		/* paragraphs with a known y and height */
+    int n_cached;		/* paragraphs with a cached layout */
+
+    GArray *pages;		/* docPageStart, one per known page */
+    int pag_para;		/* next paragraph to paginate */
+    int pag_y;			/* height used on the last page */
+    gboolean pag_open;		/* the last page is in pages */
+    gboolean pag_done;
+    GPtrArray *pag_layouts;	/* layouts on the last page so far */
+
+    GQueue cache;		/* docPage, most recently used first */
+    int cache_pages;
+} documentImpl;
+
+static void freeDocPage(docPage *page);
+
+static void resetPagination(SDLPangoDraw_Document *doc);
+
+static void releaseParagraphLayouts(
+    SDLPangoDraw_Document *doc,
+    int keep_first, int keep_last);
+
+/*!
+    Count the bytes of an incomplete UTF-8 sequence at the end of text.
+    Paragraphs longer than MAX_PARAGRAPH_LENGTH are split, and each piece
+    must end on a character boundary.
+
+    @param *text [in] Text
+    @param length [in] Length of the text
+    @return Number of bytes to drop from the end
+*/
+static int
+incompleteUTF8Tail(
+    const char *text,
+    int length)
+{
+    int i;
+
+    for(i = 1; i <= 4 && i <= length; i++) {
+	unsigned char c = (unsigned char)text[length - i];
+
+	if((c & 0xC0) != 0x80) {
+	    int need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+	    return need > i ? i : 0;
+	}
+    }
+    return 0;
+}
+
+/*!
+    Find the next paragraph in the source.
+
+    @param *doc [i/o] Document
+    @return FALSE at the end of the source
+*/
+static gboolean
+scanParagraph(
+    SDLPangoDraw_Document *doc)
+{
+    docParagraph para;
+    int length = 0;
+    gboolean found_eol = FALSE;
+
+    if(doc->scan_done)
+	return FALSE;
+
+    para.offset = doc->scan_offset;
+
+    if(doc->read) {
+	char chunk[READ_CHUNK];
+
+	while(length < MAX_PARAGRAPH_LENGTH && ! found_eol) {
+	    int want = MIN(READ_CHUNK, MAX_PARAGRAPH_LENGTH - length);
+	    int got = doc->read(doc->userdata, para.offset + length, chunk, want);
+	    char *eol;
+
+	    if(got <= 0)
+		break;
+	    eol = memchr(chunk, '\n', got);
+	    if(eol) {
+		length += eol - chunk;
+		found_eol = TRUE;
+	    } else {
+		length += got;
+		if(length == MAX_PARAGRAPH_LENGTH) {
+		    length -= incompleteUTF8Tail(chunk, got);
+		    break;
+		}
+	    }
+	}
+	if(length == 0 && ! found_eol) {
+	    doc->scan_done = TRUE;
+	    return FALSE;
+	}
+    } else {
+	const char *start = doc->text + para.offset;
+	int rest = doc->text_length - para.offset;
+	const char *eol;
+
+	if(rest <= 0) {
+	    doc->scan_done = TRUE;
+	    return FALSE;
+	}
+	eol = memchr(start, '\n', MIN(rest, MAX_PARAGRAPH_LENGTH));
+	if(eol) {
+	    length = eol - start;
+	    found_eol = TRUE;
+	} else if(rest > MAX_PARAGRAPH_LENGTH) {
+	    length = MAX_PARAGRAPH_LENGTH;
+	    length -= incompleteUTF8Tail(start, length);
+	} else {
+	    length = rest;
+	}
+    }
+
+    doc->scan_offset = para.offset + length + (found_eol ? 1 : 0);
+    para.length = length;
+    para.y = 0;
+    para.height = 0;
+    para.layout = NULL;
+    g_array_append_val(doc->paragraphs, para);
+
+    return TRUE;
+}
+
+/*!
+    Get the text of a paragraph.
+    Text read through the callback stays valid until the next call.
+
+    @param *doc [i/o] Document
+    @param index [in] Paragraph index
+    @param *length [out] Length of the text
+    @return The text
+*/
+static const char *
+fetchParagraph(
+    SDLPangoDraw_Document *doc,
+    int index,
+    int *length)
+{
+    docParagraph *para = &g_array_index(doc->paragraphs, docParagraph, index);
+    const char *text;
+    int len = para->length;
+
+    if(doc->read) {
+	int done = 0;
+
+	if(doc->read_buf_size < len) {
+	    g_free(doc->read_buf);
+	    doc->read_buf = g_malloc(len);
+	    doc->read_buf_size = len;
+	}
+	while(done < len) {
+	    int got = doc->read(doc->userdata, para->offset + done,
+		doc->read_buf + done, len - done);
+	    if(got <= 0)
+		break;
+	    done += got;
+	}
+	text = doc->read_buf;
+	len = done;
+    } else {
+	text = doc->text + para->offset;
+    }
+
+    if(len > 0 && text[len - 1] == '\r')
+	len--;
+
+    *length = len;
+    return text;
+}
+
+/*!
+    Lay out a paragraph with the settings of the document's context.
+
+    @param *doc [i/o] Document
+    @param index [in] Paragraph index
+    @return A new layout
+*/
+static PangoLayout *
+layoutParagraph(
+    SDLPangoDraw_Document *doc,
+    int index)
+{
+    PangoLayout *layout;
+    const char *text;
+    int length;
+
+    text = fetchParagraph(doc, index, &length);
+
+    layout = pango_layout_new (doc->context->context);
+    pango_layout_set_width (layout,
+	doc->page_width > 0 ? doc->page_width * PANGO_SCALE : -1);
+    pango_layout_set_font_description (layout, doc->context->font_desc);
+    pango_layout_set_auto_dir (layout, TRUE);
+    pango_layout_set_text (layout, text, length);
+
+    return layout;
+}
+
+/*!
+    Put a page into the page cache, evicting the least recently used pages.
+
+    @param *doc [i/o] Document
+    @param *page [in] Page to cache
+*/
+static void
+cacheDocPage(
+    SDLPangoDraw_Document *doc,
+    docPage *page)
+{
+    g_queue_push_head(&doc->cache, page);
+    while((int)doc->cache.length > doc->cache_pages)
+	freeDocPage(g_queue_pop_tail(&doc->cache));
+}
+
+/*!
+    Close the page being paginated and hand its layouts to the page cache.
+
+    @param *doc [i/o] Document
+*/
+static void
+finishPaginatedPage(
+    SDLPangoDraw_Document *doc)
+{
+    docPage *page;
+
+    if(doc->pag_layouts->len == 0)
+	return;
+
+    page = g_new(docPage, 1);
+    page->index = doc->pages->len - 1;
+    page->n_layouts = doc->pag_layouts->len;
+    page->layouts = (PangoLayout **)g_ptr_array_free(doc->pag_layouts, FALSE);
+    doc->pag_layouts = g_ptr_array_new();
+
+    cacheDocPage(doc, page);
+}
+
+/*!
+    Paginate one more paragraph.
+
+    @param *doc [i/o] Document
+    @return FALSE at the end of the document
+*/
+static gboolean
+paginateParagraph(
+    SDLPangoDraw_Document *doc)
+{
+    PangoLayout *layout;
+    PangoLayoutIter *iter;
+    PangoRectangle logical_rect;
+    int para = doc->pag_para;
+    int line = 0;
+    int first_line = 0;
+    int para_top = 0;
+    int bottom = 0;
+
+    if(doc->pag_done)
+	return FALSE;
+
+    if(para >= (int)doc->paragraphs->len && ! scanParagraph(doc)) {
+	doc->pag_done = TRUE;
+	finishPaginatedPage(doc);
+	return FALSE;
+    }
+
+    if(! doc->pag_open) {
+	docPageStart start;
+
+	start.para = para;
+	start.line = 0;
+	g_array_append_val(doc->pages, start);
+	doc->pag_open = TRUE;
+    }
+
+    layout = layoutParagraph(doc, para);
+    g_ptr_array_add(doc->pag_layouts, layout);
+
+    iter = pango_layout_get_iter (layout);
+    do {
+	int top;
+
+	pango_layout_iter_get_line_extents (iter, NULL, &logical_rect);
+	top = PANGO_PIXELS (logical_rect.y);
+	bottom = PANGO_PIXELS (logical_rect.y + logical_rect.height);
+	if(line == 0)
+	    para_top = top;
+
+	/* Start a new page unless this line is the first one on its page. */
+	if(doc->pag_y + (bottom - para_top) > doc->page_height
+	    && (doc->pag_y > 0 || line > first_line))
+	{
+	    docPageStart start;
+
+	    finishPaginatedPage(doc);
+	    g_ptr_array_add(doc->pag_layouts, g_object_ref(layout));
+
+	    start.para = para;
+	    start.line = line;
+	    g_array_append_val(doc->pages, start);
+	    doc->pag_y = 0;
+	    para_top = top;
+	    first_line = line;
+	}
+	line++;
+    } while (pango_layout_iter_next_line (iter));
+    pango_layout_iter_free (iter);
+
+    doc->pag_y += bottom - para_top;
+    doc->pag_para = para + 1;
+
+    return TRUE;
+}
+
+/*!
+    Paginate until the given page is known and complete.
+
+    @param *doc [i/o] Document
+    @param page [in] Page number
+    @return FALSE if the document has no such page
+*/
+static gboolean
+paginateTo(
+    SDLPangoDraw_Document *doc,
+    int page)
+{
+    while((int)doc->pages->len <= page + 1 && paginateParagraph(doc))
+	;
+
+    return page >= 0 && page < (int)doc->pages->len;
+}
+
+/*!
+    Get the last line (exclusive) of a page.
+
+    @param *doc [in] Document
+    @param page [in] Page number, which must be complete
+    @return Start of the next page, or the end of the document
+*/
+static docPageStart
+pageEnd(
+    SDLPangoDraw_Document *doc,
+    int page)
+{
+    docPageStart end;
+
+    if(page + 1 < (int)doc->pages->len)
+	return g_array_index(doc->pages, docPageStart, page + 1);
+
+    end.para = doc->paragraphs->len;
+    end.line = 0;
+    return end;
+}
+
+/*!
+    Get a page from the page cache, laying it out if necessary.
+
+    @param *doc [i/o] Document
+    @param index [in] Page number
+    @return The page, or NULL if the document has no such page
+*/
+static docPage *
+getDocPage(
+    SDLPangoDraw_Document *doc,
+    int index)
+{
+    docPageStart start, end;
+    docPage *page;
+    GList *link;
+    int i;
+
+    if(! paginateTo(doc, index))
+	return NULL;
+
+    for(link = doc->cache.head; link; link = link->next) {
+	page = link->data;
+	if(page->index == index) {
+	    g_queue_unlink(&doc->cache, link);
+	    g_queue_push_head_link(&doc->cache, link);
+	    return page;
+	}
+    }
+
+    start = g_array_index(doc->pages, docPageStart, index);
+    end = pageEnd(doc, index);
+
+    page = g_new(docPage, 1);
+    page->index = index;
+    page->n_layouts = (end.line > 0 ? end.para + 1 : end.para) - start.para;
+    page->layouts = g_new(PangoLayout *, page->n_layouts);
+    for(i = 0; i < page->n_layouts; i++)
+	page->layouts[i] = layoutParagraph(doc, start.para + i);
+
+    cacheDocPage(doc, page);
+    return page;
+}
+
+/*!
+    Free a cached page.
+
+    @param *page [i/o] Page
+*/
+static void
+freeDocPage(
+    docPage *page)
+{
+    int i;
+
+    for(i = 0; i < page->n_layouts; i++)
+	g_object_unref(page->layouts[i]);
+    g_free(page->layouts);
+    g_free(page);
+}
+
+/*!
+    Forget all pages, for example after the page size changed.
+
+    @param *doc [i/o] Document
+*/
+static void
+resetPagination(
+    SDLPangoDraw_Document *doc)
+{
+    guint i;
+
+    while(! g_queue_is_empty(&doc->cache))
+	freeDocPage(g_queue_pop_head(&doc->cache));
+
+    for(i = 0; i < doc->pag_layouts->len; i++)
+	g_object_unref(g_ptr_array_index(doc->pag_layouts, i));
+    g_ptr_array_set_size(doc->pag_layouts, 0);
+
+    g_array_set_size(doc->pages, 0);
+    doc->pag_para = 0;
+    doc->pag_y = 0;
+    doc->pag_open = FALSE;
+    doc->pag_done = FALSE;
+}
+
+/*!
+    Create a document from a text buffer.
+    A document renders large plain text page by page.
+    Paragraphs (separated by newlines) are laid out lazily with the font,
+    language, DPI and colors of the context, and only a few laid out pages
+    are kept in memory.
+
+    The buffer is not copied; it must stay valid and unchanged until the
+    document is freed.
+    The context must outlive the document.
+
+    @param *context [in] Context
+    @param *text [in] The text (must be in UTF-8).
+    @param length [in] Text length. -1 means NULL-terminated text.
+    @return A new document
+*/
+SDLPangoDraw_Document*
+SDLPangoDraw_CreateDocument(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length)
+{
+    SDLPangoDraw_Document *doc = g_new0(SDLPangoDraw_Document, 1);
+
+    doc->context = context;
+    doc->text = text;
+    doc->text_length = length < 0 ? (int)strlen(text) : length;
+
+    doc->page_width = context->min_width > 0 ? context->min_width : DEFAULT_PAGE_WIDTH;
+    doc->page_height = context->min_height > 0 ? context->min_height : DEFAULT_PAGE_HEIGHT;
+
+    doc->paragraphs = g_array_new(FALSE, FALSE, sizeof(docParagraph));
+    doc->pages = g_array_new(FALSE, FALSE, sizeof(docPageStart));
+    doc->pag_layouts = g_ptr_array_new();
+    g_queue_init(&doc->cache);
+    doc->cache_pages = DEFAULT_PAGE_CACHE;
+
+    return doc;
+}
+
+/*!
+    Create a document whose text is fetched through a callback.
+    The callback is called with an offset and must fill the buffer with the
+    text starting at that offset, so the text never has to be in memory as
+    a whole.
+    The same range may be requested more than once.
+
+    @param *context [in] Context
+    @param read [in] Callback to read the text (must be in UTF-8).
+    @param *userdata [in] Passed to the callback
+    @return A new document
+*/
+SDLPangoDraw_Document*
+SDLPangoDraw_CreateDocument_GivenReadFunc(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_ReadFunc read,
+    void *userdata)
+{
+    SDLPangoDraw_Document *doc = SDLPangoDraw_CreateDocument(context, "", 0);
+
+    doc->text = NULL;
+    doc->read = read;
+    doc->userdata = userdata;
+
+    return doc;
+}
+
+/*!
+    Free a document.
+
+    @param *doc [i/o] Document to be free
+*/
+void
+SDLPangoDraw_FreeDocument(
+    SDLPangoDraw_Document *doc)
+{
+    resetPagination(doc);
+    releaseParagraphLayouts(doc, 0, -1);
+    if(doc->buffer)
+	g_string_free(doc->buffer, TRUE);
+
+    g_ptr_array_free(doc->pag_layouts, TRUE);
+    g_array_free(doc->pages, TRUE);
+    g_array_free(doc->paragraphs, TRUE);
+    g_free(doc->read_buf);
+    g_free(doc);
+}
+
+/*!
+    Specify the page size of a document.
+    Text is wrapped at the page width.
+    The default is the minimum size of the context, or 640 X 480.
+
+    @param *doc [i/o] Document
+    @param width [in] Width. zero/minus value means no wrapping.
+    @param height [in] Height. Must be positive.
+*/
+void
+SDLPangoDraw_SetDocumentPageSize(
+    SDLPangoDraw_Document *doc,
+    int width, int height)
+{
+    if(height <= 0) {
+	SDL_SetError("page height must be positive");
+	return;
+    }
+
+    doc->page_width = width;
+    doc->page_height = height;
+    resetPagination(doc);
+    releaseParagraphLayouts(doc, 0, -1);
+    doc->measured = 0;
+}
+
+/*!
+    Specify how many laid out pages a document keeps in memory.
+    The default is 4.
+
+    @param *doc [i/o] Document
+    @param pages [in] Number of pages. At least 1.
+*/
+void
+SDLPangoDraw_SetDocumentCacheSize(
+    SDLPangoDraw_Document *doc,
+    int pages)
+{
+    doc->cache_pages = MAX(1, pages);
+    while((int)doc->cache.length > doc->cache_pages)
+	freeDocPage(g_queue_pop_tail(&doc->cache));
+}
+
+/*!
+    Query whether a page exists.
+    Only the pages up to the given one are laid out.
+
+    @param *doc [i/o] Document
+    @param page [in] Page number, from 0
+    @return non-zero if the page exists
+*/
+int
+SDLPangoDraw_HasDocumentPage(
+    SDLPangoDraw_Document *doc,
+    int page)
+{
+    return paginateTo(doc, page);
+}
+
+/*!
+    Get the number of pages.
+    This lays out the whole document once.
+
+    @param *doc [i/o] Document
+    @return Number of pages
+*/
+int
+SDLPangoDraw_GetDocumentPageCount(
+    SDLPangoDraw_Document *doc)
+{
+    while(paginateParagraph(doc))
+	;
+
+    return doc->pages->len;
+}
+
+/*!
+    Draw a page of a document on an existing surface.
+
+    @param *doc [i/o] Document
+    @param page [in] Page number, from 0
+    @param *surface [i/o] Surface to draw on
+    @param x [in] X of left-top of drawing area
+    @param y [in] Y of left-top of drawing area
+*/
+void
+SDLPangoDraw_DrawDocumentPage(
+    SDLPangoDraw_Document *doc,
+    int page,
+    SDL_Surface *surface,
+    int x, int y)
+{
+    docPage *cached;
+    docPageStart start, end;
+    int i;
+
+    if(! surface) {
+	SDL_SetError("surface is NULL");
+	return;
+    }
+
+    cached = getDocPage(doc, page);
+    if(! cached) {
+	SDL_SetError("page does not exist");
+	return;
+    }
+
+    SDL_FillRect(surface, NULL, SDL_MapRGBA(surface->format, 0, 0, 0, 0));
+
+    start = g_array_index(doc->pages, docPageStart, page);
+    end = pageEnd(doc, page);
+
+    for(i = 0; i < cached->n_layouts; i++) {
+	int para = start.para + i;
+	int first = para == start.para ? start.line : 0;
+	int count = para == end.para ? end.line - first : -1;
+
+	y += drawLayoutLines(doc->context, surface, cached->layouts[i],
+	    x, y, first, count);
+    }
+}
+
+/*!
+    Get the layout of a paragraph, from the paragraph cache if possible.
+    The returned layout is owned by the cache.
+
+    @param *doc [i/o] Document
+    @param index [in] Paragraph index
+    @return The layout
+*/
+static PangoLayout *
+getParagraphLayout(
+    SDLPangoDraw_Document *doc,
+    int index)
+{
+    docParagraph *para = &g_array_index(doc->paragraphs, docParagraph, index);
+
+    if(! para->layout) {
+	PangoLayout *layout = layoutParagraph(doc, index);
+
+	para = &g_array_index(doc->paragraphs, docParagraph, index);
+	para->layout = layout;
+	doc->n_cached++;
+    }
+    return para->layout;
+}
+
+/*!
+    Drop cached paragraph layouts outside a range of paragraphs.
+
+    @param *doc [i/o] Document
+    @param keep_first [in] First paragraph to keep
+    @param keep_last [in] Last paragraph to keep. -1 drops everything.
+*/
+static void
+releaseParagraphLayouts(
+    SDLPangoDraw_Document *doc,
+    int keep_first, int keep_last)
+{
+    guint i;
+
+    for(i = 0; i < doc->paragraphs->len && doc->n_cached > 0; i++) {
+	docParagraph *para = &g_array_index(doc->paragraphs, docParagraph, i);
+
+	if(para->layout && ((int)i < keep_first || (int)i > keep_last)) {
+	    g_object_unref(para->layout);
+	    para->layout = NULL;
+	    doc->n_cached--;
+	}
+    }
+}
+
+/*!
+    Get the height in pixels of a laid out paragraph.
+
+    @param *layout [in] Layout of the paragraph
+    @return Height
+*/
+static int
+paragraphHeight(
+    PangoLayout *layout)
+{
+    PangoRectangle logical_rect;
+
+    pango_layout_get_extents (layout, NULL, &logical_rect);
+
+    return PANGO_PIXELS (logical_rect.y + logical_rect.height)
+	- PANGO_PIXELS (logical_rect.y);
+}
+
+/*!
+    Measure paragraphs until the given one has a known y and height, or
+    until the given y is reached.
+    Measuring does not keep the layouts, unless they were cached already.
+
+    @param *doc [i/o] Document
+    @param index [in] Paragraph index. -1 means no limit.
+    @param y [in] Y in pixels. -1 means no limit.
+*/
+static void
+measureParagraphs(
+    SDLPangoDraw_Document *doc,
+    int index, int y)
+{
+    while(index < 0 || doc->measured <= index) {
+	docParagraph *para;
+	int top = 0;
+
+	if(doc->measured > 0) {
+	    para = &g_array_index(doc->paragraphs, docParagraph, doc->measured - 1);
+	    top = para->y + para->height;
+	    if(y >= 0 && top > y)
+		break;
+	}
+	if(doc->measured >= (int)doc->paragraphs->len && ! scanParagraph(doc))
+	    break;
+
+	para = &g_array_index(doc->paragraphs, docParagraph, doc->measured);
+	if(para->layout) {
+	    para->height = paragraphHeight(para->layout);
+	} else {
+	    PangoLayout *layout = layoutParagraph(doc, doc->measured);
+
+	    para = &g_array_index(doc->paragraphs, docParagraph, doc->measured);
+	    para->height = paragraphHeight(layout);
+	    g_object_unref(layout);
+	}
+	para->y = top;
+	doc->measured++;
+    }
+}
+
+/*!
+    Find the measured paragraph at a vertical position.
+
+    @param *doc [in] Document with at least one measured paragraph
+    @param y [in] Y in pixels
+    @return Paragraph index, clamped to the measured paragraphs
+*/
+static int
+findParagraphAtY(
+    SDLPangoDraw_Document *doc,
+    int y)
+{
+    int lo = 0;
+    int hi = doc->measured - 1;
+
+    while(lo < hi) {
+	int mid = (lo + hi + 1) / 2;
+
+	if(g_array_index(doc->paragraphs, docParagraph, mid).y <= y)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    return lo;
+}
+
+/*!
+    Find the paragraph containing a byte offset.
+
+    @param *doc [in] Document with at least one paragraph
+    @param offset [in] Byte offset
+    @return Paragraph index
+*/
+static int
+findParagraphAtOffset(
+    SDLPangoDraw_Document *doc,
+    int offset)
+{
+    int lo = 0;
+    int hi = doc->paragraphs->len - 1;
+
+    while(lo < hi) {
+	int mid = (lo + hi + 1) / 2;
+
+	if(g_array_index(doc->paragraphs, docParagraph, mid).offset <= offset)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    return lo;
+}
+
+/*!
+    Forget the pages from the one containing a paragraph onwards.
+    Pagination restarts from the last page that begins with a paragraph
+    before that one.
+
+    @param *doc [i/o] Document
+    @param para [in] First paragraph that changed
+*/
+static void
+truncatePagination(
+    SDLPangoDraw_Document *doc,
+    int para)
+{
+    GList *link;
+    guint i;
+    int keep = 0;
+
+    for(i = doc->pages->len; i > 0; i--) {
+	docPageStart *start = &g_array_index(doc->pages, docPageStart, i - 1);
+
+	if(start->line == 0 && start->para <= para) {
+	    keep = i - 1;
+	    break;
+	}
+    }
+    if(keep >= (int)doc->pages->len)
+	return;
+
+    for(link = doc->cache.head; link; ) {
+	GList *next = link->next;
+	docPage *page = link->data;
+
+	if(page->index >= keep) {
+	    g_queue_unlink(&doc->cache, link);
+	    g_list_free(link);
+	    freeDocPage(page);
+	}
+	link = next;
+    }
+
+    for(i = 0; i < doc->pag_layouts->len; i++)
+	g_object_unref(g_ptr_array_index(doc->pag_layouts, i));
+    g_ptr_array_set_size(doc->pag_layouts, 0);
+
+    doc->pag_para = g_array_index(doc->pages, docPageStart, keep).para;
+    g_array_set_size(doc->pages, keep);
+    doc->pag_y = 0;
+    doc->pag_open = FALSE;
+    doc->pag_done = FALSE;
+}
+
+/*!
+    Create an editable document.
+    Unlike SDLPangoDraw_CreateDocument, the text is copied, and it can be
+    changed with SDLPangoDraw_ReplaceDocumentText.
+
+    @param *context [in] Context
+    @param *text [in] The text (must be in UTF-8).
+    @param length [in] Text length. -1 means NULL-terminated text.
+    @return A new document
+*/
+SDLPangoDraw_Document*
+SDLPangoDraw_CreateEditableDocument(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length)
+{
+    SDLPangoDraw_Document *doc = SDLPangoDraw_CreateDocument(context, "", 0);
+
+    if(length < 0)
+	length = strlen(text);
+    doc->buffer = g_string_new_len(text, length);
+    doc->text = doc->buffer->str;
+    doc->text_length = doc->buffer->len;
+
+    /* Editing needs the paragraph table of the whole text. */
+    while(scanParagraph(doc))
+	;
+
+    return doc;
+}
+
+/*!
+    Replace a range of the text of an editable document.
+    Only the paragraphs touched by the edit are laid out again; the
+    paragraphs after them are just moved. An edit below the part of the
+    document measured so far lays out nothing, since nothing there has
+    been drawn; the edited paragraphs are measured when they are reached.
+    The vertical band of the document that must be drawn again (see
+    SDLPangoDraw_DrawDocumentBand) is reported. When the height of the
+    edited paragraphs changes, the band extends to the end of the part of the
+    document measured so far, which includes everything drawn before, since
+    everything below has moved.
+
+    @param *doc [i/o] Document
+    @param start [in] Byte offset of the range to replace
+    @param end [in] Byte offset of the end of the range (exclusive)
+    @param *text [in] Replacement text (must be in UTF-8). May be empty.
+    @param length [in] Text length. -1 means NULL-terminated text.
+    @param *band_y [out] Top of the changed band in pixels. May be NULL.
+    @param *band_h [out] Height of the changed band in pixels. May be NULL.
+    @return 0 on success, -1 on error
+*/
+int
+SDLPangoDraw_ReplaceDocumentText(
+    SDLPangoDraw_Document *doc,
+    int start, int end,
+    const char *text,
+    int length,
+    int *band_y,
+    int *band_h)
+{
+    GArray *fresh;
+    docParagraph *para;
+    int first, last, n_old;
+    int next_start, pos;
+    int delta, height_delta;
+    int old_top, old_bottom, old_height, new_bottom;
+    gboolean lazy;
+    int i;
+
+    if(! doc->buffer) {
+	SDL_SetError("document is not editable");
+	return -1;
+    }
+    if(start < 0 || start > end || end > (int)doc->buffer->len) {
+	SDL_SetError("range is out of the text");
+	return -1;
+    }
+    if(length < 0)
+	length = strlen(text);
+
+    /* Paragraphs touched by the edit, and their extents before it. */
+    if(doc->paragraphs->len == 0) {
+	first = 0;
+	last = -1;
+    } else {
+	first = findParagraphAtOffset(doc, start);
+	last = findParagraphAtOffset(doc, end);
+    }
+    /* Everything before a measured paragraph is measured, so this lays
+       out the touched paragraphs only. */
+    lazy = doc->paragraphs->len > 0 && first >= doc->measured;
+    if(! lazy)
+	measureParagraphs(doc, last, -1);
+    old_top = 0;
+    old_bottom = 0;
+    old_height = 0;
+    if(doc->measured > 0) {
+	para = &g_array_index(doc->paragraphs, docParagraph, doc->measured - 1);
+	old_height = para->y + para->height;
+    }
+    if(last >= first && ! lazy) {
+	old_top = g_array_index(doc->paragraphs, docParagraph, first).y;
+	para = &g_array_index(doc->paragraphs, docParagraph, last);
+	old_bottom = para->y + para->height;
+    }
+
+    g_string_erase(doc->buffer, start, end - start);
+    g_string_insert_len(doc->buffer, start, text, length);
+    doc->text = doc->buffer->str;
+    doc->text_length = doc->buffer->len;
+    delta = length - (end - start);
+
+    /* Scan the edited text again, until it is back in step with the
+       paragraphs after the edit. */
+    fresh = g_array_new(FALSE, FALSE, sizeof(docParagraph));
+    pos = last >= first ? g_array_index(doc->paragraphs, docParagraph, first).offset : 0;
+    for(;;) {
+	next_start = last + 1 < (int)doc->paragraphs->len
+	    ? g_array_index(doc->paragraphs, docParagraph, last + 1).offset + delta
+	    : doc->text_length + 1;
+	while(pos < next_start && pos < doc->text_length) {
+	    const char *eol;
+	    docParagraph piece;
+	    int rest = doc->text_length - pos;
+
+	    eol = memchr(doc->text + pos, '\n', MIN(rest, MAX_PARAGRAPH_LENGTH));
+	    piece.offset = pos;
+	    if(eol) {
+		piece.length = eol - (doc->text + pos);
+	    } else if(rest > MAX_PARAGRAPH_LENGTH) {
+		piece.length = MAX_PARAGRAPH_LENGTH
+		    - incompleteUTF8Tail(doc->text + pos, MAX_PARAGRAPH_LENGTH);
+	    } else {
+		piece.length = rest;
+	    }
+	    piece.y = 0;
+	    piece.height = 0;
+	    piece.layout = NULL;
+	    g_array_append_val(fresh, piece);
+	    pos += piece.length + (eol ? 1 : 0);
+	}
+	if(pos <= next_start || last + 1 >= (int)doc->paragraphs->len)
+	    break;
+	/* The new text runs into the next paragraph; take it in, too. */
+	last++;
+	if(! lazy) {
+	    measureParagraphs(doc, last, -1);
+	    para = &g_array_index(doc->paragraphs, docParagraph, last);
+	    old_bottom = para->y + para->height;
+	}
+    }
+
+    /* Swap in the new paragraphs and lay them out. */
+    n_old = last - first + 1;
+    for(i = first; i <= last; i++) {
+	para = &g_array_index(doc->paragraphs, docParagraph, i);
+	if(para->layout) {
+	    g_object_unref(para->layout);
+	    doc->n_cached--;
+	}
+    }
+    g_array_remove_range(doc->paragraphs, first, n_old);
+    g_array_insert_vals(doc->paragraphs, first, fresh->data, fresh->len);
+
+    if(lazy) {
+	for(i = first + fresh->len; i < (int)doc->paragraphs->len; i++)
+	    g_array_index(doc->paragraphs, docParagraph, i).offset += delta;
+	truncatePagination(doc, first);
+	if(band_y)
+	    *band_y = old_height;
+	if(band_h)
+	    *band_h = 0;
+	g_array_free(fresh, TRUE);
+	return 0;
+    }
+
+    doc->measured += fresh->len - n_old;
+
+    new_bottom = old_top;
+    for(i = first; i < first + (int)fresh->len; i++) {
+	PangoLayout *layout = getParagraphLayout(doc, i);
+
+	para = &g_array_index(doc->paragraphs, docParagraph, i);
+	para->y = new_bottom;
+	para->height = paragraphHeight(layout);
+	new_bottom += para->height;
+    }
+    height_delta = new_bottom - old_bottom;
+
+    for(i = first + fresh->len; i < (int)doc->paragraphs->len; i++) {
+	para = &g_array_index(doc->paragraphs, docParagraph, i);
+	para->offset += delta;
+	para->y += height_delta;
+    }
+
+    truncatePagination(doc, first);
+
+    if(band_y)
+	*band_y = old_top;
+    if(band_h) {
+	if(height_delta == 0)
+	    *band_h = new_bottom - old_top;
+	else
+	    *band_h = MAX(old_height, old_height + height_delta) - old_top;
+    }
+
+    if(doc->n_cached > MAX_CACHED_PARAGRAPHS)
+	releaseParagraphLayouts(doc, first, first + fresh->len - 1);
+
+    g_array_free(fresh, TRUE);
+
+    return 0;
+}
+
+/*!
+    Get the height of the whole document, drawn continuously without pages.
+    This measures the whole document once.
+
+    @param *doc [i/o] Document
+    @return Height in pixels
+*/
+int
+SDLPangoDraw_GetDocumentHeight(
+    SDLPangoDraw_Document *doc)
+{
+    docParagraph *para;
+
+    measureParagraphs(doc, -1, -1);
+    if(doc->measured == 0)
+	return 0;
+
+    para = &g_array_index(doc->paragraphs, docParagraph, doc->measured - 1);
+    return para->y + para->height;
+}
+
+/*!
+    Draw a vertical band of the document, drawn continuously without pages.
+    The rows of the surface from y to y + band_h are cleared, and the lines
+    of the document between band_y and band_y + band_h are drawn there.
+    The layouts of the visible paragraphs are cached, so drawing the same
+    band again (for example after an edit) only lays out what changed.
+
+    @param *doc [i/o] Document
+    @param *surface [i/o] Surface to draw on
+    @param x [in] X of left of drawing area
+    @param y [in] Y of the surface where the band goes
+    @param band_y [in] Top of the band in the document, in pixels
+    @param band_h [in] Height of the band in pixels
+*/
+void
+SDLPangoDraw_DrawDocumentBand(
+    SDLPangoDraw_Document *doc,
+    SDL_Surface *surface,
+    int x, int y,
+    int band_y, int band_h)
+{
+    SDL_Rect clear_rect;
+    int first, i;
+
+    if(! surface) {
+	SDL_SetError("surface is NULL");
+	return;
+    }
+    if(band_h <= 0)
+	return;
+
+    if(y < surface->h && y + band_h > 0) {
+	clear_rect.x = 0;
+	clear_rect.y = MAX(y, 0);
+	clear_rect.w = surface->w;
+	clear_rect.h = MIN(y + band_h, surface->h) - clear_rect.y;
+	SDL_FillRect(surface, &clear_rect, SDL_MapRGBA(surface->format, 0, 0, 0, 0));
+    }
+
+    measureParagraphs(doc, -1, band_y + band_h);
+    if(doc->measured == 0)
+	return;
+
+    first = findParagraphAtY(doc, band_y);
+    for(i = first; i < doc->measured; i++) {
+	docParagraph *para = &g_array_index(doc->paragraphs, docParagraph, i);
+	PangoLayout *layout;
+	PangoLayoutIter *iter;
+	PangoRectangle logical_rect;
+	int line = 0;
+	int first_line = -1;
+	int n_lines = 0;
+	int first_top = 0;
+	int para_y = para->y;
+
+	if(para_y >= band_y + band_h)
+	    break;
+
+	layout = getParagraphLayout(doc, i);
+
+	/* Only the lines that meet the band are drawn. */
+	iter = pango_layout_get_iter (layout);
+	do {
+	    int top, bottom;
+
+	    pango_layout_iter_get_line_extents (iter, NULL, &logical_rect);
+	    top = para_y + PANGO_PIXELS (logical_rect.y);
+	    bottom = para_y + PANGO_PIXELS (logical_rect.y + logical_rect.height);
+	    if(bottom > band_y && top < band_y + band_h) {
+		if(first_line < 0) {
+		    first_line = line;
+		    first_top = top;
+		}
+		n_lines++;
+	    }
+	    line++;
+	} while (pango_layout_iter_next_line (iter));
+	pango_layout_iter_free (iter);
+
+	if(n_lines > 0)
+	    drawLayoutLines(doc->context, surface, layout,
+		x, y + first_top - band_y, first_line, n_lines);
+    }
+
+    if(doc->n_cached > MAX_CACHED_PARAGRAPHS)
+	releaseParagraphLayouts(doc, first, i - 1);
+}
+
+#define TEMPLATE_PLACEHOLDER "\xef\xbf\xbc"	/* U+FFFC OBJECT REPLACEMENT CHARACTER */
+#define TEMPLATE_PRESHAPED "0123456789 +-.,:/%"
+
+/*!
+    A glyph of the pre-shaped glyph set of a template.
+*/
+typedef struct _templateGlyph {
+    PangoFont *font;		/*!< Font of the glyph */
+    PangoGlyphInfo info;	/*!< The glyph and its advance */
+} templateGlyph;
+
+/*!
+    A named field of a template.
+    The coordinates are in pixels, relative to the left-top of the template.
+*/
+typedef struct _templateField {
+    char *name;
+    int index;			/*!< Byte index of the placeholder */
+    int chars;			/*!< Maximum number of characters */
+    gboolean left;		/*!< Left aligned, instead of right aligned */
+    int width;			/*!< Width in Pango units */
+    GArray *value;		/*!< templateGlyph, the current value */
+    int value_width;		/*!< Width of the value in Pango units */
+    gboolean dirty;		/*!< Changed since it was drawn */
+    SDL_Rect rect;		/*!< Where the field is drawn */
+    int baseline;		/*!< Baseline, from the top of the rect */
+} templateField;
+
+typedef struct _templateImpl {
+    SDLPangoDraw_Context *context;
+    PangoLayout *layout;
+    GArray *fields;		/* templateField, in text order */
+    GHashTable *glyphs;		/* templateGlyph by character */
+    PangoGlyphString *run;	/* scratch for drawing a field */
+} templateImpl;
+
+/*!
+    Get the glyph of a character from the glyph set of a template, shaping
+    it (through the shaped-run cache) the first time.
+
+    @param *tmpl [i/o] Template
+    @param c [in] Character
+    @return The glyph, or NULL if the character has no glyph
+*/
+static const templateGlyph *
+getTemplateGlyph(
+    SDLPangoDraw_Template *tmpl,
+    gunichar c)
+{
+    templateGlyph *glyph;
+    PangoAttrList *attrs;
+    GList *items;
+    char buf[6];
+    int len;
+
+    glyph = g_hash_table_lookup(tmpl->glyphs, GUINT_TO_POINTER(c));
+    if(glyph)
+	return glyph;
+
+    len = g_unichar_to_utf8(c, buf);
+    attrs = pango_attr_list_new ();
+    items = pango_itemize (tmpl->context->context, buf, 0, len, attrs, NULL);
+    pango_attr_list_unref (attrs);
+    if(! items)
+	return NULL;
+
+    if(! items->next) {
+	PangoItem *item = items->data;
+	PangoGlyphString *glyphs = shapeItem(tmpl->context, buf, len, item);
+
+	if(glyphs->num_glyphs == 1) {
+	    glyph = g_new(templateGlyph, 1);
+	    glyph->font = g_object_ref(item->analysis.font);
+	    glyph->info = glyphs->glyphs[0];
+	    g_hash_table_insert(tmpl->glyphs, GUINT_TO_POINTER(c), glyph);
+	}
+	pango_glyph_string_free (glyphs);
+    }
+
+    for(; items; items = g_list_delete_link(items, items))
+	pango_item_free (items->data);
+
+    return glyph;
+}
+
+/*!
+    Free a glyph of a template.
+
+    @param data [i/o] templateGlyph
+*/
+static void
+freeTemplateGlyph(
+    gpointer data)
+{
+    templateGlyph *glyph = data;
+
+    g_object_unref(glyph->font);
+    g_free(glyph);
+}
+
+/*!
+    Find a field of a template by name.
+
+    @param *tmpl [in] Template
+    @param *name [in] Name of the field
+    @return The field, or NULL
+*/
+static templateField *
+findTemplateField(
+    SDLPangoDraw_Template *tmpl,
+    const char *name)
+{
+    guint i;
+
+    for(i = 0; i < tmpl->fields->len; i++) {
+	templateField *field = &g_array_index(tmpl->fields, templateField, i);
+
+	if(strcmp(field->name, name) == 0)
+	    return field;
+    }
+    SDL_SetError("no such template field: %s", name);
+    return NULL;
+}
+
+/*!
+    Parse a template into text with a placeholder for every field.
+
+    @param *tmpl [i/o] Template with no fields
+    @param *text [in] Template text
+    @param length [in] Length in bytes
+    @return The text to lay out, or NULL on a syntax error
+*/
+static GString *
+parseTemplate(
+    SDLPangoDraw_Template *tmpl,
+    const char *text,
+    int length)
+{
+    GString *out = g_string_sized_new(length);
+    const char *p = text;
+    const char *end = text + length;
+
+    while(p < end) {
+	const char *name, *colon, *close;
+	templateField field;
+	char *digits_end;
+
+	if(*p == '}' && p + 1 < end && p[1] == '}') {
+	    g_string_append_c(out, '}');
+	    p += 2;
+	    continue;
+	}
+	if(*p != '{') {
+	    g_string_append_c(out, *p++);
+	    continue;
+	}
+	if(p + 1 < end && p[1] == '{') {
+	    g_string_append_c(out, '{');
+	    p += 2;
+	    continue;
+	}
+
+	/* {name:N} or {name:-N} */
+	name = p + 1;
+	close = memchr(name, '}', end - name);
+	colon = close ? memchr(name, ':', close - name) : NULL;
+	if(! colon || colon == name) {
+	    SDL_SetError("bad template field at offset %d", (int)(p - text));
+	    g_string_free(out, TRUE);
+	    return NULL;
+	}
+
+	field.left = colon[1] == '-';
+	field.chars = (int)strtol(colon + 1 + field.left, &digits_end, 10);
+	if(digits_end != close || field.chars <= 0) {
+	    SDL_SetError("bad template field width at offset %d", (int)(p - text));
+	    g_string_free(out, TRUE);
+	    return NULL;
+	}
+
+	field.name = g_strndup(name, colon - name);
+	field.index = out->len;
+	field.value = g_array_new(FALSE, FALSE, sizeof(templateGlyph));
+	field.value_width = 0;
+	field.dirty = TRUE;
+	g_array_append_val(tmpl->fields, field);
+
+	g_string_append(out, TEMPLATE_PLACEHOLDER);
+	p = close + 1;
+    }
+
+    return out;
+}
+
+/*!
+    Find where the fields of a template are drawn.
+
+    @param *tmpl [i/o] Template that has been laid out
+*/
+static void
+placeTemplateFields(
+    SDLPangoDraw_Template *tmpl)
+{
+    PangoLayoutIter *iter;
+    PangoRectangle line_rect;
+    guint i = 0;
+
+    iter = pango_layout_get_iter (tmpl->layout);
+    do {
+	PangoLayoutLine *line = pango_layout_iter_get_line (iter);
+	int baseline = pango_layout_iter_get_baseline (iter);
+
+	pango_layout_iter_get_line_extents (iter, NULL, &line_rect);
+
+	for(; i < tmpl->fields->len; i++) {
+	    templateField *field = &g_array_index(tmpl->fields, templateField, i);
+	    PangoRectangle pos;
+
+	    if(field->index >= line->start_index + line->length)
+		break;
+
+	    pango_layout_index_to_pos (tmpl->layout, field->index, &pos);
+	    if(pos.width < 0) {
+		pos.x += pos.width;
+		pos.width = -pos.width;
+	    }
+	    field->rect.x = PANGO_PIXELS (pos.x);
+	    field->rect.y = PANGO_PIXELS (line_rect.y);
+	    field->rect.w = PANGO_PIXELS (pos.x + pos.width) - field->rect.x;
+	    field->rect.h = PANGO_PIXELS (line_rect.y + line_rect.height) - field->rect.y;
+	    field->baseline = PANGO_PIXELS (baseline) - field->rect.y;
+	}
+    } while (pango_layout_iter_next_line (iter));
+    pango_layout_iter_free (iter);
+}
+
+/*!
+    Create a template: text laid out once, with fields that can be updated
+    and redrawn alone.
+    A field is written as {name:N}, where N is the maximum number of
+    characters. The value is right aligned, or left aligned with {name:-N}.
+    Write {{ and }} for literal braces.
+    The field is as wide as N digits of the font of the context.
+    Digits and the usual number punctuation are shaped when the template is
+    created; any other character is shaped the first time it is used.
+
+    @param *context [in] Context. Its font, color, minimum width and
+	alignment are used.
+    @param *text [in] Template text (must be in UTF-8).
+    @param length [in] Text length. -1 means NULL-terminated text.
+    @return A new template, or NULL if the template text is malformed
+*/
+SDLPangoDraw_Template*
+SDLPangoDraw_CreateTemplate(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length)
+{
+    SDLPangoDraw_Template *tmpl = g_new0(SDLPangoDraw_Template, 1);
+    PangoFontMetrics *metrics;
+    PangoAttrList *attrs;
+    PangoRectangle shape_rect;
+    GString *layout_text;
+    const char *p;
+    int digit_width = 0;
+    guint i;
+
+    tmpl->context = context;
+    tmpl->fields = g_array_new(FALSE, FALSE, sizeof(templateField));
+    tmpl->glyphs = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+	NULL, freeTemplateGlyph);
+    tmpl->run = pango_glyph_string_new ();
+
+    if(length < 0)
+	length = strlen(text);
+    layout_text = parseTemplate(tmpl, text, length);
+    if(! layout_text) {
+	SDLPangoDraw_FreeTemplate(tmpl);
+	return NULL;
+    }
+
+    for(p = TEMPLATE_PRESHAPED; *p; p++) {
+	const templateGlyph *glyph = getTemplateGlyph(tmpl, (gunichar)*p);
+
+	if(glyph && *p >= '0' && *p <= '9')
+	    digit_width = MAX(digit_width, glyph->info.geometry.width);
+    }
+
+    metrics = pango_context_get_metrics (context->context, context->font_desc,
+	pango_context_get_language (context->context));
+    if(digit_width == 0)
+	digit_width = pango_font_metrics_get_approximate_digit_width (metrics);
+    shape_rect.y = -pango_font_metrics_get_ascent (metrics);
+    shape_rect.height = pango_font_metrics_get_ascent (metrics)
+	+ pango_font_metrics_get_descent (metrics);
+    pango_font_metrics_unref (metrics);
+
+    /* Every field is laid out as a placeholder as wide as the field. */
+    attrs = pango_attr_list_new ();
+    for(i = 0; i < tmpl->fields->len; i++) {
+	templateField *field = &g_array_index(tmpl->fields, templateField, i);
+	PangoAttribute *attr;
+
+	field->width = field->chars * digit_width;
+	shape_rect.x = 0;
+	shape_rect.width = field->width;
+	attr = pango_attr_shape_new (&shape_rect, &shape_rect);
+	attr->start_index = field->index;
+	attr->end_index = field->index + strlen(TEMPLATE_PLACEHOLDER);
+	pango_attr_list_insert (attrs, attr);
+    }
+
+    tmpl->layout = pango_layout_new (context->context);
+    pango_layout_set_font_description (tmpl->layout, context->font_desc);
+    pango_layout_set_auto_dir (tmpl->layout, TRUE);
+    pango_layout_set_alignment (tmpl->layout, context->alignment);
+    pango_layout_set_width (tmpl->layout,
+	context->min_width > 0 ? context->min_width * PANGO_SCALE : -1);
+    pango_layout_set_text (tmpl->layout, layout_text->str, layout_text->len);
+    pango_layout_set_attributes (tmpl->layout, attrs);
+    pango_attr_list_unref (attrs);
+    g_string_free(layout_text, TRUE);
+
+    placeTemplateFields(tmpl);
+
+    return tmpl;
+}
+
+/*!
+    Free a template.
+
+    @param *tmpl [i/o] Template to be free
+*/
+void
+SDLPangoDraw_FreeTemplate(
+    SDLPangoDraw_Template *tmpl)
+{
+    guint i;
+
+    for(i = 0; i < tmpl->fields->len; i++) {
+	templateField *field = &g_array_index(tmpl->fields, templateField, i);
+
+	g_free(field->name);
+	g_array_free(field->value, TRUE);
+    }
+    g_array_free(tmpl->fields, TRUE);
+    g_hash_table_destroy(tmpl->glyphs);
+    pango_glyph_string_free (tmpl->run);
+    if(tmpl->layout)
+	g_object_unref (tmpl->layout);
+    g_free(tmpl);
+}
+
+/*!
+    Set the value of a field of a template.
+    The value is cut to the width of the field. Characters without a glyph
+    of their own are skipped.
+    Nothing is drawn until SDLPangoDraw_DrawTemplateFields or
+    SDLPangoDraw_DrawTemplate is called.
+
+    @param *tmpl [i/o] Template
+    @param *name [in] Name of the field
+    @param *value [in] Value (must be in UTF-8).
+    @return 0 on success, -1 if there is no such field
+*/
+int
+SDLPangoDraw_SetTemplateField(
+    SDLPangoDraw_Template *tmpl,
+    const char *name,
+    const char *value)
+{
+    templateField *field = findTemplateField(tmpl, name);
+    gboolean changed = FALSE;
+    guint n = 0;
+
+    if(! field)
+	return -1;
+
+    field->value_width = 0;
+    for(; *value && (int)n < field->chars; value = g_utf8_next_char(value)) {
+	const templateGlyph *glyph = getTemplateGlyph(tmpl, g_utf8_get_char(value));
+
+	if(! glyph)
+	    continue;
+	if(field->value_width + glyph->info.geometry.width > field->width)
+	    break;
+
+	/* The value is overwritten in place, noting whether it changes. */
+	if(n < field->value->len) {
+	    templateGlyph *old = &g_array_index(field->value, templateGlyph, n);
+
+	    if(old->font != glyph->font || old->info.glyph != glyph->info.glyph) {
+		*old = *glyph;
+		changed = TRUE;
+	    }
+	} else {
+	    g_array_append_val(field->value, *glyph);
+	    changed = TRUE;
+	}
+	field->value_width += glyph->info.geometry.width;
+	n++;
+    }
+    if(n != field->value->len) {
+	g_array_set_size(field->value, n);
+	changed = TRUE;
+    }
+
+    if(changed)
+	field->dirty = TRUE;
+
+    return 0;
+}
+
+/*!
+    Draw a field of a template.
+    The rect of the field is filled with the background color, and the value
+    is drawn with the glyphs of the glyph set, without laying out the text.
+
+    @param *tmpl [i/o] Template
+    @param *field [i/o] Field
+    @param *surface [i/o] Surface to draw on
+    @param x [in] X of left-top of the template
+    @param y [in] Y of left-top of the template
+*/
+static void
+drawTemplateField(
+    SDLPangoDraw_Template *tmpl,
+    templateField *field,
+    SDL_Surface *surface,
+    int x, int y)
+{
+    SDLPangoDraw_Matrix matrix = tmpl->context->color_matrix;
+    const templateGlyph *glyphs = (const templateGlyph *)field->value->data;
+    SDL_Rect rect;
+    int left, right;
+    int offset;
+    guint start, i;
+
+    left = x + field->rect.x;
+    right = left + field->rect.w;
+
+    rect.x = left;
+    rect.y = y + field->rect.y;
+    rect.w = field->rect.w;
+    rect.h = field->rect.h;
+    if(tmpl->context->premultiplied)
+	premultiplyMatrix(&matrix);
+    SDL_FillRect(surface, &rect, SDL_MapRGBA(surface->format,
+	matrix.m[0][0], matrix.m[1][0], matrix.m[2][0], matrix.m[3][0]));
+
+    offset = field->left ? 0 : field->width - field->value_width;
+
+    /* One glyph string per run of glyphs in the same font. */
+    for(start = 0; start < field->value->len; start = i) {
+	int run_x, run_right;
+	int width = 0;
+
+	for(i = start; i < field->value->len && glyphs[i].font == glyphs[start].font; i++)
+	    ;
+
+	pango_glyph_string_set_size (tmpl->run, i - start);
+	for(i = start; i < start + tmpl->run->num_glyphs; i++) {
+	    tmpl->run->glyphs[i - start] = glyphs[i].info;
+	    tmpl->run->log_clusters[i - start] = i - start;
+	    width += glyphs[i].info.geometry.width;
+	}
+
+	run_x = left + PANGO_PIXELS (offset);
+	run_right = i < field->value->len
+	    ? left + PANGO_PIXELS (offset + width) : right;
+	offset += width;
+
+	drawGlyphString(tmpl->context, surface, &matrix,
+	    glyphs[start].font, tmpl->run,
+	    run_x, rect.y, MIN(run_right, right) - run_x, rect.h,
+	    field->baseline);
+    }
+
+    field->dirty = FALSE;
+}
+
+/*!
+    Draw a template, with the current values of its fields.
+    Unlike SDLPangoDraw_Draw, the surface is not cleared first.
+
+    @param *tmpl [i/o] Template
+    @param *surface [i/o] Surface to draw on
+    @param x [in] X of left-top of drawing area
+    @param y [in] Y of left-top of drawing area
+*/
+void
+SDLPangoDraw_DrawTemplate(
+    SDLPangoDraw_Template *tmpl,
+    SDL_Surface *surface,
+    int x, int y)
+{
+    guint i;
+
+    if(! surface) {
+	SDL_SetError("surface is NULL");
+	return;
+    }
+
+    drawLayoutLines(tmpl->context, surface, tmpl->layout, x, y, 0, -1);
+
+    for(i = 0; i < tmpl->fields->len; i++)
+	drawTemplateField(tmpl, &g_array_index(tmpl->fields, templateField, i),
+	    surface, x, y);
+}
+
+/*!
+    Draw only the fields of a template whose value has changed since they
+    were last drawn. The template must have been drawn at the same place
+    with SDLPangoDraw_DrawTemplate before.
+
+    @param *tmpl [i/o] Template
+    @param *surface [i/o] Surface to draw on
+    @param x [in] X of left-top of the template
+    @param y [in] Y of left-top of the template
+    @return Number of fields drawn
+*/
+int
+SDLPangoDraw_DrawTemplateFields(
+    SDLPangoDraw_Template *tmpl,
+    SDL_Surface *surface,
+    int x, int y)
+{
+    guint i;
+    int drawn = 0;
+
+    if(! surface) {
+	SDL_SetError("surface is NULL");
+	return 0;
+    }
+
+    for(i = 0; i < tmpl->fields->len; i++) {
+	templateField *field = &g_array_index(tmpl->fields, templateField, i);
+
+	if(field->dirty) {
+	    drawTemplateField(tmpl, field, surface, x, y);
+	    drawn++;
+	}
+    }
+    return drawn;
+}
+
+/*!
+    Get the rect of a field of a template, for example to update only that
+    part of the screen.
+    The rect is relative to the left-top of the template.
+
+    @param *tmpl [in] Template
+    @param *name [in] Name of the field
+    @param *rect [out] Rect of the field
+    @return 0 on success, -1 if there is no such field
+*/
+int
+SDLPangoDraw_GetTemplateFieldRect(
+    SDLPangoDraw_Template *tmpl,
+    const char *name,
+    SDL_Rect *rect)
+{
+    templateField *field = findTemplateField(tmpl, name);
+
+    if(! field)
+	return -1;
+    *rect = field->rect;
+    return 0;
+}
+
+/*!
+    Get the size of a template.
+
+    @param *tmpl [in] Template
+    @param *width [out] Width. May be NULL.
+    @param *height [out] Height. May be NULL.
+*/
+void
+SDLPangoDraw_GetTemplateSize(
+    SDLPangoDraw_Template *tmpl,
+    int *width, int *height)
+{
+    PangoRectangle logical_rect;
+
+    pango_layout_get_extents (tmpl->layout, NULL, &logical_rect);
+    if(width)
+	*width = PANGO_PIXELS (logical_rect.width);
+    if(height)
+	*height = PANGO_PIXELS (logical_rect.height);
+}
+
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+
+/*!
+    A glyph kept in a glyph atlas. It is both the key and the value of the
+    glyph table of the atlas.
+*/
+typedef struct _atlasGlyph {
+    PangoFont *font;		/*!< Font of the glyph, referenced */
+    PangoGlyph glyph;		/*!< The glyph */
+    SDL_Rect rect;		/*!< Where the glyph is in the texture */
+    int left;			/*!< Left of the rect from the glyph origin */
+    int top;			/*!< Top of the rect from the baseline */
+} atlasGlyph;
+
+typedef struct _glyphAtlasImpl {
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    int width;
+    int height;
+    int shelf_x;		/* Next free x on the current shelf */
+    int shelf_y;		/* Top of the current shelf */
+    int shelf_height;		/* Height of the current shelf */
+    GHashTable *glyphs;		/* atlasGlyph */
+    GArray *vertices;		/* SDL_Vertex, the batch not drawn yet */
+    GArray *indices;		/* int, the batch not drawn yet */
+} glyphAtlasImpl;
+
+static guint
+hashAtlasGlyph(
+    gconstpointer key)
+{
+    const atlasGlyph *g = key;
+
+    return GPOINTER_TO_UINT(g->font) ^ (g->glyph * 2654435761u);
+}
+
+static gboolean
+equalAtlasGlyph(
+    gconstpointer a,
+    gconstpointer b)
+{
+    const atlasGlyph *ga = a;
+    const atlasGlyph *gb = b;
+
+    return ga->font == gb->font && ga->glyph == gb->glyph;
+}
+
+static void
+freeAtlasGlyph(
+    gpointer data)
+{
+    atlasGlyph *g = data;
+
+    g_object_unref(g->font);
+    g_free(g);
+}
+
+/*!
+    Send the batched glyphs of an atlas to its renderer.
+
+    @param *atlas [i/o] Atlas
+*/
+static void
+flushGlyphAtlas(
+    SDLPangoDraw_GlyphAtlas *atlas)
+{
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    if(atlas->indices->len > 0)
+	SDL_RenderGeometry(atlas->renderer, atlas->texture,
+	    (SDL_Vertex *)atlas->vertices->data, atlas->vertices->len,
+	    (int *)atlas->indices->data, atlas->indices->len);
+#endif
+    g_array_set_size(atlas->vertices, 0);
+    g_array_set_size(atlas->indices, 0);
+}
+
+/*!
+    Forget every glyph of an atlas. The texture is reused from the left-top.
+
+    @param *atlas [i/o] Atlas
+*/
+static void
+resetGlyphAtlas(
+    SDLPangoDraw_GlyphAtlas *atlas)
+{
+    flushGlyphAtlas(atlas);
+    g_hash_table_remove_all(atlas->glyphs);
+    atlas->shelf_x = 0;
+    atlas->shelf_y = 0;
+    atlas->shelf_height = 0;
+}
+
+/*!
+    Find room for a rect in an atlas. Rects are packed left to right on
+    shelves, and a new shelf is opened below when a rect does not fit.
+
+    @param *atlas [i/o] Atlas
+    @param *rect [i/o] Rect. w and h are read, x and y are written.
+    @return TRUE if there was room
+*/
+static gboolean
+packGlyphAtlas(
+    SDLPangoDraw_GlyphAtlas *atlas,
+    SDL_Rect *rect)
+{
+    if(atlas->shelf_x + rect->w > atlas->width) {
+	atlas->shelf_y += atlas->shelf_height;
+	atlas->shelf_x = 0;
+	atlas->shelf_height = 0;
+    }
+    if(rect->w > atlas->width || atlas->shelf_y + rect->h > atlas->height)
+	return FALSE;
+
+    rect->x = atlas->shelf_x;
+    rect->y = atlas->shelf_y;
+    atlas->shelf_x += rect->w;
+    atlas->shelf_height = MAX(atlas->shelf_height, rect->h);
+    return TRUE;
+}
+
+/*!
+    Get a glyph from an atlas, rasterizing and uploading it the first time.
+    When the atlas is full, it is emptied and the glyph goes in first.
+
+    @param *context [i/o] Context, for its scratch bitmap
+    @param *atlas [i/o] Atlas
+    @param *font [in] Font of the glyph
+    @param glyph [in] Glyph
+    @return The glyph, or NULL if it has no ink or does not fit the atlas
+*/
+static const atlasGlyph *
+lookupAtlasGlyph(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_GlyphAtlas *atlas,
+    PangoFont *font,
+    PangoGlyph glyph)
+{
+    atlasGlyph key;
+    atlasGlyph *entry;
+    PangoRectangle ink_rect;
+    PangoGlyphInfo info;
+    PangoGlyphString one;
+    gint cluster = 0;
+    FT_Bitmap tile;
+    SDL_Rect rect;
+    int left, top;
+    void *pixels;
+    int pitch;
+    int i, j;
+
+    key.font = font;
+    key.glyph = glyph;
+    entry = g_hash_table_lookup(atlas->glyphs, &key);
+    if(entry)
+	return entry->rect.w > 0 ? entry : NULL;
+
+    /* One pixel of padding on each side keeps filtering inside the glyph. */
+    pango_font_get_glyph_extents(font, glyph, &ink_rect, NULL);
+    left = PANGO_PIXELS_FLOOR (ink_rect.x) - 1;
+    top = PANGO_PIXELS_FLOOR (ink_rect.y) - 1;
+    rect.w = PANGO_PIXELS_CEIL (ink_rect.x + ink_rect.width) + 1 - left;
+    rect.h = PANGO_PIXELS_CEIL (ink_rect.y + ink_rect.height) + 1 - top;
+
+    entry = g_new(atlasGlyph, 1);
+    entry->font = g_object_ref(font);
+    entry->glyph = glyph;
+    entry->left = left;
+    entry->top = top;
+    entry->rect.x = entry->rect.y = entry->rect.w = entry->rect.h = 0;
+
+    if(ink_rect.width == 0 || ink_rect.height == 0) {
+	/* Spaces are remembered too, so they are not measured again. */
+	g_hash_table_insert(atlas->glyphs, entry, entry);
+	return NULL;
+    }
+
+    if(! packGlyphAtlas(atlas, &rect)) {
+	resetGlyphAtlas(atlas);
+	if(! packGlyphAtlas(atlas, &rect)) {
+	    freeAtlasGlyph(entry);
+	    return NULL;
+	}
+    }
+
+    reserveScratch(context, rect.w, rect.h);
+    tile = *context->tmp_ftbitmap;
+    tile.width = rect.w;
+    tile.rows = rect.h;
+
+    info.glyph = glyph;
+    info.geometry.width = 0;
+    info.geometry.x_offset = 0;
+    info.geometry.y_offset = 0;
+    one.num_glyphs = 1;
+    one.glyphs = &info;
+    one.log_clusters = &cluster;
+    pango_ft2_render(&tile, font, &one, -left, -top);
+
+    if(SDL_LockTexture(atlas->texture, &rect, &pixels, &pitch) == 0) {
+	for(j = 0; j < rect.h; j++) {
+	    const Uint8 *src = tile.buffer + j * tile.pitch;
+	    Uint32 *dst = (Uint32 *)((Uint8 *)pixels + j * pitch);
+
+	    for(i = 0; i < rect.w; i++)
+		dst[i] = ((Uint32)src[i] << 24) | 0xFFFFFF;
+	}
+	SDL_UnlockTexture(atlas->texture);
+    }
+    memset(tile.buffer, 0, tile.pitch * tile.rows);
+
+    entry->rect = rect;
+    g_hash_table_insert(atlas->glyphs, entry, entry);
+    return entry;
+}
+
+/*!
+    Draw glyphs with the renderer of the atlas of a context.
+    Same arguments as drawGlyphString.
+*/
+static void
+atlasGlyphString(
+    SDLPangoDraw_Context *context,
+    const SDLPangoDraw_Matrix *color_matrix,
+    PangoFont *font,
+    PangoGlyphString *glyphs,
+    int x, int y,
+    int width, int height,
+    int baseline)
+{
+    SDLPangoDraw_GlyphAtlas *atlas = context->atlas;
+    Uint8 r = color_matrix->m[0][1];
+    Uint8 g = color_matrix->m[1][1];
+    Uint8 b = color_matrix->m[2][1];
+    Uint8 a = color_matrix->m[3][1];
+    int x_off = 0;
+    int i;
+
+    if(color_matrix->m[3][0] != 0) {
+	SDL_Rect bg;
+
+	bg.x = x;
+	bg.y = y;
+	bg.w = width;
+	bg.h = height;
+	flushGlyphAtlas(atlas);
+	SDL_SetRenderDrawColor(atlas->renderer,
+	    color_matrix->m[0][0], color_matrix->m[1][0],
+	    color_matrix->m[2][0], color_matrix->m[3][0]);
+	SDL_RenderFillRect(atlas->renderer, &bg);
+    }
+
+    if(a == 0)
+	return;
+
+#if ! SDL_VERSION_ATLEAST(2, 0, 18)
+    SDL_SetTextureColorMod(atlas->texture, r, g, b);
+    SDL_SetTextureAlphaMod(atlas->texture, a);
+#endif
+
+    for(i = 0; i < glyphs->num_glyphs; i++) {
+	const PangoGlyphInfo *info = &glyphs->glyphs[i];
+	const atlasGlyph *entry;
+	int gx, gy;
+
+	if(info->glyph != PANGO_GLYPH_EMPTY) {
+	    entry = lookupAtlasGlyph(context, atlas, font, info->glyph);
+	    if(entry) {
+		gx = x + PANGO_PIXELS (x_off + info->geometry.x_offset) + entry->left;
+		gy = y + baseline + PANGO_PIXELS (info->geometry.y_offset) + entry->top;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+		{
+		    /* Two triangles per glyph: 0-1-2 and 2-1-3. */
+		    static const int quad[6] = { 0, 1, 2, 2, 1, 3 };
+		    SDL_Vertex corners[4];
+		    int base = atlas->vertices->len;
+		    int k;
+
+		    for(k = 0; k < 4; k++) {
+			int right = k & 1;
+			int bottom = k >> 1;
+
+			corners[k].position.x = (float)(gx + right * entry->rect.w);
+			corners[k].position.y = (float)(gy + bottom * entry->rect.h);
+			corners[k].color.r = r;
+			corners[k].color.g = g;
+			corners[k].color.b = b;
+			corners[k].color.a = a;
+			corners[k].tex_coord.x =
+			    (float)(entry->rect.x + right * entry->rect.w) / atlas->width;
+			corners[k].tex_coord.y =
+			    (float)(entry->rect.y + bottom * entry->rect.h) / atlas->height;
+		    }
+		    g_array_append_vals(atlas->vertices, corners, 4);
+		    for(k = 0; k < 6; k++) {
+			int index = base + quad[k];
+			g_array_append_val(atlas->indices, index);
+		    }
+		}
+#else
+		{
+		    SDL_Rect dst;
+
+		    dst.x = gx;
+		    dst.y = gy;
+		    dst.w = entry->rect.w;
+		    dst.h = entry->rect.h;
+		    SDL_RenderCopy(atlas->renderer, atlas->texture, &entry->rect, &dst);
+		}
+#endif
+	    }
+	}
+	x_off += info->geometry.width;
+    }
+}
+
+/*!
+    Draw a horizontal line of a pixel with the renderer of an atlas.
+    Same arguments as drawHLine.
+*/
+static void
+atlasHLine(
+    SDLPangoDraw_GlyphAtlas *atlas,
+    const SDLPangoDraw_Matrix *color_matrix,
+    int y, int start, int end)
+{
+    SDL_Rect line;
+
+    if(end <= start)
+	return;
+
+    line.x = start;
+    line.y = y;
+    line.w = end - start;
+    line.h = 1;
+    flushGlyphAtlas(atlas);
+    SDL_SetRenderDrawColor(atlas->renderer,
+	color_matrix->m[0][1], color_matrix->m[1][1],
+	color_matrix->m[2][1], color_matrix->m[3][1]);
+    SDL_RenderFillRect(atlas->renderer, &line);
+}
+
+/*!
+    Create a glyph atlas: a streaming texture of a renderer that keeps
+    the glyphs drawn by SDLPangoDraw_DrawToRenderer.
+    An atlas may be shared by several contexts drawing to the same renderer.
+    When it is full, it is emptied and filled again with the glyphs in use.
+
+    @param *renderer [in] Renderer
+    @param width [in] Width of the texture
+    @param height [in] Height of the texture
+    @return A new atlas, or NULL on error
+*/
+SDLPangoDraw_GlyphAtlas *
+SDLPangoDraw_CreateGlyphAtlas(
+    SDL_Renderer *renderer,
+    int width, int height)
+{
+    SDLPangoDraw_GlyphAtlas *atlas;
+    SDL_Texture *texture;
+
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+	SDL_TEXTUREACCESS_STREAMING, width, height);
+    if(! texture)
+	return NULL;
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+
+    atlas = g_malloc(sizeof(SDLPangoDraw_GlyphAtlas));
+    atlas->renderer = renderer;
+    atlas->texture = texture;
+    atlas->width = width;
+    atlas->height = height;
+    atlas->shelf_x = 0;
+    atlas->shelf_y = 0;
+    atlas->shelf_height = 0;
+    atlas->glyphs = g_hash_table_new_full(hashAtlasGlyph, equalAtlasGlyph,
+	NULL, freeAtlasGlyph);
+    atlas->vertices = g_array_new(FALSE, FALSE, sizeof(SDL_Vertex));
+    atlas->indices = g_array_new(FALSE, FALSE, sizeof(int));
+
+    return atlas;
+}
+
+/*!
+    Free a glyph atlas and its texture.
+
+    @param *atlas [i/o] Atlas
+*/
+void
+SDLPangoDraw_FreeGlyphAtlas(
+    SDLPangoDraw_GlyphAtlas *atlas)
+{
+    if(! atlas)
+	return;
+
+    g_hash_table_destroy(atlas->glyphs);
+    g_array_free(atlas->vertices, TRUE);
+    g_array_free(atlas->indices, TRUE);
+    SDL_DestroyTexture(atlas->texture);
+    g_free(atlas);
+}
+
+/*!
+    Forget every glyph of a glyph atlas, for example after the fonts of
+    the contexts using it have changed.
+
+    @param *atlas [i/o] Atlas
+*/
+void
+SDLPangoDraw_ClearGlyphAtlas(
+    SDLPangoDraw_GlyphAtlas *atlas)
+{
+    resetGlyphAtlas(atlas);
+}
+
+/*!
+    Draw the text of a context with a renderer.
+    Glyphs are taken from a glyph atlas of the renderer, and drawn as one
+    batch of textured quads (one copy per glyph before SDL 2.0.18).
+    Only glyphs that are new to the atlas are rasterized.
+    Backgrounds and lines are drawn as filled rects; effects are not drawn.
+    The draw color and blend mode of the renderer are kept.
+
+    @param *context [i/o] Context
+    @param *atlas [i/o] Glyph atlas of the renderer to draw with
+    @param x [in] X of left-top of drawing area
+    @param y [in] Y of left-top of drawing area
+*/
+void
+SDLPangoDraw_DrawToRenderer(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_GlyphAtlas *atlas,
+    int x, int y)
+{
+    Uint8 r, g, b, a;
+    SDL_BlendMode blend_mode;
+
+    adoptPrewarm(context);
+
+    context->buffer_growths = 0;
+
+    if(! atlas) {
+	SDL_SetError("atlas is NULL");
+	return;
+    }
+
+    SDL_GetRenderDrawColor(atlas->renderer, &r, &g, &b, &a);
+    SDL_GetRenderDrawBlendMode(atlas->renderer, &blend_mode);
+    SDL_SetRenderDrawBlendMode(atlas->renderer, SDL_BLENDMODE_BLEND);
+
+    context->atlas = atlas;
+    drawLayoutLines(context, NULL, context->layout, x, y, 0, -1);
+    flushGlyphAtlas(atlas);
+    context->atlas = NULL;
+    enforceMemoryBudget(context);
+
+    SDL_SetRenderDrawColor(atlas->renderer, r, g, b, a);
+    SDL_SetRenderDrawBlendMode(atlas->renderer, blend_mode);
+}
+
+#endif /* SDL_VERSION_ATLEAST(2, 0, 0) */
+
+#define COMPILED_MAGIC "SPDL"
+#define COMPILED_VERSION 2
+#define COMPILED_BYTE_ORDER 0x01020304
+
+#define COMPILED_STRIKE 0x01
+#define COMPILED_FG_SET 0x02
+#define COMPILED_BG_SET 0x04
+#define COMPILED_SHAPE_SET 0x08
+#define COMPILED_ULINE_SHIFT 8
+
+/*
+    The compiled layout format. Every field is 32 bits wide, in the byte
+    order of the machine that wrote the file; byte_order tells a file of
+    another machine apart. The sections follow the header in this order,
+    and are referred to by offset from the start of the file.
+    Coordinates are in Pango units.
+*/
+typedef struct _compiledHeader {
+    char magic[4];		/*!< COMPILED_MAGIC */
+    Uint32 version;		/*!< COMPILED_VERSION */
+    Uint32 byte_order;		/*!< COMPILED_BYTE_ORDER */
+    Uint32 file_size;
+    Uint32 n_fonts, fonts_offset;
+    Uint32 n_layouts, layouts_offset;
+    Uint32 n_lines, lines_offset;
+    Uint32 n_runs, runs_offset;
+    Uint32 n_glyphs, glyphs_offset;
+    Uint32 strings_size, strings_offset;
+} compiledHeader;
+
+typedef struct _compiledFont {
+    Uint32 name;		/*!< Font description without size, in strings */
+    Sint32 size;		/*!< Absolute size */
+    Uint32 family, style;	/*!< Family and style of the face, in strings */
+    Uint32 file;		/*!< Base name of the font file, in strings */
+    Sint32 face_index;		/*!< Face in the font file */
+    Uint32 n_glyphs;		/*!< Glyphs in the face */
+} compiledFont;
+
+typedef struct _compiledLayout {
+    Uint32 name;		/*!< Name, in strings */
+    Uint32 first_line, n_lines;
+    Sint32 x, y, width, height;	/*!< Logical extents */
+} compiledLayout;
+
+typedef struct _compiledLine {
+    Sint32 x, y, height;	/*!< Logical rect, without its width */
+    Sint32 baseline;
+    Uint32 first_run, n_runs;
+} compiledLine;
+
+typedef struct _compiledRun {
+    Uint32 font;
+    Uint32 first_glyph, n_glyphs;
+    Uint32 flags;		/*!< COMPILED_STRIKE etc. and the underline */
+    Uint32 fg_color[3];
+    Uint32 bg_color[3];
+    Sint32 rise;
+    Sint32 x_off;		/*!< X from the line */
+    Sint32 ink_rect[4];
+    Sint32 logical_rect[4];
+} compiledRun;
+
+typedef struct _compiledGlyph {
+    Uint32 glyph;
+    Sint32 width, x_offset, y_offset;
+} compiledGlyph;
+
+typedef struct _layoutWriterImpl {
+    GArray *fonts;		/* compiledFont */
+    GArray *layouts;		/* compiledLayout */
+    GArray *lines;		/* compiledLine */
+    GArray *runs;		/* compiledRun */
+    GArray *glyphs;		/* compiledGlyph */
+    GString *strings;
+    GHashTable *font_index;	/* size and description to index + 1 */
+    GHashTable *names;		/* names of the layouts */
+} layoutWriterImpl;
+
+typedef struct _compiledLayoutsImpl {
+    GMappedFile *file;
+    const compiledHeader *header;
+    const compiledFont *fonts;
+    const compiledLayout *layouts;
+    const compiledLine *lines;
+    const compiledRun *runs;
+    const compiledGlyph *glyphs;
+    const char *strings;
+    GHashTable *names;		/* name to index + 1 */
+    PangoFontMap *font_map;	/* font map the fonts were loaded from */
+    PangoFont **loaded_fonts;
+} compiledLayoutsImpl;
+
+/*!
+    Create a writer of compiled layouts.
+    Layouts are added with SDLPangoDraw_AddCompiledLayout, then written
+    to a file with SDLPangoDraw_WriteCompiledLayouts.
+
+    @return A new writer
+*/
+SDLPangoDraw_LayoutWriter *
+SDLPangoDraw_CreateLayoutWriter()
+{
+    SDLPangoDraw_LayoutWriter *writer = g_malloc(sizeof(SDLPangoDraw_LayoutWriter));
+
+    writer->fonts = g_array_new(FALSE, FALSE, sizeof(compiledFont));
+    writer->layouts = g_array_new(FALSE, FALSE, sizeof(compiledLayout));
+    writer->lines = g_array_new(FALSE, FALSE, sizeof(compiledLine));
+    writer->runs = g_array_new(FALSE, FALSE, sizeof(compiledRun));
+    writer->glyphs = g_array_new(FALSE, FALSE, sizeof(compiledGlyph));
+    writer->strings = g_string_new(NULL);
+    writer->font_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    writer->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    return writer;
+}
+
+/*!
+    Free a writer of compiled layouts.
+
+    @param *writer [i/o] Writer
+*/
+void
+SDLPangoDraw_FreeLayoutWriter(
+    SDLPangoDraw_LayoutWriter *writer)
+{
+    if(! writer)
+	return;
+
+    g_array_free(writer->fonts, TRUE);
+    g_array_free(writer->layouts, TRUE);
+    g_array_free(writer->lines, TRUE);
+    g_array_free(writer->runs, TRUE);
+    g_array_free(writer->glyphs, TRUE);
+    g_string_free(writer->strings, TRUE);
+    g_hash_table_destroy(writer->font_index);
+    g_hash_table_destroy(writer->names);
+    g_free(writer);
+}
+
+/*!
+    Add a string to the string table of a writer.
+
+    @param *writer [i/o] Writer
+    @param *text [in] String
+    @return Offset of the string in the table
+*/
+static Uint32
+addCompiledString(
+    SDLPangoDraw_LayoutWriter *writer,
+    const char *text)
+{
+    Uint32 offset = writer->strings->len;
+
+    g_string_append_len(writer->strings, text, strlen(text) + 1);
+    return offset;
+}
+
+/*!
+    The face a font was loaded from. The glyph ids of compiled layouts
+    are only good for the face they were shaped with.
+*/
+typedef struct _faceIdentity {
+    const char *family;
+    const char *style;
+    const char *file;		/*!< Base name of the font file */
+    int face_index;
+    Uint32 n_glyphs;
+} faceIdentity;
+
+/*!
+    Get the face a font was loaded from.
+    The strings belong to the font.
+
+    @param *font [in] Font
+    @param *face [out] Face
+    @return TRUE on success, FALSE if the font has no face
+*/
+static gboolean
+identifyFace(
+    PangoFont *font,
+    faceIdentity *face)
+{
+    FcPattern *pattern = getFontPattern(font);
+    FcChar8 *family, *style, *file;
+    const char *base;
+    FT_Face ft_face;
+
+    if(! pattern
+	|| FcPatternGetString(pattern, FC_FAMILY, 0, &family) != FcResultMatch
+	|| FcPatternGetString(pattern, FC_FILE, 0, &file) != FcResultMatch)
+	return FALSE;
+    if(FcPatternGetString(pattern, FC_STYLE, 0, &style) != FcResultMatch)
+	style = (FcChar8 *)"";
+    if(FcPatternGetInteger(pattern, FC_INDEX, 0, &face->face_index) != FcResultMatch)
+	face->face_index = 0;
+
+    ft_face = pango_fc_font_lock_face(PANGO_FC_FONT (font));
+    if(! ft_face)
+	return FALSE;
+    face->n_glyphs = (Uint32)ft_face->num_glyphs;
+    pango_fc_font_unlock_face(PANGO_FC_FONT (font));
+
+    base = strrchr((const char *)file, '/');
+    face->family = (const char *)family;
+    face->style = (const char *)style;
+    face->file = base ? base + 1 : (const char *)file;
+    return TRUE;
+}
+
+/*!
+    Describe the faces the text of a context is drawn with, one line per
+    font: family, style, file, face index and number of glyphs, separated
+    by tabs. Tools that keep what they draw can tell from it that a font
+    file was updated. The text is laid out if it is not yet.
+
+    @param *context [in] Context, with the text set
+    @param *buffer [out] Buffer for the description, NUL-terminated. May
+    be NULL.
+    @param size [in] Size of the buffer in bytes
+    @return Length of the whole description, without the NUL, or -1 if a
+    font has no face. Only size - 1 bytes of it are copied.
+*/
+int
+SDLPangoDraw_DescribeFaces(
+    SDLPangoDraw_Context *context,
+    char *buffer,
+    int size)
+{
+    GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GString *description = g_string_new(NULL);
+    lineCursor cursor;
+    int length = 0;
+
+    openLines(&cursor, context, context->layout);
+    do {
+	GSList *tmp_list;
+
+	for(tmp_list = cursor.line.runs; tmp_list; tmp_list = tmp_list->next) {
+	    PangoLayoutRun *run = tmp_list->data;
+	    PangoFont *font = run->item->analysis.font;
+	    faceIdentity face;
+
+	    if(g_hash_table_lookup(seen, font))
+		continue;
+	    g_hash_table_insert(seen, font, font);
+	    if(! identifyFace(font, &face)) {
+		SDL_SetError("font has no face to describe");
+		length = -1;
+		break;
+	    }
+	    g_string_append_printf(description, "%s\t%s\t%s\t%d\t%u\n",
+		face.family, face.style, face.file, face.face_index,
+		(unsigned int)face.n_glyphs);
+	}
+    } while (length == 0 && nextLine(&cursor));
+    closeLines(&cursor);
+
+    if(length == 0) {
+	length = (int)description->len;
+	if(buffer && size > 0)
+	    g_strlcpy(buffer, description->str, size);
+    }
+
+    g_string_free(description, TRUE);
+    g_hash_table_destroy(seen);
+    return length;
+}
+
+/*!
+    Get the index of a font in the font table of a writer.
+    Fonts are kept by description and absolute size, so that the file
+    does not depend on the DPI of the context that loads it, and with the
+    face they were loaded from, so that a context that loads another face
+    for them can tell.
+
+    @param *writer [i/o] Writer
+    @param *context [in] Context the font belongs to
+    @param *font [in] Font
+    @param *index [out] Index of the font
+    @return 0 on success, -1 if the font has no face
+*/
+static int
+addCompiledFont(
+    SDLPangoDraw_LayoutWriter *writer,
+    SDLPangoDraw_Context *context,
+    PangoFont *font,
+    Uint32 *index)
+{
+    PangoFontDescription *desc;
+    compiledFont record;
+    faceIdentity face;
+    gchar *name;
+    gchar *key;
+    gpointer found;
+
+    if(! identifyFace(font, &face)) {
+	SDL_SetError("font has no face to compile");
+	return -1;
+    }
+
+    desc = pango_font_describe(font);
+
+    record.size = pango_font_description_get_size(desc);
+    if(! pango_font_description_get_size_is_absolute(desc))
+	record.size = (Sint32)(record.size * context->dpi_y / 72.0 + 0.5);
+    pango_font_description_unset_fields(desc, PANGO_FONT_MASK_SIZE);
+    name = pango_font_description_to_string(desc);
+    pango_font_description_free(desc);
+
+    key = g_strdup_printf("%d %s", record.size, name);
+    found = g_hash_table_lookup(writer->font_index, key);
+    if(found) {
+	g_free(key);
+	g_free(name);
+	*index = GPOINTER_TO_UINT(found) - 1;
+	return 0;
+    }
+
+    record.name = addCompiledString(writer, name);
+    record.family = addCompiledString(writer, face.family);
+    record.style = addCompiledString(writer, face.style);
+    record.file = addCompiledString(writer, face.file);
+    record.face_index = face.face_index;
+    record.n_glyphs = face.n_glyphs;
+    g_array_append_val(writer->fonts, record);
+    g_hash_table_insert(writer->font_index, key, GUINT_TO_POINTER(writer->fonts->len));
+    g_free(name);
+    *index = writer->fonts->len - 1;
+    return 0;
+}
+
+/*!
+    Add the laid-out text of a context to a writer of compiled layouts.
+    Everything needed to draw it is kept: fonts, glyphs and their
+    positions, colors and lines of the runs, and the extents. The default
+    color of the context is not; it is taken from the context that draws.
+
+    @param *writer [i/o] Writer
+    @param *context [in] Context, with the text set
+    @param *name [in] Name of the layout, unique in the writer
+    @return 0 on success, -1 if the name is already used or a font has
+    no face. Nothing of the layout is added then.
+*/
+int
+SDLPangoDraw_AddCompiledLayout(
+    SDLPangoDraw_LayoutWriter *writer,
+    SDLPangoDraw_Context *context,
+    const char *name)
+{
+    PangoRectangle logical_rect;
+    compiledLayout layout;
+    lineCursor cursor;
+    guint n_runs = writer->runs->len;
+    guint n_glyphs = writer->glyphs->len;
+
+    if(g_hash_table_lookup(writer->names, name)) {
+	SDL_SetError("layout name is already used");
+	return -1;
+    }
+
+    getLayoutExtents(context, &logical_rect);
+    layout.name = addCompiledString(writer, name);
+    layout.first_line = writer->lines->len;
+    layout.x = logical_rect.x;
+    layout.y = logical_rect.y;
+    layout.width = logical_rect.width;
+    layout.height = logical_rect.height;
+
+    openLines(&cursor, context, context->layout);
+    do {
+	compiledLine line;
+	GSList *tmp_list;
+	int x_off = 0;
+
+	line.x = cursor.line.logical_rect.x;
+	line.y = cursor.line.logical_rect.y;
+	line.height = cursor.line.logical_rect.height;
+	line.baseline = cursor.line.baseline;
+	line.first_run = writer->runs->len;
+
+	for(tmp_list = cursor.line.runs; tmp_list; tmp_list = tmp_list->next) {
+	    PangoLayoutRun *run = tmp_list->data;
+	    runStyle style;
+	    compiledRun record;
+	    int i;
+
+	    if(addCompiledFont(writer, context, run->item->analysis.font, &record.font)) {
+		closeLines(&cursor);
+		g_array_set_size(writer->lines, layout.first_line);
+		g_array_set_size(writer->runs, n_runs);
+		g_array_set_size(writer->glyphs, n_glyphs);
+		return -1;
+	    }
+
+	    getRunStyle(run, &style);
+
+	    record.first_glyph = writer->glyphs->len;
+	    record.n_glyphs = run->glyphs->num_glyphs;
+	    record.flags = (style.strike ? COMPILED_STRIKE : 0)
+		| (style.fg_set ? COMPILED_FG_SET : 0)
+		| (style.bg_set ? COMPILED_BG_SET : 0)
+		| (style.shape_set ? COMPILED_SHAPE_SET : 0)
+		| ((Uint32)style.uline << COMPILED_ULINE_SHIFT);
+	    record.fg_color[0] = style.fg_set ? style.fg_color.red : 0;
+	    record.fg_color[1] = style.fg_set ? style.fg_color.green : 0;
+	    record.fg_color[2] = style.fg_set ? style.fg_color.blue : 0;
+	    record.bg_color[0] = style.bg_set ? style.bg_color.red : 0;
+	    record.bg_color[1] = style.bg_set ? style.bg_color.green : 0;
+	    record.bg_color[2] = style.bg_set ? style.bg_color.blue : 0;
+	    record.rise = style.rise;
+	    record.x_off = x_off;
+	    record.ink_rect[0] = style.ink_rect.x;
+	    record.ink_rect[1] = style.ink_rect.y;
+	    record.ink_rect[2] = style.ink_rect.width;
+	    record.ink_rect[3] = style.ink_rect.height;
+	    record.logical_rect[0] = style.logical_rect.x;
+	    record.logical_rect[1] = style.logical_rect.y;
+	    record.logical_rect[2] = style.logical_rect.width;
+	    record.logical_rect[3] = style.logical_rect.height;
+	    g_array_append_val(writer->runs, record);
+
+	    for(i = 0; i < run->glyphs->num_glyphs; i++) {
+		const PangoGlyphInfo *info = &run->glyphs->glyphs[i];
+		compiledGlyph glyph;
+
+		glyph.glyph = info->glyph;
+		glyph.width = info->geometry.width;
+		glyph.x_offset = info->geometry.x_offset;
+		glyph.y_offset = info->geometry.y_offset;
+		g_array_append_val(writer->glyphs, glyph);
+	    }
+
+	    x_off += style.logical_rect.width;
+	}
+
+	line.n_runs = writer->runs->len - line.first_run;
+	g_array_append_val(writer->lines, line);
+    } while (nextLine(&cursor));
+    closeLines(&cursor);
+
+    layout.n_lines = writer->lines->len - layout.first_line;
+    g_array_append_val(writer->layouts, layout);
+    g_hash_table_insert(writer->names, g_strdup(name), GINT_TO_POINTER(1));
+    return 0;
+}
+
+/*!
+    Write the layouts added to a writer to a file, for
+    SDLPangoDraw_OpenCompiledLayouts.
+
+    @param *writer [in] Writer
+    @param *filename [in] File to write
+    @return 0 on success, -1 on error
+*/
+int
+SDLPangoDraw_WriteCompiledLayouts(
+    SDLPangoDraw_LayoutWriter *writer,
+    const char *filename)
+{
+    static const char padding[4] = { 0, 0, 0, 0 };
+    compiledHeader header;
+    Uint32 strings_padding = (4 - writer->strings->len % 4) % 4;
+    Uint32 offset = sizeof(compiledHeader);
+    FILE *file;
+    int result = 0;
+
+    memcpy(header.magic, COMPILED_MAGIC, 4);
+    header.version = COMPILED_VERSION;
+    header.byte_order = COMPILED_BYTE_ORDER;
+
+#define PLACE_SECTION(n, off, array, type) \
+    header.n = (array)->len; \
+    header.off = offset; \
+    offset += (array)->len * sizeof(type)
+
+    PLACE_SECTION(n_fonts, fonts_offset, writer->fonts, compiledFont);
+    PLACE_SECTION(n_layouts, layouts_offset, writer->layouts, compiledLayout);
+    PLACE_SECTION(n_lines, lines_offset, writer->lines, compiledLine);
+    PLACE_SECTION(n_runs, runs_offset, writer->runs, compiledRun);
+    PLACE_SECTION(n_glyphs, glyphs_offset, writer->glyphs, compiledGlyph);
+
+#undef PLACE_SECTION
+
+    header.strings_size = writer->strings->len;
+    header.strings_offset = offset;
+    header.file_size = offset + writer->strings->len + strings_padding;
+
+    file = fopen(filename, "wb");
+    if(! file) {
+	SDL_SetError("cannot open %s", filename);
+	return -1;
+    }
+    if(fwrite(&header, sizeof(header), 1, file) != 1
+	|| fwrite(writer->fonts->data, sizeof(compiledFont), writer->fonts->len, file) != writer->fonts->len
+	|| fwrite(writer->layouts->data, sizeof(compiledLayout), writer->layouts->len, file) != writer->layouts->len
+	|| fwrite(writer->lines->data, sizeof(compiledLine), writer->lines->len, file) != writer->lines->len
+	|| fwrite(writer->runs->data, sizeof(compiledRun), writer->runs->len, file) != writer->runs->len
+	|| fwrite(writer->glyphs->data, sizeof(compiledGlyph), writer->glyphs->len, file) != writer->glyphs->len
+	|| fwrite(writer->strings->str, 1, writer->strings->len, file) != writer->strings->len
+	|| fwrite(padding, 1, strings_padding, file) != strings_padding)
+    {
+	SDL_SetError("cannot write %s", filename);
+	result = -1;
+    }
+    if(fclose(file) != 0 && result == 0) {
+	SDL_SetError("cannot write %s", filename);
+	result = -1;
+    }
+    return result;
+}
+
+/*!
+    Check that a section of a compiled file is inside the file.
+*/
+static gboolean
+checkSection(
+    gsize file_size,
+    Uint32 offset,
+    Uint32 count,
+    gsize record_size)
+{
+    return offset % 4 == 0 && offset <= file_size
+	&& count <= (file_size - offset) / record_size;
+}
+
+/*!
+    Check that a range of records is inside a section.
+*/
+static gboolean
+checkRange(
+    Uint32 first,
+    Uint32 count,
+    Uint32 total)
+{
+    return first <= total && count <= total - first;
+}
+
+/*!
+    Check everything a compiled file refers to, so that drawing from it
+    never reads outside the file.
+
+    @param *layouts [in] Compiled layouts
+    @param length [in] Size of the file
+    @return TRUE if the file is valid
+*/
+static gboolean
+validateCompiledLayouts(
+    const SDLPangoDraw_CompiledLayouts *layouts,
+    gsize length)
+{
+    const compiledHeader *header = layouts->header;
+    Uint32 i;
+
+    if(length < sizeof(compiledHeader)
+	|| memcmp(header->magic, COMPILED_MAGIC, 4) != 0) {
+	SDL_SetError("not a compiled layout file");
+	return FALSE;
+    }
+    if(header->byte_order != COMPILED_BYTE_ORDER) {
+	SDL_SetError("compiled layout file of another byte order");
+	return FALSE;
+    }
+    if(header->version != COMPILED_VERSION) {
+	SDL_SetError("compiled layout file of version %u, expected %u",
+	    header->version, COMPILED_VERSION);
+	return FALSE;
+    }
+    if(header->file_size != length
+	|| ! checkSection(length, header->fonts_offset, header->n_fonts, sizeof(compiledFont))
+	|| ! checkSection(length, header->layouts_offset, header->n_layouts, sizeof(compiledLayout))
+	|| ! checkSection(length, header->lines_offset, header->n_lines, sizeof(compiledLine))
+	|| ! checkSection(length, header->runs_offset, header->n_runs, sizeof(compiledRun))
+	|| ! checkSection(length, header->glyphs_offset, header->n_glyphs, sizeof(compiledGlyph))
+	|| ! checkSection(length, header->strings_offset, header->strings_size, 1)
+	|| header->strings_size == 0
+	|| layouts->strings[header->strings_size - 1] != '\0')
+    {
+	SDL_SetError("compiled layout file is truncated or corrupt");
+	return FALSE;
+    }
+
+    for(i = 0; i < header->n_fonts; i++) {
+	if(layouts->fonts[i].name >= header->strings_size
+	    || layouts->fonts[i].family >= header->strings_size
+	    || layouts->fonts[i].style >= header->strings_size
+	    || layouts->fonts[i].file >= header->strings_size)
+	    goto corrupt;
+    }
+    for(i = 0; i < header->n_layouts; i++) {
+	if(layouts->layouts[i].name >= header->strings_size
+	    || ! checkRange(layouts->layouts[i].first_line, layouts->layouts[i].n_lines,
+		header->n_lines))
+	    goto corrupt;
+    }
+    for(i = 0; i < header->n_lines; i++) {
+	if(! checkRange(layouts->lines[i].first_run, layouts->lines[i].n_runs,
+		header->n_runs))
+	    goto corrupt;
+    }
+    for(i = 0; i < header->n_runs; i++) {
+	if(layouts->runs[i].font >= header->n_fonts
+	    || ! checkRange(layouts->runs[i].first_glyph, layouts->runs[i].n_glyphs,
+		header->n_glyphs))
+	    goto corrupt;
+    }
+    return TRUE;
+
+corrupt:
+    SDL_SetError("compiled layout file is corrupt");
+    return FALSE;
+}
+
+/*!
+    Open a file of compiled layouts.
+    The file is mapped in memory, not read, and is checked once here.
+
+    @param *filename [in] File written by SDLPangoDraw_WriteCompiledLayouts
+    @return The compiled layouts, or NULL on error
+*/
+SDLPangoDraw_CompiledLayouts *
+SDLPangoDraw_OpenCompiledLayouts(
+    const char *filename)
+{
+    SDLPangoDraw_CompiledLayouts *layouts;
+    GMappedFile *file;
+    GError *error = NULL;
+    const char *data;
+    gsize length;
+    Uint32 i;
+
+    file = g_mapped_file_new(filename, FALSE, &error);
+    if(! file) {
+	SDL_SetError("%s", error->message);
+	g_error_free(error);
+	return NULL;
+    }
+    data = g_mapped_file_get_contents(file);
+    length = g_mapped_file_get_length(file);
+
+    layouts = g_malloc(sizeof(SDLPangoDraw_CompiledLayouts));
+    layouts->file = file;
+    layouts->header = (const compiledHeader *)data;
+    if(length >= sizeof(compiledHeader)) {
+	const compiledHeader *header = layouts->header;
+
+	layouts->fonts = (const compiledFont *)(data + header->fonts_offset);
+	layouts->layouts = (const compiledLayout *)(data + header->layouts_offset);
+	layouts->lines = (const compiledLine *)(data + header->lines_offset);
+	layouts->runs = (const compiledRun *)(data + header->runs_offset);
+	layouts->glyphs = (const compiledGlyph *)(data + header->glyphs_offset);
+	layouts->strings = data + header->strings_offset;
+    }
+    if(! validateCompiledLayouts(layouts, length)) {
+	g_mapped_file_unref(file);
+	g_free(layouts);
+	return NULL;
+    }
+
+    layouts->names = g_hash_table_new(g_str_hash, g_str_equal);
+    for(i = 0; i < layouts->header->n_layouts; i++) {
+	g_hash_table_insert(layouts->names,
+	    (gpointer)(layouts->strings + layouts->layouts[i].name),
+	    GUINT_TO_POINTER(i + 1));
+    }
+    layouts->font_map = NULL;
+    layouts->loaded_fonts = g_new0(PangoFont *, layouts->header->n_fonts);
+
+    return layouts;
+}
+
+/*!
+    Release the fonts loaded for compiled layouts.
+*/
+static void
+unloadCompiledFonts(
+    SDLPangoDraw_CompiledLayouts *layouts)
+{
+    Uint32 i;
+
+    for(i = 0; i < layouts->header->n_fonts; i++) {
+	if(layouts->loaded_fonts[i]) {
+	    g_object_unref(layouts->loaded_fonts[i]);
+	    layouts->loaded_fonts[i] = NULL;
+	}
+    }
+    layouts->font_map = NULL;
+}
+
+/*!
+    Close a file of compiled layouts.
+
+    @param *layouts [i/o] Compiled layouts
+*/
+void
+SDLPangoDraw_CloseCompiledLayouts(
+    SDLPangoDraw_CompiledLayouts *layouts)
+{
+    if(! layouts)
+	return;
+
+    unloadCompiledFonts(layouts);
+    g_free(layouts->loaded_fonts);
+    g_hash_table_destroy(layouts->names);
+    g_mapped_file_unref(layouts->file);
+    g_free(layouts);
+}
+
+/*!
+    Find a compiled layout by name.
+
+    @param *layouts [in] Compiled layouts
+    @param *name [in] Name given to SDLPangoDraw_AddCompiledLayout
+    @return Index of the layout, or -1 if there is none
+*/
+int
+SDLPangoDraw_FindCompiledLayout(
+    SDLPangoDraw_CompiledLayouts *layouts,
+    const char *name)
+{
+    return (int)GPOINTER_TO_UINT(g_hash_table_lookup(layouts->names, name)) - 1;
+}
+
+/*!
+    Get the size of a compiled layout.
+
+    @param *layouts [in] Compiled layouts
+    @param index [in] Index of the layout
+    @param *width [out] Width. May be NULL.
+    @param *height [out] Height. May be NULL.
+    @return 0 on success, -1 if there is no such layout
+*/
+int
+SDLPangoDraw_GetCompiledLayoutSize(
+    SDLPangoDraw_CompiledLayouts *layouts,
+    int index,
+    int *width, int *height)
+{
+    const compiledLayout *layout;
+
+    if(index < 0 || (Uint32)index >= layouts->header->n_layouts) {
+	SDL_SetError("no such compiled layout");
+	return -1;
+    }
+    layout = &layouts->layouts[index];
+    if(width)
+	*width = PANGO_PIXELS (layout->width);
+    if(height)
+	*height = PANGO_PIXELS (layout->height);
+    return 0;
+}
+
+/*!
+    Get a font of compiled layouts, loading it from the font map of
+    a context the first time.
+    The font must come from the same face as when the layouts were
+    compiled, or its glyph ids would draw other glyphs.
+
+    @param *layouts [i/o] Compiled layouts
+    @param *context [in] Context
+    @param index [in] Index of the font
+    @return The font, or NULL if it cannot be loaded or is another face
+*/
+static PangoFont *
+loadCompiledFont(
+    SDLPangoDraw_CompiledLayouts *layouts,
+    SDLPangoDraw_Context *context,
+    Uint32 index)
+{
+    const compiledFont *record = &layouts->fonts[index];
+    const char *family = layouts->strings + record->family;
+    const char *style = layouts->strings + record->style;
+    const char *file = layouts->strings + record->file;
+    PangoFontDescription *desc;
+    PangoFont *font;
+    faceIdentity face;
+
+    if(layouts->font_map != context->font_map) {
+	unloadCompiledFonts(layouts);
+	layouts->font_map = context->font_map;
+    }
+    if(layouts->loaded_fonts[index])
+	return layouts->loaded_fonts[index];
+
+    desc = pango_font_description_from_string(layouts->strings + record->name);
+    pango_font_description_set_absolute_size(desc, record->size);
+    font = pango_font_map_load_font(context->font_map, context->context, desc);
+    pango_font_description_free(desc);
+    if(! font) {
+	SDL_SetError("cannot load compiled font %s %s", family, style);
+	return NULL;
+    }
+
+    if(! identifyFace(font, &face)
+	|| strcmp(face.family, family) != 0
+	|| strcmp(face.style, style) != 0
+	|| strcmp(face.file, file) != 0
+	|| face.face_index != record->face_index
+	|| face.n_glyphs != record->n_glyphs)
+    {
+	SDL_SetError("compiled font %s %s (%s, %u glyphs) is not available",
+	    family, style, file, record->n_glyphs);
+	g_object_unref(font);
+	return NULL;
+    }
+
+    layouts->loaded_fonts[index] = font;
+    context->buffer_growths++;
+
+    return font;
+}
+
+/*!
+    Draw a compiled layout, like SDLPangoDraw_Draw draws the text of a
+    context. Nothing is parsed, itemized or shaped: the glyphs are drawn
+    from the file, with the default color of the context.
+    Effects are not drawn.
+    Every font of the layout must load the face it was compiled with from
+    the font map of the context; if one does not, nothing is drawn.
+
+    @param *context [i/o] Context to draw with
+    @param *layouts [i/o] Compiled layouts
+    @param index [in] Index of the layout
+    @param *surface [out] Surface to draw on
+    @param x [in] X of left-top of drawing area
+    @param y [in] Y of left-top of drawing area
+    @return 0 on success, -1 on error, such as a font that is not available
+*/
+int
+SDLPangoDraw_DrawCompiledLayout(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_CompiledLayouts *layouts,
+    int index,
+    SDL_Surface *surface,
+    int x, int y)
+{
+    const compiledLayout *layout;
+    Uint32 i, j;
+
+    adoptPrewarm(context);
+
+    context->buffer_growths = 0;
+
+    if(! surface) {
+	SDL_SetError("surface is NULL");
+	return -1;
+    }
+    if(index < 0 || (Uint32)index >= layouts->header->n_layouts) {
+	SDL_SetError("no such compiled layout");
+	return -1;
+    }
+    layout = &layouts->layouts[index];
+
+    /* Load every font first, so that a missing one draws nothing. */
+    for(i = 0; i < layout->n_lines; i++) {
+	const compiledLine *line = &layouts->lines[layout->first_line + i];
+
+	for(j = 0; j < line->n_runs; j++) {
+	    if(! loadCompiledFont(layouts, context, layouts->runs[line->first_run + j].font))
+		return -1;
+	}
+    }
+
+    if(PANGO_PIXELS (layout->width) && PANGO_PIXELS (layout->height)) {
+	SDL_FillRect(surface, NULL, SDL_MapRGBA(surface->format, 0, 0, 0, 0));
+    }
+
+    if(! context->compiled_glyphs) {
+	context->compiled_glyphs = pango_glyph_string_new();
+	context->buffer_growths++;
+    }
+
+    for(i = 0; i < layout->n_lines; i++) {
+	const compiledLine *line = &layouts->lines[layout->first_line + i];
+
+	for(j = 0; j < line->n_runs; j++) {
+	    const compiledRun *run = &layouts->runs[line->first_run + j];
+	    PangoGlyphString *glyphs = context->compiled_glyphs;
+	    PangoFont *font = layouts->loaded_fonts[run->font];
+	    runStyle style;
+	    Uint32 k;
+
+	    if((Uint32)glyphs->space < run->n_glyphs)
+		context->buffer_growths++;
+	    pango_glyph_string_set_size(glyphs, run->n_glyphs);
+	    for(k = 0; k < run->n_glyphs; k++) {
+		const compiledGlyph *glyph = &layouts->glyphs[run->first_glyph + k];
+
+		glyphs->glyphs[k].glyph = glyph->glyph;
+		glyphs->glyphs[k].geometry.width = glyph->width;
+		glyphs->glyphs[k].geometry.x_offset = glyph->x_offset;
+		glyphs->glyphs[k].geometry.y_offset = glyph->y_offset;
+		glyphs->log_clusters[k] = 0;
+	    }
+
+	    style.uline = (PangoUnderline)(run->flags >> COMPILED_ULINE_SHIFT);
+	    style.strike = (run->flags & COMPILED_STRIKE) != 0;
+	    style.fg_set = (run->flags & COMPILED_FG_SET) != 0;
+	    style.bg_set = (run->flags & COMPILED_BG_SET) != 0;
+	    style.shape_set = (run->flags & COMPILED_SHAPE_SET) != 0;
+	    style.fg_color.red = (guint16)run->fg_color[0];
+	    style.fg_color.green = (guint16)run->fg_color[1];
+	    style.fg_color.blue = (guint16)run->fg_color[2];
+	    style.bg_color.red = (guint16)run->bg_color[0];
+	    style.bg_color.green = (guint16)run->bg_color[1];
+	    style.bg_color.blue = (guint16)run->bg_color[2];
+	    style.rise = run->rise;
+	    style.ink_rect.x = run->ink_rect[0];
+	    style.ink_rect.y = run->ink_rect[1];
+	    style.ink_rect.width = run->ink_rect[2];
+	    style.ink_rect.height = run->ink_rect[3];
+	    style.logical_rect.x = run->logical_rect[0];
+	    style.logical_rect.y = run->logical_rect[1];
+	    style.logical_rect.width = run->logical_rect[2];
+	    style.logical_rect.height = run->logical_rect[3];
+
+	    drawRun(context, surface, &style, font, glyphs,
+		x + PANGO_PIXELS (line->x), run->x_off,
+		y + PANGO_PIXELS (line->y),
+		PANGO_PIXELS (line->height),
+		PANGO_PIXELS (line->baseline - line->y));
+	}
+    }
+
+    enforceMemoryBudget(context);
+    return 0;
+}
+
+#define PREWARM_WIDTH 1024
+
+/*!
+    A callback waiting for a prewarm job.
+*/
+typedef struct _prewarmCallback {
+    SDLPangoDraw_PrewarmFunc func;
+    void *userdata;
+} prewarmCallback;
+
+/*!
+    Fonts and glyphs being loaded by a background thread for a context.
+    The thread works on a context of its own, with its own font map, so
+    it never touches the context it warms. When it is done, the context
+    takes over its font map.
+*/
+typedef struct _prewarmJob {
+    GThread *thread;
+    gint done;			/*!< Set by the thread when warm is ready */
+    char *text;			/*!< Text to lay out and rasterize */
+    char *font_desc;
+    double dpi_x, dpi_y;
+    PangoLanguage *language;
+    PangoDirection base_dir;
+    SDLPangoDraw_RenderMode render_mode;
+    SDLPangoDraw_Context *warm;	/*!< Context of the thread */
+    GSList *callbacks;		/*!< prewarmCallback, called when adopted */
+} prewarmJob;
+
+/*!
+    Body of the prewarm thread: resolve the fonts of the text, load their
+    faces and rasterize every glyph once, so that they are in the caches of
+    the font map. Shaped runs go to the shared shaped-run cache on the way.
+
+    @param data [i/o] Job
+    @return NULL
+*/
+static gpointer
+prewarmThread(
+    gpointer data)
+{
+    prewarmJob *job = data;
+    SDLPangoDraw_Context *warm;
+    SDL_Surface *surface;
+    lineCursor cursor;
+    int height = 1;
+    int n_lines = 0;
+    int i;
+
+    /* The font map is created, and changed by the render mode, under
+       font_map_lock like those of the other threads. */
+    warm = SDLPangoDraw_CreateContext_GivenFontDesc(job->font_desc);
+    SDLPangoDraw_SetDpi(warm, job->dpi_x, job->dpi_y);
+    pango_context_set_language (warm->context, job->language);
+    pango_context_set_base_dir (warm->context, job->base_dir);
+    SDLPangoDraw_SetRenderMode(warm, job->render_mode);
+    SDLPangoDraw_SetMinimumSize(warm, PREWARM_WIDTH, 0);
+    SDLPangoDraw_SetText(warm, job->text, -1);
+
+    /* One line at a time, on a surface one line high. */
+    openLines(&cursor, warm, warm->layout);
+    do {
+	height = MAX(height, PANGO_PIXELS (cursor.line.logical_rect.height));
+	n_lines++;
+    } while (nextLine(&cursor));
+    closeLines(&cursor);
+
+    surface = SDL_CreateRGBSurface(SDL_SWSURFACE, PREWARM_WIDTH, height, DEFAULT_DEPTH,
+	DEFAULT_RMASK, DEFAULT_GMASK, DEFAULT_BMASK, DEFAULT_AMASK);
+    if(surface) {
+	for(i = 0; i < n_lines; i++)
+	    drawLayoutLines(warm, surface, warm->layout, 0, 0, i, 1);
+	SDL_FreeSurface(surface);
+    }
+
+    job->warm = warm;
+    g_atomic_int_set(&job->done, 1);
+    return NULL;
+}
+
+/*!
+    Start a prewarm job for the text waiting in a context.
+
+    @param *context [i/o] Context
+*/
+static void
+startPrewarm(
+    SDLPangoDraw_Context *context)
+{
+    prewarmJob *job = g_new(prewarmJob, 1);
+    GString *text = g_string_new(context->prewarm_text->str);
+
+    /* The new font map replaces the current one, so everything warmed
+       before is warmed again: every sample so far, and the text of the
+       context. */
+    g_string_append_c(text, '\n');
+    g_string_append(text, pango_layout_get_text (context->layout));
+
+    job->done = 0;
+    job->text = g_string_free(text, FALSE);
+    job->font_desc = pango_font_description_to_string(context->font_desc);
+    job->dpi_x = context->dpi_x;
+    job->dpi_y = context->dpi_y;
+    job->language = pango_context_get_language (context->context);
+    job->base_dir = pango_context_get_base_dir (context->context);
+    job->render_mode = context->render_mode;
+    job->warm = NULL;
+    job->callbacks = context->prewarm_callbacks;
+    context->prewarm_callbacks = NULL;
+    context->prewarm_waiting = FALSE;
+
+    context->prewarm = job;
+    job->thread = g_thread_new("SDL_PangoDraw prewarm", prewarmThread, job);
+}
+
+/*!
+    Wait for a prewarm job and free it.
+
+    @param *job [i/o] Job
+*/
+static void
+freePrewarmJob(
+    prewarmJob *job)
+{
+    GSList *tmp_list;
+
+    if(job->thread)
+	g_thread_join(job->thread);
+    if(job->warm)
+	SDLPangoDraw_FreeContext(job->warm);
+    for(tmp_list = job->callbacks; tmp_list; tmp_list = tmp_list->next)
+	g_free(tmp_list->data);
+    g_slist_free(job->callbacks);
+    g_free(job->text);
+    g_free(job->font_desc);
+    g_free(job);
+}
+
+/*!
+    Take over the font map of a finished prewarm job, and call its
+    callbacks. Runs on the thread of the context, so the switch is atomic
+    for the draws.
+
+    @param *context [i/o] Context
+    @return TRUE if a job is still running
+*/
+static gboolean
+adoptPrewarm(
+    SDLPangoDraw_Context *context)
+{
+    prewarmJob *job = context->prewarm;
+    GSList *tmp_list;
+
+    if(! job)
+	return FALSE;
+    if(! g_atomic_int_get(&job->done))
+	return TRUE;
+
+    g_thread_join(job->thread);
+    job->thread = NULL;
+
+    checkShapedText(context);
+    g_mutex_lock(&font_map_lock);
+    g_object_unref(context->font_map);
+    g_mutex_unlock(&font_map_lock);
+    context->font_map = g_object_ref(job->warm->font_map);
+    pango_context_set_font_map (context->context, context->font_map);
+    if(job->dpi_x != context->dpi_x || job->dpi_y != context->dpi_y)
+	pango_ft2_font_map_set_resolution (PANGO_FT2_FONT_MAP (context->font_map),
+	    context->dpi_x, context->dpi_y);
+    g_hash_table_remove_all(context->font_names);
+    pango_layout_context_changed (context->layout);
+    context->index_valid = FALSE;
+    reshapeText(context);
+
+    context->prewarm = NULL;
+    for(tmp_list = job->callbacks; tmp_list; tmp_list = tmp_list->next) {
+	prewarmCallback *callback = tmp_list->data;
+
+	callback->func(context, callback->userdata);
+    }
+    freePrewarmJob(job);
+
+    /* A callback may have started a job already. */
+    if(context->prewarm_waiting && ! context->prewarm)
+	startPrewarm(context);
+    return context->prewarm != NULL;
+}
+
+/*!
+    Warm the fonts of a context for some text, on a background thread:
+    resolve the fallback fonts, load their faces, shape the text and
+    rasterize its glyphs, so that the first draw of text like it does not
+    stall. Give the text itself, or just the characters it uses.
+
+    The thread works with a font map of its own. When it is done, the
+    context switches to that font map at its next draw, or at
+    SDLPangoDraw_PollPrewarm, and then calls the callback, on the thread
+    that draws. While a job runs, further calls are queued and warmed
+    together by the next job. Each job warms every sample given so far and
+    the text of the context, so nothing warmed is lost with the switch.
+    Glyph atlases and damage tracking key on the fonts, so they miss once
+    after each switch.
+
+    @param *context [i/o] Context
+    @param *text [in] Sample text or characters (UTF-8)
+    @param callback [in] Function to call when the fonts are in use, or NULL
+    @param *userdata [in] Passed to the callback
+*/
+void
+SDLPangoDraw_Prewarm(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    SDLPangoDraw_PrewarmFunc callback,
+    void *userdata)
+{
+    g_string_append(context->prewarm_text, text);
+    g_string_append_c(context->prewarm_text, '\n');
+
+    if(callback) {
+	prewarmCallback *entry = g_new(prewarmCallback, 1);
+
+	entry->func = callback;
+	entry->userdata = userdata;
+	context->prewarm_callbacks = g_slist_append(context->prewarm_callbacks, entry);
+    }
+
+    if(context->prewarm)
+	context->prewarm_waiting = TRUE;
+    else
+	startPrewarm(context);
+}
+
+/*!
+    Switch a context to the fonts of a finished prewarm job, if any, and
+    call its callbacks. Draws do this too.
+
+    @param *context [i/o] Context
+    @return 1 if a prewarm job is still running, 0 otherwise
+*/
+int
+SDLPangoDraw_PollPrewarm(
+    SDLPangoDraw_Context *context)
+{
+    return adoptPrewarm(context) ? 1 : 0;
+}
+
+#define RENDER_IDLE_CONTEXTS 8
+
+/*!
+    A text rendered by the render threads.
+*/
+typedef struct _renderTicketImpl {
+    char *font_desc;		/*!< Font description, or NULL */
+    char *markup;
+    int width;
+    double dpi;
+    SDLPangoDraw_Matrix color_matrix;
+    SDLPangoDraw_RenderFunc callback;
+    void *userdata;
+    gboolean done;		/*!< Guarded by render_lock */
+    SDL_Surface *surface;	/*!< The result, once done */
+} renderTicketImpl;
+
+/*!
+    A context kept by the render threads between tickets.
+*/
+typedef struct _renderContext {
+    char *font_desc;
+    SDLPangoDraw_Context *context;
+} renderContext;
+
+/* Everything below is guarded by render_lock. */
+static GMutex render_lock;
+static GCond render_done;
+static GThreadPool *render_pool = NULL;
+static GQueue render_contexts = G_QUEUE_INIT;	/* renderContext, most recent first */
+static GSList *render_finished = NULL;		/* Tickets whose callback is due */
+
+/*!
+    Take an idle render context for a font, or create one.
+
+    @param *font_desc [in] Font description, or NULL for the default
+    @return Context
+*/
+static SDLPangoDraw_Context *
+takeRenderContext(
+    const char *font_desc)
+{
+    SDLPangoDraw_Context *context = NULL;
+    GList *tmp_list;
+
+    g_mutex_lock(&render_lock);
+    for(tmp_list = render_contexts.head; tmp_list; tmp_list = tmp_list->next) {
+	renderContext *entry = tmp_list->data;
+
+	if(g_strcmp0(entry->font_desc, font_desc) == 0) {
+	    context = entry->context;
+	    g_queue_delete_link(&render_contexts, tmp_list);
+	    g_free(entry->font_desc);
+	    g_free(entry);
+	    break;
+	}
+    }
+    g_mutex_unlock(&render_lock);
+
+    if(context)
+	return context;
+    if(font_desc)
+	return SDLPangoDraw_CreateContext_GivenFontDesc(font_desc);
+    return SDLPangoDraw_CreateContext();
+}
+
+/*!
+    Give a render context back, for later tickets with the same font.
+    The least recently used contexts are freed.
+
+    @param *font_desc [in] Font description of the context, or NULL
+    @param *context [in] Context
+*/
+static void
+giveRenderContext(
+    const char *font_desc,
+    SDLPangoDraw_Context *context)
+{
+    renderContext *entry = g_new(renderContext, 1);
+    renderContext *evicted = NULL;
+
+    entry->font_desc = g_strdup(font_desc);
+    entry->context = context;
+
+    g_mutex_lock(&render_lock);
+    g_queue_push_head(&render_contexts, entry);
+    if(g_queue_get_length(&render_contexts) > RENDER_IDLE_CONTEXTS)
+	evicted = g_queue_pop_tail(&render_contexts);
+    g_mutex_unlock(&render_lock);
+
+    if(evicted) {
+	SDLPangoDraw_FreeContext(evicted->context);
+	g_free(evicted->font_desc);
+	g_free(evicted);
+    }
+}
+
+/*!
+    Render a ticket on a render thread.
+
+    @param data [i/o] Ticket
+    @param user_data [in] Unused
+*/
+static void
+renderThread(
+    gpointer data,
+    gpointer user_data)
+{
+    renderTicketImpl *ticket = data;
+    SDLPangoDraw_Context *context = takeRenderContext(ticket->font_desc);
+    SDL_Surface *surface;
+
+    /* Contexts are shared between tickets, so every setting is made. */
+    SDLPangoDraw_SetDpi(context, ticket->dpi, ticket->dpi);
+    SDLPangoDraw_SetDefaultColor(context, &ticket->color_matrix);
+    SDLPangoDraw_SetMinimumSize(context, ticket->width, 0);
+    SDLPangoDraw_SetMarkup(context, ticket->markup, -1);
+    surface = SDLPangoDraw_CreateSurfaceDraw(context);
+    SDLPangoDraw_SetText(context, "", -1);
+
+    giveRenderContext(ticket->font_desc, context);
+
+    g_mutex_lock(&render_lock);
+    ticket->surface = surface;
+    ticket->done = TRUE;
+    if(ticket->callback)
+	render_finished = g_slist_append(render_finished, ticket);
+    g_cond_broadcast(&render_done);
+    g_mutex_unlock(&render_lock);
+}
+
+/*!
+    Submit text to render on the render threads of the library.
+    The threads have contexts of their own; the params are copied, so
+    they may be freed right after the call. Get the result with
+    SDLPangoDraw_FinishRender.
+
+    @param *params [in] What to render
+    @return Ticket, or NULL on error
+*/
+SDLPangoDraw_RenderTicket *
+SDLPangoDraw_SubmitRender(
+    const SDLPangoDraw_RenderParams *params)
+{
+    renderTicketImpl *ticket;
+
+    if(! params || ! params->markup) {
+	SDL_SetError("no markup to render");
+	return NULL;
+    }
+
+    ticket = g_new(renderTicketImpl, 1);
+    ticket->font_desc = g_strdup(params->font_desc);
+    ticket->markup = g_strdup(params->markup);
+    ticket->width = params->width;
+    ticket->dpi = params->dpi > 0 ? params->dpi : DEFAULT_DPI;
+    ticket->color_matrix = params->color_matrix
+	? *params->color_matrix : *MATRIX_TRANSPARENT_BACK_BLACK_LETTER;
+    ticket->callback = params->callback;
+    ticket->userdata = params->userdata;
+    ticket->done = FALSE;
+    ticket->surface = NULL;
+
+    g_mutex_lock(&render_lock);
+    if(! render_pool)
+	render_pool = g_thread_pool_new(renderThread, NULL,
+	    MAX(1, (int)g_get_num_processors()), FALSE, NULL);
+    g_thread_pool_push(render_pool, ticket, NULL);
+    g_mutex_unlock(&render_lock);
+
+    return ticket;
+}
+
+/*!
+    Check whether a ticket is rendered.
+
+    @param *ticket [in] Ticket
+    @return 1 if rendered, 0 if not yet
+*/
+int
+SDLPangoDraw_PollRender(
+    SDLPangoDraw_RenderTicket *ticket)
+{
+    gboolean done;
+
+    g_mutex_lock(&render_lock);
+    done = ticket->done;
+    g_mutex_unlock(&render_lock);
+
+    return done ? 1 : 0;
+}
+
+/*!
+    Wait until a ticket is rendered.
+
+    @param *ticket [in] Ticket
+*/
+void
+SDLPangoDraw_WaitRender(
+    SDLPangoDraw_RenderTicket *ticket)
+{
+    g_mutex_lock(&render_lock);
+    while(! ticket->done)
+	g_cond_wait(&render_done, &render_lock);
+    g_mutex_unlock(&render_lock);
+}
+
+/*!
+    Take the surface of a ticket and free the ticket. Waits if the ticket
+    is not rendered yet. Its callback is not called after this.
+
+    @param *ticket [in] Ticket
+    @return Surface, to be freed with SDL_FreeSurface. NULL on error.
+*/
+SDL_Surface *
+SDLPangoDraw_FinishRender(
+    SDLPangoDraw_RenderTicket *ticket)
+{
+    SDL_Surface *surface;
+
+    g_mutex_lock(&render_lock);
+    while(! ticket->done)
+	g_cond_wait(&render_done, &render_lock);
+    render_finished = g_slist_remove(render_finished, ticket);
+    g_mutex_unlock(&render_lock);
+
+    surface = ticket->surface;
+    if(! surface)
+	SDL_SetError("rendering failed");
+
+    g_free(ticket->font_desc);
+    g_free(ticket->markup);
+    g_free(ticket);
+
+    return surface;
+}
+
+/*!
+    Call the callbacks of the rendered tickets, on the calling thread.
+    Call this from the main loop when callbacks are used.
+
+    @return Number of callbacks called
+*/
+int
+SDLPangoDraw_DispatchRenders()
+{
+    GSList *finished;
+    GSList *tmp_list;
+    int count = 0;
+
+    g_mutex_lock(&render_lock);
+    finished = render_finished;
+    render_finished = NULL;
+    g_mutex_unlock(&render_lock);
+
+    for(tmp_list = finished; tmp_list; tmp_list = tmp_list->next) {
+	renderTicketImpl *ticket = tmp_list->data;
+
+	ticket->callback(ticket, ticket->userdata);
+	count++;
+    }
+    g_slist_free(finished);
+
+    return count;
+}
+
+/*!
+    Premultiply the colors of a matrix by their alpha.
+    Interpolating between premultiplied colors by the coverage of a pixel
+    gives the premultiplied color of the pixel.
+
+    @param *matrix [i/o] Matrix
+*/
+static void
+premultiplyMatrix(
+    SDLPangoDraw_Matrix *matrix)
+{
+    int n, k;
+
+    for(k = 0; k < 2; k++) {
+	for(n = 0; n < 3; n++)
+	    matrix->m[n][k] = (Uint8)DIV255(matrix->m[n][k] * matrix->m[3][k]);
+    }
+}
+
+/*!
+    Specify whether to draw premultiplied colors: R, G and B multiplied by
+    A. Surfaces drawn this way are to be composited with
+    SDLPangoDraw_BlitPremultiplied, not SDL_BlitSurface.
+    Drawing on a renderer is not affected.
+
+    @param *context [i/o] Context
+    @param premultiplied [in] Non-zero to draw premultiplied colors
+*/
+void
+SDLPangoDraw_SetPremultiplied(
+    SDLPangoDraw_Context *context,
+    int premultiplied)
+{
+    context->premultiplied = premultiplied ? TRUE : FALSE;
+    context->damage_valid = FALSE;
+}
+
+/*!
+    Composite a row of premultiplied pixels over a row with the same R, G
+    and B layout: d = s + d * (255 - a) / 255 for every byte.
+
+    @param *src [in] Source pixels
+    @param *dst [i/o] Destination pixels
+    @param width [in] Number of pixels
+    @param ashift [in] Shift of the alpha of the source pixels
+*/
+static void
+blendRowPremultiplied(
+    const Uint32 *src,
+    Uint32 *dst,
+    int width,
+    int ashift)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi8((char)0xff);
+	const __m128i bias = _mm_set1_epi16(128);
+	const __m128i low = _mm_set1_epi32(0xff);
+	const __m128i shift = _mm_cvtsi32_si128(ashift);
+
+	for(; i + 4 <= width; i += 4) {
+	    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+	    __m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+	    __m128i a = _mm_and_si128(_mm_srl_epi32(s, shift), low);
+	    __m128i inv, lo, hi;
+
+	    /* 255 - alpha in every byte of each pixel */
+	    a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+	    a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+	    inv = _mm_xor_si128(a, ones);
+
+	    lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(inv, zero));
+	    hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(inv, zero));
+	    lo = _mm_add_epi16(lo, bias);
+	    hi = _mm_add_epi16(hi, bias);
+	    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+	    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+	    d = _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+	    _mm_storeu_si128((__m128i *)(dst + i), d);
+	}
+    }
+#endif
+
+    /* Two bytes at a time in the rest */
+    for(; i < width; i++) {
+	Uint32 s = src[i];
+	Uint32 a = (s >> ashift) & 0xff;
+	Uint32 d = dst[i];
+	Uint32 rb, ag;
+
+	if(a == 0)
+	    continue;
+	if(a == 255) {
+	    dst[i] = s;
+	    continue;
+	}
+	rb = (d & 0x00ff00ff) * (255 - a) + 0x00800080;
+	ag = ((d >> 8) & 0x00ff00ff) * (255 - a) + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+	ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+	dst[i] = s + (rb | ag);
+    }
+}
+
+/*!
+    Composite a surface drawn with premultiplied colors over an opaque
+    surface, such as the frame buffer. This is much faster than
+    SDL_BlitSurface with per-pixel alpha, above all when both surfaces are
+    32 bits with R, G and B at the same places, where SSE2 is used if the
+    compiler targets it. SDLPangoDraw_SetSurfaceCreateArgs can give the
+    surfaces of a context the layout of the frame buffer.
+    The rects work like those of SDL_BlitSurface, and the clip rect of
+    the destination is honored.
+
+    @param *src [in] Source surface, 32 bits with alpha
+    @param *srcrect [in] Rect to copy, or NULL for the whole surface
+    @param *dst [i/o] Destination surface, 16 or 32 bits
+    @param *dstrect [i/o] Position in the destination, or NULL for (0, 0).
+	Set to the rect that was drawn.
+    @return 0 on success, -1 on error
+*/
+int
+SDLPangoDraw_BlitPremultiplied(
+    SDL_Surface *src,
+    SDL_Rect *srcrect,
+    SDL_Surface *dst,
+    SDL_Rect *dstrect)
+{
+    const SDL_PixelFormat *sf = src->format;
+    const SDL_PixelFormat *df = dst->format;
+    const SDL_Rect *clip = &dst->clip_rect;
+    int sx = 0, sy = 0, w = src->w, h = src->h;
+    int dx = 0, dy = 0;
+    gboolean fast;
+    int i, j;
+
+    if(sf->BytesPerPixel != 4 || sf->Amask == 0) {
+	SDL_SetError("source must be 32 bits with alpha");
+	return -1;
+    }
+    if(df->BytesPerPixel != 2 && df->BytesPerPixel != 4) {
+	SDL_SetError("surface->format->BytesPerPixel is invalid value");
+	return -1;
+    }
+
+    if(srcrect) {
+	sx = srcrect->x;
+	sy = srcrect->y;
+	w = srcrect->w;
+	h = srcrect->h;
+    }
+    if(dstrect) {
+	dx = dstrect->x;
+	dy = dstrect->y;
+    }
+
+    /* Clip to the source, then to the clip rect of the destination. */
+    if(sx < 0) { w += sx; dx -= sx; sx = 0; }
+    if(sy < 0) { h += sy; dy -= sy; sy = 0; }
+    w = MIN(w, src->w - sx);
+    h = MIN(h, src->h - sy);
+    if(dx < clip->x) { w -= clip->x - dx; sx += clip->x - dx; dx = clip->x; }
+    if(dy < clip->y) { h -= clip->y - dy; sy += clip->y - dy; dy = clip->y; }
+    w = MIN(w, clip->x + clip->w - dx);
+    h = MIN(h, clip->y + clip->h - dy);
+
+    if(dstrect) {
+	dstrect->x = dx;
+	dstrect->y = dy;
+	dstrect->w = MAX(w, 0);
+	dstrect->h = MAX(h, 0);
+    }
+    if(w <= 0 || h <= 0)
+	return 0;
+
+    if(SDL_LockSurface(src)) {
+	SDL_SetError("surface lock failed");
+	return -1;
+    }
+    if(SDL_LockSurface(dst)) {
+	SDL_UnlockSurface(src);
+	SDL_SetError("surface lock failed");
+	return -1;
+    }
+
+    fast = df->BytesPerPixel == 4
+	&& df->Rmask == sf->Rmask && df->Gmask == sf->Gmask && df->Bmask == sf->Bmask;
+
+    for(j = 0; j < h; j++) {
+	const Uint32 *s = (const Uint32 *)((Uint8 *)src->pixels + (sy + j) * src->pitch) + sx;
+	Uint8 *d = (Uint8 *)dst->pixels + (dy + j) * dst->pitch + dx * df->BytesPerPixel;
+
+	if(fast) {
+	    blendRowPremultiplied(s, (Uint32 *)d, w, sf->Ashift);
+	    continue;
+	}
+
+	for(i = 0; i < w; i++) {
+	    Uint32 a = (s[i] & sf->Amask) >> sf->Ashift;
+	    Uint32 value;
+	    Uint8 r, g, b;
+
+	    if(a == 0)
+		continue;
+
+	    value = df->BytesPerPixel == 2 ? ((Uint16 *)d)[i] : ((Uint32 *)d)[i];
+	    SDL_GetRGB(value, dst->format, &r, &g, &b);
+	    r = (Uint8)(((s[i] & sf->Rmask) >> sf->Rshift) + DIV255(r * (255 - a)));
+	    g = (Uint8)(((s[i] & sf->Gmask) >> sf->Gshift) + DIV255(g * (255 - a)));
+	    b = (Uint8)(((s[i] & sf->Bmask) >> sf->Bshift) + DIV255(b * (255 - a)));
+	    value = SDL_MapRGB(dst->format, r, g, b);
+
+	    if(df->BytesPerPixel == 2)
+		((Uint16 *)d)[i] = (Uint16)value;
+	    else
+		((Uint32 *)d)[i] = value;
+	}
+    }
+
+    SDL_UnlockSurface(dst);
+    SDL_UnlockSurface(src);
+
+    return 0;
+}
+
+/*!
+    A color of a matrix in YUV, with its alpha.
+    Index 0 is the background and 1 the letter, as in the matrix.
+*/
+typedef struct _yuvColor {
+    int y[2], u[2], v[2], a[2];
+} yuvColor;
+
+/*!
+    Convert the colors of a matrix to limited-range YUV.
+
+    @param *color_matrix [in] Matrix
+    @param color_space [in] BT.601 or BT.709
+    @param *color [out] Colors
+*/
+static void
+matrixToYUV(
+    const SDLPangoDraw_Matrix *color_matrix,
+    SDLPangoDraw_YUVColorSpace color_space,
+    yuvColor *color)
+{
+    int k;
+
+    for(k = 0; k < 2; k++) {
+	int r = color_matrix->m[0][k];
+	int g = color_matrix->m[1][k];
+	int b = color_matrix->m[2][k];
+
+	if(color_space == SDLPANGODRAW_YUV_BT709) {
+	    color->y[k] = 16 + ((47 * r + 157 * g + 16 * b + 128) >> 8);
+	    color->u[k] = 128 + ((-26 * r - 87 * g + 112 * b + 128) >> 8);
+	    color->v[k] = 128 + ((112 * r - 102 * g - 10 * b + 128) >> 8);
+	} else {
+	    color->y[k] = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+	    color->u[k] = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+	    color->v[k] = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+	}
+	color->a[k] = color_matrix->m[3][k];
+    }
+}
+
+/*!
+    Blend a coverage mask over a YUV frame with the colors of a matrix.
+    Each luma pixel is blended with its own coverage. Each chroma sample
+    is blended with the colors and alphas of the luma pixels it covers
+    that are in the area, so nothing outside the area is touched. The
+    matrix is converted once per call, which is once per run of glyphs.
+
+    @param *frame [i/o] Frame
+    @param *color_matrix [in] Foreground and background color
+    @param *coverage [in] Coverage of the area, 0 to 255
+    @param pitch [in] Bytes from a row of coverage to the next
+    @param x [in] X of left-top of the area, inside the frame
+    @param y [in] Y of left-top of the area, inside the frame
+    @param width [in] Width of the area, inside the frame
+    @param height [in] Height of the area, inside the frame
+*/
+static void
+blendYUV(
+    const SDLPangoDraw_YUVFrame *frame,
+    const SDLPangoDraw_Matrix *color_matrix,
+    const Uint8 *coverage,
+    int pitch,
+    int x, int y,
+    int width, int height)
+{
+    yuvColor color;
+    int i, j;
+
+    matrixToYUV(color_matrix, frame->color_space, &color);
+
+    /* Nothing to do where the coverage is 0 and the background is clear. */
+    for(j = 0; j < height; j++) {
+	const Uint8 *c_row = coverage + j * pitch;
+	Uint8 *y_row = frame->planes[0] + (y + j) * frame->pitches[0] + x;
+
+	for(i = 0; i < width; i++) {
+	    int c = c_row[i];
+	    int a = DIV255(color.a[1] * c + color.a[0] * (255 - c));
+	    int luma;
+
+	    if(a == 0)
+		continue;
+	    luma = DIV255(color.y[1] * c + color.y[0] * (255 - c));
+	    y_row[i] = (Uint8)DIV255(luma * a + y_row[i] * (255 - a));
+	}
+    }
+
+    for(j = y / 2; j < (y + height + 1) / 2; j++) {
+	for(i = x / 2; i < (x + width + 1) / 2; i++) {
+	    int sum_a = 0, sum_u = 0, sum_v = 0;
+	    Uint8 *u, *v;
+	    int dx, dy;
+
+	    for(dy = 0; dy < 2; dy++) {
+		int py = j * 2 + dy - y;
+
+		if(py < 0 || py >= height)
+		    continue;
+		for(dx = 0; dx < 2; dx++) {
+		    int px = i * 2 + dx - x;
+		    int c, a;
+
+		    if(px < 0 || px >= width)
+			continue;
+		    c = coverage[py * pitch + px];
+		    a = DIV255(color.a[1] * c + color.a[0] * (255 - c));
+		    if(a == 0)
+			continue;
+		    sum_u += DIV255(color.u[1] * c + color.u[0] * (255 - c)) * a;
+		    sum_v += DIV255(color.v[1] * c + color.v[0] * (255 - c)) * a;
+		    sum_a += a;
+		}
+	    }
+	    if(sum_a == 0)
+		continue;
+
+	    if(frame->format == SDLPANGODRAW_YUV_NV12) {
+		u = frame->planes[1] + j * frame->pitches[1] + i * 2;
+		v = u + 1;
+	    } else {
+		u = frame->planes[1] + j * frame->pitches[1] + i;
+		v = frame->planes[2] + j * frame->pitches[2] + i;
+	    }
+	    /* The four luma pixels weigh a quarter each. */
+	    *u = (Uint8)((sum_u + *u * (1020 - sum_a) + 510) / 1020);
+	    *v = (Uint8)((sum_v + *v * (1020 - sum_a) + 510) / 1020);
+	}
+    }
+}
+
+/*!
+    Draw a horizontal line of a pixel on a YUV frame.
+    Same arguments as drawHLine.
+*/
+static void
+yuvHLine(
+    const SDLPangoDraw_YUVFrame *frame,
+    const SDLPangoDraw_Matrix *color_matrix,
+    int y, int start, int end)
+{
+    Uint8 full[256];
+
+    if(y < 0 || y >= frame->height)
+	return;
+    memset(full, 255, sizeof(full));
+    start = MAX(start, 0);
+    end = MIN(end, frame->width);
+
+    for(; start < end; start += sizeof(full))
+	blendYUV(frame, color_matrix, full, 0,
+	    start, y, MIN(end - start, (int)sizeof(full)), 1);
+}
+
+/*!
+    Draw the text of a context over a planar (I420) or semi-planar (NV12)
+    YUV frame, such as subtitles burnt into video.
+    The glyphs are blended straight into the planes, in a single pass over
+    the area of each run, and the frame is not cleared. Effects are not
+    drawn.
+
+    @param *context [i/o] Context
+    @param *frame [i/o] Frame
+    @param x [in] X of left-top of drawing area
+    @param y [in] Y of left-top of drawing area
+    @return 0 on success, -1 on error
+*/
+int
+SDLPangoDraw_DrawYUV(
+    SDLPangoDraw_Context *context,
+    const SDLPangoDraw_YUVFrame *frame,
+    int x, int y)
+{
+    if(! frame || ! frame->planes[0] || ! frame->planes[1]
+	|| (frame->format == SDLPANGODRAW_YUV_I420 && ! frame->planes[2]))
+    {
+	SDL_SetError("frame is incomplete");
+	return -1;
+    }
+    if(frame->format != SDLPANGODRAW_YUV_I420 && frame->format != SDLPANGODRAW_YUV_NV12) {
+	SDL_SetError("unknown YUV format");
+	return -1;
+    }
+
+    adoptPrewarm(context);
+
+    context->buffer_growths = 0;
+
+    context->yuv = frame;
+    drawLayoutLines(context, NULL, context->layout, x, y, 0, -1);
+    context->yuv = NULL;
+
+    enforceMemoryBudget(context);
+
+    return 0;
+}
+
+/*!
+    Font map substitute of the monochrome mode: no anti-aliasing, so that
+    FreeType rasterizes 1-bit glyphs.
+
+    @param *pattern [i/o] Pattern to complete
+    @param data [in] Not used
+*/
+static void
+monoSubstitute(
+    FcPattern *pattern,
+    gpointer data)
+{
+    FcPatternDel(pattern, FC_ANTIALIAS);
+    FcPatternAddBool(pattern, FC_ANTIALIAS, FcFalse);
+}
+
+/*!
+    Make the fonts of a font map rasterize for a render mode.
+
+    @param *font_map [i/o] Font map
+    @param mode [in] Render mode
+*/
+static void
+applyRenderMode(
+    PangoFontMap *font_map,
+    SDLPangoDraw_RenderMode mode)
+{
+    g_mutex_lock(&font_map_lock);
+    pango_ft2_font_map_set_default_substitute (PANGO_FT2_FONT_MAP (font_map),
+	mode == SDLPANGODRAW_RENDER_MONO ? monoSubstitute : NULL, NULL, NULL);
+    pango_ft2_font_map_substitute_changed (PANGO_FT2_FONT_MAP (font_map));
+    g_mutex_unlock(&font_map_lock);
+}
+
+/*!
+    Copy a region of a monochrome bitmap to surface: every pixel is either
+    the foreground or the background color, so each row is filled span by
+    span with the two colors, without blending.
+    The bitmap is gray, as Pango renders, but holds only 0 and 255.
+
+    @param *bitmap [in] Bitmap
+    @param bitmap_x [in] X of left-top of the region in bitmap
+    @param bitmap_y [in] Y of left-top of the region in bitmap
+    @param *surface [out] Surface
+    @param *matrix [in] Foreground and background color
+    @param x [in] X of left-top of the region in surface
+    @param y [in] Y of left-top of the region in surface
+    @param width [in] Width of the region
+    @param height [in] Height of the region
+*/
+static void
+copyFTBitmapMono(
+    const FT_Bitmap *bitmap,
+    int bitmap_x, int bitmap_y,
+    SDL_Surface *surface,
+    const SDLPangoDraw_Matrix *matrix,
+    int x, int y, int width, int height)
+{
+    const guint64 on_word = G_GUINT64_CONSTANT(0x8080808080808080);
+    Uint32 colors[2];
+    Uint8 *p_ft;
+    Uint8 *p_sdl;
+    int i;
+
+    if(x < 0) {
+	width += x; bitmap_x -= x; x = 0;
+    }
+    if(x + width > surface->w)
+	width = surface->w - x;
+    if(y < 0) {
+	height += y; bitmap_y -= y; y = 0;
+    }
+    if(y + height > surface->h)
+	height = surface->h - y;
+    if(width <= 0 || height <= 0)
+	return;
+
+    if(surface->format->BytesPerPixel != 2 && surface->format->BytesPerPixel != 4) {
+	SDL_SetError("surface->format->BytesPerPixel is invalid value");
+	return;
+    }
+
+    if(SDL_LockSurface(surface)) {
+	SDL_SetError("surface lock failed");
+	return;
+    }
+
+    colors[0] = SDL_MapRGBA(surface->format,
+	matrix->m[0][0], matrix->m[1][0], matrix->m[2][0], matrix->m[3][0]);
+    colors[1] = SDL_MapRGBA(surface->format,
+	matrix->m[0][1], matrix->m[1][1], matrix->m[2][1], matrix->m[3][1]);
+
+    p_ft = (Uint8 *)bitmap->buffer + (bitmap->pitch * bitmap_y) + bitmap_x;
+    p_sdl = (Uint8 *)surface->pixels + (surface->pitch * y);
+    for(i = 0; i < height; i++) {
+	int k = 0;
+
+	while(k < width) {
+	    int on = p_ft[k] >> 7;
+	    int start = k;
+	    int n;
+
+	    /* Skip 8 pixels at a time while they are all the same. */
+	    while(k + 8 <= width) {
+		guint64 word;
+
+		memcpy(&word, p_ft + k, 8);
+		if((word & on_word) != (on ? on_word : 0))
+		    break;
+		k += 8;
+	    }
+	    while(k < width && (p_ft[k] >> 7) == on)
+		k++;
+
+	    if(surface->format->BytesPerPixel == 2) {
+		Uint16 *p16 = (Uint16 *)p_sdl + x + start;
+
+		for(n = start; n < k; n++)
+		    *p16++ = (Uint16)colors[on];
+	    } else {
+		Uint32 *p32 = (Uint32 *)p_sdl + x + start;
+
+		for(n = start; n < k; n++)
+		    *p32++ = colors[on];
+	    }
+	}
+	p_ft += bitmap->pitch;
+	p_sdl += surface->pitch;
+    }
+
+    SDL_UnlockSurface(surface);
+}
+
+/*!
+    Set how glyphs are rasterized. SDLPANGODRAW_RENDER_MONO draws 1-bit
+    glyphs in the foreground and background colors only, which costs far
+    less than blending on targets where anti-aliasing is not worth it.
+    The default is SDLPANGODRAW_RENDER_GRAY.
+
+    @param *context [i/o] Context
+    @param mode [in] Render mode
+*/
+void
+SDLPangoDraw_SetRenderMode(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_RenderMode mode)
+{
+    if(mode == context->render_mode)
+	return;
+
+    checkShapedText(context);
+    context->render_mode = mode;
+    applyRenderMode(context->font_map, mode);
+    g_hash_table_remove_all(context->font_names);
+    pango_layout_context_changed (context->layout);
+    context->index_valid = FALSE;
+    context->damage_valid = FALSE;
+
+    reshapeText(context);
 }
@@ -40,6 +40,28 @@ extern "C" {
 
 typedef struct _contextImpl SDLPangoDraw_Context;
 
+typedef struct _documentImpl SDLPangoDraw_Document;
+
+typedef struct _templateImpl SDLPangoDraw_Template;
+
+typedef struct _layoutWriterImpl SDLPangoDraw_LayoutWriter;
+
+typedef struct _compiledLayoutsImpl SDLPangoDraw_CompiledLayouts;
+
+typedef struct _renderTicketImpl SDLPangoDraw_RenderTicket;
+
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+typedef struct _glyphAtlasImpl SDLPangoDraw_GlyphAtlas;
+#endif
+
+/*!
+    Reads document text starting at a byte offset.
+    Returns the number of bytes stored in buffer, 0 at the end of the text,
+    or -1 on error.
+*/
+typedef int (SDLCALL *SDLPangoDraw_ReadFunc)(
+    void *userdata, int offset, char *buffer, int length);
+
 /*!
     General 4 X 4 matrix struct.
 */
@@ -69,6 +91,152 @@ extern const SDLPangoDraw_Matrix *MATRIX_TRANSPARENT_BACK_WHITE_LETTER;
 */
 extern const SDLPangoDraw_Matrix *MATRIX_TRANSPARENT_BACK_TRANSPARENT_LETTER;
 
+/*!
+    Effects drawn with the text. See SDLPangoDraw_SetEffects.
+*/
+typedef struct _SDLPangoDraw_Effects {
+    int outline_radius;		/*!< Width of the outline in pixels. 0 means no outline. */
+    Uint8 outline_color[4];	/*!< Color of the outline: R, G, B and A */
+    int shadow_x;		/*!< Horizontal offset of the shadow in pixels */
+    int shadow_y;		/*!< Vertical offset of the shadow in pixels */
+    int shadow_blur;		/*!< Blur radius of the shadow in pixels */
+    Uint8 shadow_color[4];	/*!< Color of the shadow: R, G, B and A. A of 0 means no shadow. */
+} SDLPangoDraw_Effects;
+
+/*!
+    Statistics of the shaped-run cache.
+*/
+typedef struct _SDLPangoDraw_ShapeCacheStats {
+    Uint32 hits;	/*!< Lookups that found the glyphs in the cache */
+    Uint32 misses;	/*!< Lookups that had to shape the text */
+    Uint32 evictions;	/*!< Entries dropped to stay within the limit */
+    int entries;	/*!< Entries in the cache */
+    int bytes;		/*!< Memory used by the entries */
+    int limit;		/*!< Size limit in bytes */
+} SDLPangoDraw_ShapeCacheStats;
+
+/*!
+    How much memory SDLPangoDraw_Trim releases. Each level includes the
+    ones before it.
+*/
+typedef enum {
+    SDLPANGODRAW_TRIM_BUFFERS = 1,	/*!< Scratch and other buffers of the context */
+    SDLPANGODRAW_TRIM_CACHES,		/*!< Shaped-run cache, font caches and line breaks */
+    SDLPANGODRAW_TRIM_ALL		/*!< The shaped copy of the text */
+} SDLPangoDraw_TrimLevel;
+
+/*!
+    Memory held for a context, in bytes. See SDLPangoDraw_GetMemoryStats.
+*/
+typedef struct _SDLPangoDraw_MemoryStats {
+    int scratch;	/*!< Scratch bitmap and other buffers */
+    int font_maps;	/*!< Always -1: font maps cannot be counted */
+    int fonts;		/*!< Number of fonts in use, not bytes */
+    int caches;		/*!< Shaped-run cache and font names */
+    int layouts;	/*!< Text, runs and glyphs */
+} SDLPangoDraw_MemoryStats;
+
+/*!
+    Called when the fonts warmed by SDLPangoDraw_Prewarm are in use.
+*/
+typedef void (SDLCALL *SDLPangoDraw_PrewarmFunc)(
+    SDLPangoDraw_Context *context,
+    void *userdata);
+
+/*!
+    Layout of a pixel in a buffer. See SDLPangoDraw_DrawToBuffer.
+*/
+typedef struct _SDLPangoDraw_PixelFormat {
+    int bytes_per_pixel;	/*!< 2 or 4 */
+    Uint32 Rmask;		/*!< Same as SDL_CreateRGBSurface() */
+    Uint32 Gmask;		/*!< Same as SDL_CreateRGBSurface() */
+    Uint32 Bmask;		/*!< Same as SDL_CreateRGBSurface() */
+    Uint32 Amask;		/*!< Same as SDL_CreateRGBSurface() */
+} SDLPangoDraw_PixelFormat;
+
+/*!
+    Layout of the planes of a YUV frame. See SDLPangoDraw_YUVFrame.
+*/
+typedef enum {
+    SDLPANGODRAW_YUV_I420,	/*!< Y, U and V planes, chroma halved both ways */
+    SDLPANGODRAW_YUV_NV12	/*!< Y plane and interleaved UV plane, chroma halved both ways */
+} SDLPangoDraw_YUVFormat;
+
+/*!
+    How colors are converted to YUV. Both are limited range.
+*/
+typedef enum {
+    SDLPANGODRAW_YUV_BT601,	/*!< ITU-R BT.601, for SD video */
+    SDLPANGODRAW_YUV_BT709	/*!< ITU-R BT.709, for HD video */
+} SDLPangoDraw_YUVColorSpace;
+
+/*!
+    A YUV frame to draw on. See SDLPangoDraw_DrawYUV.
+*/
+typedef struct _SDLPangoDraw_YUVFrame {
+    SDLPangoDraw_YUVFormat format;
+    SDLPangoDraw_YUVColorSpace color_space;
+    int width;			/*!< Width of the luma plane */
+    int height;			/*!< Height of the luma plane */
+    Uint8 *planes[3];		/*!< Y, U and V, or Y and UV for NV12 */
+    int pitches[3];		/*!< Bytes from a row to the next, per plane */
+} SDLPangoDraw_YUVFrame;
+
+/*!
+    Progress of SDLPangoDraw_DrawIncremental. Rects are clipped to the
+    surface.
+*/
+typedef struct _SDLPangoDraw_Progress {
+    int lines_done;	/*!< Lines drawn so far */
+    int lines_total;	/*!< Lines of the text */
+    SDL_Rect drawn;	/*!< Area drawn by the last call */
+    SDL_Rect done;	/*!< Area drawn so far, from the top */
+} SDLPangoDraw_Progress;
+
+/*!
+    Called by SDLPangoDraw_DispatchRenders when a ticket is rendered.
+*/
+typedef void (SDLCALL *SDLPangoDraw_RenderFunc)(
+    SDLPangoDraw_RenderTicket *ticket,
+    void *userdata);
+
+/*!
+    Text to render on the render threads. See SDLPangoDraw_SubmitRender.
+*/
+typedef struct _SDLPangoDraw_RenderParams {
+    const char *font_desc;	/*!< Font description, or NULL for the default font */
+    const char *markup;		/*!< Markup text (UTF-8) */
+    int width;			/*!< Width to wrap at. -1 means no wrapping. */
+    double dpi;			/*!< DPI, or 0 for the default */
+    const SDLPangoDraw_Matrix *color_matrix;	/*!< Colors, or NULL for black letters */
+    SDLPangoDraw_RenderFunc callback;	/*!< Called when rendered, or NULL */
+    void *userdata;		/*!< Passed to the callback */
+} SDLPangoDraw_RenderParams;
+
+/*!
+    Specifies the kind of an attribute span. See SDLPangoDraw_Attribute.
+*/
+typedef enum {
+    SDLPANGODRAW_ATTR_FOREGROUND,	/*!< Letter color, 0xRRGGBB */
+    SDLPANGODRAW_ATTR_BACKGROUND,	/*!< Background color, 0xRRGGBB */
+    SDLPANGODRAW_ATTR_WEIGHT,		/*!< Font weight: 400 is normal, 700 is bold */
+    SDLPANGODRAW_ATTR_STYLE,		/*!< 0 normal, 1 oblique, 2 italic */
+    SDLPANGODRAW_ATTR_UNDERLINE,	/*!< 0 none, 1 single, 2 double, 3 low, 4 error */
+    SDLPANGODRAW_ATTR_STRIKETHROUGH,	/*!< 0 off, 1 on */
+    SDLPANGODRAW_ATTR_SIZE,		/*!< Font size in 1/1024 points */
+    SDLPANGODRAW_ATTR_RISE		/*!< Baseline shift in 1/1024 points */
+} SDLPangoDraw_AttributeType;
+
+/*!
+    A span of styled text for SDLPangoDraw_SetTextWithAttributes.
+*/
+typedef struct _SDLPangoDraw_Attribute {
+    int start;		/*!< Byte index of the first character */
+    int end;		/*!< Byte index after the last character */
+    SDLPangoDraw_AttributeType type;	/*!< Kind of the attribute */
+    Sint32 value;	/*!< Value, as described by the type */
+} SDLPangoDraw_Attribute;
+
 /*!
     Specifies direction of text. See Pango reference for details.
 */
@@ -89,8 +257,31 @@ typedef enum {
     SDLPANGODRAW_ALIGN_RIGHT
 } SDLPangoDraw_Alignment;
 
+/*!
+    Specifies where to ellipsize text that does not fit. See Pango
+    reference for details.
+*/
+typedef enum {
+    SDLPANGODRAW_ELLIPSIZE_NONE,	/*!< Do not ellipsize */
+    SDLPANGODRAW_ELLIPSIZE_START,	/*!< Omit characters at the start */
+    SDLPANGODRAW_ELLIPSIZE_MIDDLE,	/*!< Omit characters in the middle */
+    SDLPANGODRAW_ELLIPSIZE_END		/*!< Omit characters at the end */
+} SDLPangoDraw_Ellipsize;
+
+/*!
+    Specifies how glyphs are rasterized.
+*/
+typedef enum {
+    SDLPANGODRAW_RENDER_GRAY,	/*!< Anti-aliased, 256 levels of gray */
+    SDLPANGODRAW_RENDER_MONO	/*!< 1 bit, foreground and background only */
+} SDLPangoDraw_RenderMode;
+
 extern DECLSPEC int SDLCALL SDLPangoDraw_Init();
 
+extern DECLSPEC int SDLCALL SDLPangoDraw_InitWithFonts(
+    const char * const *paths,
+    const char *cache_dir);
+
 extern DECLSPEC int SDLCALL SDLPangoDraw_WasInit();
 
 extern DECLSPEC SDLPangoDraw_Context* SDLCALL SDLPangoDraw_CreateContext_GivenFontDesc(const char* font_desc);
@@ -113,6 +304,115 @@ extern DECLSPEC void SDLCALL SDLPangoDraw_Draw(
     SDL_Surface *surface,
     int x, int y);
 
+extern DECLSPEC int SDLCALL SDLPangoDraw_DrawYUV(
+    SDLPangoDraw_Context *context,
+    const SDLPangoDraw_YUVFrame *frame,
+    int x, int y);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_DrawToBuffer(
+    SDLPangoDraw_Context *context,
+    void *pixels,
+    int width, int height,
+    int pitch,
+    const SDLPangoDraw_PixelFormat *format,
+    int x, int y);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetScratchLimit(
+    SDLPangoDraw_Context *context,
+    int bytes);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_ReleaseScratch(
+    SDLPangoDraw_Context *context);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetEffects(
+    SDLPangoDraw_Context *context,
+    const SDLPangoDraw_Effects *effects);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetPremultiplied(
+    SDLPangoDraw_Context *context,
+    int premultiplied);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_BlitPremultiplied(
+    SDL_Surface *src,
+    SDL_Rect *srcrect,
+    SDL_Surface *dst,
+    SDL_Rect *dstrect);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_GetBufferGrowthCount(
+    SDLPangoDraw_Context *context);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_DrawDamage(
+    SDLPangoDraw_Context *context,
+    SDL_Surface *surface,
+    int x, int y,
+    SDL_Rect *rects,
+    int max_rects);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_ResetDamage(
+    SDLPangoDraw_Context *context);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_DrawIncremental(
+    SDLPangoDraw_Context *context,
+    SDL_Surface *surface,
+    int x, int y,
+    int budget_us,
+    SDLPangoDraw_Progress *progress);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetShapeCacheLimit(
+    int bytes);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_ClearShapeCache();
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_GetShapeCacheStats(
+    SDLPangoDraw_ShapeCacheStats *stats);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetShapedLayout(
+    SDLPangoDraw_Context *context,
+    int enabled);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetFastPath(
+    SDLPangoDraw_Context *context,
+    int enabled);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetReflow(
+    SDLPangoDraw_Context *context,
+    int enabled);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetMemoryBudget(
+    SDLPangoDraw_Context *context,
+    int bytes);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_Trim(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_TrimLevel level);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_GetMemoryStats(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_MemoryStats *stats);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_Prewarm(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    SDLPangoDraw_PrewarmFunc callback,
+    void *userdata);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_PollPrewarm(
+    SDLPangoDraw_Context *context);
+
+extern DECLSPEC SDLPangoDraw_RenderTicket* SDLCALL SDLPangoDraw_SubmitRender(
+    const SDLPangoDraw_RenderParams *params);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_PollRender(
+    SDLPangoDraw_RenderTicket *ticket);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_WaitRender(
+    SDLPangoDraw_RenderTicket *ticket);
+
+extern DECLSPEC SDL_Surface* SDLCALL SDLPangoDraw_FinishRender(
+    SDLPangoDraw_RenderTicket *ticket);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_DispatchRenders();
+
 extern DECLSPEC void SDLCALL SDLPangoDraw_SetDpi(
     SDLPangoDraw_Context *context,
     double dpi_x, double dpi_y);
@@ -121,6 +421,22 @@ extern DECLSPEC void SDLCALL SDLPangoDraw_SetMinimumSize(
     SDLPangoDraw_Context *context,
     int width, int height);
 
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetMaxLines(
+    SDLPangoDraw_Context *context,
+    int lines);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetMaxHeight(
+    SDLPangoDraw_Context *context,
+    int height);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetEllipsize(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_Ellipsize ellipsize);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetRenderMode(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_RenderMode mode);
+
 extern DECLSPEC void SDLCALL SDLPangoDraw_SetDefaultColor(
     SDLPangoDraw_Context *context,
     const SDLPangoDraw_Matrix *color_matrix);
@@ -131,6 +447,18 @@ extern DECLSPEC int SDLCALL SDLPangoDraw_GetLayoutWidth(
 extern DECLSPEC int SDLCALL SDLPangoDraw_GetLayoutHeight(
     SDLPangoDraw_Context *context);
 
+extern DECLSPEC int SDLCALL SDLPangoDraw_HitTest(
+    SDLPangoDraw_Context *context,
+    int x, int y,
+    int *index,
+    int *trailing);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_GetCharRect(
+    SDLPangoDraw_Context *context,
+    int index,
+    int *x, int *y,
+    int *w, int *h);
+
 extern DECLSPEC void SDLCALL SDLPangoDraw_SetMarkup(
     SDLPangoDraw_Context *context,
     const char *markup,
@@ -147,6 +475,13 @@ extern DECLSPEC void SDLCALL SDLPangoDraw_SetText(
     const char *markup,
     int length);
 
+extern DECLSPEC int SDLCALL SDLPangoDraw_SetTextWithAttributes(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length,
+    const SDLPangoDraw_Attribute *attrs,
+    int n_attrs);
+
 extern DECLSPEC void SDLCALL SDLPangoDraw_SetLanguage(
     SDLPangoDraw_Context *context,
     const char *language_tag);
@@ -155,6 +490,152 @@ extern DECLSPEC void SDLCALL SDLPangoDraw_SetBaseDirection(
     SDLPangoDraw_Context *context,
     SDLPangoDraw_Direction direction);
 
+extern DECLSPEC SDLPangoDraw_Document* SDLCALL SDLPangoDraw_CreateDocument(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length);
+
+extern DECLSPEC SDLPangoDraw_Document* SDLCALL SDLPangoDraw_CreateDocument_GivenReadFunc(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_ReadFunc read,
+    void *userdata);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_FreeDocument(
+    SDLPangoDraw_Document *doc);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetDocumentPageSize(
+    SDLPangoDraw_Document *doc,
+    int width, int height);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_SetDocumentCacheSize(
+    SDLPangoDraw_Document *doc,
+    int pages);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_HasDocumentPage(
+    SDLPangoDraw_Document *doc,
+    int page);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_GetDocumentPageCount(
+    SDLPangoDraw_Document *doc);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_DrawDocumentPage(
+    SDLPangoDraw_Document *doc,
+    int page,
+    SDL_Surface *surface,
+    int x, int y);
+
+extern DECLSPEC SDLPangoDraw_Document* SDLCALL SDLPangoDraw_CreateEditableDocument(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_ReplaceDocumentText(
+    SDLPangoDraw_Document *doc,
+    int start, int end,
+    const char *text,
+    int length,
+    int *band_y,
+    int *band_h);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_GetDocumentHeight(
+    SDLPangoDraw_Document *doc);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_DrawDocumentBand(
+    SDLPangoDraw_Document *doc,
+    SDL_Surface *surface,
+    int x, int y,
+    int band_y, int band_h);
+
+extern DECLSPEC SDLPangoDraw_Template* SDLCALL SDLPangoDraw_CreateTemplate(
+    SDLPangoDraw_Context *context,
+    const char *text,
+    int length);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_FreeTemplate(
+    SDLPangoDraw_Template *tmpl);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_SetTemplateField(
+    SDLPangoDraw_Template *tmpl,
+    const char *name,
+    const char *value);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_DrawTemplate(
+    SDLPangoDraw_Template *tmpl,
+    SDL_Surface *surface,
+    int x, int y);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_DrawTemplateFields(
+    SDLPangoDraw_Template *tmpl,
+    SDL_Surface *surface,
+    int x, int y);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_GetTemplateFieldRect(
+    SDLPangoDraw_Template *tmpl,
+    const char *name,
+    SDL_Rect *rect);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_GetTemplateSize(
+    SDLPangoDraw_Template *tmpl,
+    int *width, int *height);
+
+extern DECLSPEC SDLPangoDraw_LayoutWriter * SDLCALL SDLPangoDraw_CreateLayoutWriter();
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_FreeLayoutWriter(
+    SDLPangoDraw_LayoutWriter *writer);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_AddCompiledLayout(
+    SDLPangoDraw_LayoutWriter *writer,
+    SDLPangoDraw_Context *context,
+    const char *name);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_DescribeFaces(
+    SDLPangoDraw_Context *context,
+    char *buffer,
+    int size);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_WriteCompiledLayouts(
+    SDLPangoDraw_LayoutWriter *writer,
+    const char *filename);
+
+extern DECLSPEC SDLPangoDraw_CompiledLayouts * SDLCALL SDLPangoDraw_OpenCompiledLayouts(
+    const char *filename);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_CloseCompiledLayouts(
+    SDLPangoDraw_CompiledLayouts *layouts);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_FindCompiledLayout(
+    SDLPangoDraw_CompiledLayouts *layouts,
+    const char *name);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_GetCompiledLayoutSize(
+    SDLPangoDraw_CompiledLayouts *layouts,
+    int index,
+    int *width, int *height);
+
+extern DECLSPEC int SDLCALL SDLPangoDraw_DrawCompiledLayout(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_CompiledLayouts *layouts,
+    int index,
+    SDL_Surface *surface,
+    int x, int y);
+
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+extern DECLSPEC SDLPangoDraw_GlyphAtlas * SDLCALL SDLPangoDraw_CreateGlyphAtlas(
+    SDL_Renderer *renderer,
+    int width, int height);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_FreeGlyphAtlas(
+    SDLPangoDraw_GlyphAtlas *atlas);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_ClearGlyphAtlas(
+    SDLPangoDraw_GlyphAtlas *atlas);
+
+extern DECLSPEC void SDLCALL SDLPangoDraw_DrawToRenderer(
+    SDLPangoDraw_Context *context,
+    SDLPangoDraw_GlyphAtlas *atlas,
+    int x, int y);
+#endif
+
 
 #ifdef __FT2_BUILD_UNIX_H__
 
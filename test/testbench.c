@@ -20,13 +20,52 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <SDL_PangoDraw.h>
 
 SDLPangoDraw_Context *context;
 char *text;
 
+#ifdef COUNT_ALLOCATIONS
+/* Count the allocations made while counting is on, by interposing the
+   allocator of the C library (glibc). GLib and Pango allocate through
+   it too. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+int counting;
+int allocations;
+
+void *malloc(size_t size)
+{
+    if(counting)
+	allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if(counting)
+	allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if(counting)
+	allocations++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+/* The window is asked for its size every frame. */
+int resizeLoop(void)
+#else
 int resizeLoop(SDL_Surface **framebuf)
+#endif
 {
     SDL_Event event;
 
@@ -35,9 +74,14 @@ int resizeLoop(SDL_Surface **framebuf)
 	case SDL_QUIT:
 	    return 0;
 
+#if ! SDL_VERSION_ATLEAST(2, 0, 0)
 	case  SDL_VIDEORESIZE:
 	    *framebuf = SDL_SetVideoMode(event.resize.w, event.resize.h, 32, SDL_SWSURFACE | SDL_RESIZABLE);
+#ifdef DRAW_DAMAGE
+	    SDLPangoDraw_ResetDamage(context);
+#endif
 	    break;
+#endif
 
 	case SDL_KEYUP:
 	    if(event.key.keysym.sym == SDLK_RETURN)
@@ -72,19 +116,92 @@ char *readFile(const char *filename)
     return text;
 }
 
+#if defined(CHECK_SHAPED_LAYOUT) || defined(CHECK_REFLOW) || defined(CHECK_FAST_PATH)
+/* Nonzero if two surfaces have the same size and pixels. */
+int sameSurfaces(SDL_Surface *a, SDL_Surface *b)
+{
+    int y;
+
+    if(a->w != b->w || a->h != b->h)
+	return 0;
+    for(y = 0; y < a->h; y++) {
+	if(memcmp((Uint8 *)a->pixels + y * a->pitch,
+	    (Uint8 *)b->pixels + y * b->pitch,
+	    a->w * a->format->BytesPerPixel) != 0)
+	    return 0;
+    }
+    return 1;
+}
+
+/* Draw markup laid out by the library, or by the PangoLayout alone. */
+SDL_Surface *drawMarkup(const char *markup, int length, int shaped)
+{
+    SDLPangoDraw_SetShapedLayout(context, shaped);
+    SDLPangoDraw_SetMarkup(context, markup, length);
+    return SDLPangoDraw_CreateSurfaceDraw(context);
+}
+#endif
+
+#ifdef PREWARM
+void SDLCALL prewarmDone(SDLPangoDraw_Context *context, void *userdata)
+{
+    printf("fonts warmed in %u ms\n", SDL_GetTicks() - *(Uint32 *)userdata);
+}
+#endif
+
 int main(int argc, char *argv[])
 {
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDLPangoDraw_GlyphAtlas *atlas;
+#ifdef FRAME_LIMIT
+    int frames = 0;
+#endif
+#else
     SDL_Surface *framebuf;
     SDL_Surface *surface;
+#endif
+#ifdef COLD_START
+    Uint32 cold_start;
+#endif
     if(argc == 1) {
 	fprintf(stderr, "Usage: %s markup.txt\n", argv[0]);
 	exit(1);
     }
 
     SDL_Init(SDL_INIT_VIDEO);
+#ifdef COLD_START
+    cold_start = SDL_GetTicks();
+#endif
+#ifdef PRIVATE_FONTS
+    /* testbench markup.txt fonts-dir [cache-dir] */
+    {
+	const char *paths[2];
+
+	paths[0] = argc > 2 ? argv[2] : "/usr/share/fonts";
+	paths[1] = NULL;
+	if(SDLPangoDraw_InitWithFonts(paths, argc > 3 ? argv[3] : NULL)) {
+	    fprintf(stderr, "%s\n", SDL_GetError());
+	    exit(1);
+	}
+    }
+#else
     SDLPangoDraw_Init();
+#endif
 
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+    window = SDL_CreateWindow("testbench", SDL_WINDOWPOS_UNDEFINED,
+	SDL_WINDOWPOS_UNDEFINED, 640, 480, SDL_WINDOW_RESIZABLE);
+#ifdef SOFTWARE_RENDERER
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+#else
+    renderer = SDL_CreateRenderer(window, -1, 0);
+#endif
+    atlas = SDLPangoDraw_CreateGlyphAtlas(renderer, 512, 512);
+#else
     framebuf = SDL_SetVideoMode(640, 480, 32, SDL_SWSURFACE | SDL_RESIZABLE);
+#endif
 
     context = SDLPangoDraw_CreateContext();
 
@@ -94,14 +211,224 @@ int main(int argc, char *argv[])
 
     SDLPangoDraw_SetDefaultColor(context, MATRIX_TRANSPARENT_BACK_WHITE_LETTER);
 
+#ifdef DRAW_EFFECTS
+    {
+	SDLPangoDraw_Effects effects = {
+	    2, {0, 0, 0, 255},
+	    3, 3, 2, {0, 0, 0, 160}};
+	SDLPangoDraw_SetEffects(context, &effects);
+    }
+#endif
+
     SDLPangoDraw_SetMinimumSize(context, 640, 0);
 
+#ifdef PREMULTIPLIED
+    SDLPangoDraw_SetPremultiplied(context, 1);
+#endif
+
+#ifdef MAX_LINES
+    SDLPangoDraw_SetMaxLines(context, 3);
+    SDLPangoDraw_SetEllipsize(context, SDLPANGODRAW_ELLIPSIZE_END);
+#endif
+
 #ifdef SET_BASE_DIRECTION
     SDLPangoDraw_SetBaseDirection(context, SDLPANGO_DIRECTION_RTL);
 #endif
 
     text = readFile(argv[1]);
 
+#ifdef COLD_START
+    /* Until the fonts of the text are loaded. */
+    SDLPangoDraw_SetMarkup(context, text, -1);
+    SDLPangoDraw_GetLayoutWidth(context);
+    printf("cold start: %u ms\n", SDL_GetTicks() - cold_start);
+#endif
+
+#ifdef PREWARM
+    {
+	static Uint32 start;
+
+	start = SDL_GetTicks();
+	SDLPangoDraw_Prewarm(context, text, prewarmDone, &start);
+    }
+#endif
+
+#ifdef CHECK_SHAPED_LAYOUT
+    /* Draw every line as laid out by the library and by Pango, and
+       compare. */
+    {
+	const char *line = text;
+	int lines = 0;
+	int mismatches = 0;
+
+	while(*line) {
+	    const char *end = strchr(line, '\n');
+	    int length = end ? end - line : (int)strlen(line);
+	    SDL_Surface *shaped = drawMarkup(line, length, 1);
+	    SDL_Surface *layout = drawMarkup(line, length, 0);
+
+	    if(! sameSurfaces(shaped, layout)) {
+		printf("differs: %.*s\n", length, line);
+		mismatches++;
+	    }
+	    SDL_FreeSurface(shaped);
+	    SDL_FreeSurface(layout);
+
+	    lines++;
+	    line = end ? end + 1 : line + length;
+	}
+	printf("shaped layout: %d of %d lines differ\n", mismatches, lines);
+	SDLPangoDraw_SetShapedLayout(context, 1);
+    }
+#endif
+
+#ifdef CHECK_FAST_PATH
+    /* Draw every line through the fast path and by the PangoLayout alone,
+       and compare, as plain text and as markup. */
+    {
+	int markup;
+
+	for(markup = 0; markup < 2; markup++) {
+	    const char *line = text;
+	    int lines = 0;
+	    int mismatches = 0;
+
+	    while(*line) {
+		const char *end = strchr(line, '\n');
+		int length = end ? end - line : (int)strlen(line);
+		SDL_Surface *fast;
+		SDL_Surface *slow;
+
+		SDLPangoDraw_SetShapedLayout(context, 1);
+		if(markup)
+		    SDLPangoDraw_SetMarkup(context, line, length);
+		else
+		    SDLPangoDraw_SetText(context, line, length);
+		fast = SDLPangoDraw_CreateSurfaceDraw(context);
+		/* Drops the shaped text, so the layout is drawn. */
+		SDLPangoDraw_SetShapedLayout(context, 0);
+		slow = SDLPangoDraw_CreateSurfaceDraw(context);
+
+		if(! sameSurfaces(fast, slow))
+		    mismatches++;
+		SDL_FreeSurface(fast);
+		SDL_FreeSurface(slow);
+
+		lines++;
+		line = end ? end + 1 : line + length;
+	    }
+	    printf("fast path, %s: %d of %d lines differ\n",
+		markup ? "markup" : "text", mismatches, lines);
+	}
+	SDLPangoDraw_SetShapedLayout(context, 1);
+    }
+#endif
+
+#ifdef BENCH_RENDER_MODE
+    /* Time drawing the text anti-aliased and monochrome. */
+    {
+	static const char *names[] = {"gray", "mono"};
+	int mode;
+	int i;
+
+	SDLPangoDraw_SetMarkup(context, text, -1);
+	for(mode = SDLPANGODRAW_RENDER_GRAY; mode <= SDLPANGODRAW_RENDER_MONO; mode++) {
+	    Uint32 start;
+
+	    SDLPangoDraw_SetRenderMode(context, (SDLPangoDraw_RenderMode)mode);
+	    SDL_FreeSurface(SDLPangoDraw_CreateSurfaceDraw(context));
+	    start = SDL_GetTicks();
+	    for(i = 0; i < 100; i++)
+		SDL_FreeSurface(SDLPangoDraw_CreateSurfaceDraw(context));
+	    printf("%s: %u ms for 100 draws\n", names[mode], SDL_GetTicks() - start);
+	}
+    }
+#endif
+
+#ifdef BENCH_REFLOW
+    /* Drag the width back and forth, as a window edge would, over the
+       whole text. */
+    {
+	Uint32 start;
+	int i;
+	int w;
+
+	SDLPangoDraw_SetMarkup(context, text, -1);
+	start = SDL_GetTicks();
+	for(i = 0; i < 10; i++) {
+	    for(w = 640; w >= 200; w -= 10) {
+		SDLPangoDraw_SetMinimumSize(context, w, 0);
+		SDLPangoDraw_GetLayoutHeight(context);
+	    }
+	    for(w = 200; w <= 640; w += 10) {
+		SDLPangoDraw_SetMinimumSize(context, w, 0);
+		SDLPangoDraw_GetLayoutHeight(context);
+	    }
+	}
+	printf("reflow: %u ms for %d widths\n", SDL_GetTicks() - start, 10 * 2 * 45);
+	SDLPangoDraw_SetMinimumSize(context, 640, 0);
+    }
+#endif
+
+#ifdef CHECK_REFLOW
+    /* Draw the whole text at several widths as broken into lines by the
+       library and by the PangoLayout alone, and compare. */
+    {
+	int widths = 0;
+	int mismatches = 0;
+	int w;
+
+	for(w = 640; w >= 80; w -= 40) {
+	    SDL_Surface *reflowed;
+	    SDL_Surface *laid_out;
+
+	    SDLPangoDraw_SetMinimumSize(context, w, 0);
+	    reflowed = drawMarkup(text, -1, 1);
+	    laid_out = drawMarkup(text, -1, 0);
+
+	    if(! sameSurfaces(reflowed, laid_out)) {
+		printf("differs at width %d\n", w);
+		mismatches++;
+	    }
+	    SDL_FreeSurface(reflowed);
+	    SDL_FreeSurface(laid_out);
+	    widths++;
+	}
+	printf("reflow: %d of %d widths differ\n", mismatches, widths);
+	SDLPangoDraw_SetShapedLayout(context, 1);
+	SDLPangoDraw_SetMinimumSize(context, 640, 0);
+    }
+#endif
+
+#ifdef RENDER_MONO
+    SDLPangoDraw_SetRenderMode(context, SDLPANGODRAW_RENDER_MONO);
+#endif
+
+#if SDL_VERSION_ATLEAST(2, 0, 0)
+    SDLPangoDraw_SetMarkup(context, text, -1);
+
+    while(resizeLoop()) {
+	int w, h;
+
+	SDL_GetWindowSize(window, &w, &h);
+	SDLPangoDraw_SetMinimumSize(context, w, 0);
+
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+	SDL_RenderClear(renderer);
+	SDLPangoDraw_DrawToRenderer(context, atlas, 0, 0);
+	SDL_RenderPresent(renderer);
+
+#ifdef FRAME_LIMIT
+	/* For running with SDL_VIDEODRIVER=dummy. */
+	if(++frames == FRAME_LIMIT)
+	    break;
+#endif
+    }
+
+    SDLPangoDraw_FreeGlyphAtlas(atlas);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+#else
     surface = NULL;
     SDLPangoDraw_SetMarkup(context, text, -1);
 
@@ -118,21 +445,141 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+#ifdef DRAW_DAMAGE
+	/* Draw on the frame buffer, and update only what changed. */
+	{
+	    SDL_Rect rects[16];
+	    int n_rects;
+
+	    n_rects = SDLPangoDraw_DrawDamage(context, framebuf, 0, 0, rects, 16);
+	    if(n_rects > 0)
+		SDL_UpdateRects(framebuf, n_rects, rects);
+	}
+	continue;
+#endif
+
+#ifdef DRAW_INCREMENTAL
+	/* Draw a few lines per frame, and show them as they come. */
+	{
+	    SDLPangoDraw_Progress progress;
+
+	    SDLPangoDraw_DrawIncremental(context, framebuf, 0, 0, 4000, &progress);
+	    if(progress.drawn.w > 0)
+		SDL_UpdateRects(framebuf, 1, &progress.drawn);
+	}
+	continue;
+#endif
+
+#ifdef DRAW_YUV
+	/* Burn the text into a grey video frame, like subtitles. */
+	{
+	    SDL_Overlay *overlay = SDL_CreateYUVOverlay(framebuf->w, framebuf->h,
+		SDL_IYUV_OVERLAY, framebuf);
+	    SDLPangoDraw_YUVFrame frame;
+	    SDL_Rect rect = {0, 0, framebuf->w, framebuf->h};
+	    int i;
+
+	    SDL_LockYUVOverlay(overlay);
+	    frame.format = SDLPANGODRAW_YUV_I420;
+	    frame.color_space = SDLPANGODRAW_YUV_BT601;
+	    frame.width = overlay->w;
+	    frame.height = overlay->h;
+	    for(i = 0; i < 3; i++) {
+		frame.planes[i] = overlay->pixels[i];
+		frame.pitches[i] = overlay->pitches[i];
+		memset(frame.planes[i], 128, frame.pitches[i] * (i ? (overlay->h + 1) / 2 : overlay->h));
+	    }
+	    SDLPangoDraw_DrawYUV(context, &frame, 0, 0);
+	    SDL_UnlockYUVOverlay(overlay);
+	    SDL_DisplayYUVOverlay(overlay, &rect);
+	    SDL_FreeYUVOverlay(overlay);
+	}
+	continue;
+#endif
+
+#ifdef DRAW_TO_BUFFER
+	/* Draw straight into the pixels of the frame buffer, over what the
+	   frame already shows. */
+	{
+	    SDLPangoDraw_PixelFormat format = {
+		framebuf->format->BytesPerPixel,
+		framebuf->format->Rmask, framebuf->format->Gmask,
+		framebuf->format->Bmask, framebuf->format->Amask};
+
+	    SDL_FillRect(framebuf, NULL, SDL_MapRGB(framebuf->format, 64, 96, 128));
+	    SDL_LockSurface(framebuf);
+	    SDLPangoDraw_DrawToBuffer(context, framebuf->pixels,
+		framebuf->w, framebuf->h, framebuf->pitch, &format, 0, 0);
+	    SDL_UnlockSurface(framebuf);
+	    SDL_UpdateRect(framebuf, 0, 0, framebuf->w, framebuf->h);
+	}
+	continue;
+#endif
+
 #ifdef CREATE_SURFACE_DRAW
 	surface = SDLPangoDraw_CreateSurfaceDraw(context);
+#elif defined(SUBMIT_RENDER)
+	/* Render on the render threads of the library. */
+	{
+	    SDLPangoDraw_RenderParams params = {
+		NULL, text, framebuf->w, 0,
+		MATRIX_TRANSPARENT_BACK_WHITE_LETTER, NULL, NULL};
+	    SDLPangoDraw_RenderTicket *ticket = SDLPangoDraw_SubmitRender(&params);
+
+	    surface = SDLPangoDraw_FinishRender(ticket);
+	}
 #else
 	surface = SDL_CreateRGBSurface(SDL_SWSURFACE, framebuf->w, framebuf->h,
 	    32, (Uint32)(255 << (8 * 3)), (Uint32)(255 << (8 * 2)),
 	    (Uint32)(255 << (8 * 1)), 255);
 	SDLPangoDraw_Draw(context, surface, 0, 0);
+#ifdef COUNT_BUFFER_GROWTH
+	/* The second draw of the same text should not grow any buffer. */
+	SDLPangoDraw_Draw(context, surface, 0, 0);
+	printf("buffer growths per draw: %d\n",
+	    SDLPangoDraw_GetBufferGrowthCount(context));
+#endif
+#ifdef COUNT_ALLOCATIONS
+	/* Drawing the same text again should not allocate at all. */
+	{
+	    int i;
+
+	    allocations = 0;
+	    counting = 1;
+	    for(i = 0; i < 10; i++)
+		SDLPangoDraw_Draw(context, surface, 0, 0);
+	    counting = 0;
+	    printf("allocations in 10 draws: %d\n", allocations);
+	    if(allocations != 0)
+		exit(1);
+	}
+#endif
+#ifdef TRIM_MEMORY
+	{
+	    SDLPangoDraw_MemoryStats stats;
+
+	    SDLPangoDraw_GetMemoryStats(context, &stats);
+	    printf("scratch %d, fonts %d, caches %d, layouts %d\n",
+		stats.scratch, stats.fonts, stats.caches, stats.layouts);
+	    SDLPangoDraw_Trim(context, SDLPANGODRAW_TRIM_ALL);
+	    SDLPangoDraw_GetMemoryStats(context, &stats);
+	    printf("after trim: scratch %d, fonts %d, caches %d, layouts %d\n",
+		stats.scratch, stats.fonts, stats.caches, stats.layouts);
+	}
+#endif
 #endif
 
 	SDL_FillRect(framebuf, NULL, SDL_MapRGBA(framebuf->format, 0, 0, 0, 0));
+#ifdef PREMULTIPLIED
+	SDLPangoDraw_BlitPremultiplied(surface, NULL, framebuf, NULL);
+#else
 	SDL_BlitSurface(surface, NULL, framebuf, NULL);
+#endif
 	SDL_UpdateRect(framebuf, 0, 0, framebuf->w, framebuf->h);
 
 	SDL_FreeSurface(surface);
     }
+#endif
 
     free(text);
 
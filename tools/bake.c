@@ -0,0 +1,623 @@
+/* vim: set noet ai sw=4 sts=4 ts=8: */
+/*  bake.c -- Render text to image files, for asset builds
+    Copyright (C) 2013 Michael Imamura
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+*/
+
+/*
+    Usage: SDL_PangoDraw-bake [-j threads] [-o dir] manifest
+	   SDL_PangoDraw-bake -c file manifest
+
+    Each line of the manifest is one image, as tab-separated fields:
+
+	output	font	width	dpi	color	markup
+
+    output	File to write. The format follows the extension:
+		.png (RGBA), .ppm (RGB) or .raw (RGBA, no header).
+    font	Pango font description, e.g. "Sans 12".
+    width	Width to wrap the text at, or -1 for no wrapping.
+    dpi		Resolution, e.g. 96.
+    color	white, black, transparent-white, transparent-black, or
+		RRGGBBAA/RRGGBBAA for the back and the letters.
+    markup	The rest of the line, or @file to read it from a file.
+
+    Empty lines and lines starting with # are skipped.
+    Malformed lines are reported and count as failures.
+    Next to each output, a .hash file keeps a hash of everything the image
+    depends on, the faces of the fonts included. Entries whose output exists with the same hash are not
+    drawn again.
+
+    With -c, the entries are laid out and written to one file of compiled
+    layouts instead (see SDLPangoDraw_OpenCompiledLayouts), named by their
+    output field. The color field is not used then: compiled layouts are
+    drawn with the default color of the context that draws them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <SDL_PangoDraw.h>
+
+#define BAKE_VERSION "bake 2"
+
+typedef struct _bakeEntry {
+    int line;
+    char *output;
+    char *font;
+    int width;
+    double dpi;
+    char *color;
+    char *markup;	/* or @file */
+} bakeEntry;
+
+typedef struct _bakeJob {
+    const char *out_dir;
+    GPtrArray *entries;
+    gint next;
+    gint baked;
+    gint skipped;
+    gint failed;
+} bakeJob;
+
+/* Creating font maps is serialized, to keep Fontconfig happy. */
+static GMutex context_lock;
+
+static void freeEntry(gpointer data)
+{
+    bakeEntry *entry = data;
+
+    g_free(entry->output);
+    g_free(entry->font);
+    g_free(entry->color);
+    g_free(entry->markup);
+    g_free(entry);
+}
+
+static GPtrArray *readManifest(const char *filename, int *failed)
+{
+    GPtrArray *entries;
+    char *contents;
+    char **lines;
+    int i;
+
+    if(! g_file_get_contents(filename, &contents, NULL, NULL)) {
+	fprintf(stderr, "%s: cannot read\n", filename);
+	return NULL;
+    }
+
+    entries = g_ptr_array_new_with_free_func(freeEntry);
+    lines = g_strsplit(contents, "\n", -1);
+    for(i = 0; lines[i]; i++) {
+	char **fields;
+	bakeEntry *entry;
+
+	g_strchomp(lines[i]);
+	if(lines[i][0] == '\0' || lines[i][0] == '#')
+	    continue;
+
+	fields = g_strsplit(lines[i], "\t", 6);
+	if(g_strv_length(fields) != 6) {
+	    fprintf(stderr, "%s:%d: expected 6 tab-separated fields\n",
+		filename, i + 1);
+	    g_strfreev(fields);
+	    (*failed)++;
+	    continue;
+	}
+
+	entry = g_new(bakeEntry, 1);
+	entry->line = i + 1;
+	entry->output = g_strdup(fields[0]);
+	entry->font = g_strdup(fields[1]);
+	entry->width = atoi(fields[2]);
+	entry->dpi = g_ascii_strtod(fields[3], NULL);
+	entry->color = g_strdup(fields[4]);
+	entry->markup = g_strdup(fields[5]);
+	g_ptr_array_add(entries, entry);
+	g_strfreev(fields);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    return entries;
+}
+
+static int parseColor(const char *text, SDLPangoDraw_Matrix *matrix)
+{
+    unsigned int back, letter;
+    int i;
+
+    if(strcmp(text, "white") == 0)
+	*matrix = *MATRIX_WHITE_BACK;
+    else if(strcmp(text, "black") == 0)
+	*matrix = *MATRIX_BLACK_BACK;
+    else if(strcmp(text, "transparent-white") == 0)
+	*matrix = *MATRIX_TRANSPARENT_BACK_WHITE_LETTER;
+    else if(strcmp(text, "transparent-black") == 0)
+	*matrix = *MATRIX_TRANSPARENT_BACK_BLACK_LETTER;
+    else if(sscanf(text, "%8x/%8x", &back, &letter) == 2) {
+	memset(matrix, 0, sizeof(*matrix));
+	for(i = 0; i < 4; i++) {
+	    matrix->m[i][0] = (Uint8)(back >> (24 - 8 * i));
+	    matrix->m[i][1] = (Uint8)(letter >> (24 - 8 * i));
+	}
+    } else
+	return -1;
+
+    return 0;
+}
+
+static char *entryHash(SDLPangoDraw_Context *context,
+    const bakeEntry *entry, const char *markup)
+{
+    GChecksum *checksum;
+    char *faces;
+    char *fields;
+    char *hash;
+    int length;
+
+    length = SDLPangoDraw_DescribeFaces(context, NULL, 0);
+    if(length < 0)
+	return NULL;
+    faces = g_malloc(length + 1);
+    SDLPangoDraw_DescribeFaces(context, faces, length + 1);
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    fields = g_strdup_printf("%s\n%s\n%d\n%g\n%s\n",
+	BAKE_VERSION, entry->font, entry->width, entry->dpi, entry->color);
+    g_checksum_update(checksum, (const guchar *)fields, -1);
+    g_checksum_update(checksum, (const guchar *)markup, -1);
+    g_checksum_update(checksum, (const guchar *)faces, length);
+    hash = g_strdup(g_checksum_get_string(checksum));
+
+    g_free(faces);
+    g_free(fields);
+    g_checksum_free(checksum);
+    return hash;
+}
+
+static guint32 crc32Update(guint32 crc, const guint8 *data, gsize length)
+{
+    static guint32 table[256];
+    static gsize table_ready = 0;
+    gsize i;
+
+    if(g_once_init_enter(&table_ready)) {
+	guint32 n, c;
+	int k;
+
+	for(n = 0; n < 256; n++) {
+	    c = n;
+	    for(k = 0; k < 8; k++)
+		c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+	    table[n] = c;
+	}
+	g_once_init_leave(&table_ready, 1);
+    }
+
+    crc = ~crc;
+    for(i = 0; i < length; i++)
+	crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void appendBE32(GByteArray *out, guint32 value)
+{
+    guint8 bytes[4];
+
+    bytes[0] = (guint8)(value >> 24);
+    bytes[1] = (guint8)(value >> 16);
+    bytes[2] = (guint8)(value >> 8);
+    bytes[3] = (guint8)value;
+    g_byte_array_append(out, bytes, 4);
+}
+
+static void appendChunk(GByteArray *out, const char *type,
+    const guint8 *data, gsize length)
+{
+    guint32 crc;
+
+    appendBE32(out, (guint32)length);
+    g_byte_array_append(out, (const guint8 *)type, 4);
+    if(length)
+	g_byte_array_append(out, data, length);
+    crc = crc32Update(0, (const guint8 *)type, 4);
+    crc = crc32Update(crc, data, length);
+    appendBE32(out, crc);
+}
+
+/*
+    PNG with stored (uncompressed) deflate blocks, so that no image
+    library is needed. Asset pipelines usually recompress anyway.
+*/
+static GByteArray *encodePNG(const guint8 *rgba, int width, int height)
+{
+    static const guint8 signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    GByteArray *out = g_byte_array_new();
+    GByteArray *header = g_byte_array_new();
+    GByteArray *idat = g_byte_array_new();
+    gsize row_length = 1 + 4 * (gsize)width;
+    gsize raw_length = row_length * height;
+    guint8 *raw = g_malloc(raw_length + 1);
+    guint32 s1 = 1, s2 = 0;
+    gsize done = 0;
+    gsize i;
+    int y;
+
+    g_byte_array_append(out, signature, 8);
+
+    appendBE32(header, width);
+    appendBE32(header, height);
+    g_byte_array_append(header, (const guint8 *)"\x08\x06\x00\x00\x00", 5);
+    appendChunk(out, "IHDR", header->data, header->len);
+
+    /* Each row is a filter byte (0, none) then the pixels. */
+    for(y = 0; y < height; y++) {
+	raw[y * row_length] = 0;
+	memcpy(raw + y * row_length + 1, rgba + (gsize)y * 4 * width, 4 * width);
+    }
+    for(i = 0; i < raw_length; i++) {
+	s1 += raw[i];
+	if(s1 >= 65521)
+	    s1 -= 65521;
+	s2 += s1;
+	if(s2 >= 65521)
+	    s2 -= 65521;
+    }
+
+    g_byte_array_append(idat, (const guint8 *)"\x78\x01", 2);
+    do {
+	gsize block = MIN(raw_length - done, 65535);
+	guint8 block_header[5];
+
+	block_header[0] = done + block == raw_length ? 1 : 0;
+	block_header[1] = (guint8)block;
+	block_header[2] = (guint8)(block >> 8);
+	block_header[3] = (guint8)~block;
+	block_header[4] = (guint8)(~block >> 8);
+	g_byte_array_append(idat, block_header, 5);
+	g_byte_array_append(idat, raw + done, block);
+	done += block;
+    } while(done < raw_length);
+    appendBE32(idat, (s2 << 16) | s1);
+    appendChunk(out, "IDAT", idat->data, idat->len);
+
+    appendChunk(out, "IEND", NULL, 0);
+
+    g_free(raw);
+    g_byte_array_free(header, TRUE);
+    g_byte_array_free(idat, TRUE);
+    return out;
+}
+
+static GByteArray *encodePPM(const guint8 *rgba, int width, int height)
+{
+    GByteArray *out = g_byte_array_new();
+    char *header = g_strdup_printf("P6\n%d %d\n255\n", width, height);
+    gsize i;
+
+    g_byte_array_append(out, (const guint8 *)header, strlen(header));
+    for(i = 0; i < (gsize)width * height; i++)
+	g_byte_array_append(out, rgba + 4 * i, 3);
+
+    g_free(header);
+    return out;
+}
+
+static int writeImage(const char *path, SDL_Surface *surface)
+{
+    GByteArray *data;
+    guint8 *rgba;
+    char *tmp_path;
+    int x, y;
+    int result = 0;
+
+    rgba = g_malloc((gsize)surface->w * surface->h * 4 + 1);
+    SDL_LockSurface(surface);
+    for(y = 0; y < surface->h; y++) {
+	const Uint8 *p = (const Uint8 *)surface->pixels + y * surface->pitch;
+
+	for(x = 0; x < surface->w; x++) {
+	    Uint32 pixel;
+	    guint8 *q = rgba + ((gsize)y * surface->w + x) * 4;
+
+	    if(surface->format->BytesPerPixel == 2)
+		pixel = ((const Uint16 *)p)[x];
+	    else
+		pixel = ((const Uint32 *)p)[x];
+	    SDL_GetRGBA(pixel, surface->format, &q[0], &q[1], &q[2], &q[3]);
+	}
+    }
+    SDL_UnlockSurface(surface);
+
+    if(g_str_has_suffix(path, ".png"))
+	data = encodePNG(rgba, surface->w, surface->h);
+    else if(g_str_has_suffix(path, ".ppm"))
+	data = encodePPM(rgba, surface->w, surface->h);
+    else {
+	data = g_byte_array_new();
+	g_byte_array_append(data, rgba, (guint)surface->w * surface->h * 4);
+    }
+
+    /* Write then rename, so that an interrupted build leaves no
+       half-written image behind. */
+    tmp_path = g_strconcat(path, ".tmp", NULL);
+    if(! g_file_set_contents(tmp_path, (const char *)data->data, data->len, NULL)
+	|| g_rename(tmp_path, path) != 0)
+	result = -1;
+
+    g_free(tmp_path);
+    g_byte_array_free(data, TRUE);
+    g_free(rgba);
+    return result;
+}
+
+static SDLPangoDraw_Context *contextForFont(GHashTable *contexts, const char *font)
+{
+    SDLPangoDraw_Context *context = g_hash_table_lookup(contexts, font);
+
+    if(! context) {
+	g_mutex_lock(&context_lock);
+	context = SDLPangoDraw_CreateContext_GivenFontDesc(font);
+	g_mutex_unlock(&context_lock);
+	g_hash_table_insert(contexts, g_strdup(font), context);
+    }
+    return context;
+}
+
+static void freeContext(gpointer data)
+{
+    SDLPangoDraw_FreeContext(data);
+}
+
+static int bakeEntryWith(const bakeJob *job, GHashTable *contexts,
+    const bakeEntry *entry)
+{
+    SDLPangoDraw_Context *context;
+    SDLPangoDraw_Matrix matrix;
+    SDL_Surface *surface;
+    char *markup = NULL;
+    char *path = NULL;
+    char *hash_path = NULL;
+    char *old_hash = NULL;
+    char *hash = NULL;
+    char *dir;
+    int result = -1;
+
+    if(parseColor(entry->color, &matrix)) {
+	fprintf(stderr, "line %d: bad color \"%s\"\n", entry->line, entry->color);
+	return -1;
+    }
+
+    if(entry->markup[0] == '@') {
+	if(! g_file_get_contents(entry->markup + 1, &markup, NULL, NULL)) {
+	    fprintf(stderr, "line %d: cannot read %s\n", entry->line, entry->markup + 1);
+	    return -1;
+	}
+    } else
+	markup = g_strdup(entry->markup);
+
+    path = job->out_dir
+	? g_build_filename(job->out_dir, entry->output, NULL)
+	: g_strdup(entry->output);
+    hash_path = g_strconcat(path, ".hash", NULL);
+
+    context = contextForFont(contexts, entry->font);
+    SDLPangoDraw_SetDpi(context, entry->dpi, entry->dpi);
+    SDLPangoDraw_SetDefaultColor(context, &matrix);
+    SDLPangoDraw_SetMinimumSize(context, entry->width, 0);
+    SDLPangoDraw_SetMarkup(context, markup, -1);
+
+    hash = entryHash(context, entry, markup);
+    if(! hash) {
+	fprintf(stderr, "line %d: %s\n", entry->line, SDL_GetError());
+	goto done;
+    }
+
+    if(g_file_test(path, G_FILE_TEST_EXISTS)
+	&& g_file_get_contents(hash_path, &old_hash, NULL, NULL)
+	&& strcmp(g_strstrip(old_hash), hash) == 0)
+    {
+	result = 1;
+	goto done;
+    }
+
+    dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+
+    surface = SDLPangoDraw_CreateSurfaceDraw(context);
+    if(! surface) {
+	fprintf(stderr, "line %d: %s\n", entry->line, SDL_GetError());
+	goto done;
+    }
+    if(writeImage(path, surface)) {
+	fprintf(stderr, "line %d: cannot write %s\n", entry->line, path);
+	SDL_FreeSurface(surface);
+	goto done;
+    }
+    SDL_FreeSurface(surface);
+
+    if(! g_file_set_contents(hash_path, hash, -1, NULL)) {
+	fprintf(stderr, "line %d: cannot write %s\n", entry->line, hash_path);
+	goto done;
+    }
+    result = 0;
+
+done:
+    g_free(markup);
+    g_free(path);
+    g_free(hash_path);
+    g_free(old_hash);
+    g_free(hash);
+    return result;
+}
+
+static int compileManifest(GPtrArray *entries, const char *filename, int *compiled)
+{
+    SDLPangoDraw_LayoutWriter *writer = SDLPangoDraw_CreateLayoutWriter();
+    GHashTable *contexts;
+    int failed = 0;
+    guint i;
+
+    contexts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, freeContext);
+
+    for(i = 0; i < entries->len; i++) {
+	const bakeEntry *entry = g_ptr_array_index(entries, i);
+	SDLPangoDraw_Context *context;
+	char *markup;
+
+	if(entry->markup[0] == '@') {
+	    if(! g_file_get_contents(entry->markup + 1, &markup, NULL, NULL)) {
+		fprintf(stderr, "line %d: cannot read %s\n", entry->line, entry->markup + 1);
+		failed++;
+		continue;
+	    }
+	} else
+	    markup = g_strdup(entry->markup);
+
+	context = contextForFont(contexts, entry->font);
+	SDLPangoDraw_SetDpi(context, entry->dpi, entry->dpi);
+	SDLPangoDraw_SetMinimumSize(context, entry->width, 0);
+	SDLPangoDraw_SetMarkup(context, markup, -1);
+	if(SDLPangoDraw_AddCompiledLayout(writer, context, entry->output)) {
+	    fprintf(stderr, "line %d: %s\n", entry->line, SDL_GetError());
+	    failed++;
+	} else
+	    (*compiled)++;
+	g_free(markup);
+    }
+
+    if(SDLPangoDraw_WriteCompiledLayouts(writer, filename)) {
+	fprintf(stderr, "%s\n", SDL_GetError());
+	*compiled = 0;
+	failed++;
+    }
+
+    g_hash_table_destroy(contexts);
+    SDLPangoDraw_FreeLayoutWriter(writer);
+    return failed;
+}
+
+static gpointer worker(gpointer data)
+{
+    bakeJob *job = data;
+    GHashTable *contexts;
+    gint i;
+
+    /* Contexts are not shared between threads; each worker keeps one per
+       font. The shaped-run cache is shared. */
+    contexts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, freeContext);
+
+    while((i = g_atomic_int_add(&job->next, 1)) < (gint)job->entries->len) {
+	switch(bakeEntryWith(job, contexts, g_ptr_array_index(job->entries, i))) {
+	case 0:
+	    g_atomic_int_inc(&job->baked);
+	    break;
+	case 1:
+	    g_atomic_int_inc(&job->skipped);
+	    break;
+	default:
+	    g_atomic_int_inc(&job->failed);
+	    break;
+	}
+    }
+
+    g_mutex_lock(&context_lock);
+    g_hash_table_destroy(contexts);
+    g_mutex_unlock(&context_lock);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    bakeJob job;
+    GThread **threads;
+    const char *manifest = NULL;
+    const char *compiled = NULL;
+    int n_threads = (int)g_get_num_processors();
+    gint64 start;
+    double seconds;
+    int bad_lines;
+    int i;
+
+    job.out_dir = NULL;
+    for(i = 1; i < argc; i++) {
+	if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+	    n_threads = atoi(argv[++i]);
+	else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+	    job.out_dir = argv[++i];
+	else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+	    compiled = argv[++i];
+	else if(! manifest && argv[i][0] != '-')
+	    manifest = argv[i];
+	else
+	    n_threads = 0;
+    }
+    if(! manifest || n_threads < 1) {
+	fprintf(stderr, "Usage: %s [-j threads] [-o dir] manifest\n"
+	    "       %s -c file manifest\n", argv[0], argv[0]);
+	exit(1);
+    }
+
+    SDLPangoDraw_Init();
+
+    bad_lines = 0;
+    job.entries = readManifest(manifest, &bad_lines);
+    if(! job.entries)
+	exit(1);
+
+    if(compiled) {
+	int n_compiled = 0;
+	int failed;
+
+	start = g_get_monotonic_time();
+	failed = bad_lines + compileManifest(job.entries, compiled, &n_compiled);
+	seconds = (g_get_monotonic_time() - start) / 1e6;
+	printf("%d layouts compiled, %d failed in %.2f s\n",
+	    n_compiled, failed, seconds);
+	g_ptr_array_free(job.entries, TRUE);
+	return failed ? 1 : 0;
+    }
+
+    job.next = 0;
+    job.baked = 0;
+    job.skipped = 0;
+    job.failed = bad_lines;
+
+    n_threads = MIN(n_threads, MAX((int)job.entries->len, 1));
+    start = g_get_monotonic_time();
+
+    threads = g_new(GThread *, n_threads);
+    for(i = 0; i < n_threads; i++)
+	threads[i] = g_thread_new("bake", worker, &job);
+    for(i = 0; i < n_threads; i++)
+	g_thread_join(threads[i]);
+    g_free(threads);
+
+    seconds = (g_get_monotonic_time() - start) / 1e6;
+    printf("%d baked, %d up to date, %d failed in %.2f s with %d threads"
+	" (%.1f images/s)\n",
+	job.baked, job.skipped, job.failed, seconds, n_threads,
+	seconds > 0 ? job.baked / seconds : 0.0);
+
+    g_ptr_array_free(job.entries, TRUE);
+
+    return job.failed ? 1 : 0;
+}